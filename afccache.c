@@ -0,0 +1,587 @@
+/*
+ * afccache
+ * Date: Oct 2026
+ *
+ * On-disk cache of remote file info and directory listings. See afccache.h
+ *
+ * The cache file starts with a version line, followed by one record per
+ * path. Every field of a record is a NUL terminated string:
+ *
+ *   path, info time, info count, info..., listing time, listing count, listing...
+ */
+
+#ifdef __linux
+  #ifndef _GNU_SOURCE
+    #define _GNU_SOURCE // asprintf
+  #endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "afccache.h"
+
+#define AFCCACHE_VERSION "afccache 1\n"
+
+typedef struct afccache_entry {
+    char *path;
+    time_t info_time;
+    char **info;
+    time_t list_time;
+    char **list;
+    struct afccache_entry *next;
+} afccache_entry_t;
+
+struct afccache {
+    pthread_mutex_t lock;
+    char *file;
+    int ttl;
+    bool refresh;
+    bool dirty;
+    size_t count;
+    size_t nbuckets;
+    afccache_entry_t **buckets;
+};
+
+
+#pragma mark - paths and entries
+
+// "foo", "/foo/" and "//foo" all refer to the same remote path
+static char *cache_key(const char *path)
+{
+    char *key = malloc(strlen(path)+2);
+    if (!key)
+        return NULL;
+
+    char *k = key;
+    *k++ = '/';
+    for (; *path; path++) {
+        if (*path == '/' && k[-1] == '/')
+            continue;
+        *k++ = *path;
+    }
+    if (k - key > 1 && k[-1] == '/')
+        k--;
+    *k = '\0';
+
+    return key;
+}
+
+static char *parent_key(const char *key)
+{
+    const char *slash = strrchr(key, '/');
+    return (slash && slash != key)? strndup(key, slash - key) : strdup("/");
+}
+
+static uint64_t hash_key(const char *key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *key; key++) {
+        h ^= (unsigned char)*key;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void entry_free(afccache_entry_t *e)
+{
+    free(e->path);
+    afcproto_list_free(e->info);
+    afcproto_list_free(e->list);
+    free(e);
+}
+
+static bool cache_grow(afccache_t cache)
+{
+    size_t i, nbuckets = (cache->nbuckets)? cache->nbuckets*2 : 256;
+    afccache_entry_t **buckets = calloc(nbuckets, sizeof(afccache_entry_t*));
+    if (!buckets)
+        return false;
+
+    for (i=0; i<cache->nbuckets; i++) {
+        afccache_entry_t *e, *next;
+        for (e = cache->buckets[i]; e; e = next) {
+            next = e->next;
+            size_t b = hash_key(e->path) % nbuckets;
+            e->next = buckets[b];
+            buckets[b] = e;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+    return true;
+}
+
+// note: called with the cache lock held
+static afccache_entry_t *cache_find(afccache_t cache, const char *key, bool create)
+{
+    afccache_entry_t *e;
+
+    if (cache->nbuckets) {
+        for (e = cache->buckets[hash_key(key) % cache->nbuckets]; e; e = e->next) {
+            if (!strcmp(e->path, key))
+                return e;
+        }
+    }
+
+    if (!create)
+        return NULL;
+
+    if (cache->count >= cache->nbuckets && !cache_grow(cache))
+        return NULL;
+
+    if ((e = calloc(1, sizeof(afccache_entry_t))) == NULL || (e->path = strdup(key)) == NULL) {
+        free(e);
+        return NULL;
+    }
+
+    size_t b = hash_key(key) % cache->nbuckets;
+    e->next = cache->buckets[b];
+    cache->buckets[b] = e;
+    cache->count++;
+
+    return e;
+}
+
+static bool is_fresh(afccache_t cache, time_t when)
+{
+    return (!cache->refresh && when && time(NULL) - when < cache->ttl);
+}
+
+
+#pragma mark - loading and saving
+
+static char *cache_dir()
+{
+    const char *env;
+    char *dir=NULL;
+
+    if ((env = getenv("AFCCLIENT_CACHE_DIR")) && *env)
+        dir = strdup(env);
+    else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+        asprintf(&dir, "%s/afcclient", env);
+    else if ((env = getenv("HOME")) && *env)
+        asprintf(&dir, "%s/.cache/afcclient", env);
+
+    return dir;
+}
+
+static int make_dirs(const char *dir)
+{
+    char *path = strdup(dir), *p;
+    if (!path)
+        return -1;
+
+    for (p = path+1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(path, 0700);
+            *p = '/';
+        }
+    }
+    int ret = (mkdir(path, 0700) == 0 || errno == EEXIST)? 0 : -1;
+    free(path);
+    return ret;
+}
+
+static const char *next_field(char **p, char *end)
+{
+    char *field = *p;
+    char *nul = memchr(field, '\0', end - field);
+    if (!nul)
+        return NULL;
+    *p = nul+1;
+    return field;
+}
+
+static char **read_list(char **p, char *end)
+{
+    const char *f = next_field(p, end);
+    if (!f)
+        return NULL;
+
+    long i, count = strtol(f, NULL, 10);
+    if (count < 0 || count > end - *p)
+        return NULL;
+
+    char **list = calloc(count+1, sizeof(char*));
+    for (i=0; list && i<count; i++) {
+        if ((f = next_field(p, end)) == NULL || (list[i] = strdup(f)) == NULL) {
+            afcproto_list_free(list);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+static void cache_load(afccache_t cache)
+{
+    FILE *f = fopen(cache->file, "r");
+    if (!f)
+        return;
+
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fileno(f), &st) == 0 && (buf = malloc(st.st_size)) != NULL && fread(buf, 1, st.st_size, f) == (size_t)st.st_size) {
+        size_t vlen = strlen(AFCCACHE_VERSION);
+        char *p = buf + vlen, *end = buf + st.st_size;
+
+        if (st.st_size >= (off_t)vlen && !memcmp(buf, AFCCACHE_VERSION, vlen)) {
+            const char *path, *t;
+            while ((path = next_field(&p, end)) != NULL) {
+                afccache_entry_t *e = cache_find(cache, path, true);
+                if (!e)
+                    break;
+
+                if ((t = next_field(&p, end)) == NULL)
+                    break;
+                e->info_time = strtoll(t, NULL, 10);
+                afcproto_list_free(e->info);
+                if ((e->info = read_list(&p, end)) == NULL)
+                    break;
+
+                if ((t = next_field(&p, end)) == NULL)
+                    break;
+                e->list_time = strtoll(t, NULL, 10);
+                afcproto_list_free(e->list);
+                if ((e->list = read_list(&p, end)) == NULL)
+                    break;
+
+                // empty lists stand for "not cached"
+                if (!e->info_time) {
+                    afcproto_list_free(e->info);
+                    e->info = NULL;
+                }
+                if (!e->list_time) {
+                    afcproto_list_free(e->list);
+                    e->list = NULL;
+                }
+            }
+        }
+    }
+
+    free(buf);
+    fclose(f);
+}
+
+static void write_list(FILE *f, char **list)
+{
+    int i, count=0;
+    while (list && list[count])
+        count++;
+
+    fprintf(f, "%d", count);
+    fputc('\0', f);
+    for (i=0; i<count; i++) {
+        fputs(list[i], f);
+        fputc('\0', f);
+    }
+}
+
+int afccache_save(afccache_t cache)
+{
+    int ret=EXIT_SUCCESS;
+
+    if (!cache)
+        return ret;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->dirty) {
+        char *dir = strdup(cache->file), *tmp=NULL;
+        char *slash = (dir)? strrchr(dir, '/') : NULL;
+        if (slash)
+            *slash = '\0';
+
+        FILE *f = NULL;
+        if (dir && make_dirs(dir) == 0 && asprintf(&tmp, "%s.%d.tmp", cache->file, (int)getpid()) > 0)
+            f = fopen(tmp, "w");
+
+        if (f) {
+            time_t oldest = time(NULL) - AFCCACHE_MAX_AGE;
+            size_t i;
+
+            fputs(AFCCACHE_VERSION, f);
+            for (i=0; i<cache->nbuckets; i++) {
+                afccache_entry_t *e;
+                for (e = cache->buckets[i]; e; e = e->next) {
+                    if ((!e->info || e->info_time < oldest) && (!e->list || e->list_time < oldest))
+                        continue;
+
+                    fputs(e->path, f);
+                    fputc('\0', f);
+                    fprintf(f, "%lld", (long long)((e->info)? e->info_time : 0));
+                    fputc('\0', f);
+                    write_list(f, e->info);
+                    fprintf(f, "%lld", (long long)((e->list)? e->list_time : 0));
+                    fputc('\0', f);
+                    write_list(f, e->list);
+                }
+            }
+
+            // write and rename so that a concurrent reader never sees half a file
+            if (fclose(f) == 0 && rename(tmp, cache->file) == 0) {
+                cache->dirty = false;
+            } else {
+                fprintf(stderr, "Error: could not write cache file %s - %s\n", cache->file, strerror(errno));
+                unlink(tmp);
+                ret = EXIT_FAILURE;
+            }
+        } else {
+            fprintf(stderr, "Error: could not write cache file %s - %s\n", cache->file, strerror(errno));
+            ret = EXIT_FAILURE;
+        }
+
+        free(tmp);
+        free(dir);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+afccache_t afccache_open(const char *scope, int ttl, bool refresh)
+{
+    char *dir = cache_dir();
+    if (!dir) {
+        fprintf(stderr, "Error: no cache directory (set HOME or AFCCLIENT_CACHE_DIR)\n");
+        return NULL;
+    }
+
+    afccache_t cache = calloc(1, sizeof(struct afccache));
+    char *name = strdup(scope);
+
+    if (cache && name) {
+        char *p;
+        for (p = name; *p; p++) {
+            if (!strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-", *p))
+                *p = '_';
+        }
+
+        if (asprintf(&cache->file, "%s/%s.cache", dir, name) > 0) {
+            pthread_mutex_init(&cache->lock, NULL);
+            cache->ttl = ttl;
+            cache->refresh = refresh;
+            cache_load(cache);
+        } else {
+            free(cache);
+            cache = NULL;
+        }
+    } else {
+        free(cache);
+        cache = NULL;
+    }
+
+    free(name);
+    free(dir);
+    return cache;
+}
+
+void afccache_close(afccache_t cache)
+{
+    if (cache) {
+        size_t i;
+
+        afccache_save(cache);
+
+        for (i=0; i<cache->nbuckets; i++) {
+            afccache_entry_t *e, *next;
+            for (e = cache->buckets[i]; e; e = next) {
+                next = e->next;
+                entry_free(e);
+            }
+        }
+        free(cache->buckets);
+        free(cache->file);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+    }
+}
+
+
+#pragma mark - lookups
+
+char **afccache_lookup_info(afccache_t cache, const char *path)
+{
+    char **ret=NULL, *key;
+
+    if (!cache || (key = cache_key(path)) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    afccache_entry_t *e = cache_find(cache, key, false);
+    if (e && e->info && is_fresh(cache, e->info_time))
+        ret = afcproto_list_dup(e->info);
+    pthread_mutex_unlock(&cache->lock);
+
+    free(key);
+    return ret;
+}
+
+// takes ownership of infos and/or list, either may be NULL
+static void cache_store(afccache_t cache, const char *path, char **infos, char **list)
+{
+    char *key = cache_key(path);
+
+    pthread_mutex_lock(&cache->lock);
+    afccache_entry_t *e = (key)? cache_find(cache, key, true) : NULL;
+    if (e) {
+        if (infos) {
+            afcproto_list_free(e->info);
+            e->info = infos;
+            e->info_time = time(NULL);
+            infos = NULL;
+        }
+        if (list) {
+            afcproto_list_free(e->list);
+            e->list = list;
+            e->list_time = time(NULL);
+            list = NULL;
+        }
+        cache->dirty = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    afcproto_list_free(infos);
+    afcproto_list_free(list);
+    free(key);
+}
+
+void afccache_store_info(afccache_t cache, const char *path, char **infos)
+{
+    if (cache && infos)
+        cache_store(cache, path, afcproto_list_dup(infos), NULL);
+}
+
+afc_error_t afccache_get_file_info(afccache_t cache, afcproto_client_t afc, const char *path, char ***infos)
+{
+    if (!cache)
+        return afcproto_get_file_info(afc, path, infos);
+
+    if ((*infos = afccache_lookup_info(cache, path)) != NULL)
+        return AFC_E_SUCCESS;
+
+    afc_error_t err = afcproto_get_file_info(afc, path, infos);
+    if (!err)
+        afccache_store_info(cache, path, *infos);
+
+    return err;
+}
+
+afc_error_t afccache_read_directory(afccache_t cache, afcproto_client_t afc, const char *path, char ***list)
+{
+    if (!cache)
+        return afcproto_read_directory(afc, path, list);
+
+    char *key = cache_key(path);
+    char **cached=NULL, *mtime=NULL;
+    bool fresh=false;
+
+    *list = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    afccache_entry_t *e = (key)? cache_find(cache, key, false) : NULL;
+    if (e && e->list && !cache->refresh) {
+        const char *m = afcproto_info_value(e->info, "st_mtime");
+        fresh = is_fresh(cache, e->list_time);
+        cached = afcproto_list_dup(e->list);
+        mtime = (m)? strdup(m) : NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(key);
+
+    if (cached && fresh) {
+        free(mtime);
+        *list = cached;
+        return AFC_E_SUCCESS;
+    }
+
+    // An expired listing is still good if the directory hasn't been modified
+    // since, which only costs a file info request to find out.
+    char **infos=NULL;
+    afc_error_t err;
+
+    if (cached && mtime) {
+        err = afcproto_get_file_info(afc, path, &infos);
+        const char *m = (err)? NULL : afcproto_info_value(infos, "st_mtime");
+
+        if (m && !strcmp(m, mtime)) {
+            free(mtime);
+            *list = cached;
+            cache_store(cache, path, infos, afcproto_list_dup(cached));
+            return AFC_E_SUCCESS;
+        }
+        afcproto_list_free(infos);
+        infos = NULL;
+    }
+    afcproto_list_free(cached);
+    free(mtime);
+
+    // Otherwise ask for the directory's info and its contents back to back.
+    // The info is what a later revalidation compares against.
+    if ((err = afcproto_send_request(afc, AFC_OP_GET_FILE_INFO, path, strlen(path)+1, NULL, 0)) != AFC_E_SUCCESS)
+        return err;
+
+    afc_error_t list_err = afcproto_send_request(afc, AFC_OP_READ_DIR, path, strlen(path)+1, NULL, 0);
+    afc_error_t info_err = afcproto_receive_list(afc, &infos);
+
+    if (!list_err)
+        list_err = afcproto_receive_list(afc, list);
+
+    if (!list_err)
+        cache_store(cache, path, (info_err)? NULL : infos, afcproto_list_dup(*list));
+    else if (!info_err)
+        cache_store(cache, path, infos, NULL);
+    else
+        afcproto_list_free(infos);
+
+    return list_err;
+}
+
+void afccache_invalidate(afccache_t cache, const char *path)
+{
+    char *key, *parent;
+
+    if (!cache || (key = cache_key(path)) == NULL)
+        return;
+
+    parent = parent_key(key);
+    size_t i, klen = strlen(key);
+    bool root = !strcmp(key, "/");
+
+    pthread_mutex_lock(&cache->lock);
+    for (i=0; i<cache->nbuckets; i++) {
+        afccache_entry_t **pp = &cache->buckets[i];
+        while (*pp) {
+            afccache_entry_t *e = *pp;
+            if (root || !strcmp(e->path, key) || (!strncmp(e->path, key, klen) && e->path[klen] == '/')) {
+                *pp = e->next;
+                entry_free(e);
+                cache->count--;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+
+    // the parent's listing and mtime change with it
+    afccache_entry_t *e = (parent)? cache_find(cache, parent, false) : NULL;
+    if (e) {
+        afcproto_list_free(e->info);
+        afcproto_list_free(e->list);
+        e->info = e->list = NULL;
+        e->info_time = e->list_time = 0;
+    }
+    cache->dirty = true;
+    pthread_mutex_unlock(&cache->lock);
+
+    free(parent);
+    free(key);
+}
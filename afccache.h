@@ -0,0 +1,55 @@
+/*
+ * afccache
+ * Date: Oct 2026
+ *
+ * An on-disk cache of remote file info and directory listings, so repeated
+ * commands against the same device don't have to ask for them again.
+ *
+ * One cache file is kept per scope (device + service or app). Entries newer
+ * than the TTL are used as-is. An older directory listing is revalidated
+ * with a single file info request on the directory and reused if the
+ * directory's st_mtime hasn't changed.
+ *
+ * All functions accept a NULL cache, in which case they go straight to the
+ * connection.
+ */
+
+#ifndef _afccache_h
+#define _afccache_h
+
+#include <stdbool.h>
+
+#include "afcproto.h"
+
+#define AFCCACHE_DEFAULT_TTL 60
+
+// entries not refreshed for this long are dropped when the cache is saved
+#define AFCCACHE_MAX_AGE (7*24*60*60)
+
+typedef struct afccache *afccache_t;
+
+// Loads the cache for scope from the cache directory ($AFCCLIENT_CACHE_DIR,
+// $XDG_CACHE_HOME/afcclient or ~/.cache/afcclient). With refresh, cached
+// entries are ignored but fresh results are still stored.
+afccache_t afccache_open(const char *scope, int ttl, bool refresh);
+
+// writes the cache back if anything changed
+int afccache_save(afccache_t cache);
+
+// saves and frees the cache
+void afccache_close(afccache_t cache);
+
+afc_error_t afccache_get_file_info(afccache_t cache, afcproto_client_t afc, const char *path, char ***infos);
+
+afc_error_t afccache_read_directory(afccache_t cache, afcproto_client_t afc, const char *path, char ***list);
+
+// returns a copy of the file info for path if it's within the TTL, otherwise NULL
+char **afccache_lookup_info(afccache_t cache, const char *path);
+
+void afccache_store_info(afccache_t cache, const char *path, char **infos);
+
+// forgets path, everything below it and its parent's listing. Call after
+// changing anything on the device
+void afccache_invalidate(afccache_t cache, const char *path);
+
+#endif // _afccache_h
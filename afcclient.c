@@ -12,528 +12,6232 @@
  */
 
 #ifdef __linux
+  #ifndef _GNU_SOURCE
+    #define _GNU_SOURCE // fopencookie
+  #endif
   #include <limits.h>
 #endif
 
 #ifdef __APPLE__
   #include <sys/syslimits.h>
+  #define st_mtim st_mtimespec
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
 #include <errno.h>
 #include <libgen.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fnmatch.h>
 
 #include "libidev.h"
+#include "afccache.h"
+#include "afcfs.h"
+#include "afcsnap.h"
 
 
-#define CHUNKSZ 8192
+#define CHUNK_MIN       (4*1024)
+#define CHUNK_MAX       (4*1024*1024)
+#define CHUNK_START     (64*1024)
+#define DEFAULT_PIPELINE 8
+#define DEFAULT_JOBS    4
+#define DEFAULT_DEVICE_JOBS 8
 
 #pragma mark - AFC Implementation Utility Functions
 
 char *progname;
+int pipeline_depth = DEFAULT_PIPELINE;
+uint32_t chunk_size_override = 0;
+int jobs = DEFAULT_JOBS;
+int device_jobs = DEFAULT_DEVICE_JOBS;
+bool stop_on_error = false;
 void usage(FILE *outf);
 
+// Commands write through these rather than stdout/stderr so that the command
+// server can run several of them at once, each talking to its own client.
+// Paths given on the command line are relative to cmd_cwd when it's set.
+__thread FILE *cmd_out = NULL;
+__thread FILE *cmd_err = NULL;
+__thread const char *cmd_cwd = NULL;
+
+// the udid of the device being talked to, when one was given or found
+__thread const char *cmd_device = NULL;
+
+// the metadata cache for the device being talked to, if caching is enabled
+__thread afccache_t cmd_cache = NULL;
+int cache_ttl = -1;
+bool cache_refresh = false;
+
+#define OUTF ((cmd_out)? cmd_out : stdout)
+#define ERRF ((cmd_err)? cmd_err : stderr)
+
+// commands can check out extra connections from here for parallel work
+__thread idev_afc_pool_t pool = NULL;
+
 bool is_dir(char *path)
 {
     struct stat s;
     return (stat(path, &s) == 0 && s.st_mode & S_IFDIR);
 }
 
-int dump_afc_device_info(afc_client_t afc)
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// joins a directory and an entry name. the result must be freed
+char *path_join(const char *dir, const char *name)
+{
+    char *ret=NULL;
+    size_t len = strlen(dir);
+
+    if (len == 0)
+        ret = strdup(name);
+    else
+        asprintf(&ret, "%s%s%s", dir, (dir[len-1] == '/')? "" : "/", name);
+
+    return ret;
+}
+
+// resolves a local path given on the command line. the result must be freed
+char *local_path(const char *path)
+{
+    if (cmd_cwd && path[0] != '/')
+        return path_join(cmd_cwd, path);
+    else
+        return strdup(path);
+}
+
+// names the cache file for a device and service or app. the result must be freed
+char *cache_scope(const char *address, const char *udid, const char *svcname, const char *appid, const char *appdir)
+{
+    char *scope=NULL;
+
+    if (address)
+        asprintf(&scope, "addr-%s", address);
+    else if (appid)
+        asprintf(&scope, "%s-%s-%s", (udid)? udid : "default", appid, appdir);
+    else
+        asprintf(&scope, "%s-%s", (udid)? udid : "default", svcname);
+
+    return scope;
+}
+
+afccache_t open_cache(idev_afc_pool_t p, const char *address, const char *udid, const char *svcname, const char *appid, const char *appdir)
+{
+    afccache_t cache=NULL;
+    char *devudid = (udid || address)? NULL : idev_afc_pool_udid(p);
+    char *scope = cache_scope(address, (udid)? udid : devudid, svcname, appid, appdir);
+
+    if (scope) {
+        cache = afccache_open(scope, cache_ttl, cache_refresh);
+        if (idev_verbose && cache)
+            fprintf(stderr, "[debug] using metadata cache %s (ttl %ds)\n", scope, cache_ttl);
+    }
+
+    free(scope);
+    free(devudid);
+    return cache;
+}
+
+// parses sizes like "65536", "64k" or "1M"
+uint64_t parse_size(const char *str)
+{
+    char *end=NULL;
+    uint64_t val = strtoull(str, &end, 10);
+
+    switch ((end)? *end : '\0') {
+        case 'k': case 'K': val *= 1024; break;
+        case 'm': case 'M': val *= 1024*1024; break;
+        case 'g': case 'G': val *= 1024*1024*1024; break;
+        case '\0': break;
+        default: return 0;
+    }
+    return val;
+}
+
+// writes str as a quoted JSON string
+void print_json_string(FILE *outf, const char *str)
+{
+    const unsigned char *p;
+
+    fputc('"', outf);
+    for (p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(outf, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(outf, "\\u%04x", *p);
+        else
+            fputc(*p, outf);
+    }
+    fputc('"', outf);
+}
+
+
+#pragma mark - Transfer chunk sizing
+
+// Measure throughput over at least this many requests and this much time
+// before deciding whether to change the chunk size.
+#define CHUNK_SAMPLE_REQS   8
+#define CHUNK_SAMPLE_NS     (100*1000000ULL)
+
+// Don't let a single request take longer than this, regardless of throughput
+#define CHUNK_MAX_LATENCY_NS (500*1000000ULL)
+
+// A simple hill climb on throughput: keep doubling (or halving) the chunk
+// size while that helps, step back once it stops helping and then hold.
+// A large swing in throughput while holding starts a new search.
+typedef struct chunk_ctl {
+    uint32_t size;
+    bool fixed;
+    int direction;
+    double rate;
+    uint64_t sample_start;
+    uint64_t sample_bytes;
+    uint64_t sample_latency;
+    int sample_reqs;
+} chunk_ctl_t;
+
+void chunk_ctl_init(chunk_ctl_t *ctl)
+{
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->fixed = (chunk_size_override != 0);
+    ctl->size = (ctl->fixed)? chunk_size_override : CHUNK_START;
+    ctl->direction = 1;
+    ctl->sample_start = now_ns();
+}
+
+// records one completed request and returns the size to use for the next one
+uint32_t chunk_ctl_update(chunk_ctl_t *ctl, uint32_t bytes, uint64_t latency_ns)
+{
+    if (ctl->fixed)
+        return ctl->size;
+
+    ctl->sample_bytes += bytes;
+    ctl->sample_latency += latency_ns;
+    ctl->sample_reqs++;
+
+    uint64_t elapsed = now_ns() - ctl->sample_start;
+    if (ctl->sample_reqs < CHUNK_SAMPLE_REQS || elapsed < CHUNK_SAMPLE_NS)
+        return ctl->size;
+
+    double rate = (double)ctl->sample_bytes * 1e9 / elapsed;
+    uint64_t latency = ctl->sample_latency / ctl->sample_reqs;
+    uint32_t old_size = ctl->size;
+
+    if (latency > CHUNK_MAX_LATENCY_NS) {
+        ctl->direction = -1;
+        ctl->rate = rate;
+    } else if (ctl->direction == 0) {
+        if (rate > ctl->rate * 1.25)
+            ctl->direction = 1;
+        else if (rate < ctl->rate * 0.75)
+            ctl->direction = -1;
+        ctl->rate = rate;
+    } else if (ctl->rate == 0 || rate > ctl->rate * 1.05) {
+        ctl->rate = rate;
+    } else {
+        // no better (or worse) than the previous size. step back if it
+        // hurt, and settle. ctl->rate stays at the previous size's figure
+        if (rate < ctl->rate * 0.95)
+            ctl->size = (ctl->direction > 0)? ctl->size/2 : ctl->size*2;
+        ctl->direction = 0;
+    }
+
+    if (ctl->direction > 0 && ctl->size < CHUNK_MAX)
+        ctl->size *= 2;
+    else if (ctl->direction < 0 && ctl->size > CHUNK_MIN)
+        ctl->size /= 2;
+    else
+        ctl->direction = 0;
+
+    if (idev_verbose && ctl->size != old_size)
+        fprintf(ERRF, "[debug] chunk size %u -> %u (%.1f KB/s, %.1f ms/request)\n",
+                old_size, ctl->size, rate/1024, latency/1e6);
+
+    ctl->sample_start = now_ns();
+    ctl->sample_bytes = 0;
+    ctl->sample_latency = 0;
+    ctl->sample_reqs = 0;
+
+    return ctl->size;
+}
+
+void report_transfer(const char *what, const char *path, size_t totbytes, uint64_t start, chunk_ctl_t *ctl)
+{
+    if (idev_verbose) {
+        double secs = (now_ns() - start) / 1e9;
+        fprintf(ERRF, "[debug] %s %s: %lu bytes in %.3fs (%.1f KB/s), chunk size %u%s\n",
+                what, path, totbytes, secs, (secs > 0)? totbytes/secs/1024 : 0.0,
+                ctl->size, (ctl->fixed)? " (fixed)" : "");
+    }
+}
+
+
+#pragma mark - Progress events
+
+// With --progress=json, get and put write one JSON object per line to
+// progress_out as they go: a "start" event, "progress" events at most every
+// PROGRESS_INTERVAL_NS while data is moving and an "end" event. Checking
+// whether an event is due is a single comparison against a time the copy
+// loop already has, so the loop itself isn't slowed down.
+#define PROGRESS_INTERVAL_NS (250*1000000ULL)
+
+FILE *progress_out = NULL;
+
+typedef struct progress {
+    const char *op;
+    const char *path;
+    const char *local;
+    int64_t total;      // -1 if not known
+    uint64_t done;
+    uint64_t start_done;
+    uint64_t start_ns;
+    uint64_t last_ns;   // when the last event went out, and the bytes done then
+    uint64_t last_done;
+    uint64_t next_ns;
+} progress_t;
+
+static void progress_emit(progress_t *p, const char *event, uint64_t now, const char *error)
+{
+    double elapsed = (now - p->start_ns) / 1e9, since = (now - p->last_ns) / 1e9;
+
+    flockfile(progress_out);
+    fprintf(progress_out, "{\"event\": \"%s\", \"op\": \"%s\"", event, p->op);
+    if (cmd_device) {
+        fprintf(progress_out, ", \"device\": ");
+        print_json_string(progress_out, cmd_device);
+    }
+    fprintf(progress_out, ", \"path\": ");
+    print_json_string(progress_out, p->path);
+    fprintf(progress_out, ", \"local\": ");
+    print_json_string(progress_out, p->local);
+    fprintf(progress_out, ", \"bytes\": %llu", (unsigned long long)p->done);
+    if (p->total >= 0)
+        fprintf(progress_out, ", \"total\": %lld", (long long)p->total);
+    else
+        fprintf(progress_out, ", \"total\": null");
+    fprintf(progress_out, ", \"rate\": %.0f, \"avg_rate\": %.0f, \"elapsed\": %.3f",
+            (since > 0)? (p->done - p->last_done) / since : 0.0,
+            (elapsed > 0)? (p->done - p->start_done) / elapsed : 0.0,
+            elapsed);
+    if (error) {
+        fprintf(progress_out, ", \"error\": ");
+        print_json_string(progress_out, error);
+    }
+    fprintf(progress_out, "}\n");
+    funlockfile(progress_out);
+
+    p->last_ns = now;
+    p->last_done = p->done;
+    p->next_ns = now + PROGRESS_INTERVAL_NS;
+}
+
+// 'done' is where the transfer starts from, e.g. a resume offset
+void progress_start(progress_t *p, const char *op, const char *path, const char *local, int64_t total, uint64_t done)
+{
+    memset(p, 0, sizeof(*p));
+    p->op = op;
+    p->path = path;
+    p->local = local;
+    p->total = total;
+    p->done = p->start_done = p->last_done = done;
+    p->start_ns = p->last_ns = now_ns();
+
+    if (progress_out)
+        progress_emit(p, "start", p->start_ns, NULL);
+}
+
+static inline void progress_update(progress_t *p, uint64_t done, uint64_t now)
+{
+    p->done = done;
+    if (progress_out && now >= p->next_ns)
+        progress_emit(p, "progress", now, NULL);
+}
+
+void progress_end(progress_t *p, const char *error)
+{
+    if (progress_out)
+        progress_emit(p, "end", now_ns(), error);
+}
+
+
+#pragma mark - Buffer ring
+
+// Transfers run the device side and the local file side on separate threads
+// with a few buffers between them. One side fills empty buffers and the
+// other drains full ones, so neither waits on the other unless the ring is
+// full or empty.
+#define RING_SLOTS 3
+
+typedef struct xfer_ring {
+    char *buf[RING_SLOTS];
+    uint32_t len[RING_SLOTS];
+    uint64_t offset[RING_SLOTS];
+    int head;           // oldest full slot
+    int full;
+    bool closed;        // the producer is done
+    bool aborted;       // either side gave up
+    int error;          // errno from the side that aborted
+    uint64_t error_offset;
+    void (^side)(struct xfer_ring *r);
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} xfer_ring_t;
+
+static void *xfer_ring_main(void *arg)
+{
+    xfer_ring_t *r = arg;
+    r->side(r);
+    return NULL;
+}
+
+// Allocates the buffers and runs side on its own thread. On failure the
+// caller should do the transfer without the ring.
+int xfer_ring_start(xfer_ring_t *r, void (^side)(xfer_ring_t *r))
+{
+    int i;
+
+    memset(r, 0, sizeof(*r));
+    for (i=0; i<RING_SLOTS; i++) {
+        if ((r->buf[i] = malloc(CHUNK_MAX)) == NULL)
+            break;
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    r->side = side;
+
+    if (i < RING_SLOTS || pthread_create(&r->thread, NULL, xfer_ring_main, r) != 0) {
+        for (i=0; i<RING_SLOTS; i++)
+            free(r->buf[i]);
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// producer: waits for an empty buffer. NULL if the consumer gave up
+char *xfer_ring_fill(xfer_ring_t *r)
+{
+    char *buf = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    while (r->full == RING_SLOTS && !r->aborted)
+        pthread_cond_wait(&r->cond, &r->lock);
+    if (!r->aborted)
+        buf = r->buf[(r->head + r->full) % RING_SLOTS];
+    pthread_mutex_unlock(&r->lock);
+
+    return buf;
+}
+
+// producer: hands over the buffer from xfer_ring_fill with len bytes for offset
+void xfer_ring_push(xfer_ring_t *r, uint32_t len, uint64_t offset)
+{
+    pthread_mutex_lock(&r->lock);
+    int slot = (r->head + r->full) % RING_SLOTS;
+    r->len[slot] = len;
+    r->offset[slot] = offset;
+    r->full++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// producer: no more data is coming
+void xfer_ring_close(xfer_ring_t *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->closed = true;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// consumer: waits for the oldest full buffer. NULL once the ring is closed
+// and empty, or the producer gave up
+char *xfer_ring_drain(xfer_ring_t *r, uint32_t *len, uint64_t *offset)
+{
+    char *buf = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    while (r->full == 0 && !r->closed && !r->aborted)
+        pthread_cond_wait(&r->cond, &r->lock);
+    if (r->full && !r->aborted) {
+        buf = r->buf[r->head];
+        *len = r->len[r->head];
+        *offset = r->offset[r->head];
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return buf;
+}
+
+// consumer: gives back the buffer from xfer_ring_drain
+void xfer_ring_pop(xfer_ring_t *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->head = (r->head + 1) % RING_SLOTS;
+    r->full--;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Either side: stops the transfer. For the consumer, error_offset is where
+// the buffer it failed on was meant to go.
+void xfer_ring_abort(xfer_ring_t *r, int err)
+{
+    pthread_mutex_lock(&r->lock);
+    if (!r->aborted) {
+        r->aborted = true;
+        r->error = err;
+        r->error_offset = r->offset[r->head];
+    }
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// waits for the other side to finish and frees the buffers
+void xfer_ring_finish(xfer_ring_t *r)
+{
+    int i;
+
+    pthread_join(r->thread, NULL);
+    for (i=0; i<RING_SLOTS; i++)
+        free(r->buf[i]);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+}
+
+
+#pragma mark - AFC commands
+
+int dump_afc_device_info(afcproto_client_t afc)
 {
     int ret=EXIT_FAILURE;
 
     char **infos=NULL;
-    afc_error_t err=afc_get_device_info(afc, &infos);
+    afc_error_t err=afcproto_get_device_info(afc, &infos);
     if (err == AFC_E_SUCCESS && infos) {
         int i;
-        printf("AFC Device Info: -");
+        fprintf(OUTF, "AFC Device Info: -");
         for (i=0; infos[i]; i++)
-            printf("%c%s", ((i%2)? ':' : ' '), infos[i]);
+            fprintf(OUTF, "%c%s", ((i%2)? ':' : ' '), infos[i]);
 
-        printf("\n");
+        fprintf(OUTF, "\n");
         ret = EXIT_SUCCESS;
 
     } else {
-        fprintf(stderr, "Error: afc get device info failed: %s\n", idev_afc_strerror(err));
+        fprintf(ERRF, "Error: afc get device info failed: %s\n", idev_afc_strerror(err));
     }
 
     if (infos)
-        idevice_device_list_free(infos);
+        afcproto_list_free(infos);
 
     return ret;
 }
 
-int dump_afc_file_info(afc_client_t afc, const char *path)
+void print_file_info(const char *path, char **infolist)
+{
+    int i;
+    for(i=0; infolist[i]; i++)
+        fprintf(OUTF, "%c%s", ((i%2)? '=' : ' '), infolist[i]);
+
+    fprintf(OUTF, "\t%s\n", path);
+}
+
+int dump_afc_file_info(afcproto_client_t afc, const char *path)
 {
-    int i, ret=EXIT_FAILURE;
+    int ret=EXIT_FAILURE;
 
     char **infolist=NULL;
-    afc_error_t err = afc_get_file_info(afc, path, &infolist);
+    afc_error_t err = afccache_get_file_info(cmd_cache, afc, path, &infolist);
 
     if (err == AFC_E_SUCCESS && infolist) {
-        for(i=0; infolist[i]; i++)
-            printf("%c%s", ((i%2)? '=' : ' '), infolist[i]);
-
-        printf("\t%s\n", path);
+        print_file_info(path, infolist);
         ret=EXIT_SUCCESS;
 
     } else {
-        fprintf(stderr, "Error: info error for path: %s - %s\n", path, idev_afc_strerror(err));
+        fprintf(ERRF, "Error: info error for path: %s - %s\n", path, idev_afc_strerror(err));
     }
 
     if (infolist)
-        idevice_device_list_free(infolist);
+        afcproto_list_free(infolist);
+
+    return ret;
+}
+
+// Prints file info for every path, keeping up to pipeline_depth
+// GET_FILE_INFO requests in flight. Replies come back in request order, so
+// each entry is printed as soon as its reply arrives. Entries found in the
+// cache are printed in turn without a request.
+int dump_afc_file_infos(afcproto_client_t afc, char **paths, size_t count)
+{
+    int ret=EXIT_SUCCESS;
+    size_t sent=0, done=0, inflight=0;
+
+    char ***cached = calloc(count, sizeof(char**));
+    if (!cached) {
+        fprintf(ERRF, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (sent=0; cmd_cache && sent<count; sent++)
+        cached[sent] = afccache_lookup_info(cmd_cache, paths[sent]);
+
+    sent = 0;
+    while (done < count) {
+        while (sent < count && inflight < (size_t)pipeline_depth) {
+            if (!cached[sent]) {
+                if (afcproto_send_request(afc, AFC_OP_GET_FILE_INFO, paths[sent], strlen(paths[sent])+1, NULL, 0) != AFC_E_SUCCESS)
+                    break;
+                inflight++;
+            }
+            sent++;
+        }
+
+        if (cached[done]) {
+            print_file_info(paths[done], cached[done]);
+            done++;
+            continue;
+        }
+
+        if (!inflight) {
+            fprintf(ERRF, "Error: info error for path: %s - %s\n", paths[done], idev_afc_strerror(AFC_E_MUX_ERROR));
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        char **infolist=NULL;
+        afc_error_t err = afcproto_receive_list(afc, &infolist);
+        inflight--;
+
+        if (err == AFC_E_SUCCESS) {
+            print_file_info(paths[done], infolist);
+            afccache_store_info(cmd_cache, paths[done], infolist);
+        } else {
+            fprintf(ERRF, "Error: info error for path: %s - %s\n", paths[done], idev_afc_strerror(err));
+            if (afcproto_client_is_broken(afc)) {
+                ret = EXIT_FAILURE;
+                break;
+            }
+        }
+
+        afcproto_list_free(infolist);
+        done++;
+    }
+
+    for (sent=0; sent<count; sent++)
+        afcproto_list_free(cached[sent]);
+    free(cached);
 
     return ret;
 }
 
-int dump_afc_list_path(afc_client_t afc, const char *path)
+int dump_afc_list_path(afcproto_client_t afc, const char *path, bool names_only)
 {
     int ret=EXIT_FAILURE;
 
     char **list=NULL;
 
     if (idev_verbose)
-        fprintf(stderr, "[debug] reading afc directory contents at \"%s\"\n", path);
+        fprintf(ERRF, "[debug] reading afc directory contents at \"%s\"\n", path);
 
-    afc_error_t err = afc_read_directory(afc, path, &list);
+    afc_error_t err = afccache_read_directory(cmd_cache, afc, path, &list);
 
     //if (err == AFC_E_SUCCESS && list) {
     if (list) {
-        int i;
-        printf("AFC Device Listing path=\"%s\":\n", path);
-        for (i=0; list[i]; i++) {
-            char tpath[PATH_MAX], *lpath;
-            if (!strcmp(path, "")) {
-                lpath=list[i];
-            } else {
-                if (path[strlen(path)-1]=='/') {
-                    snprintf(tpath, PATH_MAX-1, "%s%s", path, list[i]);
-                } else {
-                    snprintf(tpath, PATH_MAX-1, "%s/%s", path, list[i]);
-                }
-                lpath = tpath;
-            }
+        size_t i, count=0;
+        while (list[count])
+            count++;
 
-            dump_afc_file_info(afc, lpath);
+        char **paths = calloc(count+1, sizeof(char*));
+        for (i=0; paths && i<count; i++) {
+            if ((paths[i] = path_join(path, list[i])) == NULL)
+                break;
         }
 
-        ret=EXIT_SUCCESS;
+        if (!paths || i < count) {
+            fprintf(ERRF, "Error: out of memory\n");
+        } else if (names_only) {
+            for (i=0; i<count; i++)
+                fprintf(OUTF, "%s\n", paths[i]);
+            ret=EXIT_SUCCESS;
+        } else {
+            fprintf(OUTF, "AFC Device Listing path=\"%s\":\n", path);
+            dump_afc_file_infos(afc, paths, count);
+            ret=EXIT_SUCCESS;
+        }
+
+        if (paths)
+            afcproto_list_free(paths);
+
     } else if (err == AFC_E_READ_ERROR) { // fall-back to doing a file info request, incase its a file
         if (idev_verbose)
-            fprintf(stderr, "[debug] directory read error -- falling back to file info at %s\n", path);
+            fprintf(ERRF, "[debug] directory read error -- falling back to file info at %s\n", path);
 
         ret = dump_afc_file_info(afc, path);
     } else {
-        fprintf(stderr, "Error: afc list \"%s\" failed: %s\n", path, idev_afc_strerror(err));
+        fprintf(ERRF, "Error: afc list \"%s\" failed: %s\n", path, idev_afc_strerror(err));
     }
 
     if (list)
-        free(list);
+        afcproto_list_free(list);
 
     return ret;
 }
 
 
-int dump_afc_path(afc_client_t afc, const char *path, FILE *outf)
+int dump_afc_path(afcproto_client_t afc, const char *path, FILE *outf)
 {
     int ret=EXIT_FAILURE;
 
     uint64_t handle=0;
 
     if (idev_verbose)
-        fprintf(stderr, "[debug] creating afc file connection to %s\n", path);
+        fprintf(ERRF, "[debug] creating afc file connection to %s\n", path);
 
-    afc_error_t err = afc_file_open(afc, path, AFC_FOPEN_RDONLY, &handle);
+    afc_error_t err = afcproto_file_open(afc, path, AFC_FOPEN_RDONLY, &handle);
 
     if (err == AFC_E_SUCCESS) {
-        char buf[CHUNKSZ];
+        // output is written on its own thread so a slow reader doesn't hold
+        // up requests to the device
+        xfer_ring_t ring;
+        bool piped = (xfer_ring_start(&ring, ^(xfer_ring_t *r) {
+            char *data;
+            uint32_t len;
+            uint64_t off;
+            while ((data = xfer_ring_drain(r, &len, &off)) != NULL) {
+                if (fwrite(data, 1, len, outf) != len) {
+                    xfer_ring_abort(r, errno);
+                    break;
+                }
+                xfer_ring_pop(r);
+            }
+        }) == EXIT_SUCCESS);
+
+        char *buf = (piped)? NULL : malloc(CHUNK_MAX);
         uint32_t bytes_read=0;
+        size_t totbytes=0;
+        int werr=0;
+
+        chunk_ctl_t ctl;
+        chunk_ctl_init(&ctl);
+
+        afcproto_reader_t rd;
+        afcproto_reader_init(&rd, afc, handle, ctl.size, pipeline_depth);
+
+        uint64_t start = now_ns(), last = start;
+        while (piped || buf) {
+            char *dest = (piped)? xfer_ring_fill(&ring) : buf;
+            if (!dest)
+                break;
+
+            if ((err=afcproto_reader_next(&rd, dest, CHUNK_MAX, &bytes_read)) != AFC_E_SUCCESS || bytes_read == 0)
+                break;
+
+            uint64_t now = now_ns();
+            rd.chunk = chunk_ctl_update(&ctl, bytes_read, now - last);
+            last = now;
+
+            if (piped) {
+                xfer_ring_push(&ring, bytes_read, totbytes);
+            } else if (fwrite(buf, 1, bytes_read, outf) != bytes_read) {
+                werr = errno;
+                break;
+            }
+            totbytes += bytes_read;
+        }
+        afcproto_reader_finish(&rd);
 
-        while((err=afc_file_read(afc, handle, buf, CHUNKSZ, &bytes_read)) == AFC_E_SUCCESS && bytes_read > 0) {
-            fwrite(buf, 1, bytes_read, outf);
+        if (piped) {
+            xfer_ring_close(&ring);
+            xfer_ring_finish(&ring);
+            werr = ring.error;
+        } else if (!buf) {
+            err = AFC_E_NO_MEM;
         }
 
-        if (err)
-            fprintf(stderr, "Error: Encountered error while reading %s: %s\n", path, idev_afc_strerror(err));
-        else
+        if (werr) {
+            fprintf(ERRF, "Error: Encountered error while writing %s: %s\n", path, strerror(werr));
+        } else if (err) {
+            fprintf(ERRF, "Error: Encountered error while reading %s: %s\n", path, idev_afc_strerror(err));
+        } else {
+            report_transfer("cat", path, totbytes, start, &ctl);
             ret=EXIT_SUCCESS;
+        }
 
-        afc_file_close(afc, handle);
+        free(buf);
+        afcproto_file_close(afc, handle);
     } else {
-        fprintf(stderr, "Error: afc open file %s failed: %s\n", path, idev_afc_strerror(err));
+        fprintf(ERRF, "Error: afc open file %s failed: %s\n", path, idev_afc_strerror(err));
     }
 
     return ret;
 }
 
+// get/put flags
+#define XFER_RECURSIVE  0x1
+#define XFER_RESUME     0x2
+#define XFER_VERIFY     0x4
 
-int get_afc_path(afc_client_t afc, const char *src, const char *dst)
-{
-    int ret=EXIT_FAILURE;
+// how much of a partial file --verify compares before resuming
+#define RESUME_VERIFY_LEN (64*1024)
 
-    if (idev_verbose)
-        fprintf(stderr, "[debug] Downloading %s to %s - creating afc file connection\n", src, dst);
+// the remote size of path, or -1 if it doesn't exist
+int64_t remote_size(afcproto_client_t afc, const char *path)
+{
+    char **info=NULL;
+    int64_t size = -1;
 
-    uint64_t handle=0;
-    afc_error_t err = afc_file_open(afc, src, AFC_FOPEN_RDONLY, &handle);
+    if (afcproto_get_file_info(afc, path, &info) == AFC_E_SUCCESS) {
+        const char *sz = afcproto_info_value(info, "st_size");
+        if (sz)
+            size = strtoll(sz, NULL, 10);
+    }
+    afcproto_list_free(info);
 
-    if (err == AFC_E_SUCCESS) {
-        char buf[CHUNKSZ];
-        uint32_t bytes_read=0;
-        size_t totbytes=0;
+    return size;
+}
 
-        FILE *outf = fopen(dst, "w");
-        if (outf) {
-            while((err=afc_file_read(afc, handle, buf, CHUNKSZ, &bytes_read)) == AFC_E_SUCCESS && bytes_read > 0) {
-                totbytes += fwrite(buf, 1, bytes_read, outf);
-            }
-            fclose(outf);
-            if (err) {
-                fprintf(stderr, "Error: Encountered error while reading %s: %s\n", src, idev_afc_strerror(err));
-                fprintf(stderr, "Warning! - %lu bytes read - incomplete data in %s may have resulted.\n", totbytes, dst);
-            } else {
-                printf("Saved %lu bytes to %s\n", totbytes, dst);
-                ret=EXIT_SUCCESS;
-            }
+// Compares the block before offset in the remote file with the same block of
+// the local one. Both file positions are left undefined.
+bool tail_matches(afcproto_client_t afc, uint64_t handle, FILE *local, uint64_t offset)
+{
+    uint32_t len = (offset < RESUME_VERIFY_LEN)? (uint32_t)offset : RESUME_VERIFY_LEN;
+    char *rbuf = malloc(len), *lbuf = malloc(len);
+    bool ret = false;
 
-        } else {
-            fprintf(stderr, "Error opening local file for writing: %s - %s\n", dst, strerror(errno));
-        }
+    if (rbuf && lbuf
+            && fseeko(local, offset-len, SEEK_SET) == 0
+            && fread(lbuf, 1, len, local) == len
+            && afcproto_file_seek(afc, handle, offset-len, SEEK_SET) == AFC_E_SUCCESS)
+    {
+        uint32_t got=0, n=0;
+        while (got < len && afcproto_file_read(afc, handle, rbuf+got, len-got, &n) == AFC_E_SUCCESS && n > 0)
+            got += n;
 
-        afc_file_close(afc, handle);
-    } else {
-        fprintf(stderr, "Error: afc open file %s failed: %s\n", src, idev_afc_strerror(err));
+        ret = (got == len && !memcmp(rbuf, lbuf, len));
     }
 
+    free(rbuf);
+    free(lbuf);
     return ret;
 }
 
-int put_afc_path(afc_client_t afc, const char *src, const char *dst)
+// Reopens a partial download at dst for appending, and moves the remote
+// handle to the same offset. Returns NULL if there's nothing usable to
+// resume from.
+FILE *resume_download(afcproto_client_t afc, uint64_t handle, const char *src, const char *dst, int64_t size, int flags, uint64_t *offset)
 {
-    int ret=EXIT_FAILURE;
+    struct stat st;
+    if (stat(dst, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NULL;
 
-    uint64_t handle=0;
+    if (size < st.st_size) {
+        fprintf(ERRF, "Warning: %s is larger than %s - downloading it again\n", dst, src);
+        return NULL;
+    }
 
-    FILE *inf = fopen(src, "r");
-    if (inf) {
-        if (idev_verbose)
-            fprintf(stderr, "[debug] Uploading %s to %s - creating afc file connection\n", src, dst);
+    FILE *f = fopen(dst, "r+");
+    if (!f)
+        return NULL;
 
-        afc_error_t err = afc_file_open(afc, dst, AFC_FOPEN_WRONLY, &handle);
+    if ((flags & XFER_VERIFY) && !tail_matches(afc, handle, f, st.st_size)) {
+        fprintf(ERRF, "Warning: %s doesn't match the start of %s - downloading it again\n", dst, src);
+        fclose(f);
+        return NULL;
+    }
 
-        if (err == AFC_E_SUCCESS) {
-            char buf[CHUNKSZ];
-            uint32_t bytes_read=0;
-            size_t totbytes=0;
+    if (fseeko(f, st.st_size, SEEK_SET) != 0 || afcproto_file_seek(afc, handle, st.st_size, SEEK_SET) != AFC_E_SUCCESS) {
+        fclose(f);
+        return NULL;
+    }
 
-            while(err==AFC_E_SUCCESS && (bytes_read=fread(buf, 1, CHUNKSZ, inf)) > 0) {
-                uint32_t bytes_written=0;
-                err=afc_file_write(afc, handle, buf, bytes_read, &bytes_written);
-                totbytes += bytes_written;
-            }
+    *offset = st.st_size;
+    return f;
+}
 
-            if (err) {
-                fprintf(stderr, "Error: Encountered error while writing %s: %s\n", src, idev_afc_strerror(err));
-                fprintf(stderr, "Warning! - %lu bytes read - incomplete data in %s may have resulted.\n", totbytes, dst);
-            } else {
-                printf("Uploaded %lu bytes to %s\n", totbytes, dst);
-                ret=EXIT_SUCCESS;
-            }
+// Opens an existing partial upload at dst and moves both files to where it
+// left off. Returns the offset, or 0 with no handle opened if the upload
+// has to start over.
+uint64_t resume_upload(afcproto_client_t afc, FILE *inf, const char *src, const char *dst, int flags, uint64_t *handle)
+{
+    struct stat st;
+    int64_t rsize = remote_size(afc, dst);
 
-            afc_file_close(afc, handle);
-        } else {
-            fprintf(stderr, "Error: afc open file %s failed: %s\n", src, idev_afc_strerror(err));
-        }
-        fclose(inf);
-    } else {
-        fprintf(stderr, "Error opening local file for reading: %s - %s\n", dst, strerror(errno));
+    if (rsize <= 0 || fstat(fileno(inf), &st) != 0)
+        return 0;
+
+    if (rsize > st.st_size) {
+        fprintf(ERRF, "Warning: %s is larger than %s - uploading it again\n", dst, src);
+        return 0;
     }
 
-    return ret;
+    if (afcproto_file_open(afc, dst, AFC_FOPEN_RW, handle) != AFC_E_SUCCESS)
+        return 0;
+
+    if ((flags & XFER_VERIFY) && !tail_matches(afc, *handle, inf, rsize)) {
+        fprintf(ERRF, "Warning: %s doesn't match the start of %s - uploading it again\n", dst, src);
+    } else if (fseeko(inf, rsize, SEEK_SET) == 0 && afcproto_file_seek(afc, *handle, rsize, SEEK_SET) == AFC_E_SUCCESS) {
+        return rsize;
+    }
+
+    afcproto_file_close(afc, *handle);
+    rewind(inf);
+    return 0;
 }
 
+// Reserves the rest of a download up front so large files aren't
+// fragmented. Returns true if the file now has its full size on disk.
+bool preallocate_local(int fd, uint64_t offset, int64_t size, const char *path)
+{
+#ifdef __linux
+    if (size <= 0 || (uint64_t)size <= offset)
+        return false;
 
-#pragma mark - Command handlers
+    int err = posix_fallocate(fd, offset, size - offset);
+    if (err == 0)
+        return true;
+
+    if (idev_verbose)
+        fprintf(ERRF, "[debug] not preallocating %s - %s\n", path, strerror(err));
+#endif
+    return false;
+}
 
-int do_info(afc_client_t afc, int argc, char **argv)
+static int pwrite_all(int fd, const char *buf, size_t len, uint64_t offset)
 {
-    int j, i, ret = EXIT_SUCCESS;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Large files are fetched in RANGE_SIZE pieces over several connections at
+// once when the pool has connections to spare. Each connection has its own
+// handle and seeks to the ranges it takes; data is written with pwrite into
+// the preallocated destination. A range that fails is put back and picked
+// up again, by any connection, from where it stopped, up to RANGE_RETRIES
+// times before the download gives up.
+#define RANGE_MIN_FILE  (64*1024*1024)
+#define RANGE_SIZE      (16*1024*1024)
+#define RANGE_RETRIES   3
+
+enum { RANGE_PENDING, RANGE_BUSY, RANGE_DONE };
+
+typedef struct range {
+    uint64_t start;
+    uint64_t length;
+    uint64_t done;
+    int failures;
+    int state;
+} range_t;
+
+typedef struct ranged_get {
+    const char *src;
+    int fd;
+    range_t *ranges;
+    size_t count;
+    uint64_t end;       // lowered if the file turns out shorter than expected
+    uint64_t totbytes;
+    afc_error_t err;
+    int werr;
+    bool stop;
+    progress_t *prog;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ranged_get_t;
+
+typedef struct range_worker {
+    pthread_t thread;
+    ranged_get_t *rg;
+    afcproto_client_t afc;
+    uint64_t handle;    // 0 until opened
+    bool pooled;        // afc was checked out for this download
+    bool running;
+    char *buf;
+    idev_afc_pool_t pool;
+    FILE *outf;
+    FILE *errf;
+    const char *device;
+} range_worker_t;
+
+// the next range to work on, waiting while others might still hand theirs back
+static range_t *range_take(ranged_get_t *rg)
+{
+    range_t *ret = NULL;
+
+    pthread_mutex_lock(&rg->lock);
+    while (!rg->stop) {
+        size_t i, busy=0;
+        for (i=0; i<rg->count && !ret; i++) {
+            if (rg->ranges[i].state == RANGE_PENDING)
+                ret = &rg->ranges[i];
+            else if (rg->ranges[i].state == RANGE_BUSY)
+                busy++;
+        }
+        if (ret) {
+            ret->state = RANGE_BUSY;
+            break;
+        } else if (busy == 0) {
+            break;
+        }
+        pthread_cond_wait(&rg->cond, &rg->lock);
+    }
+    pthread_mutex_unlock(&rg->lock);
+
+    return ret;
+}
+
+static afc_error_t range_fetch(range_worker_t *w, range_t *r)
+{
+    ranged_get_t *rg = w->rg;
+    afc_error_t err = AFC_E_SUCCESS;
+
+    if (!w->handle && (err = afcproto_file_open(w->afc, rg->src, AFC_FOPEN_RDONLY, &w->handle)) != AFC_E_SUCCESS) {
+        w->handle = 0;
+        return err;
+    }
+
+    uint64_t pos = r->start + r->done, end = r->start + r->length;
+    if ((err = afcproto_file_seek(w->afc, w->handle, pos, SEEK_SET)) != AFC_E_SUCCESS)
+        return err;
+
+    chunk_ctl_t ctl;
+    chunk_ctl_init(&ctl);
+
+    afcproto_reader_t rd;
+    afcproto_reader_init(&rd, w->afc, w->handle, ctl.size, pipeline_depth);
+    afcproto_reader_limit(&rd, end - pos);
+
+    uint64_t last = now_ns();
+    while (pos < end) {
+        uint32_t bytes_read=0;
+        if ((err = afcproto_reader_next(&rd, w->buf, CHUNK_MAX, &bytes_read)) != AFC_E_SUCCESS)
+            break;
+
+        uint64_t now = now_ns();
+        rd.chunk = chunk_ctl_update(&ctl, bytes_read, now - last);
+        last = now;
+
+        int werr = (bytes_read && pwrite_all(rg->fd, w->buf, bytes_read, pos) != 0)? errno : 0;
+        if (!werr) {
+            pos += bytes_read;
+            r->done += bytes_read;
+        }
+
+        pthread_mutex_lock(&rg->lock);
+        if (werr) {
+            rg->werr = werr;
+            rg->stop = true;
+        } else if (bytes_read == 0 && pos < rg->end) {
+            // the file got shorter since we looked at it
+            rg->end = pos;
+        }
+        rg->totbytes += bytes_read;
+        progress_update(rg->prog, rg->totbytes, now);
+        bool stop = rg->stop;
+        pthread_mutex_unlock(&rg->lock);
+
+        if (stop) {
+            err = AFC_E_OP_INTERRUPTED;
+            break;
+        } else if (bytes_read == 0) {
+            break;
+        }
+    }
+    afcproto_reader_finish(&rd);
+
+    return err;
+}
+
+static void *range_worker_main(void *arg)
+{
+    range_worker_t *w = arg;
+    ranged_get_t *rg = w->rg;
+    range_t *r;
+
+    pool = w->pool;
+    cmd_out = w->outf;
+    cmd_err = w->errf;
+    cmd_device = w->device;
+
+    while ((r = range_take(rg)) != NULL) {
+        afc_error_t err = range_fetch(w, r);
+
+        pthread_mutex_lock(&rg->lock);
+        if (!err) {
+            r->state = RANGE_DONE;
+        } else if (rg->stop) {
+            r->state = RANGE_PENDING;
+        } else if (++r->failures > RANGE_RETRIES) {
+            r->state = RANGE_PENDING;
+            rg->err = err;
+            rg->stop = true;
+        } else {
+            r->state = RANGE_PENDING;
+            if (idev_verbose)
+                fprintf(ERRF, "[debug] range %llu+%llu of %s failed (%s), retrying\n",
+                        (unsigned long long)r->start, (unsigned long long)r->length, rg->src, idev_afc_strerror(err));
+        }
+        pthread_cond_broadcast(&rg->cond);
+        pthread_mutex_unlock(&rg->lock);
+
+        // a broken pooled connection is swapped for a fresh one. Without
+        // one this worker is done and the others pick up what's left
+        if (err && afcproto_client_is_broken(w->afc)) {
+            if (!w->pooled)
+                break;
+            idev_afc_pool_checkin(pool, w->afc);
+            w->handle = 0;
+            if ((w->afc = idev_afc_pool_try_checkout(pool)) == NULL)
+                break;
+        }
+    }
+
+    pthread_mutex_lock(&rg->lock);
+    pthread_cond_broadcast(&rg->cond);
+    pthread_mutex_unlock(&rg->lock);
+    return NULL;
+}
+
+// Fetches src into fd in ranges, using afc and its open handle plus as many
+// more connections as the pool can give right away, up to -j. Returns false
+// without doing anything if the pool has none to spare. Otherwise *pos is
+// set to how much of the file is complete from the start, for truncating a
+// failed download down to something --resume can continue from.
+bool get_ranges(afcproto_client_t afc, uint64_t handle, const char *src, int fd, uint64_t size,
+        progress_t *prog, uint64_t *pos, size_t *totbytes, afc_error_t *err, int *werr)
+{
+    size_t i, count = (size + RANGE_SIZE - 1) / RANGE_SIZE;
+    int nworkers = (count < (size_t)jobs)? (int)count : jobs;
+    if (nworkers < 2)
+        return false;
+
+    range_worker_t *workers = calloc(nworkers, sizeof(range_worker_t));
+    if (!workers)
+        return false;
+
+    workers[0].afc = afc;
+    workers[0].handle = handle;
+    for (i=1; i<(size_t)nworkers; i++) {
+        if ((workers[i].afc = idev_afc_pool_try_checkout(pool)) == NULL)
+            break;
+        workers[i].pooled = true;
+    }
+    nworkers = (int)i;
+
+    ranged_get_t rg;
+    memset(&rg, 0, sizeof(rg));
+    rg.ranges = calloc(count, sizeof(range_t));
+    for (i=0; i<(size_t)nworkers && rg.ranges; i++) {
+        if ((workers[i].buf = malloc(CHUNK_MAX)) == NULL)
+            break;
+    }
+
+    if (nworkers < 2 || !rg.ranges || i < (size_t)nworkers) {
+        for (i=0; i<(size_t)nworkers; i++) {
+            free(workers[i].buf);
+            if (workers[i].pooled)
+                idev_afc_pool_checkin(pool, workers[i].afc);
+        }
+        free(rg.ranges);
+        free(workers);
+        return false;
+    }
+
+    for (i=0; i<count; i++) {
+        rg.ranges[i].start = i * (uint64_t)RANGE_SIZE;
+        rg.ranges[i].length = (size - rg.ranges[i].start < RANGE_SIZE)? size - rg.ranges[i].start : RANGE_SIZE;
+    }
+    rg.src = src;
+    rg.fd = fd;
+    rg.count = count;
+    rg.end = size;
+    rg.prog = prog;
+    pthread_mutex_init(&rg.lock, NULL);
+    pthread_cond_init(&rg.cond, NULL);
+
+    if (idev_verbose)
+        fprintf(ERRF, "[debug] fetching %s as %lu ranges over %d connections\n", src, count, nworkers);
+
+    for (i=0; i<(size_t)nworkers; i++) {
+        workers[i].rg = &rg;
+        workers[i].pool = pool;
+        workers[i].outf = cmd_out;
+        workers[i].errf = cmd_err;
+        workers[i].device = cmd_device;
+        if (i > 0 && pthread_create(&workers[i].thread, NULL, range_worker_main, &workers[i]) == 0)
+            workers[i].running = true;
+    }
+
+    range_worker_main(&workers[0]);
+
+    for (i=1; i<(size_t)nworkers; i++) {
+        if (workers[i].running)
+            pthread_join(workers[i].thread, NULL);
+        if (workers[i].afc) {
+            if (workers[i].handle)
+                afcproto_file_close(workers[i].afc, workers[i].handle);
+            idev_afc_pool_checkin(pool, workers[i].afc);
+        }
+        free(workers[i].buf);
+    }
+    free(workers[0].buf);
+    free(workers);
+
+    // complete from the start up to the first range that isn't
+    size_t left = 0;
+    for (i=0, *pos=0; i<count; i++) {
+        if (rg.ranges[i].state != RANGE_DONE)
+            left++;
+        if (*pos == rg.ranges[i].start)
+            *pos += rg.ranges[i].done;
+    }
+
+    // every worker lost its connection with work left over
+    if (left && !rg.err && !rg.werr)
+        rg.err = AFC_E_MUX_ERROR;
+
+    // A range that came up short means the file shrank while it was being
+    // read, and other ranges may have been read before or after that. The
+    // copy can't be trusted either way; the caller truncates it to the
+    // complete part, which --resume can continue from.
+    if (!left && !rg.err && !rg.werr && *pos < size) {
+        fprintf(ERRF, "Error: %s changed size while being downloaded\n", src);
+        rg.err = AFC_E_IO_ERROR;
+    }
+
+    *totbytes = rg.totbytes;
+    *err = rg.err;
+    *werr = rg.werr;
+
+    pthread_mutex_destroy(&rg.lock);
+    pthread_cond_destroy(&rg.cond);
+    free(rg.ranges);
+    return true;
+}
+
+// size is the remote file size if the caller already knows it, or -1
+int get_afc_path(afcproto_client_t afc, const char *src, const char *dst, int64_t size, int flags)
+{
+    int ret=EXIT_FAILURE;
+
+    if (idev_verbose)
+        fprintf(ERRF, "[debug] Downloading %s to %s - creating afc file connection\n", src, dst);
+
+    uint64_t handle=0;
+    afc_error_t err = afcproto_file_open(afc, src, AFC_FOPEN_RDONLY, &handle);
+
+    if (err == AFC_E_SUCCESS) {
+        uint32_t bytes_read=0;
+        size_t totbytes=0;
+        uint64_t offset=0;
+
+        if (size < 0)
+            size = remote_size(afc, src);
+
+        FILE *outf = NULL;
+        if (flags & XFER_RESUME) {
+            outf = resume_download(afc, handle, src, dst, size, flags, &offset);
+            if (!outf)
+                afcproto_file_seek(afc, handle, 0, SEEK_SET);
+        }
+        if (!outf)
+            outf = fopen(dst, "w+");
+
+        if (outf) {
+            int fd = fileno(outf), werr = 0;
+            bool prealloc = preallocate_local(fd, offset, size, dst);
+
+            progress_t prog;
+            progress_start(&prog, "get", src, dst, size, offset);
+
+            uint64_t start = now_ns(), last = start, pos = offset;
+            bool ranged = (!offset && size >= RANGE_MIN_FILE &&
+                           get_ranges(afc, handle, src, fd, size, &prog, &pos, &totbytes, &err, &werr));
+
+            // With the space reserved, large files are received straight into
+            // a mapping of the destination. Everything else is written out
+            // on the ring's thread while the next chunks are being read.
+            char *map = NULL;
+            if (!ranged && prealloc && size >= CHUNK_MAX) {
+                map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+                if (map == MAP_FAILED)
+                    map = NULL;
+            }
+
+            xfer_ring_t ring;
+            bool piped = (!ranged && xfer_ring_start(&ring, ^(xfer_ring_t *r) {
+                char *data;
+                uint32_t len;
+                uint64_t off;
+                while ((data = xfer_ring_drain(r, &len, &off)) != NULL) {
+                    if (pwrite_all(fd, data, len, off) != 0) {
+                        xfer_ring_abort(r, errno);
+                        break;
+                    }
+                    xfer_ring_pop(r);
+                }
+            }) == EXIT_SUCCESS);
+
+            char *buf = (piped || ranged)? NULL : malloc(CHUNK_MAX);
+
+            chunk_ctl_t ctl;
+            chunk_ctl_init(&ctl);
+
+            afcproto_reader_t rd;
+            afcproto_reader_init(&rd, afc, handle, ctl.size, pipeline_depth);
+
+            while (piped || buf) {
+                // a reply can be up to CHUNK_MAX, so the tail never goes into
+                // the map - nor does anything a growing file has gained past it
+                bool direct = (map && pos + CHUNK_MAX <= (uint64_t)size);
+                char *dest = (direct)? map + pos : (piped)? xfer_ring_fill(&ring) : buf;
+                if (!dest)
+                    break;
+
+                if ((err=afcproto_reader_next(&rd, dest, CHUNK_MAX, &bytes_read)) != AFC_E_SUCCESS || bytes_read == 0)
+                    break;
+
+                uint64_t now = now_ns();
+                rd.chunk = chunk_ctl_update(&ctl, bytes_read, now - last);
+                last = now;
+
+                if (direct) {
+                    ; // already in place
+                } else if (piped) {
+                    xfer_ring_push(&ring, bytes_read, pos);
+                } else if (pwrite_all(fd, buf, bytes_read, pos) != 0) {
+                    werr = errno;
+                    break;
+                }
+                pos += bytes_read;
+                totbytes += bytes_read;
+                progress_update(&prog, pos, now);
+            }
+            afcproto_reader_finish(&rd);
+
+            if (piped) {
+                xfer_ring_close(&ring);
+                xfer_ring_finish(&ring);
+                if ((werr = ring.error) != 0)
+                    pos = ring.error_offset;
+            } else if (!buf && !ranged) {
+                err = AFC_E_NO_MEM;
+            }
+
+            if (map)
+                munmap(map, size);
+
+            // drop anything past what was actually written, so a short or
+            // failed download can still be resumed from its real length
+            if ((prealloc || werr || ranged) && (size < 0 || pos < (uint64_t)size) && ftruncate(fd, pos) != 0 && idev_verbose)
+                fprintf(ERRF, "[debug] could not truncate %s - %s\n", dst, strerror(errno));
+
+            free(buf);
+            fclose(outf);
+            report_transfer("get", src, totbytes, start, &ctl);
+            progress_end(&prog, (werr)? strerror(werr) : (err)? idev_afc_strerror(err) : NULL);
+            if (werr) {
+                fprintf(ERRF, "Error writing local file: %s - %s\n", dst, strerror(werr));
+                fprintf(ERRF, "Warning! - %lu bytes read - incomplete data in %s may have resulted.\n", totbytes, dst);
+            } else if (err) {
+                fprintf(ERRF, "Error: Encountered error while reading %s: %s\n", src, idev_afc_strerror(err));
+                fprintf(ERRF, "Warning! - %lu bytes read - incomplete data in %s may have resulted.\n", totbytes, dst);
+            } else if (offset) {
+                fprintf(OUTF, "Saved %lu bytes to %s (resumed at %llu)\n", totbytes, dst, (unsigned long long)offset);
+                ret=EXIT_SUCCESS;
+            } else {
+                fprintf(OUTF, "Saved %lu bytes to %s\n", totbytes, dst);
+                ret=EXIT_SUCCESS;
+            }
+
+        } else {
+            fprintf(ERRF, "Error opening local file for writing: %s - %s\n", dst, strerror(errno));
+        }
+
+        afcproto_file_close(afc, handle);
+    } else {
+        fprintf(ERRF, "Error: afc open file %s failed: %s\n", src, idev_afc_strerror(err));
+    }
+
+    return ret;
+}
+
+int put_afc_path(afcproto_client_t afc, const char *src, const char *dst, int flags)
+{
+    int ret=EXIT_FAILURE;
+
+    uint64_t handle=0, offset=0;
+
+    FILE *inf = fopen(src, "r");
+    if (inf) {
+        if (idev_verbose)
+            fprintf(ERRF, "[debug] Uploading %s to %s - creating afc file connection\n", src, dst);
+
+        afc_error_t err = AFC_E_SUCCESS;
+        if (flags & XFER_RESUME)
+            offset = resume_upload(afc, inf, src, dst, flags, &handle);
+        if (!offset)
+            err = afcproto_file_open(afc, dst, AFC_FOPEN_WRONLY, &handle);
+
+        if (err == AFC_E_SUCCESS) {
+            uint32_t bytes_read=0;
+            size_t totbytes=0;
+
+            // regular files are written to the device straight out of a
+            // mapping, with the kernel's readahead keeping ahead of us.
+            // Anything else is read on the ring's thread.
+            struct stat st;
+            char *map = NULL, *buf = NULL;
+            int64_t total = -1;
+            if (fstat(fileno(inf), &st) == 0 && S_ISREG(st.st_mode)) {
+                total = st.st_size;
+                if (st.st_size > 0) {
+                    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(inf), 0);
+                    if (map == MAP_FAILED)
+                        map = NULL;
+                    else
+                        madvise(map, st.st_size, MADV_SEQUENTIAL);
+                }
+            }
+
+            xfer_ring_t ring;
+            bool piped = (!map && xfer_ring_start(&ring, ^(xfer_ring_t *r) {
+                char *data;
+                uint64_t off = offset;
+                while ((data = xfer_ring_fill(r)) != NULL) {
+                    size_t n = fread(data, 1, CHUNK_MAX, inf);
+                    if (n == 0) {
+                        if (ferror(inf))
+                            xfer_ring_abort(r, EIO);
+                        break;
+                    }
+                    xfer_ring_push(r, n, off);
+                    off += n;
+                }
+                xfer_ring_close(r);
+            }) == EXIT_SUCCESS);
+
+            if (!map && !piped)
+                buf = malloc(CHUNK_MAX);
+
+            chunk_ctl_t ctl;
+            chunk_ctl_init(&ctl);
+
+            progress_t prog;
+            progress_start(&prog, "put", dst, src, total, offset);
+
+            uint64_t start = now_ns(), pos = offset;
+            uint32_t avail = 0;
+            char *data = NULL;
+            while (err==AFC_E_SUCCESS) {
+                if (avail == 0) {
+                    if (data && piped)
+                        xfer_ring_pop(&ring);
+
+                    uint64_t off = pos;
+                    if (map) {
+                        data = map + pos;
+                        avail = (st.st_size - pos < CHUNK_MAX)? (uint32_t)(st.st_size - pos) : CHUNK_MAX;
+                    } else if (piped) {
+                        data = xfer_ring_drain(&ring, &avail, &off);
+                    } else if (buf) {
+                        data = buf;
+                        avail = fread(buf, 1, CHUNK_MAX, inf);
+                    }
+                    if (!data || avail == 0)
+                        break;
+                }
+
+                uint32_t bytes_written=0, len = (avail < ctl.size)? avail : ctl.size;
+                uint64_t t = now_ns();
+                err=afcproto_file_write(afc, handle, data, len, &bytes_written);
+                uint64_t now = now_ns();
+                chunk_ctl_update(&ctl, bytes_written, now - t);
+                data += bytes_written;
+                avail -= bytes_written;
+                pos += bytes_written;
+                totbytes += bytes_written;
+                progress_update(&prog, pos, now);
+            }
+
+            if (piped) {
+                xfer_ring_abort(&ring, 0);
+                xfer_ring_finish(&ring);
+                if (ring.error && !err)
+                    err = AFC_E_IO_ERROR;
+            } else if (!map && !buf) {
+                err = AFC_E_NO_MEM;
+            }
+
+            if (map)
+                munmap(map, st.st_size);
+            free(buf);
+            report_transfer("put", dst, totbytes, start, &ctl);
+            progress_end(&prog, (err)? idev_afc_strerror(err) : NULL);
+
+            if (err) {
+                fprintf(ERRF, "Error: Encountered error while writing %s: %s\n", src, idev_afc_strerror(err));
+                fprintf(ERRF, "Warning! - %lu bytes read - incomplete data in %s may have resulted.\n", totbytes, dst);
+            } else if (offset) {
+                fprintf(OUTF, "Uploaded %lu bytes to %s (resumed at %llu)\n", totbytes, dst, (unsigned long long)offset);
+                ret=EXIT_SUCCESS;
+            } else {
+                fprintf(OUTF, "Uploaded %lu bytes to %s\n", totbytes, dst);
+                ret=EXIT_SUCCESS;
+            }
+
+            afcproto_file_close(afc, handle);
+        } else {
+            fprintf(ERRF, "Error: afc open file %s failed: %s\n", src, idev_afc_strerror(err));
+        }
+        fclose(inf);
+    } else {
+        fprintf(ERRF, "Error opening local file for reading: %s - %s\n", dst, strerror(errno));
+    }
+
+    return ret;
+}
+
+
+#pragma mark - Parallel transfers
+
+typedef struct xfer_job {
+    char *src;
+    char *dst;
+    uint64_t size;
+    uint64_t mtime_ns; // for sync, the mtime to give the copy
+    uint64_t elapsed_ns;
+    int status;
+} xfer_job_t;
+
+typedef struct xfer_queue {
+    xfer_job_t *jobs;
+    size_t count;
+    size_t capacity;
+    size_t next;
+    int failures;
+    int connections;
+    uint64_t elapsed_ns;
+    pthread_mutex_t lock;
+} xfer_queue_t;
+
+void xfer_queue_init(xfer_queue_t *q)
+{
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+}
+
+void xfer_queue_free(xfer_queue_t *q)
+{
+    size_t i;
+    for (i=0; i<q->count; i++) {
+        free(q->jobs[i].src);
+        free(q->jobs[i].dst);
+    }
+    free(q->jobs);
+    pthread_mutex_destroy(&q->lock);
+}
+
+// takes ownership of src and dst
+int xfer_queue_add(xfer_queue_t *q, char *src, char *dst, uint64_t size)
+{
+    if (q->count == q->capacity) {
+        size_t cap = (q->capacity)? q->capacity*2 : 64;
+        xfer_job_t *jobs = realloc(q->jobs, cap * sizeof(xfer_job_t));
+        if (!jobs) {
+            free(src);
+            free(dst);
+            return EXIT_FAILURE;
+        }
+        q->jobs = jobs;
+        q->capacity = cap;
+    }
+
+    memset(&q->jobs[q->count], 0, sizeof(xfer_job_t));
+    q->jobs[q->count].src = src;
+    q->jobs[q->count].dst = dst;
+    q->jobs[q->count].size = size;
+    q->count++;
+    return EXIT_SUCCESS;
+}
+
+static int cmp_job_size(const void *a, const void *b)
+{
+    uint64_t sa = ((xfer_job_t*)a)->size, sb = ((xfer_job_t*)b)->size;
+    return (sa < sb)? -1 : (sa > sb);
+}
+
+// orders jobs largest, smallest, next largest, next smallest... so that the
+// big files start early and there are always small ones left to fill in
+// around them, instead of every worker ending up on one big file at the end
+void xfer_queue_mix(xfer_queue_t *q)
+{
+    if (q->count < 3)
+        return;
+
+    qsort(q->jobs, q->count, sizeof(xfer_job_t), cmp_job_size);
+
+    xfer_job_t *mixed = malloc(q->count * sizeof(xfer_job_t));
+    if (mixed) {
+        size_t lo=0, hi=q->count, i;
+        for (i=0; i<q->count; i++)
+            mixed[i] = (i%2)? q->jobs[lo++] : q->jobs[--hi];
+
+        free(q->jobs);
+        q->jobs = mixed;
+        q->capacity = q->count;
+    }
+}
+
+xfer_job_t *xfer_queue_next(xfer_queue_t *q)
+{
+    xfer_job_t *job = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->next < q->count)
+        job = &q->jobs[q->next++];
+    pthread_mutex_unlock(&q->lock);
+
+    return job;
+}
+
+typedef struct xfer_worker {
+    pthread_t thread;
+    afcproto_client_t afc;
+    xfer_queue_t *queue;
+    int(^transfer)(afcproto_client_t afc, xfer_job_t *job);
+    idev_afc_pool_t pool;
+    FILE *outf;
+    FILE *errf;
+    const char *device;
+} xfer_worker_t;
+
+static void *xfer_worker_main(void *arg)
+{
+    xfer_worker_t *w = arg;
+    xfer_job_t *job;
+
+    // big files fetch ranges over more connections from the same pool
+    pool = w->pool;
+    cmd_out = w->outf;
+    cmd_err = w->errf;
+    cmd_device = w->device;
+
+    while ((job = xfer_queue_next(w->queue)) != NULL) {
+        uint64_t start = now_ns();
+        job->status = w->transfer(w->afc, job);
+        job->elapsed_ns = now_ns() - start;
+
+        if (job->status != EXIT_SUCCESS) {
+            pthread_mutex_lock(&w->queue->lock);
+            w->queue->failures++;
+            pthread_mutex_unlock(&w->queue->lock);
+        }
+    }
+    return NULL;
+}
+
+// Runs every job in the queue over up to 'jobs' connections. The first
+// worker uses afc, the rest check connections out of the pool. Only
+// connections that are free right away are used, so commands sharing a pool
+// can never wait on each other.
+int xfer_queue_run(afcproto_client_t afc, xfer_queue_t *q, int(^transfer)(afcproto_client_t afc, xfer_job_t *job))
+{
+    int i, nworkers = (q->count < (size_t)jobs)? (int)q->count : jobs;
+
+    if (nworkers < 1)
+        return EXIT_SUCCESS;
+
+    xfer_worker_t *workers = calloc(nworkers, sizeof(xfer_worker_t));
+    if (!workers) {
+        fprintf(ERRF, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    workers[0].afc = afc;
+    for (i=1; i<nworkers; i++) {
+        if ((workers[i].afc = idev_afc_pool_try_checkout(pool)) == NULL) {
+            nworkers = i;
+            break;
+        }
+    }
+
+    if (idev_verbose)
+        fprintf(ERRF, "[debug] transferring %lu files over %d connections\n", q->count, nworkers);
+
+    for (i=0; i<nworkers; i++) {
+        workers[i].queue = q;
+        workers[i].transfer = transfer;
+        workers[i].pool = pool;
+        workers[i].outf = cmd_out;
+        workers[i].errf = cmd_err;
+        workers[i].device = cmd_device;
+        if (i > 0 && pthread_create(&workers[i].thread, NULL, xfer_worker_main, &workers[i]) != 0) {
+            idev_afc_pool_checkin(pool, workers[i].afc);
+            workers[i].afc = NULL;
+        }
+    }
+
+    uint64_t start = now_ns();
+    xfer_worker_main(&workers[0]);
+
+    for (i=1; i<nworkers; i++) {
+        if (workers[i].afc) {
+            pthread_join(workers[i].thread, NULL);
+            idev_afc_pool_checkin(pool, workers[i].afc);
+        }
+    }
+    free(workers);
+
+    q->elapsed_ns = now_ns() - start;
+    q->connections = nworkers;
+
+    return (q->failures)? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// prints per-file and aggregate throughput once a queue has been run
+void xfer_queue_report(xfer_queue_t *q, const char *verb)
+{
+    size_t i, nfiles=0;
+    uint64_t totbytes=0;
+
+    fprintf(OUTF, "%s summary:\n", verb);
+    for (i=0; i<q->count; i++) {
+        xfer_job_t *job = &q->jobs[i];
+        if (job->status != EXIT_SUCCESS)
+            continue;
+
+        double secs = job->elapsed_ns / 1e9;
+        fprintf(OUTF, "  %12llu bytes %10.1f KB/s  %s\n", (unsigned long long)job->size,
+               (secs > 0)? job->size/secs/1024 : 0.0, job->dst);
+        nfiles++;
+        totbytes += job->size;
+    }
+
+    double secs = q->elapsed_ns / 1e9;
+    fprintf(OUTF, "%s %lu files, %llu bytes in %.3fs (%.1f KB/s aggregate over %d connections)\n",
+           verb, nfiles, (unsigned long long)totbytes, secs, (secs > 0)? totbytes/secs/1024 : 0.0, q->connections);
+}
+
+int make_local_dir(const char *path)
+{
+    if (mkdir(path, 0755) != 0 && !(errno == EEXIST && is_dir((char*)path))) {
+        fprintf(ERRF, "Error creating local directory: %s - %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Fetches file info for every path, keeping up to pipeline_depth requests
+// in flight. Entries that failed are left NULL, with the reason in errs if
+// given; NULL paths fail with AFC_E_NO_MEM. Free with free_file_infos()
+char ***fetch_file_infos(afcproto_client_t afc, char **paths, size_t count, afc_error_t *errs)
+{
+    size_t i, sent=0, done=0, inflight=0;
+    char ***infos = calloc(count+1, sizeof(char**));
+
+    for (i=0; errs && i<count; i++)
+        errs[i] = (paths[i])? AFC_E_MUX_ERROR : AFC_E_NO_MEM;
+
+    while (infos && done < count) {
+        for (; sent < count && inflight < (size_t)pipeline_depth; sent++) {
+            if (!paths[sent])
+                continue;
+            if (afcproto_send_request(afc, AFC_OP_GET_FILE_INFO, paths[sent], strlen(paths[sent])+1, NULL, 0) != AFC_E_SUCCESS)
+                break;
+            inflight++;
+        }
+
+        while (done < sent && !paths[done])
+            done++;
+        if (done == sent || afcproto_client_is_broken(afc))
+            break;
+
+        afc_error_t err = afcproto_receive_list(afc, &infos[done]);
+        if (errs)
+            errs[done] = err;
+        done++;
+        inflight--;
+    }
+
+    return infos;
+}
+
+void free_file_infos(char ***infos, size_t count)
+{
+    size_t i;
+    for (i=0; infos && i<count; i++)
+        afcproto_list_free(infos[i]);
+    free(infos);
+}
+
+// reads a remote directory without "." and "..". returns the number of entries or -1
+ssize_t read_remote_entries(afcproto_client_t afc, const char *path, char ***names, afc_error_t *err)
+{
+    char **list=NULL;
+    size_t i, count=0;
+
+    *names = NULL;
+    if ((*err = afcproto_read_directory(afc, path, &list)) != AFC_E_SUCCESS)
+        return -1;
+
+    for (i=0; list[i]; i++) {
+        if (strcmp(list[i], ".") && strcmp(list[i], ".."))
+            list[count++] = list[i];
+        else
+            free(list[i]);
+    }
+    list[count] = NULL;
+
+    *names = list;
+    return count;
+}
+
+// Walks the remote tree at src, creating the matching local directories and
+// symlinks under dst and queueing every regular file. Directories are all
+// made here, before any worker starts, so the workers only ever write files.
+int queue_remote_tree(afcproto_client_t afc, const char *src, const char *dst, xfer_queue_t *q)
+{
+    int ret = make_local_dir(dst);
+    if (ret != EXIT_SUCCESS)
+        return ret;
+
+    char **names=NULL;
+    afc_error_t err;
+    ssize_t count = read_remote_entries(afc, src, &names, &err);
+    if (count < 0) {
+        fprintf(ERRF, "Error: afc list \"%s\" failed: %s\n", src, idev_afc_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    // the info for the whole directory is fetched with requests pipelined
+    ssize_t i;
+    char **spaths = calloc(count+1, sizeof(char*));
+    for (i=0; spaths && i<count; i++)
+        spaths[i] = path_join(src, names[i]);
+
+    afc_error_t *errs = calloc(count+1, sizeof(afc_error_t));
+    char ***infos = (spaths && errs)? fetch_file_infos(afc, spaths, count, errs) : NULL;
+    if (!infos) {
+        fprintf(ERRF, "Error: out of memory\n");
+        ret = EXIT_FAILURE;
+    }
+
+    for (i=0; infos && i<count; i++) {
+        char *spath = spaths[i];
+        char *dpath = path_join(dst, names[i]);
+        char **info = infos[i];
+
+        if (!info) {
+            fprintf(ERRF, "Error: info error for path: %s - %s\n", (spath)? spath : names[i], idev_afc_strerror(errs[i]));
+            ret = EXIT_FAILURE;
+        } else {
+            const char *type = afcproto_info_value(info, "st_ifmt");
+            const char *size = afcproto_info_value(info, "st_size");
+            const char *target = afcproto_info_value(info, "LinkTarget");
+
+            if (type && !strcmp(type, "S_IFDIR")) {
+                ret |= queue_remote_tree(afc, spath, dpath, q);
+            } else if (type && !strcmp(type, "S_IFLNK") && target) {
+                if (symlink(target, dpath) != 0 && errno != EEXIST) {
+                    fprintf(ERRF, "Error creating local symlink: %s - %s\n", dpath, strerror(errno));
+                    ret = EXIT_FAILURE;
+                }
+            } else if (type && !strcmp(type, "S_IFREG")) {
+                ret |= xfer_queue_add(q, spath, dpath, (size)? strtoull(size, NULL, 10) : 0);
+                spaths[i] = dpath = NULL;
+            } else if (idev_verbose) {
+                fprintf(ERRF, "[debug] skipping %s (%s)\n", spath, (type)? type : "unknown type");
+            }
+        }
+
+        free(dpath);
+    }
+
+    free_file_infos(infos, count);
+    free(errs);
+    for (i=0; spaths && i<count; i++)
+        free(spaths[i]);
+    free(spaths);
+    afcproto_list_free(names);
+    return ret;
+}
+
+int get_afc_tree(afcproto_client_t afc, const char *src, const char *dst, int flags)
+{
+    xfer_queue_t q;
+    xfer_queue_init(&q);
+
+    int ret = queue_remote_tree(afc, src, dst, &q);
+
+    xfer_queue_mix(&q);
+    ret |= xfer_queue_run(afc, &q, ^int(afcproto_client_t wafc, xfer_job_t *job) {
+        return get_afc_path(wafc, job->src, job->dst, job->size, flags);
+    });
+
+    xfer_queue_report(&q, "Downloaded");
+
+    if (q.failures)
+        fprintf(ERRF, "Error: %d of %lu files failed to download\n", q.failures, q.count);
+
+    xfer_queue_free(&q);
+    return ret;
+}
+
+typedef struct strlist {
+    char **items;
+    size_t count;
+    size_t capacity;
+} strlist_t;
+
+// takes ownership of str
+int strlist_add(strlist_t *l, char *str)
+{
+    if (l->count == l->capacity) {
+        size_t cap = (l->capacity)? l->capacity*2 : 64;
+        char **items = realloc(l->items, cap * sizeof(char*));
+        if (!items) {
+            free(str);
+            return EXIT_FAILURE;
+        }
+        l->items = items;
+        l->capacity = cap;
+    }
+    l->items[l->count++] = str;
+    return EXIT_SUCCESS;
+}
+
+void strlist_free(strlist_t *l)
+{
+    size_t i;
+    for (i=0; i<l->count; i++)
+        free(l->items[i]);
+    free(l->items);
+    memset(l, 0, sizeof(*l));
+}
+
+// Walks the local tree at src, collecting the remote directories to create
+// (parents before children) and the symlinks to make, and queueing files.
+int queue_local_tree(const char *src, const char *dst, xfer_queue_t *q, strlist_t *dirs, strlist_t *links)
+{
+    int ret = strlist_add(dirs, strdup(dst));
+
+    DIR *dir = opendir(src);
+    if (!dir) {
+        fprintf(ERRF, "Error opening local directory: %s - %s\n", src, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+
+        char *spath = path_join(src, ent->d_name);
+        char *dpath = path_join(dst, ent->d_name);
+        struct stat st;
+
+        if (lstat(spath, &st) != 0) {
+            fprintf(ERRF, "Error: cannot stat local file: %s - %s\n", spath, strerror(errno));
+            ret = EXIT_FAILURE;
+        } else if (S_ISDIR(st.st_mode)) {
+            ret |= queue_local_tree(spath, dpath, q, dirs, links);
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(spath, target, sizeof(target)-1);
+            if (len >= 0) {
+                target[len] = '\0';
+                ret |= strlist_add(links, strdup(target));
+                ret |= strlist_add(links, dpath);
+                dpath = NULL;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            ret |= xfer_queue_add(q, spath, dpath, st.st_size);
+            spath = dpath = NULL;
+        } else if (idev_verbose) {
+            fprintf(ERRF, "[debug] skipping %s (not a regular file)\n", spath);
+        }
+
+        free(spath);
+        free(dpath);
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+// Creates remote directories with up to pipeline_depth MAKE_DIR requests in
+// flight. The device handles requests in the order sent, so listing parents
+// before children is enough to keep this correct.
+int make_remote_dirs(afcproto_client_t afc, strlist_t *dirs)
+{
+    int ret=EXIT_SUCCESS;
+    size_t sent=0, done=0;
+
+    while (done < dirs->count) {
+        while (sent < dirs->count && sent - done < (size_t)pipeline_depth) {
+            const char *path = dirs->items[sent];
+            if (afcproto_send_request(afc, AFC_OP_MAKE_DIR, path, strlen(path)+1, NULL, 0) != AFC_E_SUCCESS)
+                break;
+            sent++;
+        }
+
+        if (done == sent) {
+            fprintf(ERRF, "Error: mkdir error: %s\n", idev_afc_strerror(AFC_E_MUX_ERROR));
+            return EXIT_FAILURE;
+        }
+
+        char *data=NULL;
+        uint32_t len=0;
+        afc_error_t err = afcproto_receive_response(afc, NULL, &data, &len);
+        free(data);
+
+        if (err && err != AFC_E_OBJECT_EXISTS) {
+            fprintf(ERRF, "Error: mkdir error: %s - %s\n", dirs->items[done], idev_afc_strerror(err));
+            ret = EXIT_FAILURE;
+            if (afcproto_client_is_broken(afc))
+                return ret;
+        }
+        done++;
+    }
+
+    return ret;
+}
+
+int put_afc_tree(afcproto_client_t afc, const char *src, const char *dst, int flags)
+{
+    xfer_queue_t q;
+    xfer_queue_init(&q);
+
+    strlist_t dirs = {0}, links = {0};
+    int ret = queue_local_tree(src, dst, &q, &dirs, &links);
+
+    if (idev_verbose)
+        fprintf(ERRF, "[debug] creating %lu remote directories\n", dirs.count);
+
+    if (make_remote_dirs(afc, &dirs) == EXIT_SUCCESS) {
+        size_t i;
+        for (i=0; i+1 < links.count; i+=2) {
+            afc_error_t err = afcproto_make_link(afc, AFC_SYMLINK, links.items[i], links.items[i+1]);
+            if (err) {
+                fprintf(ERRF, "Error: link %s -> %s - %s\n", links.items[i+1], links.items[i], idev_afc_strerror(err));
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        xfer_queue_mix(&q);
+        ret |= xfer_queue_run(afc, &q, ^int(afcproto_client_t wafc, xfer_job_t *job) {
+            return put_afc_path(wafc, job->src, job->dst, flags);
+        });
+
+        xfer_queue_report(&q, "Uploaded");
+
+        if (q.failures)
+            fprintf(ERRF, "Error: %d of %lu files failed to upload\n", q.failures, q.count);
+    } else {
+        ret = EXIT_FAILURE;
+    }
+    afccache_invalidate(cmd_cache, dst);
+
+    strlist_free(&dirs);
+    strlist_free(&links);
+    xfer_queue_free(&q);
+    return ret;
+}
+
+
+#pragma mark - Sync
+
+#define SYNC_PUSH       0x1
+#define SYNC_DELETE     0x2
+#define SYNC_DRY_RUN    0x4
+
+typedef struct sync_ctx {
+    afcproto_client_t afc;
+    int flags;
+    xfer_queue_t q;
+    size_t unchanged;
+    size_t deleted;
+    size_t would_transfer; // with SYNC_DRY_RUN, instead of queueing
+} sync_ctx_t;
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+uint64_t info_mtime(char **info)
+{
+    const char *mtime = afcproto_info_value(info, "st_mtime");
+    return (mtime)? strtoull(mtime, NULL, 10) : 0;
+}
+
+// Files are the same if sizes match and mtimes agree to the second, which is
+// as much as some local filesystems keep.
+bool same_file(uint64_t size, uint64_t mtime_ns, struct stat *st)
+{
+    return (st->st_size == (off_t)size && st->st_mtime == (time_t)(mtime_ns / 1000000000ULL));
+}
+
+int set_local_mtime(const char *path, uint64_t mtime_ns)
+{
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = mtime_ns / 1000000000ULL;
+    times[1].tv_nsec = mtime_ns % 1000000000ULL;
+
+    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0) {
+        fprintf(ERRF, "Warning: could not set mtime on %s - %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int remove_local_tree(const char *path)
+{
+    struct stat st;
+    int ret = EXIT_SUCCESS;
+
+    if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        struct dirent *de;
+        while (d && (de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+                char *child = path_join(path, de->d_name);
+                ret |= remove_local_tree(child);
+                free(child);
+            }
+        }
+        if (d)
+            closedir(d);
+
+        if (rmdir(path) != 0) {
+            fprintf(ERRF, "Error removing local directory: %s - %s\n", path, strerror(errno));
+            ret = EXIT_FAILURE;
+        }
+    } else if (unlink(path) != 0) {
+        fprintf(ERRF, "Error removing local file: %s - %s\n", path, strerror(errno));
+        ret = EXIT_FAILURE;
+    }
+
+    return ret;
+}
+
+// Makes way for an entry of a different type. Directories are only
+// removed with --delete.
+int sync_clear_local(sync_ctx_t *ctx, const char *path, struct stat *st)
+{
+    if (S_ISDIR(st->st_mode) && !(ctx->flags & SYNC_DELETE)) {
+        fprintf(ERRF, "Error: %s is in the way (use --delete to replace it)\n", path);
+        return EXIT_FAILURE;
+    }
+    return (ctx->flags & SYNC_DRY_RUN)? EXIT_SUCCESS : remove_local_tree(path);
+}
+
+int sync_clear_remote(sync_ctx_t *ctx, const char *path, const char *type)
+{
+    bool dir = (type && !strcmp(type, "S_IFDIR"));
+
+    if (dir && !(ctx->flags & SYNC_DELETE)) {
+        fprintf(ERRF, "Error: %s is in the way (use --delete to replace it)\n", path);
+        return EXIT_FAILURE;
+    }
+
+    if (ctx->flags & SYNC_DRY_RUN)
+        return EXIT_SUCCESS;
+
+    afc_error_t err = (dir)? afcproto_remove_path_and_contents(ctx->afc, path) : afcproto_remove_path(ctx->afc, path);
+    if (err) {
+        fprintf(ERRF, "Error: could not remove %s - %s\n", path, idev_afc_strerror(err));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Mirrors the remote directory src into the local directory dst. Directories,
+// symlinks and deletions are done as the tree is walked, files that need
+// copying are queued for afterwards.
+int sync_pull_dir(sync_ctx_t *ctx, const char *src, const char *dst)
+{
+    int ret = EXIT_SUCCESS;
+    bool dry = (ctx->flags & SYNC_DRY_RUN);
+    struct stat st;
+
+    if (lstat(dst, &st) != 0 || (dry && !S_ISDIR(st.st_mode))) {
+        if (dry)
+            fprintf(OUTF, "would create %s\n", dst);
+        else if (make_local_dir(dst) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    } else if (!S_ISDIR(st.st_mode)) {
+        fprintf(ERRF, "Error: %s is not a directory\n", dst);
+        return EXIT_FAILURE;
+    }
+
+    char **names=NULL;
+    afc_error_t err;
+    ssize_t count = read_remote_entries(ctx->afc, src, &names, &err);
+    if (count < 0) {
+        fprintf(ERRF, "Error: afc list \"%s\" failed: %s\n", src, idev_afc_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    qsort(names, count, sizeof(char*), cmp_str);
+
+    ssize_t i;
+    char **spaths = calloc(count+1, sizeof(char*));
+    for (i=0; spaths && i<count; i++)
+        spaths[i] = path_join(src, names[i]);
+
+    afc_error_t *errs = calloc(count+1, sizeof(afc_error_t));
+    char ***infos = (spaths && errs)? fetch_file_infos(ctx->afc, spaths, count, errs) : NULL;
+    if (!infos) {
+        fprintf(ERRF, "Error: out of memory\n");
+        ret = EXIT_FAILURE;
+    }
+
+    for (i=0; infos && i<count && !afcproto_client_is_broken(ctx->afc); i++) {
+        char *dpath = path_join(dst, names[i]);
+        char **info = infos[i];
+        const char *type = afcproto_info_value(info, "st_ifmt");
+        bool exists = (lstat(dpath, &st) == 0);
+
+        if (!info) {
+            fprintf(ERRF, "Error: info error for path: %s - %s\n", (spaths[i])? spaths[i] : names[i], idev_afc_strerror(errs[i]));
+            ret = EXIT_FAILURE;
+
+        } else if (type && !strcmp(type, "S_IFDIR")) {
+            if (exists && !S_ISDIR(st.st_mode) && sync_clear_local(ctx, dpath, &st) != EXIT_SUCCESS)
+                ret = EXIT_FAILURE;
+            else
+                ret |= sync_pull_dir(ctx, spaths[i], dpath);
+
+        } else if (type && !strcmp(type, "S_IFLNK")) {
+            const char *target = afcproto_info_value(info, "LinkTarget");
+            char cur[PATH_MAX];
+            ssize_t n = (exists && S_ISLNK(st.st_mode))? readlink(dpath, cur, sizeof(cur)-1) : -1;
+            if (n >= 0)
+                cur[n] = '\0';
+
+            if (!target) {
+                ; // nothing to link to
+            } else if (n >= 0 && !strcmp(cur, target)) {
+                ctx->unchanged++;
+            } else if (exists && sync_clear_local(ctx, dpath, &st) != EXIT_SUCCESS) {
+                ret = EXIT_FAILURE;
+            } else if (dry) {
+                fprintf(OUTF, "would link %s -> %s\n", dpath, target);
+            } else if (symlink(target, dpath) != 0) {
+                fprintf(ERRF, "Error creating local symlink: %s - %s\n", dpath, strerror(errno));
+                ret = EXIT_FAILURE;
+            }
+
+        } else if (type && !strcmp(type, "S_IFREG")) {
+            const char *size = afcproto_info_value(info, "st_size");
+            uint64_t fsize = (size)? strtoull(size, NULL, 10) : 0;
+            uint64_t mtime = info_mtime(info);
+
+            if (exists && S_ISREG(st.st_mode) && same_file(fsize, mtime, &st)) {
+                ctx->unchanged++;
+            } else if (exists && !S_ISREG(st.st_mode) && sync_clear_local(ctx, dpath, &st) != EXIT_SUCCESS) {
+                ret = EXIT_FAILURE;
+            } else if (dry) {
+                fprintf(OUTF, "would download %s\n", spaths[i]);
+                ctx->would_transfer++;
+            } else if (xfer_queue_add(&ctx->q, strdup(spaths[i]), dpath, fsize) == EXIT_SUCCESS) {
+                ctx->q.jobs[ctx->q.count-1].mtime_ns = mtime;
+                dpath = NULL;
+            } else {
+                ret = EXIT_FAILURE;
+                dpath = NULL;
+            }
+        }
+
+        free(dpath);
+    }
+
+    // anything local that isn't on the device any more
+    DIR *d = (ctx->flags & SYNC_DELETE)? opendir(dst) : NULL;
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        char *name = de->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") || bsearch(&name, names, count, sizeof(char*), cmp_str))
+            continue;
+
+        char *path = path_join(dst, name);
+        if (dry)
+            fprintf(OUTF, "would delete %s\n", path);
+        else
+            ret |= remove_local_tree(path);
+        ctx->deleted++;
+        free(path);
+    }
+    if (d)
+        closedir(d);
+
+    free_file_infos(infos, count);
+    free(errs);
+    afcproto_list_free(spaths);
+    afcproto_list_free(names);
+
+    if (afcproto_client_is_broken(ctx->afc))
+        ret = EXIT_FAILURE;
+
+    return ret;
+}
+
+// Mirrors the local directory src into the remote directory dst, the same
+// way as sync_pull_dir
+int sync_push_dir(sync_ctx_t *ctx, const char *src, const char *dst)
+{
+    int ret = EXIT_SUCCESS;
+    bool dry = (ctx->flags & SYNC_DRY_RUN);
+
+    DIR *d = opendir(src);
+    if (!d) {
+        fprintf(ERRF, "Error opening local directory: %s - %s\n", src, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    char **names=NULL;
+    afc_error_t err;
+    ssize_t i, count = read_remote_entries(ctx->afc, dst, &names, &err);
+
+    if (count < 0 && err == AFC_E_OBJECT_NOT_FOUND) {
+        count = 0;
+        if (dry) {
+            fprintf(OUTF, "would create %s\n", dst);
+        } else if ((err = afcproto_make_directory(ctx->afc, dst)) != AFC_E_SUCCESS) {
+            fprintf(ERRF, "Error: mkdir error: %s - %s\n", dst, idev_afc_strerror(err));
+            closedir(d);
+            return EXIT_FAILURE;
+        }
+    } else if (count < 0) {
+        fprintf(ERRF, "Error: afc list \"%s\" failed: %s\n", dst, idev_afc_strerror(err));
+        closedir(d);
+        return EXIT_FAILURE;
+    }
+
+    if (names)
+        qsort(names, count, sizeof(char*), cmp_str);
+
+    char **rpaths = calloc(count+1, sizeof(char*));
+    for (i=0; rpaths && i<count; i++)
+        rpaths[i] = path_join(dst, names[i]);
+
+    afc_error_t *errs = calloc(count+1, sizeof(afc_error_t));
+    char ***infos = (rpaths && errs)? fetch_file_infos(ctx->afc, rpaths, count, errs) : NULL;
+    bool *seen = calloc(count+1, sizeof(bool));
+    if (!infos || !seen) {
+        fprintf(ERRF, "Error: out of memory\n");
+        ret = EXIT_FAILURE;
+    }
+
+    struct dirent *de;
+    while (infos && seen && (de = readdir(d)) != NULL && !afcproto_client_is_broken(ctx->afc)) {
+        char *name = de->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+
+        struct stat st;
+        char *lpath = path_join(src, name);
+        char *rpath = path_join(dst, name);
+        char **found = (count)? bsearch(&name, names, count, sizeof(char*), cmp_str) : NULL;
+        char **info = (found)? infos[found - names] : NULL;
+        const char *rtype = afcproto_info_value(info, "st_ifmt");
+
+        if (found)
+            seen[found - names] = true;
+
+        if (lstat(lpath, &st) != 0) {
+            fprintf(ERRF, "Error: could not stat %s - %s\n", lpath, strerror(errno));
+            ret = EXIT_FAILURE;
+
+        } else if (found && !info && errs[found - names] != AFC_E_OBJECT_NOT_FOUND) {
+            // gone since the listing is fine, anything else isn't
+            fprintf(ERRF, "Error: info error for path: %s - %s\n", rpath, idev_afc_strerror(errs[found - names]));
+            ret = EXIT_FAILURE;
+
+        } else if (S_ISDIR(st.st_mode)) {
+            if (rtype && strcmp(rtype, "S_IFDIR") && sync_clear_remote(ctx, rpath, rtype) != EXIT_SUCCESS)
+                ret = EXIT_FAILURE;
+            else
+                ret |= sync_push_dir(ctx, lpath, rpath);
+
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t n = readlink(lpath, target, sizeof(target)-1);
+            const char *rtarget = afcproto_info_value(info, "LinkTarget");
+
+            if (n < 0) {
+                fprintf(ERRF, "Error reading local symlink: %s - %s\n", lpath, strerror(errno));
+                ret = EXIT_FAILURE;
+            } else if (target[n] = '\0', rtype && !strcmp(rtype, "S_IFLNK") && rtarget && !strcmp(rtarget, target)) {
+                ctx->unchanged++;
+            } else if (rtype && sync_clear_remote(ctx, rpath, rtype) != EXIT_SUCCESS) {
+                ret = EXIT_FAILURE;
+            } else if (dry) {
+                fprintf(OUTF, "would link %s -> %s\n", rpath, target);
+            } else if ((err = afcproto_make_link(ctx->afc, AFC_SYMLINK, target, rpath)) != AFC_E_SUCCESS) {
+                fprintf(ERRF, "Error: link %s -> %s - %s\n", rpath, target, idev_afc_strerror(err));
+                ret = EXIT_FAILURE;
+            }
+
+        } else if (S_ISREG(st.st_mode)) {
+            const char *size = afcproto_info_value(info, "st_size");
+            uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+
+            if (rtype && !strcmp(rtype, "S_IFREG") && size && same_file(strtoull(size, NULL, 10), info_mtime(info), &st)) {
+                ctx->unchanged++;
+            } else if (rtype && strcmp(rtype, "S_IFREG") && sync_clear_remote(ctx, rpath, rtype) != EXIT_SUCCESS) {
+                ret = EXIT_FAILURE;
+            } else if (dry) {
+                fprintf(OUTF, "would upload %s\n", lpath);
+                ctx->would_transfer++;
+            } else if (xfer_queue_add(&ctx->q, lpath, rpath, st.st_size) == EXIT_SUCCESS) {
+                ctx->q.jobs[ctx->q.count-1].mtime_ns = mtime;
+                lpath = rpath = NULL;
+            } else {
+                ret = EXIT_FAILURE;
+                lpath = rpath = NULL;
+            }
+
+        } else if (idev_verbose) {
+            fprintf(ERRF, "[debug] skipping %s\n", lpath);
+        }
+
+        free(lpath);
+        free(rpath);
+    }
+    closedir(d);
+
+    // anything on the device that isn't here any more
+    for (i=0; infos && seen && (ctx->flags & SYNC_DELETE) && i<count; i++) {
+        if (seen[i] || !rpaths[i] || afcproto_client_is_broken(ctx->afc))
+            continue;
+
+        if (dry) {
+            fprintf(OUTF, "would delete %s\n", rpaths[i]);
+        } else {
+            const char *rtype = afcproto_info_value(infos[i], "st_ifmt");
+            bool dir = (rtype && !strcmp(rtype, "S_IFDIR"));
+            err = (dir)? afcproto_remove_path_and_contents(ctx->afc, rpaths[i]) : afcproto_remove_path(ctx->afc, rpaths[i]);
+            if (err) {
+                fprintf(ERRF, "Error: could not remove %s - %s\n", rpaths[i], idev_afc_strerror(err));
+                ret = EXIT_FAILURE;
+            }
+        }
+        ctx->deleted++;
+    }
+
+    free(seen);
+    free(errs);
+    free_file_infos(infos, count);
+    afcproto_list_free(rpaths);
+    afcproto_list_free(names);
+
+    if (afcproto_client_is_broken(ctx->afc))
+        ret = EXIT_FAILURE;
+
+    return ret;
+}
+
+int sync_tree(afcproto_client_t afc, const char *src, const char *dst, int flags)
+{
+    sync_ctx_t ctx = { .afc = afc, .flags = flags };
+    xfer_queue_init(&ctx.q);
+
+    int ret = (flags & SYNC_PUSH)? sync_push_dir(&ctx, src, dst) : sync_pull_dir(&ctx, src, dst);
+
+    if (ctx.q.count) {
+        xfer_queue_mix(&ctx.q);
+
+        if (flags & SYNC_PUSH) {
+            ret |= xfer_queue_run(afc, &ctx.q, ^int(afcproto_client_t wafc, xfer_job_t *job) {
+                int r = put_afc_path(wafc, job->src, job->dst, 0);
+                afc_error_t err = (r == EXIT_SUCCESS)? afcproto_set_file_time(wafc, job->dst, job->mtime_ns) : AFC_E_SUCCESS;
+                if (err)
+                    fprintf(ERRF, "Warning: could not set mtime on %s - %s\n", job->dst, idev_afc_strerror(err));
+                return r;
+            });
+            xfer_queue_report(&ctx.q, "Uploaded");
+        } else {
+            ret |= xfer_queue_run(afc, &ctx.q, ^int(afcproto_client_t wafc, xfer_job_t *job) {
+                int r = get_afc_path(wafc, job->src, job->dst, job->size, 0);
+                if (r == EXIT_SUCCESS)
+                    set_local_mtime(job->dst, job->mtime_ns);
+                return r;
+            });
+            xfer_queue_report(&ctx.q, "Downloaded");
+        }
+    }
+
+    fprintf(OUTF, "Sync %s: %lu %s, %lu unchanged, %lu %s\n",
+            (ret == EXIT_SUCCESS)? "complete" : "incomplete",
+            (flags & SYNC_DRY_RUN)? ctx.would_transfer : ctx.q.count,
+            (flags & SYNC_DRY_RUN)? "to transfer" : "transferred", ctx.unchanged,
+            ctx.deleted, (flags & SYNC_DRY_RUN)? "to delete" : "deleted");
+
+    if (ctx.q.failures)
+        fprintf(ERRF, "Error: %d of %lu files failed to transfer\n", ctx.q.failures, ctx.q.count);
+
+    xfer_queue_free(&ctx.q);
+    return ret;
+}
+
+
+#pragma mark - Tree walks
+
+// "du", "find", "snapshot" and "rm -r" walk remote trees breadth first over
+// up to -j pooled connections, each working on a different directory. Only
+// directories still to be listed, and ones whose subtrees are unfinished,
+// are kept in memory; entries are handed on as their info arrives.
+
+// once this many directories are waiting, new ones are taken first, so the
+// walk goes depth first and the queue stops growing
+#define WALK_FRONTIER   4096
+
+// entries whose info is fetched (with -P requests in flight) at a time
+#define WALK_BATCH      256
+
+typedef struct walk_dir {
+    char *path;
+    int depth;
+    struct walk_dir *parent;
+    // this directory's listing plus its unfinished subdirectories
+    int pending;
+    // for the caller, e.g. du's running total
+    uint64_t size;
+    // something in or below it failed
+    bool incomplete;
+    bool posted;
+    struct walk_dir *next;
+} walk_dir_t;
+
+// entry and finish run with the walk's lock held, one at a time. entry gets
+// every path with its info; child is set for directories and is only
+// walked if entry returns true. finish gets each walked directory once
+// everything below it has been.
+//
+// The optional listed and post run on a worker's connection without the
+// lock. listed gets each batch of a directory's entries after entry has
+// seen them. post gets each walked directory once everything below it has
+// been, unless something there failed, before finish. A false return from
+// either counts as a failure, which the callback reports.
+typedef struct walk {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    walk_dir_t *head;
+    walk_dir_t *tail;
+    size_t queued;
+    // directories waiting for post
+    walk_dir_t *posts;
+    int busy;
+    int failures;
+    bool(^entry)(walk_dir_t *parent, walk_dir_t *child, const char *path, char **info);
+    void(^finish)(walk_dir_t *dir);
+    bool(^listed)(afcproto_client_t afc, walk_dir_t *dir, char **paths, char ***infos, size_t count);
+    bool(^post)(afcproto_client_t afc, walk_dir_t *dir);
+} walk_t;
+
+typedef struct walk_worker {
+    pthread_t thread;
+    afcproto_client_t afc;
+    walk_t *walk;
+    FILE *outf;
+    FILE *errf;
+    const char *device;
+    afccache_t cache;
+} walk_worker_t;
+
+static bool info_is_type(char **info, const char *type)
+{
+    const char *t = afcproto_info_value(info, "st_ifmt");
+    return (t && !strcmp(t, type));
+}
+
+static walk_dir_t *walk_dir_new(const char *path, walk_dir_t *parent)
+{
+    walk_dir_t *d = calloc(1, sizeof(walk_dir_t));
+    if (d && (d->path = strdup(path)) == NULL) {
+        free(d);
+        return NULL;
+    }
+    if (d) {
+        d->parent = parent;
+        d->depth = (parent)? parent->depth+1 : 0;
+        d->pending = 1;
+    }
+    return d;
+}
+
+// note: called with the lock held
+static void walk_push(walk_t *w, walk_dir_t *d)
+{
+    if (d->parent)
+        d->parent->pending++;
+
+    if (w->queued >= WALK_FRONTIER) {
+        d->next = w->head;
+        w->head = d;
+        if (!w->tail)
+            w->tail = d;
+    } else {
+        d->next = NULL;
+        if (w->tail)
+            w->tail->next = d;
+        else
+            w->head = d;
+        w->tail = d;
+    }
+    w->queued++;
+    pthread_cond_signal(&w->cond);
+}
+
+// note: called with the lock held
+static void walk_release(walk_t *w, walk_dir_t *d)
+{
+    while (d && --d->pending == 0) {
+        // post holds the directory until a worker has run it
+        if (w->post && !d->posted && !d->incomplete) {
+            d->posted = true;
+            d->pending = 1;
+            d->next = w->posts;
+            w->posts = d;
+            pthread_cond_signal(&w->cond);
+            return;
+        }
+
+        walk_dir_t *parent = d->parent;
+        if (parent && d->incomplete)
+            parent->incomplete = true;
+        if (w->finish)
+            w->finish(d);
+        free(d->path);
+        free(d);
+        d = parent;
+    }
+}
+
+// Hands the entry a walked path, and queues it if it's a directory the
+// entry callback wants walked. note: called with the lock held
+static void walk_visit(walk_t *w, walk_dir_t *parent, const char *path, char **info)
+{
+    walk_dir_t *child = NULL;
+
+    if (info_is_type(info, "S_IFDIR") && (child = walk_dir_new(path, parent)) == NULL) {
+        fprintf(ERRF, "Error: out of memory\n");
+        w->failures++;
+        return;
+    }
+
+    if (w->entry(parent, child, path, info) && child) {
+        walk_push(w, child);
+    } else if (child) {
+        free(child->path);
+        free(child);
+    }
+}
+
+// lists one directory and visits its entries a batch at a time
+static void walk_list(walk_t *w, afcproto_client_t afc, walk_dir_t *d)
+{
+    char **list = NULL;
+    afc_error_t err = afccache_read_directory(cmd_cache, afc, d->path, &list);
+    if (err != AFC_E_SUCCESS) {
+        pthread_mutex_lock(&w->lock);
+        fprintf(ERRF, "Error: cannot list %s - %s\n", d->path, idev_afc_strerror(err));
+        d->incomplete = true;
+        w->failures++;
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+
+    size_t i, n, count;
+    for (count=0; list[count]; count++);
+
+    char **paths = calloc(WALK_BATCH, sizeof(char*));
+    for (i=0; paths && i<count && !afcproto_client_is_broken(afc); i+=n) {
+        size_t j, nfetch=0;
+        n = 0;
+        for (; i+n < count && n < WALK_BATCH; n++) {
+            const char *name = list[i+n];
+            paths[n] = (strcmp(name, ".") && strcmp(name, ".."))? path_join(d->path, name) : NULL;
+        }
+
+        // fetch what the cache doesn't have
+        char ***infos = calloc(n, sizeof(char**));
+        char **missing = calloc(n, sizeof(char*));
+        for (j=0; infos && missing && j<n; j++) {
+            if (paths[j] && (infos[j] = afccache_lookup_info(cmd_cache, paths[j])) == NULL)
+                missing[nfetch++] = paths[j];
+        }
+        char ***fetched = (nfetch)? fetch_file_infos(afc, missing, nfetch, NULL) : NULL;
+
+        pthread_mutex_lock(&w->lock);
+        size_t k=0;
+        for (j=0; infos && missing && j<n; j++) {
+            if (!paths[j])
+                continue;
+            if (!infos[j] && fetched && k < nfetch && missing[k] == paths[j]) {
+                infos[j] = fetched[k];
+                fetched[k++] = NULL;
+                afccache_store_info(cmd_cache, paths[j], infos[j]);
+            }
+
+            // entries gone since the listing are skipped quietly
+            if (infos[j])
+                walk_visit(w, d, paths[j], infos[j]);
+        }
+        bool ok = true;
+        if (!infos || !missing || (nfetch && !fetched)) {
+            fprintf(ERRF, "Error: out of memory\n");
+            ok = false;
+        } else if (afcproto_client_is_broken(afc)) {
+            fprintf(ERRF, "Error: cannot list %s - %s\n", d->path, idev_afc_strerror(AFC_E_MUX_ERROR));
+            ok = false;
+        }
+        if (!ok) {
+            d->incomplete = true;
+            w->failures++;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        if (ok && w->listed) {
+            // the entries with info go to the front, swapped so all are freed
+            size_t m = 0;
+            for (j=0; j<n; j++) {
+                if (paths[j] && infos[j]) {
+                    char *p = paths[m], **info = infos[m];
+                    paths[m] = paths[j];
+                    infos[m] = infos[j];
+                    paths[j] = p;
+                    infos[j] = info;
+                    m++;
+                }
+            }
+            if (m && !w->listed(afc, d, paths, infos, m)) {
+                pthread_mutex_lock(&w->lock);
+                d->incomplete = true;
+                w->failures++;
+                pthread_mutex_unlock(&w->lock);
+            }
+        }
+
+        free_file_infos(fetched, nfetch);
+        free_file_infos(infos, n);
+        free(missing);
+        for (j=0; j<n; j++)
+            free(paths[j]);
+    }
+
+    free(paths);
+    afcproto_list_free(list);
+}
+
+static void *walk_worker_main(void *arg)
+{
+    walk_worker_t *ww = arg;
+    walk_t *w = ww->walk;
+
+    cmd_out = ww->outf;
+    cmd_err = ww->errf;
+    cmd_device = ww->device;
+    cmd_cache = ww->cache;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        // done once nothing is queued and nobody can queue more
+        while (!w->head && !w->posts && w->busy)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if ((!w->head && !w->posts) || afcproto_client_is_broken(ww->afc))
+            break;
+
+        // finished directories go first, so their memory is freed early
+        walk_dir_t *d = w->posts;
+        if (d) {
+            w->posts = d->next;
+        } else {
+            d = w->head;
+            if ((w->head = d->next) == NULL)
+                w->tail = NULL;
+            w->queued--;
+        }
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+
+        bool ok = true;
+        if (d->posted)
+            ok = w->post(ww->afc, d);
+        else
+            walk_list(w, ww->afc, d);
+
+        pthread_mutex_lock(&w->lock);
+        w->busy--;
+        if (!ok) {
+            d->incomplete = true;
+            w->failures++;
+        }
+        walk_release(w, d);
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Walks each of the roots. The first worker uses afc, the rest take the
+// connections that are free in the pool right away.
+int walk_trees(afcproto_client_t afc, walk_t *w, char **roots, int count)
+{
+    int i, nworkers = 0;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    for (i=0; i<count; i++) {
+        char **info = NULL;
+        afc_error_t err = afccache_get_file_info(cmd_cache, afc, roots[i], &info);
+        if (err == AFC_E_SUCCESS) {
+            walk_visit(w, NULL, roots[i], info);
+        } else {
+            fprintf(ERRF, "Error: %s - %s\n", roots[i], idev_afc_strerror(err));
+            w->failures++;
+        }
+        afcproto_list_free(info);
+    }
+
+    walk_worker_t *workers = calloc(jobs, sizeof(walk_worker_t));
+    if (!workers) {
+        fprintf(ERRF, "Error: out of memory\n");
+        w->failures++;
+    }
+
+    for (i=0; workers && i<jobs; i++) {
+        workers[i].afc = (i == 0)? afc : idev_afc_pool_try_checkout(pool);
+        if (!workers[i].afc)
+            break;
+        workers[i].walk = w;
+        workers[i].outf = cmd_out;
+        workers[i].errf = cmd_err;
+        workers[i].device = cmd_device;
+        workers[i].cache = cmd_cache;
+        if (i > 0 && pthread_create(&workers[i].thread, NULL, walk_worker_main, &workers[i]) != 0) {
+            idev_afc_pool_checkin(pool, workers[i].afc);
+            break;
+        }
+        nworkers++;
+    }
+
+    if (idev_verbose)
+        fprintf(ERRF, "[debug] walking over %d connections\n", nworkers);
+
+    if (workers)
+        walk_worker_main(&workers[0]);
+
+    for (i=1; i<nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        idev_afc_pool_checkin(pool, workers[i].afc);
+    }
+    free(workers);
+
+    // whatever is left couldn't be reached over a broken connection
+    while (w->head || w->posts) {
+        walk_dir_t *d = (w->head)? w->head : w->posts;
+        if (d == w->head)
+            w->head = d->next;
+        else
+            w->posts = d->next;
+        fprintf(ERRF, "Error: cannot %s %s - %s\n", (d->posted)? "finish" : "list", d->path, idev_afc_strerror(AFC_E_MUX_ERROR));
+        d->incomplete = true;
+        w->failures++;
+        walk_release(w, d);
+    }
+
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+
+    return (w->failures)? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+#pragma mark - Recursive remove
+
+typedef struct rm_counts {
+    uint64_t files;
+    uint64_t dirs;
+} rm_counts_t;
+
+// Removes every path, keeping up to pipeline_depth requests in flight.
+// errs gets the result for each
+static void remove_paths(afcproto_client_t afc, char **paths, size_t count, afc_error_t *errs)
+{
+    size_t i, sent=0, done=0;
+
+    for (i=0; i<count; i++)
+        errs[i] = AFC_E_MUX_ERROR;
+
+    while (done < count) {
+        while (sent < count && sent - done < (size_t)pipeline_depth) {
+            if (afcproto_send_request(afc, AFC_OP_REMOVE_PATH, paths[sent], strlen(paths[sent])+1, NULL, 0) != AFC_E_SUCCESS)
+                break;
+            sent++;
+        }
+
+        if (done == sent || afcproto_client_is_broken(afc))
+            break;
+
+        char *buf = NULL;
+        uint32_t len = 0;
+        errs[done++] = afcproto_receive_response(afc, NULL, &buf, &len);
+        free(buf);
+    }
+}
+
+// Removes the tree at dir over the pooled connections: files as soon as
+// they are listed, with the removals pipelined, and each directory once
+// everything below it is gone. With dry_run only prints what would go.
+// Paths gone already count as removed.
+static int remove_tree(afcproto_client_t afc, char *dir, bool dry_run, rm_counts_t *counts)
+{
+    walk_t w;
+    memset(&w, 0, sizeof(w));
+
+    w.entry = ^bool(walk_dir_t *parent, walk_dir_t *child, const char *path, char **info) {
+        if (dry_run && !child) {
+            fprintf(OUTF, "Would remove: %s\n", path);
+            counts->files++;
+        }
+        return true;
+    };
+
+    if (dry_run) {
+        w.finish = ^(walk_dir_t *d) {
+            fprintf(OUTF, "Would remove: %s\n", d->path);
+            counts->dirs++;
+        };
+    } else {
+        w.listed = ^bool(afcproto_client_t wafc, walk_dir_t *d, char **paths, char ***infos, size_t count) {
+            char **files = calloc(count, sizeof(char*));
+            afc_error_t *errs = calloc(count, sizeof(afc_error_t));
+            size_t i, n=0;
+            bool ok = (files && errs);
+
+            for (i=0; ok && i<count; i++) {
+                if (!info_is_type(infos[i], "S_IFDIR"))
+                    files[n++] = paths[i];
+            }
+            if (ok)
+                remove_paths(wafc, files, n, errs);
+            else
+                fprintf(ERRF, "Error: out of memory\n");
+
+            for (i=0; ok && i<n; i++) {
+                if (errs[i] == AFC_E_SUCCESS || errs[i] == AFC_E_OBJECT_NOT_FOUND) {
+                    __atomic_fetch_add(&counts->files, 1, __ATOMIC_RELAXED);
+                    if (idev_verbose)
+                        fprintf(ERRF, "[debug] removed %s\n", files[i]);
+                } else {
+                    fprintf(ERRF, "Error: could not remove %s - %s\n", files[i], idev_afc_strerror(errs[i]));
+                    ok = false;
+                }
+            }
+
+            free(files);
+            free(errs);
+            return ok;
+        };
+
+        w.post = ^bool(afcproto_client_t wafc, walk_dir_t *d) {
+            afc_error_t err = afcproto_remove_path(wafc, d->path);
+            if (err != AFC_E_SUCCESS && err != AFC_E_OBJECT_NOT_FOUND) {
+                fprintf(ERRF, "Error: could not remove %s - %s\n", d->path, idev_afc_strerror(err));
+                return false;
+            }
+            __atomic_fetch_add(&counts->dirs, 1, __ATOMIC_RELAXED);
+            if (idev_verbose)
+                fprintf(ERRF, "[debug] removed %s\n", d->path);
+            return true;
+        };
+    }
+
+    return walk_trees(afc, &w, &dir, 1);
+}
+
+// Removes a path and everything below it. A single request does it where
+// the server supports that, otherwise the tree is walked.
+int remove_path_recursive(afcproto_client_t afc, char *path, bool dry_run, rm_counts_t *counts, int *trees)
+{
+    if (!dry_run) {
+        afc_error_t err = afcproto_remove_path_and_contents(afc, path);
+        if (err == AFC_E_SUCCESS) {
+            fprintf(OUTF, "Removed: %s\n", path);
+            (*trees)++;
+            return EXIT_SUCCESS;
+        } else if (err != AFC_E_OP_NOT_SUPPORTED && err != AFC_E_UNKNOWN_PACKET_TYPE) {
+            fprintf(ERRF, "Error: could not remove %s - %s\n", path, idev_afc_strerror(err));
+            return EXIT_FAILURE;
+        } else if (idev_verbose) {
+            fprintf(ERRF, "[debug] removing %s in one request failed (%s), walking it\n", path, idev_afc_strerror(err));
+        }
+    }
+
+    char **info = NULL;
+    afc_error_t err = afcproto_get_file_info(afc, path, &info);
+    bool dir = (err == AFC_E_SUCCESS && info_is_type(info, "S_IFDIR"));
+    afcproto_list_free(info);
+
+    if (err != AFC_E_SUCCESS) {
+        fprintf(ERRF, "Error: could not remove %s - %s\n", path, idev_afc_strerror(err));
+        return EXIT_FAILURE;
+    } else if (dir) {
+        return remove_tree(afc, path, dry_run, counts);
+    } else if (dry_run) {
+        fprintf(OUTF, "Would remove: %s\n", path);
+    } else if ((err = afcproto_remove_path(afc, path)) != AFC_E_SUCCESS) {
+        fprintf(ERRF, "Error: could not remove %s - %s\n", path, idev_afc_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    counts->files++;
+    return EXIT_SUCCESS;
+}
+
+
+#pragma mark - Bench
+
+// "bench" runs a fixed workload in a scratch directory on the device and
+// prints the results as JSON:
+//
+//  - seq_write/seq_read: one file of --size bytes written and read back at
+//    each chunk size, reads pipelined -P deep
+//  - small_file_write: --files files of 4KB, each opened, written and closed
+//  - read_directory: the directory holding those files, listed repeatedly
+//  - get_file_info: file info for each of them
+//
+// Latencies are per request (per file for small_file_write) in microseconds.
+
+#define BENCH_DEFAULT_SIZE      (16*1024*1024)
+#define BENCH_DEFAULT_FILES     500
+#define BENCH_SMALL_FILE_SIZE   4096
+#define BENCH_LIST_ROUNDS       20
+
+static const uint32_t bench_chunks[] = { 16*1024, 64*1024, 256*1024, 1024*1024, CHUNK_MAX };
+
+typedef struct bench_samples {
+    uint64_t *ns;
+    size_t count;
+    size_t capacity;
+} bench_samples_t;
+
+typedef struct bench {
+    afcproto_client_t afc;
+    const char *dir;
+    uint64_t size;
+    int files;
+    int results;
+    char *data;
+    bench_samples_t samples;
+} bench_t;
+
+static void bench_sample(bench_t *b, uint64_t ns)
+{
+    bench_samples_t *s = &b->samples;
+
+    if (s->count == s->capacity) {
+        size_t cap = (s->capacity)? s->capacity*2 : 1024;
+        uint64_t *n = realloc(s->ns, cap * sizeof(uint64_t));
+        if (!n)
+            return;
+        s->ns = n;
+        s->capacity = cap;
+    }
+    s->ns[s->count++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+    return (va < vb)? -1 : (va > vb);
+}
+
+// nearest rank percentile of the (sorted) samples, in microseconds
+static double bench_percentile(bench_samples_t *s, double pct)
+{
+    if (s->count == 0)
+        return 0;
+
+    size_t rank = (size_t)(pct / 100.0 * s->count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > s->count)
+        rank = s->count;
+    return s->ns[rank-1] / 1000.0;
+}
+
+// prints one result from the samples collected since the last one
+static void bench_report(bench_t *b, const char *test, uint32_t chunk, uint64_t bytes, uint64_t elapsed_ns)
+{
+    bench_samples_t *s = &b->samples;
+    double secs = elapsed_ns / 1e9;
+
+    qsort(s->ns, s->count, sizeof(uint64_t), cmp_u64);
+
+    fprintf(OUTF, "%s    {\"test\": \"%s\"", (b->results++)? ",\n" : "", test);
+    if (chunk)
+        fprintf(OUTF, ", \"chunk\": %u", chunk);
+    fprintf(OUTF, ", \"ops\": %lu, \"seconds\": %.6f, \"ops_per_sec\": %.1f", s->count, secs, (secs > 0)? s->count/secs : 0.0);
+    if (bytes)
+        fprintf(OUTF, ", \"bytes\": %llu, \"mb_per_sec\": %.2f", (unsigned long long)bytes, (secs > 0)? bytes/secs/(1024*1024) : 0.0);
+    fprintf(OUTF, ", \"latency_us\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}",
+            bench_percentile(s, 0), bench_percentile(s, 50), bench_percentile(s, 90), bench_percentile(s, 99), bench_percentile(s, 100));
+    fflush(OUTF);
+
+    s->count = 0;
+}
+
+// READ latencies come from the afcproto observer, which times each request
+// from sending it to reading its reply, so they stay per request however
+// many are in flight. The empty replies of reads past the end aren't
+// counted. Other observers (--stats) are passed every call.
+static __thread bench_t *bench_reading = NULL;
+static afcproto_observer_t bench_next_observer = NULL;
+static pthread_once_t bench_observer_once = PTHREAD_ONCE_INIT;
+
+static void bench_observe(uint64_t operation, uint64_t bytes_out, uint64_t bytes_in, uint64_t elapsed_ns, afc_error_t err)
+{
+    if (bench_reading && operation == AFC_OP_READ && bytes_in > 0)
+        bench_sample(bench_reading, elapsed_ns);
+    if (bench_next_observer)
+        bench_next_observer(operation, bytes_out, bytes_in, elapsed_ns, err);
+}
+
+static void bench_set_observer(void)
+{
+    bench_next_observer = afcproto_get_observer();
+    afcproto_set_observer(bench_observe);
+}
+
+static int bench_fail(const char *what, const char *path, afc_error_t err)
+{
+    fprintf(ERRF, "Error: bench %s %s failed: %s\n", what, path, idev_afc_strerror(err));
+    return EXIT_FAILURE;
+}
+
+static int bench_seq_write(bench_t *b, const char *path, uint32_t chunk)
+{
+    uint64_t handle=0, done=0;
+    afc_error_t err = afcproto_file_open(b->afc, path, AFC_FOPEN_WRONLY, &handle);
+    if (err)
+        return bench_fail("open", path, err);
+
+    uint64_t start = now_ns();
+    while (!err && done < b->size) {
+        uint32_t n = (b->size - done < chunk)? (uint32_t)(b->size - done) : chunk, written=0;
+        uint64_t t = now_ns();
+        err = afcproto_file_write(b->afc, handle, b->data, n, &written);
+        bench_sample(b, now_ns() - t);
+        done += written;
+    }
+    afcproto_file_close(b->afc, handle);
+
+    if (err)
+        return bench_fail("write", path, err);
+
+    bench_report(b, "seq_write", chunk, done, now_ns() - start);
+    return EXIT_SUCCESS;
+}
+
+static int bench_seq_read(bench_t *b, const char *path, uint32_t chunk)
+{
+    uint64_t handle=0, done=0;
+    uint32_t n=0;
+    afc_error_t err = afcproto_file_open(b->afc, path, AFC_FOPEN_RDONLY, &handle);
+    if (err)
+        return bench_fail("open", path, err);
+
+    pthread_once(&bench_observer_once, bench_set_observer);
+
+    afcproto_reader_t rd;
+    afcproto_reader_init(&rd, b->afc, handle, chunk, pipeline_depth);
+
+    uint64_t start = now_ns();
+    bench_reading = b;
+    while ((err = afcproto_reader_next(&rd, b->data, CHUNK_MAX, &n)) == AFC_E_SUCCESS && n > 0)
+        done += n;
+    afcproto_reader_finish(&rd);
+    bench_reading = NULL;
+    afcproto_file_close(b->afc, handle);
+
+    if (err)
+        return bench_fail("read", path, err);
+
+    bench_report(b, "seq_read", chunk, done, now_ns() - start);
+    return EXIT_SUCCESS;
+}
+
+static char *bench_small_path(bench_t *b, int i)
+{
+    char *path=NULL;
+    asprintf(&path, "%s/small/f%05d", b->dir, i);
+    return path;
+}
+
+static int bench_small_files(bench_t *b)
+{
+    int i;
+    afc_error_t err = AFC_E_SUCCESS;
+    uint64_t start = now_ns();
+
+    for (i=0; i<b->files && !err; i++) {
+        char *path = bench_small_path(b, i);
+        uint64_t handle=0, t = now_ns();
+        uint32_t written=0;
+
+        if ((err = afcproto_file_open(b->afc, path, AFC_FOPEN_WRONLY, &handle)) == AFC_E_SUCCESS) {
+            err = afcproto_file_write(b->afc, handle, b->data, BENCH_SMALL_FILE_SIZE, &written);
+            afc_error_t cerr = afcproto_file_close(b->afc, handle);
+            if (!err)
+                err = cerr;
+        }
+        bench_sample(b, now_ns() - t);
+
+        if (err)
+            bench_fail("small file", path, err);
+        free(path);
+    }
+
+    if (err)
+        return EXIT_FAILURE;
+
+    bench_report(b, "small_file_write", 0, (uint64_t)b->files * BENCH_SMALL_FILE_SIZE, now_ns() - start);
+    return EXIT_SUCCESS;
+}
+
+static int bench_read_directory(bench_t *b, const char *dir)
+{
+    int i;
+    uint64_t start = now_ns();
+
+    for (i=0; i<BENCH_LIST_ROUNDS; i++) {
+        char **list=NULL;
+        uint64_t t = now_ns();
+        afc_error_t err = afcproto_read_directory(b->afc, dir, &list);
+        bench_sample(b, now_ns() - t);
+        afcproto_list_free(list);
+
+        if (err)
+            return bench_fail("read_directory", dir, err);
+    }
+
+    bench_report(b, "read_directory", 0, 0, now_ns() - start);
+    return EXIT_SUCCESS;
+}
+
+static int bench_file_info(bench_t *b)
+{
+    int i;
+    uint64_t start = now_ns();
+
+    for (i=0; i<b->files; i++) {
+        char *path = bench_small_path(b, i);
+        char **info=NULL;
+        uint64_t t = now_ns();
+        afc_error_t err = afcproto_get_file_info(b->afc, path, &info);
+        bench_sample(b, now_ns() - t);
+        afcproto_list_free(info);
+
+        if (err) {
+            bench_fail("get_file_info", path, err);
+            free(path);
+            return EXIT_FAILURE;
+        }
+        free(path);
+    }
+
+    bench_report(b, "get_file_info", 0, 0, now_ns() - start);
+    return EXIT_SUCCESS;
+}
+
+// removes everything the bench may have created
+static void bench_cleanup(bench_t *b, const char *seq, const char *small)
+{
+    int i;
+
+    if (afcproto_remove_path_and_contents(b->afc, b->dir) == AFC_E_SUCCESS)
+        return;
+
+    // older devices don't have REMOVE_PATH_AND_CONTENTS
+    afcproto_remove_path(b->afc, seq);
+    for (i=0; i<b->files; i++) {
+        char *path = bench_small_path(b, i);
+        afcproto_remove_path(b->afc, path);
+        free(path);
+    }
+    afcproto_remove_path(b->afc, small);
+    afcproto_remove_path(b->afc, b->dir);
+}
+
+int run_bench(afcproto_client_t afc, const char *dir, uint64_t size, int files)
+{
+    int ret = EXIT_SUCCESS;
+    size_t i;
+    char **info=NULL;
+
+    if (afcproto_get_file_info(afc, dir, &info) == AFC_E_SUCCESS) {
+        afcproto_list_free(info);
+        fprintf(ERRF, "Error: %s already exists - pick another bench directory\n", dir);
+        return EXIT_FAILURE;
+    }
+
+    afc_error_t err = afcproto_make_directory(afc, dir);
+    if (err)
+        return bench_fail("mkdir", dir, err);
+
+    bench_t b = { .afc = afc, .dir = dir, .size = size, .files = files };
+    char *seq = path_join(dir, "seq");
+    char *small = path_join(dir, "small");
+    char *udid = (pool)? idev_afc_pool_udid(pool) : NULL;
+
+    // incompressible-ish test data
+    b.data = malloc(CHUNK_MAX);
+    uint32_t x = 2463534242u;
+    for (i=0; b.data && i<CHUNK_MAX; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        b.data[i] = (char)x;
+    }
+
+    fprintf(OUTF, "{\n  \"udid\": ");
+    if (udid)
+        print_json_string(OUTF, udid);
+    else
+        fprintf(OUTF, "null");
+    fprintf(OUTF, ",\n  \"dir\": ");
+    print_json_string(OUTF, dir);
+    fprintf(OUTF, ",\n  \"size\": %llu,\n  \"files\": %d,\n  \"pipeline\": %d,\n  \"results\": [\n",
+            (unsigned long long)size, files, pipeline_depth);
+
+    if (!seq || !small || !b.data) {
+        fprintf(ERRF, "Error: out of memory\n");
+        ret = EXIT_FAILURE;
+    }
+
+    for (i=0; ret == EXIT_SUCCESS && i < sizeof(bench_chunks)/sizeof(bench_chunks[0]); i++) {
+        ret = bench_seq_write(&b, seq, bench_chunks[i]);
+        if (ret == EXIT_SUCCESS)
+            ret = bench_seq_read(&b, seq, bench_chunks[i]);
+        afcproto_remove_path(afc, seq);
+    }
+
+    if (ret == EXIT_SUCCESS && (err = afcproto_make_directory(afc, small)) != AFC_E_SUCCESS)
+        ret = bench_fail("mkdir", small, err);
+    if (ret == EXIT_SUCCESS)
+        ret = bench_small_files(&b);
+    if (ret == EXIT_SUCCESS)
+        ret = bench_read_directory(&b, small);
+    if (ret == EXIT_SUCCESS)
+        ret = bench_file_info(&b);
+
+    fprintf(OUTF, "%s  ],\n  \"complete\": %s\n}\n", (b.results)? "\n" : "", (ret == EXIT_SUCCESS)? "true" : "false");
+
+    if (!afcproto_client_is_broken(afc))
+        bench_cleanup(&b, seq, small);
+
+    free(b.samples.ns);
+    free(b.data);
+    free(udid);
+    free(seq);
+    free(small);
+    return ret;
+}
+
+
+#pragma mark - Tar
+
+// "tar" writes remote trees to stdout as a POSIX (ustar) archive in one pass.
+// Headers are built from the file info, and file contents are streamed
+// from pipelined reads. Names that don't fit a ustar header, and files of
+// 8GB or more, get a pax extended header. The device keeps no owner or
+// permission bits, so entries are 0644/0755 and owned by uid/gid 0.
+//
+// Output goes through the buffer ring: headers and data are packed into its
+// buffers on this thread and written out on the ring's, so at most
+// RING_SLOTS * CHUNK_MAX bytes are held however big the tree is.
+
+#define TAR_BLOCK       512
+#define TAR_RECORD      (20*TAR_BLOCK)
+
+typedef struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+enum {
+    TAR_FILE        = '0',
+    TAR_SYMLINK     = '2',
+    TAR_DIR         = '5',
+    TAR_PAX         = 'x',
+};
+
+typedef struct tar_ctx {
+    afcproto_client_t afc;
+    FILE *outf;
+    xfer_ring_t ring;
+    bool piped;
+    char *buf;          // the buffer being filled
+    uint32_t used;
+    uint64_t total;     // archive bytes so far
+    int werr;
+    size_t files;
+    size_t failures;
+} tar_ctx_t;
+
+// writes the buffer being filled out (or hands it to the ring's thread)
+static void tar_flush(tar_ctx_t *t)
+{
+    if (!t->buf || t->used == 0)
+        return;
+
+    if (t->piped) {
+        xfer_ring_push(&t->ring, t->used, t->total - t->used);
+        t->buf = NULL;
+    } else if (!t->werr && fwrite(t->buf, 1, t->used, t->outf) != t->used) {
+        t->werr = errno;
+    }
+    t->used = 0;
+}
+
+// room for at least len (<= CHUNK_MAX) more bytes of output
+static char *tar_space(tar_ctx_t *t, uint32_t len)
+{
+    if (t->buf && CHUNK_MAX - t->used < len)
+        tar_flush(t);
+
+    if (!t->buf && t->piped && (t->buf = xfer_ring_fill(&t->ring)) == NULL)
+        t->werr = (t->ring.error)? t->ring.error : EIO;
+
+    return (t->werr)? NULL : t->buf + t->used;
+}
+
+static void tar_commit(tar_ctx_t *t, uint32_t len)
+{
+    t->used += len;
+    t->total += len;
+}
+
+static int tar_write(tar_ctx_t *t, const char *data, size_t len)
+{
+    while (len > 0) {
+        uint32_t n = (len < CHUNK_MAX)? (uint32_t)len : CHUNK_MAX;
+        char *dest = tar_space(t, n);
+        if (!dest)
+            return EXIT_FAILURE;
+
+        if (data) {
+            memcpy(dest, data, n);
+            data += n;
+        } else {
+            memset(dest, 0, n);
+        }
+        tar_commit(t, n);
+        len -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+// zeros up to the next block boundary
+static int tar_pad(tar_ctx_t *t)
+{
+    uint32_t rem = t->total % TAR_BLOCK;
+    return (rem)? tar_write(t, NULL, TAR_BLOCK - rem) : EXIT_SUCCESS;
+}
+
+// octal, NUL terminated. false if the value doesn't fit
+static bool tar_octal(char *field, size_t len, uint64_t val)
+{
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%0*llo", (int)(len-1), (unsigned long long)val);
+    if (n < 0 || (size_t)n > len-1)
+        return false;
+
+    memcpy(field, tmp, len);
+    return true;
+}
+
+// splits a long name over the prefix and name fields at a '/'
+static bool tar_set_name(tar_header_t *h, const char *name)
+{
+    size_t len = strlen(name);
+    if (len <= sizeof(h->name)) {
+        memcpy(h->name, name, len);
+        return true;
+    }
+
+    const char *slash;
+    for (slash = name + len - 1; slash > name; slash--) {
+        if (*slash == '/' && (size_t)(slash - name) <= sizeof(h->prefix) && len - (slash - name) - 1 <= sizeof(h->name))
+            break;
+    }
+    if (slash == name || len - (slash - name) - 1 == 0)
+        return false;
+
+    memcpy(h->prefix, name, slash - name);
+    memcpy(h->name, slash+1, len - (slash - name) - 1);
+    return true;
+}
+
+// appends one "<len> key=value\n" pax record, where len counts itself
+static void tar_pax_record(char **recs, size_t *len, const char *key, const char *value)
+{
+    size_t body = strlen(key) + strlen(value) + 3, n = body + 1, digits;
+    for (;;) {
+        digits = snprintf(NULL, 0, "%zu", n);
+        if (digits + body == n)
+            break;
+        n = digits + body;
+    }
+
+    char *p = realloc(*recs, *len + n + 1);
+    if (!p)
+        return;
+
+    snprintf(p + *len, n + 1, "%zu %s=%s\n", n, key, value);
+    *recs = p;
+    *len += n;
+}
+
+static void tar_checksum(tar_header_t *h)
+{
+    unsigned int sum = 0;
+    size_t i;
+
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (i=0; i<sizeof(*h); i++)
+        sum += ((unsigned char *)h)[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+    h->chksum[7] = ' ';
+}
+
+static void tar_header_init(tar_header_t *h, char type, int mode, uint64_t size, uint64_t mtime)
+{
+    memset(h, 0, sizeof(*h));
+    h->typeflag = type;
+    tar_octal(h->mode, sizeof(h->mode), mode);
+    tar_octal(h->uid, sizeof(h->uid), 0);
+    tar_octal(h->gid, sizeof(h->gid), 0);
+    tar_octal(h->size, sizeof(h->size), size);
+    tar_octal(h->mtime, sizeof(h->mtime), mtime);
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+}
+
+static int tar_write_header(tar_ctx_t *t, const char *name, char type, uint64_t size, uint64_t mtime, const char *linkname)
+{
+    tar_header_t h;
+    char *pax = NULL;
+    size_t paxlen = 0;
+    int mode = (type == TAR_DIR)? 0755 : (type == TAR_SYMLINK)? 0777 : 0644;
+
+    tar_header_init(&h, type, mode, size, mtime);
+
+    if (!tar_set_name(&h, name)) {
+        tar_pax_record(&pax, &paxlen, "path", name);
+        memcpy(h.name, name, sizeof(h.name));
+    }
+    if (linkname) {
+        if (strlen(linkname) > sizeof(h.linkname))
+            tar_pax_record(&pax, &paxlen, "linkpath", linkname);
+        strncpy(h.linkname, linkname, sizeof(h.linkname));
+    }
+    if (!tar_octal(h.size, sizeof(h.size), size)) {
+        char num[24];
+        snprintf(num, sizeof(num), "%llu", (unsigned long long)size);
+        tar_pax_record(&pax, &paxlen, "size", num);
+    }
+    tar_checksum(&h);
+
+    int ret = EXIT_SUCCESS;
+    if (pax) {
+        tar_header_t ph;
+        tar_header_init(&ph, TAR_PAX, 0644, paxlen, mtime);
+        memcpy(ph.name, "././@PaxHeader", 14);
+        tar_checksum(&ph);
+
+        ret = tar_write(t, (char *)&ph, sizeof(ph));
+        if (ret == EXIT_SUCCESS)
+            ret = tar_write(t, pax, paxlen);
+        if (ret == EXIT_SUCCESS)
+            ret = tar_pad(t);
+        free(pax);
+    }
+
+    return (ret == EXIT_SUCCESS)? tar_write(t, (char *)&h, sizeof(h)) : ret;
+}
+
+// Streams a file's contents after its header. The header already promised
+// 'size' bytes, so a file that changed since its info was read is cut off
+// or padded with zeros to keep the archive readable.
+static int tar_write_data(tar_ctx_t *t, const char *path, uint64_t size)
+{
+    uint64_t handle=0, done=0;
+    afc_error_t err = afcproto_file_open(t->afc, path, AFC_FOPEN_RDONLY, &handle);
+
+    if (err == AFC_E_SUCCESS) {
+        chunk_ctl_t ctl;
+        chunk_ctl_init(&ctl);
+
+        afcproto_reader_t rd;
+        afcproto_reader_init(&rd, t->afc, handle, ctl.size, pipeline_depth);
+        afcproto_reader_limit(&rd, size);
+
+        uint64_t last = now_ns();
+        while (done < size) {
+            // replies never exceed what's left of the file
+            uint32_t want = (size - done < CHUNK_MAX)? (uint32_t)(size - done) : CHUNK_MAX, bytes_read=0;
+            char *dest = tar_space(t, want);
+            if (!dest)
+                break;
+
+            if ((err = afcproto_reader_next(&rd, dest, want, &bytes_read)) != AFC_E_SUCCESS || bytes_read == 0)
+                break;
+
+            uint64_t now = now_ns();
+            rd.chunk = chunk_ctl_update(&ctl, bytes_read, now - last);
+            last = now;
+
+            tar_commit(t, bytes_read);
+            done += bytes_read;
+        }
+        afcproto_reader_finish(&rd);
+        afcproto_file_close(t->afc, handle);
+    }
+
+    if (t->werr)
+        return EXIT_FAILURE;
+
+    if (err)
+        fprintf(ERRF, "Error: could not read %s: %s - padding with zeros\n", path, idev_afc_strerror(err));
+    else if (done < size)
+        fprintf(ERRF, "Warning: %s shrank by %llu bytes - padding with zeros\n", path, (unsigned long long)(size - done));
+
+    if (done < size) {
+        t->failures++;
+        if (tar_write(t, NULL, size - done) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+    return tar_pad(t);
+}
+
+// Adds one entry, and everything below it for a directory. path is the
+// remote path, name what it's called in the archive. Returns failure only
+// when the archive itself can't be written any more.
+static int tar_add(tar_ctx_t *t, const char *path, const char *name, char **info)
+{
+    const char *type = afcproto_info_value(info, "st_ifmt");
+    const char *size = afcproto_info_value(info, "st_size");
+    uint64_t mtime = info_mtime(info) / 1000000000ULL;
+
+    if (type && !strcmp(type, "S_IFDIR")) {
+        if (*name) {
+            char *dname = NULL;
+            asprintf(&dname, "%s/", name);
+            int ret = (dname)? tar_write_header(t, dname, TAR_DIR, 0, mtime, NULL) : EXIT_FAILURE;
+            free(dname);
+            if (ret != EXIT_SUCCESS)
+                return ret;
+        }
+
+        afc_error_t err;
+        char **names=NULL;
+        ssize_t i, count = read_remote_entries(t->afc, path, &names, &err);
+        if (count < 0) {
+            fprintf(ERRF, "Error: could not read directory %s: %s\n", path, idev_afc_strerror(err));
+            t->failures++;
+            return EXIT_SUCCESS;
+        }
+
+        // sorted, so the same tree always makes the same archive
+        qsort(names, count, sizeof(char *), cmp_str);
+
+        char **paths = calloc(count+1, sizeof(char *));
+        for (i=0; paths && i<count; i++)
+            paths[i] = path_join(path, names[i]);
+
+        afc_error_t *errs = calloc(count+1, sizeof(afc_error_t));
+        char ***infos = (paths && errs)? fetch_file_infos(t->afc, paths, count, errs) : NULL;
+        int ret = (infos)? EXIT_SUCCESS : EXIT_FAILURE;
+
+        for (i=0; infos && i<count && ret == EXIT_SUCCESS; i++) {
+            if (!infos[i]) {
+                fprintf(ERRF, "Error: could not get info for %s - %s\n", (paths[i])? paths[i] : names[i], idev_afc_strerror(errs[i]));
+                t->failures++;
+                continue;
+            }
+            char *child = path_join(name, names[i]);
+            ret = tar_add(t, paths[i], child, infos[i]);
+            free(child);
+        }
+
+        free_file_infos(infos, count);
+        free(errs);
+        for (i=0; paths && i<count; i++)
+            free(paths[i]);
+        free(paths);
+        afcproto_list_free(names);
+        return ret;
+
+    } else if (type && !strcmp(type, "S_IFLNK")) {
+        const char *target = afcproto_info_value(info, "LinkTarget");
+        return tar_write_header(t, name, TAR_SYMLINK, 0, mtime, (target)? target : "");
+
+    } else if (type && !strcmp(type, "S_IFREG")) {
+        uint64_t len = (size)? strtoull(size, NULL, 10) : 0;
+        if (tar_write_header(t, name, TAR_FILE, len, mtime, NULL) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        t->files++;
+        return tar_write_data(t, path, len);
+
+    } else {
+        fprintf(ERRF, "Warning: skipping %s (%s)\n", path, (type)? type : "unknown type");
+        return EXIT_SUCCESS;
+    }
+}
+
+// the name an argument gets in the archive: without leading and trailing
+// slashes, and empty for the top directory so its contents go in as is
+static char *tar_name(const char *path)
+{
+    while (*path == '/')
+        path++;
+
+    char *name = strdup(path);
+    size_t len = (name)? strlen(name) : 0;
+    while (len > 0 && name[len-1] == '/')
+        name[--len] = '\0';
+
+    if (name && !strcmp(name, "."))
+        name[0] = '\0';
+    return name;
+}
+
+int tar_paths(afcproto_client_t afc, char **paths, int count, FILE *outf)
+{
+    tar_ctx_t t;
+    memset(&t, 0, sizeof(t));
+    t.afc = afc;
+    t.outf = outf;
+
+    t.piped = (xfer_ring_start(&t.ring, ^(xfer_ring_t *r) {
+        char *data;
+        uint32_t len;
+        uint64_t off;
+        while ((data = xfer_ring_drain(r, &len, &off)) != NULL) {
+            if (fwrite(data, 1, len, outf) != len) {
+                xfer_ring_abort(r, errno);
+                break;
+            }
+            xfer_ring_pop(r);
+        }
+    }) == EXIT_SUCCESS);
+
+    if (!t.piped && (t.buf = malloc(CHUNK_MAX)) == NULL) {
+        fprintf(ERRF, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    int i, ret = EXIT_SUCCESS;
+    for (i=0; i<count && ret == EXIT_SUCCESS; i++) {
+        char **info=NULL;
+        afc_error_t err = afcproto_get_file_info(afc, paths[i], &info);
+        char *name = tar_name(paths[i]);
+
+        if (err || !info) {
+            fprintf(ERRF, "Error: could not get info for %s: %s\n", paths[i], idev_afc_strerror(err));
+            t.failures++;
+        } else if (name) {
+            ret = tar_add(&t, paths[i], name, info);
+        }
+        free(name);
+        afcproto_list_free(info);
+    }
+
+    // two empty blocks end the archive, padded out to a full record
+    if (ret == EXIT_SUCCESS)
+        ret = tar_write(&t, NULL, 2*TAR_BLOCK);
+    if (ret == EXIT_SUCCESS && t.total % TAR_RECORD)
+        ret = tar_write(&t, NULL, TAR_RECORD - t.total % TAR_RECORD);
+    tar_flush(&t);
+
+    if (t.piped) {
+        xfer_ring_close(&t.ring);
+        xfer_ring_finish(&t.ring);
+        if (!t.werr)
+            t.werr = t.ring.error;
+    } else {
+        free(t.buf);
+    }
+    if (!t.werr && fflush(outf) != 0)
+        t.werr = errno;
+
+    if (t.werr) {
+        fprintf(ERRF, "Error: could not write archive: %s\n", strerror(t.werr));
+        return EXIT_FAILURE;
+    }
+
+    if (idev_verbose)
+        fprintf(ERRF, "[debug] tar: %lu files, %llu bytes\n", t.files, (unsigned long long)t.total);
+
+    return (t.failures)? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+#pragma mark - Untar
+
+// "untar" unpacks a tar stream onto the device as it arrives. The input is
+// read on the buffer ring's thread, and file contents are written to the
+// device straight out of its buffers, so nothing is staged locally and at
+// most RING_SLOTS * CHUNK_MAX bytes of input are held. ustar, pax and GNU
+// long name entries are understood. Entries that would land outside the
+// destination (absolute or ".." paths) are unpacked relative to it or
+// skipped, as tar does.
+
+typedef struct untar_in {
+    FILE *inf;
+    xfer_ring_t ring;
+    bool piped;
+    char *buf;          // the current input buffer, and how far into it we are
+    uint32_t len;
+    uint32_t pos;
+    char *own;          // the buffer when reading without the ring
+    uint64_t total;
+} untar_in_t;
+
+typedef struct untar_ctx {
+    afcproto_client_t afc;
+    untar_in_t in;
+    const char *dir;
+    size_t files;
+    size_t dirs;
+    size_t links;
+    uint64_t bytes;
+    size_t failures;
+} untar_ctx_t;
+
+// the next up to max bytes of input, in place. NULL at the end
+static char *untar_next(untar_in_t *in, uint32_t max, uint32_t *n)
+{
+    *n = 0;
+    if (in->pos == in->len) {
+        uint64_t off;
+        in->pos = in->len = 0;
+        if (in->piped) {
+            if (in->buf)
+                xfer_ring_pop(&in->ring);
+            in->buf = xfer_ring_drain(&in->ring, &in->len, &off);
+        } else {
+            in->len = fread(in->own, 1, CHUNK_MAX, in->inf);
+            in->buf = (in->len)? in->own : NULL;
+        }
+        if (!in->buf)
+            return NULL;
+    }
+
+    char *p = in->buf + in->pos;
+    *n = (in->len - in->pos < max)? in->len - in->pos : max;
+    in->pos += *n;
+    in->total += *n;
+    return p;
+}
+
+// copies exactly len bytes of input to dest, or skips them if dest is NULL
+static int untar_read(untar_in_t *in, char *dest, uint64_t len)
+{
+    while (len > 0) {
+        uint32_t n;
+        char *p = untar_next(in, (len < CHUNK_MAX)? (uint32_t)len : CHUNK_MAX, &n);
+        if (!p)
+            return EXIT_FAILURE;
+        if (dest) {
+            memcpy(dest, p, n);
+            dest += n;
+        }
+        len -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+static uint64_t untar_padding(uint64_t size)
+{
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+// octal, or GNU's base-256 for values that don't fit
+static uint64_t untar_number(const char *field, size_t len)
+{
+    uint64_t val = 0;
+    size_t i = 0;
+
+    if ((unsigned char)field[0] & 0x80) {
+        val = (unsigned char)field[0] & 0x7f;
+        for (i=1; i<len; i++)
+            val = (val << 8) | (unsigned char)field[i];
+        return val;
+    }
+
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        val = (val << 3) | (field[i] - '0');
+    return val;
+}
+
+static bool untar_checksum_ok(tar_header_t *h)
+{
+    uint64_t want = untar_number(h->chksum, sizeof(h->chksum));
+    unsigned int sum = 0;
+    int ssum = 0;
+    size_t i;
+
+    for (i=0; i<sizeof(*h); i++) {
+        unsigned char c = (i >= offsetof(tar_header_t, chksum) && i < offsetof(tar_header_t, chksum) + sizeof(h->chksum))? ' ' : ((unsigned char *)h)[i];
+        sum += c;
+        ssum += (signed char)c;
+    }
+    // some old tars summed signed chars
+    return (want == sum || want == (uint64_t)(unsigned int)ssum);
+}
+
+// a NUL terminated copy of a header field that might fill its whole width
+static char *untar_field(const char *field, size_t len)
+{
+    char *ret = malloc(len + 1);
+    if (ret) {
+        memcpy(ret, field, len);
+        ret[len] = '\0';
+    }
+    return ret;
+}
+
+// Makes an archive name safe to put under the destination: leading slashes
+// and "./" are dropped, and names with ".." in them are refused. The result
+// (an empty string for the top directory itself) must be freed.
+static char *untar_clean_name(const char *name)
+{
+    while (*name == '/' || (name[0] == '.' && name[1] == '/'))
+        name += (*name == '/')? 1 : 2;
+
+    char *ret = strdup(name);
+    size_t len = (ret)? strlen(ret) : 0;
+    while (len > 0 && ret[len-1] == '/')
+        ret[--len] = '\0';
+    if (ret && !strcmp(ret, "."))
+        ret[0] = '\0';
+
+    const char *p = ret;
+    while (p && *p) {
+        const char *slash = strchr(p, '/');
+        size_t n = (slash)? (size_t)(slash - p) : strlen(p);
+        if (n == 2 && p[0] == '.' && p[1] == '.') {
+            free(ret);
+            return NULL;
+        }
+        p += n + ((slash)? 1 : 0);
+    }
+    return ret;
+}
+
+// pax records override the header's fields for the next entry
+static void untar_parse_pax(char *data, uint64_t len, char **path, char **linkpath, int64_t *size, int64_t *mtime)
+{
+    char *p = data, *end = data + len;
+
+    while (p < end) {
+        char *sp = memchr(p, ' ', end - p);
+        uint64_t reclen = strtoull(p, NULL, 10);
+        if (!sp || reclen == 0 || reclen > (uint64_t)(end - p) || p[reclen-1] != '\n')
+            break;
+
+        char *key = sp + 1, *rec_end = p + reclen - 1;
+        char *eq = memchr(key, '=', rec_end - key);
+        if (eq) {
+            *eq = '\0';
+            *rec_end = '\0';
+            char *val = eq + 1;
+            if (!strcmp(key, "path")) {
+                free(*path);
+                *path = strdup(val);
+            } else if (!strcmp(key, "linkpath")) {
+                free(*linkpath);
+                *linkpath = strdup(val);
+            } else if (!strcmp(key, "size")) {
+                *size = strtoll(val, NULL, 10);
+            } else if (!strcmp(key, "mtime")) {
+                *mtime = strtoll(val, NULL, 10);
+            }
+        }
+        p += reclen;
+    }
+}
+
+// Opens path for writing, creating its parent directories if the archive
+// didn't have entries for them
+static afc_error_t untar_open(untar_ctx_t *u, const char *path, uint64_t *handle)
+{
+    afc_error_t err = afcproto_file_open(u->afc, path, AFC_FOPEN_WRONLY, handle);
+    if (err == AFC_E_OBJECT_NOT_FOUND) {
+        char *parent = strdup(path);
+        char *slash = (parent)? strrchr(parent, '/') : NULL;
+        if (slash && slash != parent) {
+            *slash = '\0';
+            if (afcproto_make_directory(u->afc, parent) == AFC_E_SUCCESS)
+                err = afcproto_file_open(u->afc, path, AFC_FOPEN_WRONLY, handle);
+        }
+        free(parent);
+    }
+    return err;
+}
+
+// Writes the next size bytes of input to path. The input is always consumed,
+// so a file that can't be written doesn't stop the rest of the archive.
+static int untar_file(untar_ctx_t *u, const char *path, uint64_t size, int64_t mtime)
+{
+    uint64_t handle=0, left=size;
+    afc_error_t err = untar_open(u, path, &handle);
+
+    chunk_ctl_t ctl;
+    chunk_ctl_init(&ctl);
+
+    while (left > 0) {
+        uint32_t n, written=0;
+        char *data = untar_next(&u->in, (left < ctl.size)? (uint32_t)left : ctl.size, &n);
+        if (!data) {
+            fprintf(ERRF, "Error: archive ends in the middle of %s\n", path);
+            if (!err)
+                afcproto_file_close(u->afc, handle);
+            return EXIT_FAILURE;
+        }
+        left -= n;
+
+        if (!err) {
+            uint64_t t = now_ns();
+            err = afcproto_file_write(u->afc, handle, data, n, &written);
+            chunk_ctl_update(&ctl, written, now_ns() - t);
+        }
+    }
+
+    if (!err) {
+        afcproto_file_close(u->afc, handle);
+        if (mtime > 0)
+            afcproto_set_file_time(u->afc, path, (uint64_t)mtime * 1000000000ULL);
+        u->files++;
+        u->bytes += size;
+    } else {
+        fprintf(ERRF, "Error: could not write %s: %s\n", path, idev_afc_strerror(err));
+        u->failures++;
+    }
+
+    if (untar_read(&u->in, NULL, untar_padding(size)) != EXIT_SUCCESS) {
+        fprintf(ERRF, "Error: archive is truncated\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void untar_link(untar_ctx_t *u, afc_link_type_t type, const char *target, const char *path)
+{
+    afc_error_t err = afcproto_make_link(u->afc, type, target, path);
+
+    // replace whatever was there, as tar does
+    if (err == AFC_E_OBJECT_EXISTS && afcproto_remove_path(u->afc, path) == AFC_E_SUCCESS)
+        err = afcproto_make_link(u->afc, type, target, path);
+
+    if (err) {
+        fprintf(ERRF, "Error: could not link %s -> %s: %s\n", path, target, idev_afc_strerror(err));
+        u->failures++;
+    } else {
+        u->links++;
+    }
+}
+
+static int untar_entries(untar_ctx_t *u)
+{
+    char *longname=NULL, *longlink=NULL, *paxpath=NULL, *paxlink=NULL;
+    int64_t paxsize=-1, paxmtime=-1;
+    int ret = EXIT_SUCCESS, zeros = 0;
+
+    for (;;) {
+        tar_header_t h;
+        if (untar_read(&u->in, (char *)&h, sizeof(h)) != EXIT_SUCCESS) {
+            // a missing end marker is common enough, e.g. from a truncated
+            // stream tar itself would also accept
+            if (u->in.total % TAR_BLOCK) {
+                fprintf(ERRF, "Error: archive is truncated\n");
+                ret = EXIT_FAILURE;
+            }
+            break;
+        }
+
+        static const char zero[TAR_BLOCK];
+        if (!memcmp(&h, zero, sizeof(h))) {
+            if (++zeros == 2)
+                break;
+            continue;
+        }
+        zeros = 0;
+
+        if (!untar_checksum_ok(&h)) {
+            fprintf(ERRF, "Error: bad tar header at offset %llu\n", (unsigned long long)(u->in.total - TAR_BLOCK));
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        uint64_t size = untar_number(h.size, sizeof(h.size));
+        char type = (h.typeflag)? h.typeflag : TAR_FILE;
+
+        // entries that describe the next one
+        if (type == TAR_PAX || type == 'g' || type == 'L' || type == 'K') {
+            char *data = (size < 16*1024*1024)? malloc(size + 1) : NULL;
+            if (!data || untar_read(&u->in, data, size) != EXIT_SUCCESS ||
+                untar_read(&u->in, NULL, untar_padding(size)) != EXIT_SUCCESS)
+            {
+                fprintf(ERRF, "Error: bad or truncated extended header\n");
+                free(data);
+                ret = EXIT_FAILURE;
+                break;
+            }
+            data[size] = '\0';
+
+            if (type == TAR_PAX) {
+                untar_parse_pax(data, size, &paxpath, &paxlink, &paxsize, &paxmtime);
+            } else if (type == 'L') {
+                free(longname);
+                longname = strdup(data);
+            } else if (type == 'K') {
+                free(longlink);
+                longlink = strdup(data);
+            }
+            free(data);
+            continue;
+        }
+
+        char *name;
+        if (paxpath) {
+            name = strdup(paxpath);
+        } else if (longname) {
+            name = strdup(longname);
+        } else if (h.prefix[0] && !memcmp(h.magic, "ustar", 5)) {
+            char *prefix = untar_field(h.prefix, sizeof(h.prefix)), *base = untar_field(h.name, sizeof(h.name));
+            name = (prefix && base)? path_join(prefix, base) : NULL;
+            free(prefix);
+            free(base);
+        } else {
+            name = untar_field(h.name, sizeof(h.name));
+        }
+        char *linkname = (paxlink)? strdup(paxlink) : (longlink)? strdup(longlink) : untar_field(h.linkname, sizeof(h.linkname));
+        if (paxsize >= 0)
+            size = paxsize;
+        int64_t mtime = (paxmtime >= 0)? paxmtime : (int64_t)untar_number(h.mtime, sizeof(h.mtime));
+
+        free(longname);
+        free(longlink);
+        free(paxpath);
+        free(paxlink);
+        longname = longlink = paxpath = paxlink = NULL;
+        paxsize = paxmtime = -1;
+
+        char *clean = (name)? untar_clean_name(name) : NULL;
+        char *path = (clean)? path_join(u->dir, clean) : NULL;
+        bool has_data = (type == TAR_FILE || type == '7');
+
+        if (!path) {
+            fprintf(ERRF, "Warning: skipping %s\n", (name)? name : "entry with a bad name");
+            u->failures++;
+        } else if (type == TAR_DIR) {
+            if (*clean) {
+                afc_error_t err = afcproto_make_directory(u->afc, path);
+                if (err) {
+                    fprintf(ERRF, "Error: could not create directory %s: %s\n", path, idev_afc_strerror(err));
+                    u->failures++;
+                } else {
+                    u->dirs++;
+                }
+            }
+        } else if (type == TAR_SYMLINK) {
+            untar_link(u, AFC_SYMLINK, linkname, path);
+        } else if (type == '1') {
+            char *target = untar_clean_name(linkname);
+            char *tpath = (target)? path_join(u->dir, target) : NULL;
+            if (tpath) {
+                untar_link(u, AFC_HARDLINK, tpath, path);
+            } else {
+                fprintf(ERRF, "Warning: skipping hard link %s to %s\n", name, linkname);
+                u->failures++;
+            }
+            free(target);
+            free(tpath);
+        } else if (has_data) {
+            if (idev_verbose)
+                fprintf(ERRF, "[debug] untar %s (%llu bytes)\n", path, (unsigned long long)size);
+            ret = untar_file(u, path, size, mtime);
+        } else {
+            fprintf(ERRF, "Warning: skipping %s (unsupported entry type '%c')\n", name, type);
+        }
+
+        // anything not written out above still has its data to skip
+        if (!(has_data && path) && ret == EXIT_SUCCESS && untar_read(&u->in, NULL, size + untar_padding(size)) != EXIT_SUCCESS) {
+            fprintf(ERRF, "Error: archive is truncated\n");
+            ret = EXIT_FAILURE;
+        }
+
+        free(name);
+        free(linkname);
+        free(clean);
+        free(path);
+
+        if (ret != EXIT_SUCCESS || afcproto_client_is_broken(u->afc))
+            break;
+    }
+
+    free(longname);
+    free(longlink);
+    free(paxpath);
+    free(paxlink);
+
+    return (ret == EXIT_SUCCESS && afcproto_client_is_broken(u->afc))? EXIT_FAILURE : ret;
+}
+
+int untar_stream(afcproto_client_t afc, FILE *inf, const char *dir)
+{
+    untar_ctx_t u;
+    memset(&u, 0, sizeof(u));
+    u.afc = afc;
+    u.dir = dir;
+    u.in.inf = inf;
+
+    afc_error_t err = afcproto_make_directory(afc, dir);
+    if (err) {
+        fprintf(ERRF, "Error: could not create directory %s: %s\n", dir, idev_afc_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    u.in.piped = (xfer_ring_start(&u.in.ring, ^(xfer_ring_t *r) {
+        char *data;
+        uint64_t off = 0;
+        while ((data = xfer_ring_fill(r)) != NULL) {
+            size_t n = fread(data, 1, CHUNK_MAX, inf);
+            if (n == 0) {
+                if (ferror(inf))
+                    xfer_ring_abort(r, EIO);
+                break;
+            }
+            xfer_ring_push(r, n, off);
+            off += n;
+        }
+        xfer_ring_close(r);
+    }) == EXIT_SUCCESS);
+
+    if (!u.in.piped && (u.in.own = malloc(CHUNK_MAX)) == NULL) {
+        fprintf(ERRF, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start = now_ns();
+    int ret = untar_entries(&u);
+
+    if (u.in.piped) {
+        xfer_ring_abort(&u.in.ring, 0);
+        xfer_ring_finish(&u.in.ring);
+        if (u.in.ring.error) {
+            fprintf(ERRF, "Error: could not read archive: %s\n", strerror(u.in.ring.error));
+            ret = EXIT_FAILURE;
+        }
+    } else {
+        if (ferror(inf)) {
+            fprintf(ERRF, "Error: could not read archive: %s\n", strerror(errno));
+            ret = EXIT_FAILURE;
+        }
+        free(u.in.own);
+    }
+
+    afccache_invalidate(cmd_cache, dir);
+
+    double secs = (now_ns() - start) / 1e9;
+    fprintf(OUTF, "Unpacked %lu files (%llu bytes), %lu directories and %lu links into %s in %.3fs%s\n",
+            u.files, (unsigned long long)u.bytes, u.dirs, u.links, dir, secs,
+            (u.failures)? " - some entries failed" : "");
+
+    return (u.failures)? EXIT_FAILURE : ret;
+}
+
+
+#pragma mark - Command handlers
+
+int do_info(afcproto_client_t afc, int argc, char **argv)
+{
+    int j, i, ret = EXIT_SUCCESS;
     if (argc > 1) {
         for (i=1; i<argc ; i++) {
             ret |= dump_afc_file_info(afc, argv[i]);
         }
     } else {
-        fprintf(stderr, "Error: you must specify at least one path.\n");
-        ret = EXIT_FAILURE;
+        fprintf(ERRF, "Error: you must specify at least one path.\n");
+        ret = EXIT_FAILURE;
+    }
+
+    return ret;
+}
+
+int do_list(afcproto_client_t afc, int argc, char **argv)
+{
+    int i, ret = EXIT_SUCCESS;
+    bool names_only = false;
+
+    if (argc > 1 && !strcmp(argv[1], "--names-only")) {
+        names_only = true;
+        argc--;
+        argv++;
+    }
+
+    if (argc > 1) {
+        for (i=1; i<argc ; i++) {
+            ret |= dump_afc_list_path(afc, argv[i], names_only);
+        }
+    } else {
+        ret = dump_afc_list_path(afc, "", names_only);
+    }
+
+    return ret;
+}
+
+
+int do_mkdir(afcproto_client_t afc, int argc, char **argv)
+{
+    int i, ret=EXIT_SUCCESS;
+    if (argc > 1) {
+        for (i=1; i<argc ; i++) {
+            afc_error_t err = afcproto_make_directory(afc, argv[i]);
+            afccache_invalidate(cmd_cache, argv[i]);
+
+            if (err == AFC_E_SUCCESS) {
+                fprintf(OUTF, "Created directory: %s\n", argv[i]);
+            } else {
+                fprintf(ERRF, "Error: mkdir error: %s\n", idev_afc_strerror(err));
+                ret = EXIT_FAILURE;
+            }
+        }
+    } else {
+        fprintf(ERRF, "Error: you must specify at least one directory path.\n");
+        ret = EXIT_FAILURE;
+    }
+
+    return ret;
+}
+
+int do_rm(afcproto_client_t afc, int argc, char **argv)
+{
+    int i, ret=EXIT_SUCCESS;
+    bool recursive = false, dry_run = false;
+
+    for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+        if (!strcmp(argv[0], "-r") || !strcmp(argv[0], "-R")) {
+            recursive = true;
+        } else if (!strcmp(argv[0], "-n") || !strcmp(argv[0], "--dry-run")) {
+            dry_run = true;
+        } else {
+            fprintf(ERRF, "Error: invalid arguments for rm command.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc < 1) {
+        fprintf(ERRF, "Error: you must specify at least one path to remove.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!recursive) {
+        for (i=0; i<argc; i++) {
+            if (dry_run) {
+                // report what the remove itself would fail with
+                char **info = NULL, **names = NULL;
+                afc_error_t err = afcproto_get_file_info(afc, argv[i], &info);
+                if (err == AFC_E_SUCCESS && info_is_type(info, "S_IFDIR") &&
+                    read_remote_entries(afc, argv[i], &names, &err) > 0)
+                {
+                    err = AFC_E_DIR_NOT_EMPTY;
+                }
+                afcproto_list_free(names);
+                afcproto_list_free(info);
+
+                if (err == AFC_E_SUCCESS) {
+                    fprintf(OUTF, "Would remove: %s\n", argv[i]);
+                } else {
+                    fprintf(ERRF, "Error: could not remove %s - %s\n", argv[i], idev_afc_strerror(err));
+                    ret = EXIT_FAILURE;
+                }
+                continue;
+            }
+
+            afc_error_t err = afcproto_remove_path(afc, argv[i]);
+            afccache_invalidate(cmd_cache, argv[i]);
+
+            if (err == AFC_E_SUCCESS) {
+                fprintf(OUTF, "Removed: %s\n", argv[i]);
+            } else {
+                fprintf(ERRF, "Error: could not remove %s - %s\n", argv[i], idev_afc_strerror(err));
+                ret = EXIT_FAILURE;
+            }
+        }
+        return ret;
+    }
+
+    // the walk lists directories afresh, as anything a stale listing
+    // missed would keep its directory from being removed
+    afccache_t cache = cmd_cache;
+    cmd_cache = NULL;
+
+    rm_counts_t counts = { 0, 0 };
+    int trees = 0;
+    uint64_t start = now_ns();
+
+    for (i=0; i<argc; i++) {
+        ret |= remove_path_recursive(afc, argv[i], dry_run, &counts, &trees);
+        afccache_invalidate(cache, argv[i]);
+    }
+
+    cmd_cache = cache;
+
+    const char *verb = (dry_run)? "Would remove" : "Removed";
+    if (trees && !counts.files && !counts.dirs) {
+        fprintf(OUTF, "%s %d %s in one request each", verb, trees, (trees == 1)? "path" : "paths");
+    } else {
+        fprintf(OUTF, "%s %llu files and %llu directories", verb, (unsigned long long)counts.files, (unsigned long long)counts.dirs);
+        if (trees)
+            fprintf(OUTF, ", plus %d %s in one request each", trees, (trees == 1)? "path" : "paths");
+    }
+    fprintf(OUTF, " in %.3fs\n", (now_ns() - start) / 1e9);
+
+    return ret;
+}
+
+int do_rename(afcproto_client_t afc, int argc, char **argv)
+{
+    int ret = EXIT_FAILURE;
+
+    if (argc == 3) {
+        afc_error_t err = afcproto_rename_path(afc, argv[1], argv[2]);
+        afccache_invalidate(cmd_cache, argv[1]);
+        afccache_invalidate(cmd_cache, argv[2]);
+
+        if (err == AFC_E_SUCCESS) {
+            fprintf(OUTF, "Renamed %s to %s\n", argv[1], argv[2]);
+            ret = EXIT_SUCCESS;
+        } else {
+            fprintf(ERRF, "Error: rename %s to %s - %s\n", argv[1], argv[2], idev_afc_strerror(err));
+        }
+
+    } else {
+        fprintf(ERRF, "Error: invalid number of arguments for rename.\n");
+    }
+
+    return ret;
+}
+
+int do_link(afcproto_client_t afc, int argc, char **argv)
+{
+    int ret=EXIT_FAILURE;
+
+    if (argc == 3) {
+        afc_error_t err = afcproto_make_link(afc, AFC_HARDLINK, argv[1], argv[2]);
+        afccache_invalidate(cmd_cache, argv[2]);
+
+        if (err == AFC_E_SUCCESS) {
+            fprintf(OUTF, "Created hard-link %s -> %s\n", argv[2], argv[1]);
+            ret = EXIT_SUCCESS;
+        } else {
+            fprintf(ERRF, "Error: link %s -> %s - %s\n", argv[2], argv[1], idev_afc_strerror(err));
+        }
+
+    } else {
+        fprintf(ERRF, "Error: invalid number of arguments for link command.\n");
+    }
+
+    return ret;
+}
+
+int do_symlink(afcproto_client_t afc, int argc, char **argv)
+{
+    int ret=EXIT_FAILURE;
+
+    if (argc == 3) {
+        afc_error_t err = afcproto_make_link(afc, AFC_SYMLINK, argv[1], argv[2]);
+        afccache_invalidate(cmd_cache, argv[2]);
+
+        if (err == AFC_E_SUCCESS) {
+            fprintf(OUTF, "Created symbolic-link %s -> %s\n", argv[2], argv[1]);
+            ret = EXIT_SUCCESS;
+        } else {
+            fprintf(ERRF, "Error: link %s -> %s - %s\n", argv[2], argv[1], idev_afc_strerror(err));
+        }
+
+    } else {
+        fprintf(ERRF, "Error: invalid number of arguments for link command.\n");
+    }
+
+    return ret;
+}
+
+int do_cat(afcproto_client_t afc, int argc, char **argv)
+{
+    int ret=EXIT_FAILURE;
+
+    if (argc == 2) {
+        ret = dump_afc_path(afc, argv[1], OUTF);
+    } else {
+        fprintf(ERRF, "Error: invalid number of arguments for cat command.\n");
+    }
+
+    return ret;
+}
+
+int do_tar(afcproto_client_t afc, int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(ERRF, "Error: invalid number of arguments for tar command.\n");
+        return EXIT_FAILURE;
+    }
+
+    int fd = fileno(OUTF);
+    if (fd >= 0 && isatty(fd)) {
+        fprintf(ERRF, "Error: refusing to write an archive to a terminal, redirect or pipe stdout\n");
+        return EXIT_FAILURE;
+    }
+
+    return tar_paths(afc, argv+1, argc-1, OUTF);
+}
+
+int do_untar(afcproto_client_t afc, int argc, char **argv)
+{
+    char *archive = NULL;
+    if (argc == 4 && !strcmp(argv[1], "-f")) {
+        archive = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 2) {
+        fprintf(ERRF, "Error: invalid arguments for untar command.\n");
+        return EXIT_FAILURE;
+    }
+
+    // cmd_cwd is only set for commands from a server client, whose stdin
+    // isn't relayed to us
+    if ((!archive || !strcmp(archive, "-")) && cmd_cwd) {
+        fprintf(ERRF, "Error: untar can't read stdin through a server, use -f <archive>\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *inf = stdin;
+    if (archive && strcmp(archive, "-")) {
+        char *path = local_path(archive);
+        inf = (path)? fopen(path, "r") : NULL;
+        free(path);
+        if (!inf) {
+            fprintf(ERRF, "Error opening local file for reading: %s - %s\n", archive, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    } else if (isatty(fileno(stdin))) {
+        fprintf(ERRF, "Error: refusing to read an archive from a terminal, redirect or pipe stdin\n");
+        return EXIT_FAILURE;
+    }
+
+    int ret = untar_stream(afc, inf, argv[1]);
+    if (inf != stdin)
+        fclose(inf);
+    return ret;
+}
+
+// strips the leading -r, --resume and --verify flags off a get or put command
+int parse_xfer_flags(int *argc, char ***argv)
+{
+    int flags = 0;
+
+    while (*argc > 1) {
+        char *arg = (*argv)[1];
+        if (!strcmp(arg, "-r"))
+            flags |= XFER_RECURSIVE;
+        else if (!strcmp(arg, "--resume"))
+            flags |= XFER_RESUME;
+        else if (!strcmp(arg, "--verify"))
+            flags |= XFER_RESUME|XFER_VERIFY;
+        else
+            break;
+
+        (*argc)--;
+        (*argv)++;
+    }
+
+    return flags;
+}
+
+int do_get(afcproto_client_t afc, int argc, char **argv)
+{
+    int ret=EXIT_FAILURE;
+    char *dst=NULL;
+    int flags = parse_xfer_flags(&argc, &argv);
+
+    if (flags & XFER_RECURSIVE) {
+        if (argc == 2) {
+            char *name = basename(argv[1]);
+            dst = local_path((strcmp(name, "/"))? name : ".");
+            ret = get_afc_tree(afc, argv[1], dst, flags);
+        } else if (argc == 3) {
+            dst = local_path(argv[2]);
+            ret = get_afc_tree(afc, argv[1], dst, flags);
+        } else {
+            fprintf(ERRF, "Error: invalid number of arguments for get -r command.\n");
+        }
+    } else if (argc == 2) {
+        dst = local_path(basename(argv[1]));
+        ret = get_afc_path(afc, argv[1], dst, -1, flags);
+    } else if (argc == 3) {
+        dst = local_path(argv[2]);
+        if (is_dir(dst)) {
+            char *dpath = path_join(dst, basename(argv[1]));
+            free(dst);
+            dst = dpath;
+        }
+        ret = get_afc_path(afc, argv[1], dst, -1, flags);
+    } else {
+        fprintf(ERRF, "Error: invalid number of arguments for get command.\n");
+    }
+
+    free(dst);
+    return ret;
+}
+
+int do_put(afcproto_client_t afc, int argc, char **argv)
+{
+    int ret=EXIT_FAILURE;
+    char *src=NULL;
+    int flags = parse_xfer_flags(&argc, &argv);
+
+    if (flags & XFER_RECURSIVE) {
+        if (argc == 2) {
+            src = local_path(argv[1]);
+            ret = put_afc_tree(afc, src, basename(argv[1]), flags);
+        } else if (argc == 3) {
+            src = local_path(argv[1]);
+            ret = put_afc_tree(afc, src, argv[2], flags);
+        } else {
+            fprintf(ERRF, "Error: invalid number of arguments for put -r command.\n");
+        }
+    } else if (argc == 2) {
+        src = local_path(argv[1]);
+        ret = put_afc_path(afc, src, basename(argv[1]), flags);
+        afccache_invalidate(cmd_cache, basename(argv[1]));
+    } else if (argc == 3) {
+        src = local_path(argv[1]);
+        ret = put_afc_path(afc, src, argv[2], flags);
+        afccache_invalidate(cmd_cache, argv[2]);
+    } else {
+        fprintf(ERRF, "Error: invalid number of arguments for put command.\n");
+    }
+
+    free(src);
+    return ret;
+}
+
+
+
+int do_sync(afcproto_client_t afc, int argc, char **argv)
+{
+    int ret=EXIT_FAILURE, flags=0;
+
+    for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+        if (!strcmp(argv[1], "--push"))
+            flags |= SYNC_PUSH;
+        else if (!strcmp(argv[1], "--delete"))
+            flags |= SYNC_DELETE;
+        else if (!strcmp(argv[1], "--dry-run") || !strcmp(argv[1], "-n"))
+            flags |= SYNC_DRY_RUN;
+        else
+            break;
+    }
+
+    if (argc == 3) {
+        if (flags & SYNC_PUSH) {
+            char *src = local_path(argv[1]);
+            ret = sync_tree(afc, src, argv[2], flags);
+            afccache_invalidate(cmd_cache, argv[2]);
+            free(src);
+        } else {
+            char *dst = local_path(argv[2]);
+            ret = sync_tree(afc, argv[1], dst, flags);
+            free(dst);
+        }
+    } else {
+        fprintf(ERRF, "Error: invalid arguments for sync command.\n");
+    }
+
+    return ret;
+}
+
+// prints sizes like "912", "1.5K" or "23M"
+static void print_human_size(uint64_t size)
+{
+    const char *units = "KMGTPE";
+    double val = size;
+    int u = -1;
+
+    while (val >= 1024 && units[u+1]) {
+        val /= 1024;
+        u++;
+    }
+    if (u < 0)
+        fprintf(OUTF, "%llu", (unsigned long long)size);
+    else
+        fprintf(OUTF, (val < 10)? "%.1f%c" : "%.0f%c", val, units[u]);
+}
+
+// "du" prints the space used by each directory once everything below it
+// has been walked, so totals appear as subtrees finish rather than at the
+// end. Sizes are in 1K blocks like du(1), or bytes with -b.
+int do_du(afcproto_client_t afc, int argc, char **argv)
+{
+    bool summarize = false, human = false, apparent = false;
+    int maxdepth = -1;
+
+    for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+        if (!strcmp(argv[0], "-s")) {
+            summarize = true;
+        } else if (!strcmp(argv[0], "-h")) {
+            human = true;
+        } else if (!strcmp(argv[0], "-b")) {
+            apparent = true;
+        } else if (!strcmp(argv[0], "-d") && argc > 1 && (maxdepth = atoi(argv[1])) >= 0) {
+            argc--, argv++;
+        } else {
+            fprintf(ERRF, "Error: invalid arguments for du command.\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (summarize)
+        maxdepth = 0;
+
+    void(^print)(uint64_t, const char *) = ^(uint64_t size, const char *path) {
+        if (human)
+            print_human_size(size);
+        else
+            fprintf(OUTF, "%llu", (unsigned long long)((apparent)? size : (size + 1023) / 1024));
+        fprintf(OUTF, "\t%s\n", path);
+    };
+
+    walk_t w;
+    memset(&w, 0, sizeof(w));
+
+    w.entry = ^bool(walk_dir_t *parent, walk_dir_t *child, const char *path, char **info) {
+        const char *val = afcproto_info_value(info, (apparent)? "st_size" : "st_blocks");
+        uint64_t size = (val)? strtoull(val, NULL, 10) : 0;
+        if (!apparent)
+            size *= 512;
+
+        if (child)
+            child->size = size;
+        else if (parent)
+            parent->size += size;
+        else
+            print(size, path);
+        return true;
+    };
+
+    w.finish = ^(walk_dir_t *dir) {
+        if (maxdepth < 0 || dir->depth <= maxdepth)
+            print(dir->size, dir->path);
+        if (dir->parent)
+            dir->parent->size += dir->size;
+    };
+
+    char *root = "/";
+    return (argc > 0)? walk_trees(afc, &w, argv, argc) : walk_trees(afc, &w, &root, 1);
+}
+
+typedef struct find_opts {
+    const char *name;
+    int name_flags;
+    char type;
+    bool has_size;
+    int size_cmp;
+    uint64_t size;
+    int mtime_cmp;
+    int64_t mtime_days;
+    int mindepth;
+    int maxdepth;
+    char term;
+} find_opts_t;
+
+// parses "+N", "-N" or "N" into a comparison (1, -1 or 0) and a value
+static bool parse_find_number(const char *str, bool size, int *cmp, uint64_t *val)
+{
+    *cmp = (*str == '+')? 1 : (*str == '-')? -1 : 0;
+    if (*cmp)
+        str++;
+
+    if (size) {
+        // sizes are in bytes; a trailing 'c' as in find(1) is accepted
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%s", str);
+        size_t len = strlen(buf);
+        if (len && buf[len-1] == 'c')
+            buf[len-1] = '\0';
+        *val = parse_size(buf);
+        return (*val > 0 || !strcmp(buf, "0"));
+    }
+
+    char *end = NULL;
+    *val = strtoull(str, &end, 10);
+    return (end && end != str && *end == '\0');
+}
+
+static bool find_matches(find_opts_t *o, const char *path, char **info, int depth)
+{
+    if (depth < o->mindepth)
+        return false;
+
+    if (o->name) {
+        const char *slash = strrchr(path, '/');
+        const char *base = (slash && slash[1])? slash+1 : path;
+        if (fnmatch(o->name, base, o->name_flags) != 0)
+            return false;
+    }
+
+    if (o->type) {
+        const char *t = (o->type == 'f')? "S_IFREG" : (o->type == 'd')? "S_IFDIR" : "S_IFLNK";
+        if (!info_is_type(info, t))
+            return false;
+    }
+
+    if (o->has_size) {
+        const char *val = afcproto_info_value(info, "st_size");
+        uint64_t size = (val)? strtoull(val, NULL, 10) : 0;
+        if ((o->size_cmp > 0 && size <= o->size) || (o->size_cmp < 0 && size >= o->size) || (!o->size_cmp && size != o->size))
+            return false;
+    }
+
+    if (o->mtime_days >= 0) {
+        // whole days since the last change, as find(1) counts them
+        int64_t age = ((int64_t)time(NULL) - (int64_t)(info_mtime(info) / 1000000000ULL)) / 86400;
+        if ((o->mtime_cmp > 0 && age <= o->mtime_days) || (o->mtime_cmp < 0 && age >= o->mtime_days) || (!o->mtime_cmp && age != o->mtime_days))
+            return false;
+    }
+
+    return true;
+}
+
+// "find" prints the paths below the given ones that match every predicate,
+// as they are found - not in any particular order.
+int do_find(afcproto_client_t afc, int argc, char **argv)
+{
+    find_opts_t o;
+    memset(&o, 0, sizeof(o));
+    o.mtime_days = -1;
+    o.maxdepth = -1;
+    o.term = '\n';
+
+    int npaths;
+    for (argc--, argv++, npaths=0; npaths < argc && argv[npaths][0] != '-'; npaths++);
+    char **paths = argv;
+
+    bool ok = true;
+    int i;
+    for (i=npaths; ok && i<argc; i++) {
+        const char *arg = argv[i], *val = (i+1 < argc)? argv[i+1] : NULL;
+        uint64_t n;
+
+        if (!strcmp(arg, "-print0")) {
+            o.term = '\0';
+            continue;
+        } else if (!val) {
+            ok = false;
+        } else if (!strcmp(arg, "-name") || !strcmp(arg, "-iname")) {
+            o.name = val;
+            o.name_flags = (arg[1] == 'i')? FNM_CASEFOLD : 0;
+        } else if (!strcmp(arg, "-type")) {
+            o.type = val[0];
+            ok = ((o.type == 'f' || o.type == 'd' || o.type == 'l') && val[1] == '\0');
+        } else if (!strcmp(arg, "-size")) {
+            ok = o.has_size = parse_find_number(val, true, &o.size_cmp, &o.size);
+        } else if (!strcmp(arg, "-mtime")) {
+            ok = parse_find_number(val, false, &o.mtime_cmp, &n);
+            o.mtime_days = (int64_t)n;
+        } else if (!strcmp(arg, "-mindepth")) {
+            ok = ((o.mindepth = atoi(val)) >= 0);
+        } else if (!strcmp(arg, "-maxdepth")) {
+            ok = ((o.maxdepth = atoi(val)) >= 0);
+        } else {
+            ok = false;
+        }
+        i++;
+    }
+
+    if (!ok) {
+        fprintf(ERRF, "Error: invalid arguments for find command.\n");
+        return EXIT_FAILURE;
+    }
+
+    walk_t w;
+    memset(&w, 0, sizeof(w));
+
+    w.entry = ^bool(walk_dir_t *parent, walk_dir_t *child, const char *path, char **info) {
+        int depth = (parent)? parent->depth+1 : 0;
+        if (find_matches(&o, path, info, depth))
+            fprintf(OUTF, "%s%c", path, o.term);
+        return (o.maxdepth < 0 || depth < o.maxdepth);
+    };
+
+    char *root = "/";
+    return (npaths > 0)? walk_trees(afc, &w, paths, npaths) : walk_trees(afc, &w, &root, 1);
+}
+
+// the type letters used in snapshot indexes
+static char snapshot_type(char **info)
+{
+    static const char *types[] = { "S_IFREG", "S_IFDIR", "S_IFLNK", "S_IFCHR", "S_IFBLK", "S_IFIFO", "S_IFSOCK" };
+    const char *t = afcproto_info_value(info, "st_ifmt");
+    int i;
+
+    for (i=0; t && i<7; i++) {
+        if (!strcmp(t, types[i]))
+            return "fdlcbps"[i];
+    }
+    return '?';
+}
+
+// "snapshot" records everything below a directory in an index file, for a
+// later "diff" against another snapshot. The file is only written once the
+// whole tree has been walked, as a partial one would make a diff report
+// everything that was missed as deleted.
+int do_snapshot(afcproto_client_t afc, int argc, char **argv)
+{
+    char *dir = NULL, *out = NULL;
+    int i;
+
+    for (i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-o") && i+1 < argc && !out) {
+            out = argv[++i];
+        } else if (!dir) {
+            dir = argv[i];
+        } else {
+            out = NULL;
+            break;
+        }
+    }
+
+    if (!dir || !out) {
+        fprintf(ERRF, "Error: invalid arguments for snapshot command.\n");
+        return EXIT_FAILURE;
+    }
+
+    afcsnap_builder_t b = afcsnap_builder_new(dir);
+    if (!b) {
+        fprintf(ERRF, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    walk_t w;
+    memset(&w, 0, sizeof(w));
+    walk_t *wp = &w;
+    size_t root_len = strlen(dir);
+
+    w.entry = ^bool(walk_dir_t *parent, walk_dir_t *child, const char *path, char **info) {
+        if (!parent) {
+            if (!child) {
+                fprintf(ERRF, "Error: %s is not a directory\n", path);
+                wp->failures++;
+            }
+            return true;
+        }
+
+        // paths are kept relative to the root, so snapshots of the same
+        // tree under different names still compare
+        const char *rel = path + root_len;
+        while (*rel == '/')
+            rel++;
+
+        const char *size = afcproto_info_value(info, "st_size");
+        char type = snapshot_type(info);
+        const char *target = (type == 'l')? afcproto_info_value(info, "LinkTarget") : NULL;
+
+        if (!afcsnap_builder_add(b, rel, type, (size)? strtoull(size, NULL, 10) : 0, info_mtime(info), target)) {
+            if (!wp->failures)
+                fprintf(ERRF, "Error: out of memory\n");
+            wp->failures++;
+            return false;
+        }
+        return true;
+    };
+
+    int ret = walk_trees(afc, &w, &dir, 1);
+
+    if (ret == EXIT_SUCCESS) {
+        char *file = local_path(out);
+        int err = afcsnap_builder_write(b, file);
+        if (err) {
+            fprintf(ERRF, "Error: could not write snapshot %s - %s\n", file, strerror(err));
+            ret = EXIT_FAILURE;
+        }
+        free(file);
+    } else {
+        fprintf(ERRF, "Error: snapshot of %s incomplete, %s not written\n", dir, out);
+    }
+
+    afcsnap_builder_free(b);
+    return ret;
+}
+
+// "diff" compares two snapshots and prints a line per change, with paths
+// below the second snapshot's root:
+//
+//   A  added
+//   D  deleted
+//   M  size or mtime changed (not reported for directories)
+//   T  type or link target changed
+//
+// It doesn't need a device.
+int do_diff(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(ERRF, "Error: invalid arguments for diff command.\n");
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_FAILURE;
+    char *files[2] = { local_path(argv[1]), local_path(argv[2]) };
+    afcsnap_t snaps[2] = { NULL, NULL };
+    const char *error = NULL;
+    int i;
+
+    for (i=0; i<2; i++) {
+        if ((snaps[i] = afcsnap_open(files[i], &error)) == NULL) {
+            fprintf(ERRF, "Error: cannot read snapshot %s - %s\n", files[i], error);
+            break;
+        }
+    }
+
+    if (i == 2) {
+        afcsnap_t a = snaps[0], b = snaps[1];
+        const char *root = afcsnap_root(b);
+        const char *sep = (root[0] && root[strlen(root)-1] == '/')? "" : "/";
+
+        int r = afcsnap_diff(a, b, ^int(char what, const afcsnap_entry_t *ea, const afcsnap_entry_t *eb) {
+            fprintf(OUTF, "%c\t%s%s%s\n", what, root, sep, (eb)? afcsnap_path(b, eb) : afcsnap_path(a, ea));
+            return 0;
+        });
+
+        if (r == 0)
+            ret = EXIT_SUCCESS;
+        else
+            fprintf(ERRF, "Error: entries out of order in %s or %s\n", files[0], files[1]);
+    }
+
+    for (i=0; i<2; i++) {
+        afcsnap_close(snaps[i]);
+        free(files[i]);
+    }
+    return ret;
+}
+
+int do_bench(afcproto_client_t afc, int argc, char **argv)
+{
+    uint64_t size = BENCH_DEFAULT_SIZE;
+    int files = BENCH_DEFAULT_FILES;
+    char *dir = NULL;
+
+    for (argc--, argv++; argc > 0; argc--, argv++) {
+        if (!strcmp(argv[0], "--size") && argc > 1) {
+            if ((size = parse_size(argv[1])) == 0) {
+                fprintf(ERRF, "Error: invalid bench size: %s\n", argv[1]);
+                return EXIT_FAILURE;
+            }
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "--files") && argc > 1) {
+            if ((files = atoi(argv[1])) < 1) {
+                fprintf(ERRF, "Error: invalid number of bench files: %s\n", argv[1]);
+                return EXIT_FAILURE;
+            }
+            argc--, argv++;
+        } else if (argv[0][0] != '-' && argc == 1) {
+            dir = argv[0];
+        } else {
+            fprintf(ERRF, "Error: invalid arguments for bench command.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    char *tmp = NULL;
+    if (!dir && asprintf(&tmp, "afcclient-bench.%d", (int)getpid()) > 0)
+        dir = tmp;
+
+    int ret = (dir)? run_bench(afc, dir, size, files) : EXIT_FAILURE;
+    free(tmp);
+    return ret;
+}
+
+// "mount" serves the device as a local filesystem until it is unmounted.
+// It takes connections from the pool as it needs them, so -j sets how
+// many requests it can have going at once.
+int do_mount(int argc, char **argv)
+{
+    uint64_t cache_size = AFCFS_DEFAULT_CACHE_SIZE;
+    int ttl = AFCFS_DEFAULT_TTL;
+    char *mountpoint = NULL, *dir = "/";
+    int nopts = 0;
+
+    char **opts = calloc(argc, sizeof(char*));
+    if (!opts) {
+        fprintf(ERRF, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (argc--, argv++; argc > 0; argc--, argv++) {
+        if (!strcmp(argv[0], "--cache-size") && argc > 1) {
+            if ((cache_size = parse_size(argv[1])) == 0) {
+                fprintf(ERRF, "Error: invalid cache size: %s\n", argv[1]);
+                free(opts);
+                return EXIT_FAILURE;
+            }
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "--ttl") && argc > 1) {
+            if ((ttl = atoi(argv[1])) < 0) {
+                fprintf(ERRF, "Error: invalid ttl: %s\n", argv[1]);
+                free(opts);
+                return EXIT_FAILURE;
+            }
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "-o") && argc > 1) {
+            opts[nopts++] = argv[0];
+            opts[nopts++] = argv[1];
+            argc--, argv++;
+        } else if (argv[0][0] != '-' && !mountpoint) {
+            mountpoint = argv[0];
+        } else if (argv[0][0] != '-' && argc == 1) {
+            dir = argv[0];
+        } else {
+            mountpoint = NULL;
+            break;
+        }
+    }
+
+    if (!mountpoint) {
+        fprintf(ERRF, "Error: invalid arguments for mount command.\n");
+        free(opts);
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_FAILURE;
+    char *fsname = NULL;
+    afcfs_t fs = afcfs_new(pool, dir, (size_t)cache_size, ttl);
+    if (!fs || asprintf(&fsname, "afc:%s", (cmd_device)? cmd_device : "local") < 0) {
+        fprintf(ERRF, "Error: out of memory\n");
+        fsname = NULL;
+    } else {
+        struct stat st;
+        int err = afcfs_getattr(fs, "/", &st);
+        if (!err && !S_ISDIR(st.st_mode))
+            err = -ENOTDIR;
+
+        if (err) {
+            fprintf(ERRF, "Error: cannot mount %s - %s\n", dir, strerror(-err));
+        } else {
+            if (idev_verbose)
+                fprintf(ERRF, "[debug] mounting %s on %s (cache %lluMB, ttl %ds)\n", dir, mountpoint, (unsigned long long)(cache_size >> 20), ttl);
+            ret = afcfs_mount(fs, mountpoint, fsname, nopts, opts);
+        }
+    }
+
+    afcfs_free(fs);
+    free(fsname);
+    free(opts);
+    return ret;
+}
+
+int cmd_main(afcproto_client_t afc, int argc, char **argv)
+{
+        int ret=0;
+
+        char *cmd = argv[0];
+
+        if (!strcmp(cmd, "devinfo") || !strcmp(cmd, "deviceinfo")) {
+            if (argc == 1) {
+                ret = dump_afc_device_info(afc);
+            } else {
+                fprintf(ERRF, "Error: unexpected extra arguments for devinfo\n");
+                usage(ERRF);
+                ret=EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(cmd, "info")) {
+            ret = do_info(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "ls") || !strcmp(cmd, "list")) {
+            ret = do_list(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "mkdir")) {
+            ret = do_mkdir(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "rm") || !strcmp(cmd, "remove")) {
+            ret = do_rm(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "rename")) {
+            ret = do_rename(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "link") || !strcmp(cmd, "hardlink")) {
+            ret = do_link(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "symlink")) {
+            ret = do_symlink(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "cat")) {
+            ret = do_cat(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "tar")) {
+            ret = do_tar(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "untar")) {
+            ret = do_untar(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "get")) {
+            ret = do_get(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "put")) {
+            ret = do_put(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "sync")) {
+            ret = do_sync(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "du")) {
+            ret = do_du(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "find")) {
+            ret = do_find(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "snapshot")) {
+            ret = do_snapshot(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "diff")) {
+            ret = do_diff(argc, argv);
+        }
+        else if (!strcmp(cmd, "bench")) {
+            ret = do_bench(afc, argc, argv);
+        }
+        else if (!strcmp(cmd, "mount")) {
+            fprintf(ERRF, "Error: mount can't be run from a batch or through a server\n");
+            ret = EXIT_FAILURE;
+        }
+        else {
+            fprintf(ERRF, "Error: unknown command: %s\n", cmd);
+            usage(ERRF);
+            ret = EXIT_FAILURE;
+        }
+
+        return ret;
+}
+
+#pragma mark - Batch mode
+
+#define BATCH_MAX_ARGS 256
+
+// Splits a command line into words, in place. Words may be quoted with '...'
+// or "..." and a backslash escapes the next character. Returns the number of
+// words or -1 on an unterminated quote or too many words.
+int split_command_line(char *line, char **argv, int max)
+{
+    int argc=0;
+    char *in=line, *out=line;
+
+    while (*in) {
+        while (*in == ' ' || *in == '\t')
+            in++;
+
+        if (!*in)
+            break;
+
+        if (argc == max)
+            return -1;
+
+        argv[argc++] = out;
+
+        char quote = 0;
+        while (*in && (quote || (*in != ' ' && *in != '\t'))) {
+            if (quote && *in == quote) {
+                quote = 0;
+                in++;
+            } else if (!quote && (*in == '\'' || *in == '"')) {
+                quote = *in++;
+            } else if (*in == '\\' && in[1] && quote != '\'') {
+                in++;
+                *out++ = *in++;
+            } else {
+                *out++ = *in++;
+            }
+        }
+
+        if (quote)
+            return -1;
+
+        if (*in)
+            in++;
+        *out++ = '\0';
+    }
+
+    return argc;
+}
+
+// Runs one command per line from path (or stdin for "-") on the same
+// connection. Blank lines and lines starting with '#' are skipped.
+int run_batch(afcproto_client_t afc, const char *path)
+{
+    FILE *inf = (!strcmp(path, "-"))? stdin : fopen(path, "r");
+    if (!inf) {
+        fprintf(ERRF, "Error opening batch file: %s - %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    char *line=NULL;
+    size_t cap=0;
+    ssize_t len;
+    int lineno=0, ncmds=0, nfailed=0;
+
+    while ((len = getline(&line, &cap, inf)) != -1) {
+        lineno++;
+
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = '\0';
+
+        char *cmdline = line + strspn(line, " \t");
+        if (!*cmdline || *cmdline == '#')
+            continue;
+
+        char *orig = strdup(cmdline);
+        char *argv[BATCH_MAX_ARGS];
+        int argc = split_command_line(cmdline, argv, BATCH_MAX_ARGS);
+        int ret;
+
+        if (argc < 0) {
+            fprintf(ERRF, "Error: could not parse command line\n");
+            ret = EXIT_FAILURE;
+        } else if (argc == 0) {
+            free(orig);
+            continue;
+        } else {
+            ret = cmd_main(afc, argc, argv);
+        }
+        fflush(OUTF);
+
+        ncmds++;
+        if (ret != EXIT_SUCCESS)
+            nfailed++;
+
+        fprintf(ERRF, "%s:%d: %s: %s\n", path, lineno, (ret == EXIT_SUCCESS)? "ok" : "FAILED", orig);
+        free(orig);
+
+        if (afcproto_client_is_broken(afc)) {
+            fprintf(ERRF, "Error: connection lost - stopping batch at %s:%d\n", path, lineno);
+            break;
+        }
+
+        if (ret != EXIT_SUCCESS && stop_on_error)
+            break;
+    }
+
+    free(line);
+    if (inf != stdin)
+        fclose(inf);
+
+    fprintf(ERRF, "%s: %d commands, %d failed\n", path, ncmds, nfailed);
+
+    return (nfailed)? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+#pragma mark - Command server
+
+// "afcclient serve" keeps lockdown sessions and connection pools warm and
+// runs commands sent to it by other afcclient processes over a UNIX socket,
+// so that each command skips the device lookup and handshake.
+//
+// Request: a big-endian 32 bit length, followed by NUL terminated
+// "key=value" strings. Keys are udid, service, appid, appdir, cwd and arg
+// (once per command argument).
+//
+// Reply: frames of a channel byte and a big-endian 32 bit length, followed by
+// that many bytes. The last frame is SERVE_CHAN_EXIT with the exit status.
+
+#define SERVE_CHAN_STDOUT   1
+#define SERVE_CHAN_STDERR   2
+#define SERVE_CHAN_EXIT     3
+#define SERVE_MAX_REQUEST   (64*1024)
+#define SERVE_MAX_ARGS      256
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int serve_socket_address(const char *path, struct sockaddr_un *sun)
+{
+    memset(sun, 0, sizeof(struct sockaddr_un));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+typedef struct serve_conn {
+    int fd;
+    pthread_mutex_t lock; // stdout and stderr frames share the socket
+} serve_conn_t;
+
+typedef struct serve_stream {
+    serve_conn_t *conn;
+    uint8_t chan;
+} serve_stream_t;
+
+static int serve_send_frame(serve_conn_t *conn, uint8_t chan, const char *buf, uint32_t len)
+{
+    char hdr[5];
+    uint32_t belen = htonl(len);
+    int ret;
+
+    hdr[0] = chan;
+    memcpy(hdr+1, &belen, 4);
+
+    pthread_mutex_lock(&conn->lock);
+    ret = (write_all(conn->fd, hdr, sizeof(hdr)) == 0 && write_all(conn->fd, buf, len) == 0)? 0 : -1;
+    pthread_mutex_unlock(&conn->lock);
+
+    return ret;
+}
+
+#ifdef __APPLE__
+static int serve_stream_write(void *cookie, const char *buf, int len)
+#else
+static ssize_t serve_stream_write(void *cookie, const char *buf, size_t len)
+#endif
+{
+    serve_stream_t *s = cookie;
+    return (serve_send_frame(s->conn, s->chan, buf, len) == 0)? len : -1;
+}
+
+static FILE *serve_stream_open(serve_stream_t *s)
+{
+#ifdef __APPLE__
+    return funopen(s, NULL, serve_stream_write, NULL, NULL);
+#else
+    cookie_io_functions_t io = { NULL, serve_stream_write, NULL, NULL };
+    return fopencookie(s, "w", io);
+#endif
+}
+
+// one warm lockdown session per device, with a pool per service or app
+typedef struct serve_target {
+    char *svcname;
+    char *appid;
+    char *appdir;
+    idev_afc_pool_t pool;
+    afccache_t cache;
+    struct serve_target *next;
+} serve_target_t;
+
+typedef struct serve_session {
+    char *udid; // NULL for the first device found
+    idevice_t idev;
+    lockdownd_client_t client;
+    serve_target_t *targets;
+    int refs;
+    bool dead;
+    struct serve_session *next;
+} serve_session_t;
+
+static pthread_mutex_t serve_lock = PTHREAD_MUTEX_INITIALIZER;
+static serve_session_t *serve_sessions = NULL;
+
+// with -C the server talks to a plain AFC server instead of devices
+static char *serve_address = NULL;
+static const char *serve_socket_path = NULL;
+
+static bool str_eq(const char *a, const char *b)
+{
+    return (a && b)? !strcmp(a, b) : (a == b);
+}
+
+static void serve_session_free(serve_session_t *sess)
+{
+    serve_target_t *t, *next;
+
+    for (t = sess->targets; t; t = next) {
+        next = t->next;
+        afccache_close(t->cache);
+        idev_afc_pool_free(t->pool);
+        free(t->svcname);
+        free(t->appid);
+        free(t->appdir);
+        free(t);
+    }
+    idev_lockdownd_close(sess->idev, sess->client);
+    free(sess->udid);
+    free(sess);
+}
+
+// Finds or opens the session for udid, and the pool for the requested
+// service or app within it. Takes a reference on the session.
+// note: called with serve_lock held
+static serve_session_t *serve_session_get(char *udid, char *svcname, char *appid, char *appdir, serve_target_t **target_out)
+{
+    serve_session_t *sess;
+    serve_target_t *t;
+
+    if (serve_address)
+        udid = svcname = appid = appdir = NULL;
+
+    for (sess = serve_sessions; sess; sess = sess->next) {
+        if (str_eq(sess->udid, udid))
+            break;
+    }
+
+    if (!sess) {
+        if ((sess = calloc(1, sizeof(serve_session_t))) == NULL)
+            return NULL;
+
+        sess->udid = (udid)? strdup(udid) : NULL;
+        if (!serve_address && idev_lockdownd_open(progname, sess->udid, &sess->idev, &sess->client) != EXIT_SUCCESS) {
+            free(sess->udid);
+            free(sess);
+            return NULL;
+        }
+        sess->next = serve_sessions;
+        serve_sessions = sess;
+
+        if (idev_verbose)
+            fprintf(stderr, "[debug] opened session for %s\n", (udid)? udid : "default device");
+    }
+
+    for (t = sess->targets; t; t = t->next) {
+        if (str_eq(t->svcname, svcname) && str_eq(t->appid, appid) && str_eq(t->appdir, appdir))
+            break;
+    }
+
+    if (!t) {
+        if ((t = calloc(1, sizeof(serve_target_t))) == NULL)
+            return NULL;
+
+        if (serve_address)
+            t->pool = idev_afc_pool_new_address(serve_address, jobs);
+        else
+            t->pool = idev_afc_pool_new(sess->idev, sess->client, svcname, appid, appdir, jobs);
+
+        if (!t->pool) {
+            free(t);
+            return NULL;
+        }
+        if (cache_ttl >= 0)
+            t->cache = open_cache(t->pool, serve_address, udid, svcname, appid, appdir);
+
+        t->svcname = (svcname)? strdup(svcname) : NULL;
+        t->appid = (appid)? strdup(appid) : NULL;
+        t->appdir = (appdir)? strdup(appdir) : NULL;
+        t->next = sess->targets;
+        sess->targets = t;
+    }
+
+    sess->refs++;
+    *target_out = t;
+    return sess;
+}
+
+// Drops a reference, and with kill also forgets the session so that the next
+// request opens a fresh one. It's freed once the last user is done with it.
+// note: called with serve_lock held
+static void serve_session_put(serve_session_t *sess, bool kill)
+{
+    if (kill && !sess->dead) {
+        serve_session_t **pp;
+        for (pp = &serve_sessions; *pp; pp = &(*pp)->next) {
+            if (*pp == sess) {
+                *pp = sess->next;
+                break;
+            }
+        }
+        sess->dead = true;
+    }
+
+    if (--sess->refs == 0 && sess->dead)
+        serve_session_free(sess);
+}
+
+static int serve_run(char *udid, char *svcname, char *appid, char *appdir, int argc, char **argv)
+{
+    int ret=EXIT_FAILURE, attempt;
+    serve_session_t *sess=NULL;
+    serve_target_t *t=NULL;
+    afcproto_client_t afc=NULL;
+
+    // A failed checkout usually means that the device went away or that the
+    // lockdown session expired, so retry once on a fresh session.
+    for (attempt=0; attempt<2; attempt++) {
+        pthread_mutex_lock(&serve_lock);
+        sess = serve_session_get(udid, svcname, appid, appdir, &t);
+        pthread_mutex_unlock(&serve_lock);
+
+        if (!sess || (afc = idev_afc_pool_checkout(t->pool)) != NULL)
+            break;
+
+        pthread_mutex_lock(&serve_lock);
+        serve_session_put(sess, true);
+        pthread_mutex_unlock(&serve_lock);
+        sess = NULL;
+    }
+
+    if (afc) {
+        pool = t->pool;
+        cmd_cache = t->cache;
+        ret = cmd_main(afc, argc, argv);
+        idev_afc_pool_checkin(t->pool, afc);
+        afccache_save(t->cache);
+        pool = NULL;
+        cmd_cache = NULL;
+    } else {
+        fprintf(ERRF, "Error: could not open an AFC connection for %s\n", (udid)? udid : "the default device");
+    }
+
+    if (sess) {
+        pthread_mutex_lock(&serve_lock);
+        serve_session_put(sess, false);
+        pthread_mutex_unlock(&serve_lock);
+    }
+
+    return ret;
+}
+
+static void *serve_connection(void *arg)
+{
+    serve_conn_t conn = { .fd = (int)(intptr_t)arg };
+    serve_stream_t out = { &conn, SERVE_CHAN_STDOUT }, err = { &conn, SERVE_CHAN_STDERR };
+    char *udid=NULL, *svcname=AFC_SERVICE_NAME, *appid=NULL, *appdir=NULL;
+    char *argv[SERVE_MAX_ARGS];
+    char *req=NULL;
+    uint32_t len=0;
+    int argc=0, ret=EXIT_FAILURE;
+
+    pthread_mutex_init(&conn.lock, NULL);
+
+    if (read_all(conn.fd, (char *)&len, sizeof(len)) == 0
+            && (len = ntohl(len)) > 0 && len <= SERVE_MAX_REQUEST
+            && (req = calloc(1, len+1)) != NULL
+            && read_all(conn.fd, req, len) == 0
+            && (cmd_out = serve_stream_open(&out)) != NULL
+            && (cmd_err = serve_stream_open(&err)) != NULL)
+    {
+        char *p = req, *end = req+len;
+        while (p < end && *p) {
+            size_t n = strlen(p);
+            char *val = strchr(p, '=');
+            if (val) {
+                *val++ = '\0';
+                if (!strcmp(p, "arg") && argc < SERVE_MAX_ARGS)
+                    argv[argc++] = val;
+                else if (!strcmp(p, "udid"))
+                    udid = val;
+                else if (!strcmp(p, "service"))
+                    svcname = val;
+                else if (!strcmp(p, "appid"))
+                    appid = val;
+                else if (!strcmp(p, "appdir"))
+                    appdir = val;
+                else if (!strcmp(p, "cwd"))
+                    cmd_cwd = val;
+            }
+            p += n+1;
+        }
+
+        setvbuf(cmd_out, NULL, _IOFBF, CHUNK_START);
+
+        if (idev_verbose)
+            fprintf(stderr, "[debug] serving command: %s (%d args)\n", (argc)? argv[0] : "-", argc);
+
+        if (argc < 1)
+            fprintf(ERRF, "Missing command argument\n");
+        else
+            ret = serve_run(udid, svcname, appid, appdir, argc, argv);
+
+    } else if (idev_verbose) {
+        // also seen when a starting server checks whether one is running
+        fprintf(stderr, "[debug] dropping incomplete request\n");
+    }
+
+    if (cmd_out)
+        fclose(cmd_out);
+    if (cmd_err)
+        fclose(cmd_err);
+    cmd_out = cmd_err = NULL;
+    cmd_cwd = NULL;
+
+    uint32_t status = htonl(ret);
+    serve_send_frame(&conn, SERVE_CHAN_EXIT, (char *)&status, sizeof(status));
+
+    close(conn.fd);
+    pthread_mutex_destroy(&conn.lock);
+    free(req);
+
+    return NULL;
+}
+
+static void serve_stop(int sig)
+{
+    unlink(serve_socket_path);
+    _exit(EXIT_SUCCESS);
+}
+
+int serve_main(const char *path)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if (serve_socket_address(path, &sun) != 0)
+        return EXIT_FAILURE;
+
+    // don't take over the socket of a server that's still running
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0) {
+        if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+            fprintf(stderr, "Error: a server is already listening on %s\n", path);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        close(fd);
+    }
+    unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "Error: could not create socket: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // only the owner may send commands
+    mode_t mask = umask(077);
+    int err = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+    umask(mask);
+
+    if (err != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: could not listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return EXIT_FAILURE;
     }
 
-    return ret;
-}
+    serve_socket_path = path;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, serve_stop);
+    signal(SIGTERM, serve_stop);
+
+    if (idev_verbose)
+        fprintf(stderr, "[debug] serving commands on %s\n", path);
+
+    for (;;) {
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, (void *)(intptr_t)cfd) == 0)
+            pthread_detach(thread);
+        else
+            close(cfd);
+    }
+
+    close(fd);
+    unlink(path);
+    return EXIT_FAILURE;
+}
+
+static void serve_request_field(FILE *f, const char *key, const char *val)
+{
+    if (val) {
+        fprintf(f, "%s=%s", key, val);
+        fputc('\0', f);
+    }
+}
+
+// Sends a command to a running server and relays its output. Returns the
+// command's exit status.
+int serve_client(const char *path, char *udid, char *svcname, char *appid, char *appdir, int argc, char **argv)
+{
+    struct sockaddr_un sun;
+    char cwd[PATH_MAX];
+    char *req=NULL, *buf=NULL;
+    size_t reqlen=0, bufsize=0;
+    int i, fd, ret=EXIT_FAILURE;
+
+    if (serve_socket_address(path, &sun) != 0)
+        return EXIT_FAILURE;
+
+    FILE *f = open_memstream(&req, &reqlen);
+    if (!f) {
+        fprintf(stderr, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    serve_request_field(f, "udid", udid);
+    serve_request_field(f, "service", svcname);
+    serve_request_field(f, "appid", appid);
+    serve_request_field(f, "appdir", appdir);
+    serve_request_field(f, "cwd", getcwd(cwd, sizeof(cwd)));
+    for (i=0; i<argc; i++)
+        serve_request_field(f, "arg", argv[i]);
+    fputc('\0', f);
+    fclose(f);
+
+    if (reqlen > SERVE_MAX_REQUEST) {
+        fprintf(stderr, "Error: command line too long for the server\n");
+        free(req);
+        return EXIT_FAILURE;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        fprintf(stderr, "Error: could not connect to server at %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        free(req);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t belen = htonl(reqlen);
+    if (write_all(fd, (char *)&belen, sizeof(belen)) != 0 || write_all(fd, req, reqlen) != 0) {
+        fprintf(stderr, "Error: could not send command to server: %s\n", strerror(errno));
+        close(fd);
+        free(req);
+        return EXIT_FAILURE;
+    }
+    free(req);
+
+    for (;;) {
+        char hdr[5];
+        uint32_t len;
+
+        if (read_all(fd, hdr, sizeof(hdr)) != 0) {
+            fprintf(stderr, "Error: lost connection to server\n");
+            break;
+        }
+        memcpy(&len, hdr+1, 4);
+        len = ntohl(len);
+
+        if (len > bufsize) {
+            char *nbuf = realloc(buf, len);
+            if (!nbuf) {
+                fprintf(stderr, "Error: out of memory\n");
+                break;
+            }
+            buf = nbuf;
+            bufsize = len;
+        }
 
-int do_list(afc_client_t afc, int argc, char **argv)
-{
-    int i, ret = EXIT_SUCCESS;
+        if (read_all(fd, buf, len) != 0) {
+            fprintf(stderr, "Error: lost connection to server\n");
+            break;
+        }
 
-    if (argc > 1) {
-        for (i=1; i<argc ; i++) {
-            ret |= dump_afc_list_path(afc, argv[i]);
+        if (hdr[0] == SERVE_CHAN_STDOUT) {
+            fwrite(buf, 1, len, stdout);
+        } else if (hdr[0] == SERVE_CHAN_STDERR) {
+            fflush(stdout);
+            fwrite(buf, 1, len, stderr);
+        } else if (hdr[0] == SERVE_CHAN_EXIT && len == sizeof(uint32_t)) {
+            uint32_t status;
+            memcpy(&status, buf, sizeof(status));
+            ret = ntohl(status);
+            break;
         }
-    } else {
-        ret = dump_afc_list_path(afc, "");
     }
 
+    close(fd);
+    free(buf);
+
     return ret;
 }
 
 
-int do_mkdir(afc_client_t afc, int argc, char **argv)
+#pragma mark - Multiple devices
+
+// With several -u options or --all-devices the command runs against each
+// device in its own thread, up to --device-jobs at a time. Every line a
+// command prints is prefixed with its device's udid.
+
+static pthread_mutex_t prefix_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct prefix_stream {
+    const char *prefix;
+    FILE *dest;
+    char *line;
+    size_t len;
+    size_t cap;
+} prefix_stream_t;
+
+// lines from different devices may interleave, but never mix
+static void prefix_stream_emit(prefix_stream_t *s)
 {
-    int i, ret=EXIT_SUCCESS;
-    if (argc > 1) {
-        for (i=1; i<argc ; i++) {
-            afc_error_t err = afc_make_directory(afc, argv[i]);
+    pthread_mutex_lock(&prefix_lock);
+    fprintf(s->dest, "%s: %.*s", s->prefix, (int)s->len, s->line);
+    fflush(s->dest);
+    pthread_mutex_unlock(&prefix_lock);
+    s->len = 0;
+}
 
-            if (err == AFC_E_SUCCESS) {
-                printf("Created directory: %s\n", argv[i]);
-            } else {
-                fprintf(stderr, "Error: mkdir error: %s\n", idev_afc_strerror(err));
-                ret = EXIT_FAILURE;
-            }
-        }
-    } else {
-        fprintf(stderr, "Error: you must specify at least one directory path.\n");
-        ret = EXIT_FAILURE;
+static int prefix_stream_append(prefix_stream_t *s, const char *buf, size_t len)
+{
+    if (s->len + len > s->cap) {
+        size_t cap = (s->len + len) * 2;
+        char *line = realloc(s->line, cap);
+        if (!line)
+            return -1;
+        s->line = line;
+        s->cap = cap;
     }
-
-    return ret;
+    memcpy(s->line + s->len, buf, len);
+    s->len += len;
+    return 0;
 }
 
-int do_rm(afc_client_t afc, int argc, char **argv)
+#ifdef __APPLE__
+static int prefix_stream_write(void *cookie, const char *buf, int len)
+#else
+static ssize_t prefix_stream_write(void *cookie, const char *buf, size_t len)
+#endif
 {
-    int i, ret=EXIT_SUCCESS;
-    if (argc > 1) {
-        for (i=1; i<argc ; i++) {
-            afc_error_t err = afc_remove_path(afc, argv[i]);
+    prefix_stream_t *s = cookie;
+    const char *p = buf, *end = buf + len, *nl;
 
-            if (err == AFC_E_SUCCESS) {
-                printf("Removed: %s\n", argv[i]);
-            } else {
-                fprintf(stderr, "Error: mkdir error: %s\n", idev_afc_strerror(err));
-                ret = EXIT_FAILURE;
-            }
-        }
-    } else {
-        fprintf(stderr, "Error: you must specify at least one path to remove.\n");
-        ret = EXIT_FAILURE;
+    while (p < end) {
+        nl = memchr(p, '\n', end - p);
+        size_t n = (nl)? (size_t)(nl - p) + 1 : (size_t)(end - p);
+        if (prefix_stream_append(s, p, n) != 0)
+            return -1;
+        if (nl)
+            prefix_stream_emit(s);
+        p += n;
     }
-
-    return ret;
+    return len;
 }
 
-int do_rename(afc_client_t afc, int argc, char **argv)
+static int prefix_stream_close(void *cookie)
 {
-    int ret = EXIT_FAILURE;
-
-    if (argc == 3) {
-        afc_error_t err = afc_rename_path(afc, argv[1], argv[2]);
+    prefix_stream_t *s = cookie;
 
-        if (err == AFC_E_SUCCESS) {
-            printf("Renamed %s to %s\n", argv[1], argv[2]);
-            ret = EXIT_SUCCESS;
-        } else {
-            fprintf(stderr, "Error: rename %s to %s - %s\n", argv[1], argv[2], idev_afc_strerror(err));
-        }
+    // finish off a last line without a newline
+    if (s->len && prefix_stream_append(s, "\n", 1) == 0)
+        prefix_stream_emit(s);
 
-    } else {
-        fprintf(stderr, "Error: invalid number of arguments for rename.\n");
-    }
+    free(s->line);
+    s->line = NULL;
+    return 0;
+}
 
-    return ret;
+static FILE *prefix_stream_open(prefix_stream_t *s)
+{
+    FILE *f;
+#ifdef __APPLE__
+    f = funopen(s, NULL, prefix_stream_write, NULL, prefix_stream_close);
+#else
+    cookie_io_functions_t io = { NULL, prefix_stream_write, NULL, prefix_stream_close };
+    f = fopencookie(s, "w", io);
+#endif
+    if (f)
+        setvbuf(f, NULL, _IOLBF, 0);
+    return f;
 }
 
-int do_link(afc_client_t afc, int argc, char **argv)
+typedef struct device_fanout {
+    char **udids;
+    int *status;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+    int(^run)(char *udid);
+} device_fanout_t;
+
+static void *device_worker_main(void *arg)
 {
-    int ret=EXIT_FAILURE;
+    device_fanout_t *f = arg;
 
-    if (argc == 3) {
-        afc_error_t err = afc_make_link(afc, AFC_HARDLINK, argv[1], argv[2]);
+    while (true) {
+        pthread_mutex_lock(&f->lock);
+        int i = (f->next < f->count)? f->next++ : -1;
+        pthread_mutex_unlock(&f->lock);
 
-        if (err == AFC_E_SUCCESS) {
-            printf("Created hard-link %s -> %s\n", argv[2], argv[1]);
-            ret = EXIT_SUCCESS;
-        } else {
-            fprintf(stderr, "Error: link %s -> %s - %s\n", argv[2], argv[1], idev_afc_strerror(err));
-        }
+        if (i < 0)
+            break;
 
-    } else {
-        fprintf(stderr, "Error: invalid number of arguments for link command.\n");
-    }
+        prefix_stream_t out = { .prefix = f->udids[i], .dest = stdout };
+        prefix_stream_t err = { .prefix = f->udids[i], .dest = stderr };
+        cmd_out = prefix_stream_open(&out);
+        cmd_err = prefix_stream_open(&err);
 
-    return ret;
+        f->status[i] = f->run(f->udids[i]);
+
+        if (cmd_out)
+            fclose(cmd_out);
+        if (cmd_err)
+            fclose(cmd_err);
+        cmd_out = cmd_err = NULL;
+    }
+    return NULL;
 }
 
-int do_symlink(afc_client_t afc, int argc, char **argv)
+// Runs run() once per udid over up to device_jobs threads, then prints a
+// status line per device. Fails if any of them failed.
+int run_on_devices(char **udids, int count, int(^run)(char *udid))
 {
-    int ret=EXIT_FAILURE;
+    int i, nfailed=0, nthreads = (count < device_jobs)? count : device_jobs;
 
-    if (argc == 3) {
-        afc_error_t err = afc_make_link(afc, AFC_SYMLINK, argv[1], argv[2]);
+    device_fanout_t f = { .udids = udids, .count = count, .run = run };
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    f.status = calloc(count, sizeof(int));
+    if (!threads || !f.status) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(threads);
+        free(f.status);
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&f.lock, NULL);
 
-        if (err == AFC_E_SUCCESS) {
-            printf("Created symbolic-link %s -> %s\n", argv[2], argv[1]);
-            ret = EXIT_SUCCESS;
-        } else {
-            fprintf(stderr, "Error: link %s -> %s - %s\n", argv[2], argv[1], idev_afc_strerror(err));
-        }
+    if (idev_verbose)
+        fprintf(stderr, "[debug] running on %d devices, %d at a time\n", count, nthreads);
 
-    } else {
-        fprintf(stderr, "Error: invalid number of arguments for link command.\n");
+    for (i=0; i<nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, device_worker_main, &f) != 0)
+            break;
     }
+    nthreads = i;
 
-    return ret;
-}
+    // if no thread could be started, do it all here
+    if (nthreads == 0)
+        device_worker_main(&f);
 
-int do_cat(afc_client_t afc, int argc, char **argv)
-{
-    int ret=EXIT_FAILURE;
+    for (i=0; i<nthreads; i++)
+        pthread_join(threads[i], NULL);
 
-    if (argc == 2) {
-        ret = dump_afc_path(afc, argv[1], stdout);
-    } else {
-        fprintf(stderr, "Error: invalid number of arguments for cat command.\n");
+    for (i=0; i<count; i++) {
+        if (f.status[i] != EXIT_SUCCESS)
+            nfailed++;
+        fprintf(stderr, "%s: %s\n", udids[i], (f.status[i] == EXIT_SUCCESS)? "ok" : "FAILED");
     }
+    fprintf(stderr, "%d devices, %d failed\n", count, nfailed);
 
-    return ret;
+    pthread_mutex_destroy(&f.lock);
+    free(threads);
+    free(f.status);
+
+    return (nfailed)? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-int do_get(afc_client_t afc, int argc, char **argv)
+// adds udid to the list unless it's already there
+static int add_udid(char ***udids, int *count, const char *udid)
 {
-    int ret=EXIT_FAILURE;
-
-    if (argc == 2) {
-        ret = get_afc_path(afc, argv[1], basename(argv[1]));
-    } else if (argc == 3) {
-        char *dst = argv[2];
-        char dpath[PATH_MAX];
-        if (is_dir(dst)) {
-            snprintf(dpath, PATH_MAX-1, "%s/%s", dst, basename(argv[1]));
-            dst = dpath;
-        }
-        ret = get_afc_path(afc, argv[1], dpath);
-    } else {
-        fprintf(stderr, "Error: invalid number of arguments for get command.\n");
+    int i;
+    for (i=0; i<*count; i++) {
+        if (!strcmp((*udids)[i], udid))
+            return EXIT_SUCCESS;
     }
 
-    return ret;
+    char **l = realloc(*udids, (*count + 2) * sizeof(char*));
+    if (!l || (l[*count] = strdup(udid)) == NULL) {
+        if (l)
+            *udids = l;
+        fprintf(stderr, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    l[++(*count)] = NULL;
+    *udids = l;
+    return EXIT_SUCCESS;
 }
 
-int do_put(afc_client_t afc, int argc, char **argv)
+// adds every attached device to the list
+static int add_all_devices(char ***udids, int *count)
 {
-    int ret=EXIT_FAILURE;
+    char **devices=NULL;
+    int i, ndevices=0, ret=EXIT_SUCCESS;
 
-    if (argc == 2) {
-        ret = put_afc_path(afc, argv[1], basename(argv[1]));
-    } else if (argc == 3) {
-        ret = put_afc_path(afc, argv[1], argv[2]);
-    } else {
-        fprintf(stderr, "Error: invalid number of arguments for put command.\n");
+    idevice_error_t ierr = idevice_get_device_list(&devices, &ndevices);
+    if (ierr != IDEVICE_E_SUCCESS) {
+        fprintf(stderr, "Error: Cannot list devices: %s\n", idev_idevice_strerror(ierr));
+        return EXIT_FAILURE;
     }
 
-    return ret;
-}
-
-
+    if (ndevices == 0) {
+        fprintf(stderr, "Error: No device found -- Is it plugged in?\n");
+        ret = EXIT_FAILURE;
+    }
 
-int cmd_main(afc_client_t afc, int argc, char **argv)
-{
-        int ret=0;
+    // a device attached over both USB and the network is listed twice
+    for (i=0; i<ndevices && ret == EXIT_SUCCESS; i++)
+        ret = add_udid(udids, count, devices[i]);
 
-        char *cmd = argv[0];
+    idevice_device_list_free(devices);
+    return ret;
+}
 
-        if (!strcmp(cmd, "devinfo") || !strcmp(cmd, "deviceinfo")) {
-            if (argc == 1) {
-                ret = dump_afc_device_info(afc);
-            } else {
-                fprintf(stderr, "Error: unexpected extra arguments for devinfo\n");
-                usage(stderr);
-                ret=EXIT_FAILURE;
-            }
-        }
-        else if (!strcmp(cmd, "info")) {
-            ret = do_info(afc, argc, argv);
-        }
-        else if (!strcmp(cmd, "ls") || !strcmp(cmd, "list")) {
-            ret = do_list(afc, argc, argv);
-        }
-        else if (!strcmp(cmd, "mkdir")) {
-            ret = do_mkdir(afc, argc, argv);
-        }
-        else if (!strcmp(cmd, "rm") || !strcmp(cmd, "remove")) {
-            ret = do_rm(afc, argc, argv);
-        }
-        else if (!strcmp(cmd, "rename")) {
-            ret = do_rename(afc, argc, argv);
-        }
-        else if (!strcmp(cmd, "link") || !strcmp(cmd, "hardlink")) {
-            ret = do_link(afc, argc, argv);
-        }
-        else if (!strcmp(cmd, "symlink")) {
-            ret = do_symlink(afc, argc, argv);
-        }
-        else if (!strcmp(cmd, "cat")) {
-            ret = do_cat(afc, argc, argv);
-        }
-        else if (!strcmp(cmd, "get")) {
-            ret = do_get(afc, argc, argv);
-        }
-        else if (!strcmp(cmd, "put")) {
-            ret = do_put(afc, argc, argv);
-        }
-        else {
-            fprintf(stderr, "Error: unknown command: %s\n", cmd);
-            usage(stderr);
-            ret = EXIT_FAILURE;
-        }
 
-        return ret;
-}
+#pragma mark - Main
 
-#define OPTION_FLAGS "rs:c:d:u:vh"
+#define OPTION_FLAGS "rs:c:d:u:C:P:k:j:b:ES:vh"
 void usage(FILE *outf)
 {
     fprintf(outf,
-        "Usage: %s [%s] command cmdargs...\n\n"
+        "Usage: %s [%s] command cmdargs...\n"
+        "       %s [%s] -b <file>\n"
+        "       %s [%s] serve --socket <path>\n\n"
         "  Options:\n"
         "    -r, --root                 Use the afc2 server if jailbroken (ignored with -c/-d)\n"
         "    -s, --service=NAME>        Use the specified lockdown service (ignored with -c/-d)\n"
 	"    -c, --container=<APP-ID>   Access dir for app-id (may not work on newer iOS vers)\n"
 	"    -d, --documents=<APP-ID>   Access doc dir for app-id (prefix paths with Documents/)\n"
-        "    -u, --uuid=<UDID>          Specify the device udid\n"
+        "    -u, --uuid=<UDID>          Specify the device udid (repeat to run on several devices)\n"
+        "        --all-devices          Run on every attached device\n"
+        "        --device-jobs=<N>      Number of devices worked on at once (default: %d)\n"
+        "    -C, --connect=<ADDR>       Talk to an AFC server at host:port or unix:<path> instead of a device\n"
+        "    -P, --pipeline=<N>         Number of read requests kept in flight (default: %d)\n"
+        "    -k, --chunk-size=<SIZE>    Use a fixed transfer chunk size, e.g. 256k (default: adaptive)\n"
+        "    -j, --jobs=<N>             Size of the connection pool for parallel commands (default: %d)\n"
+        "    -b, --batch=<FILE>         Run one command per line from FILE (- for stdin) over one session\n"
+        "    -E, --stop-on-error        Stop a batch at the first failing command (default: continue)\n"
+        "    -S, --socket=<PATH>        Run the command in the server listening on PATH (see serve)\n"
+        "        --cache[=SECONDS]      Cache file info and listings on disk for SECONDS (default: %d)\n"
+        "        --refresh              Ignore cached entries but update the cache (implies --cache)\n"
+        "        --no-cache             Don't use the cache, even if AFCCLIENT_CACHE is set\n"
+        "        --stats[=json]         Print AFC request counts and latencies per operation to stderr at exit\n"
+        "        --progress=json        Write get/put progress as JSON lines to stderr, or to --progress-fd\n"
+        "        --progress-fd=<FD>     File descriptor for --progress events (default: 2)\n"
         "    -v, --verbose              Enable verbose debug messages\n"
         "    -h, --help                 Display this help message\n\n"
 
         "  Where \"command\" and \"cmdargs...\" are as folows:\n"
         "    devinfo                    dump device info from AFC server\n"
         "    list <dir> [dir2...]       list remote directory contents\n"
+        "    ls --names-only [dir...]   list entry paths only, without fetching file info\n"
         "    info <path> [path2...]     dump remote file information\n"
         "    mkdir <path> [path2...]    create directory at path\n"
         "    rm <path> [path2...]       remove directory at path\n"
+        "    rm -r [--dry-run] <path>...  remove paths and everything below them over -j connections\n"
         "    rename <from> <to>         rename path 'from' to path 'to'\n"
         "    link <target> <link>       create a hard-link from 'link' to 'target'\n"
         "    symlink <target> <link>    create a symbolic-link from 'link' to 'target'\n"
         "    cat <path>                 cat contents of <path> to stdout\n"
+        "    tar <path> [path2...]      write a tar archive of remote files and directories to stdout\n"
+        "    untar [-f <archive>] <dir> unpack a tar archive from stdin (or archive) into dir\n"
         "    get <path> [localpath]     download a file (default: current dir)\n"
+        "    get -r <dir> [localdir]    download a directory tree over parallel connections\n"
         "    put <localpath> [path]     upload a file (default: remote top-level dir)\n"
-        , progname, OPTION_FLAGS);
+        "    put -r <localdir> [dir]    upload a directory tree over parallel connections\n"
+        "                               get/put --resume continue partial files where they left off,\n"
+        "                               --verify also compares the last 64KB before resuming\n"
+        "    sync <dir> <localdir>      copy new and changed files from the device (by size and mtime)\n"
+        "    sync --push <localdir> <dir>  copy new and changed files to the device\n"
+        "                               sync --delete removes what's gone from the source, -n only reports\n"
+        "    du [-s] [-h] [-b] [-d N] [path...]\n"
+        "                               print space used by each directory (1K blocks, -b bytes)\n"
+        "    find [path...] [-name GLOB] [-iname GLOB] [-type f|d|l] [-size [+-]N] [-mtime [+-]DAYS]\n"
+        "         [-mindepth N] [-maxdepth N] [-print0]\n"
+        "                               print paths matching every test, walking over -j connections\n"
+        "    snapshot <dir> -o <file>   write an index of everything below dir to a local file\n"
+        "    diff <file-a> <file-b>     list what was added (A), deleted (D), modified (M) or\n"
+        "                               changed type (T) between two snapshots\n"
+        "    bench [--size SIZE] [--files N] [dir]\n"
+        "                               time transfers and file ops in a scratch dir, print JSON\n"
+        "    mount [--cache-size SIZE] [--ttl SECONDS] [-o OPTS] <mountpoint> [dir]\n"
+        "                               serve dir (default: /) as a local filesystem until unmounted\n"
+        "    serve --socket <path>      keep device sessions open and run commands sent with -S\n"
+        , progname, OPTION_FLAGS, progname, OPTION_FLAGS, progname, OPTION_FLAGS, DEFAULT_DEVICE_JOBS, DEFAULT_PIPELINE, DEFAULT_JOBS, AFCCACHE_DEFAULT_TTL);
 }
 
 
+// long-only options
+enum {
+    OPT_CACHE = 256,
+    OPT_REFRESH,
+    OPT_NO_CACHE,
+    OPT_ALL_DEVICES,
+    OPT_DEVICE_JOBS,
+    OPT_STATS,
+    OPT_PROGRESS,
+    OPT_PROGRESS_FD,
+};
+
 static struct option longopts[] = {
     { "root",       no_argument,            NULL,   'r' },
     { "service",    required_argument,      NULL,   's' },
@@ -541,21 +6245,54 @@ static struct option longopts[] = {
     { "documents",  required_argument,      NULL,   'd' },
     { "appid",      required_argument,      NULL,   'a' },
     { "udid",       required_argument,      NULL,   'u' },
+    { "all-devices", no_argument,           NULL,   OPT_ALL_DEVICES },
+    { "device-jobs", required_argument,     NULL,   OPT_DEVICE_JOBS },
+    { "connect",    required_argument,      NULL,   'C' },
+    { "pipeline",   required_argument,      NULL,   'P' },
+    { "chunk-size", required_argument,      NULL,   'k' },
+    { "jobs",       required_argument,      NULL,   'j' },
+    { "batch",      required_argument,      NULL,   'b' },
+    { "stop-on-error", no_argument,         NULL,   'E' },
+    { "socket",     required_argument,      NULL,   'S' },
+    { "cache",      optional_argument,      NULL,   OPT_CACHE },
+    { "refresh",    no_argument,            NULL,   OPT_REFRESH },
+    { "no-cache",   no_argument,            NULL,   OPT_NO_CACHE },
+    { "stats",      optional_argument,      NULL,   OPT_STATS },
+    { "progress",   required_argument,      NULL,   OPT_PROGRESS },
+    { "progress-fd", required_argument,     NULL,   OPT_PROGRESS_FD },
     { "verbose",    no_argument,            NULL,   'v' },
     { "help",       no_argument,            NULL,   'h' },
     { NULL,         0,                      NULL,   0 }
 };
 
+static bool stats_json = false;
+
+static void print_stats(void)
+{
+    idev_stats_print(stderr, stats_json);
+}
+
 int main(int argc, char **argv)
 {
     progname = basename(argv[0]);
 
-    char *appid=NULL, *udid=NULL, *svcname=NULL, *appdir=NULL;
+    char *appid=NULL, *udid=NULL, *svcname=NULL, *appdir=NULL, *address=NULL, *batch=NULL, *socket_path=NULL;
 
     svcname = AFC_SERVICE_NAME;
 
+    char **udids=NULL;
+    int nudids=0;
+    bool all_devices = false;
+
+    bool no_cache = false, stats = false, progress = false;
+    int progress_fd = STDERR_FILENO;
+    char *cache_env = getenv("AFCCLIENT_CACHE");
+    if (cache_env && *cache_env)
+        cache_ttl = atoi(cache_env);
+
+    // stop at the command name so that command flags like "get -r" are left alone
     int flag;
-    while ((flag = getopt_long(argc, argv, OPTION_FLAGS, longopts, NULL)) != -1) {
+    while ((flag = getopt_long(argc, argv, "+" OPTION_FLAGS, longopts, NULL)) != -1) {
         switch(flag) {
             case 'r':
                 svcname = AFC2_SERVICE_NAME;
@@ -581,9 +6318,109 @@ int main(int argc, char **argv)
                     return EXIT_FAILURE;
                 }
 
+                if (add_udid(&udids, &nudids, optarg) != EXIT_SUCCESS)
+                    return EXIT_FAILURE;
                 udid = optarg;
                 break;
 
+            case OPT_ALL_DEVICES:
+                all_devices = true;
+                break;
+
+            case OPT_DEVICE_JOBS:
+                device_jobs = atoi(optarg);
+                if (device_jobs < 1) {
+                    fprintf(stderr, "Error: invalid number of device jobs: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'C':
+                address = optarg;
+                break;
+
+            case 'P':
+                pipeline_depth = atoi(optarg);
+                if (pipeline_depth < 1 || pipeline_depth > AFCPROTO_READER_MAX_WINDOW) {
+                    fprintf(stderr, "Error: invalid pipeline depth: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1) {
+                    fprintf(stderr, "Error: invalid number of jobs: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'k':
+                {
+                    uint64_t sz = parse_size(optarg);
+                    if (sz < CHUNK_MIN || sz > CHUNK_MAX) {
+                        fprintf(stderr, "Error: chunk size must be between %d and %d bytes: %s\n", CHUNK_MIN, CHUNK_MAX, optarg);
+                        return EXIT_FAILURE;
+                    }
+                    chunk_size_override = (uint32_t)sz;
+                }
+                break;
+
+            case 'b':
+                batch = optarg;
+                break;
+
+            case 'E':
+                stop_on_error = true;
+                break;
+
+            case 'S':
+                socket_path = optarg;
+                break;
+
+            case OPT_CACHE:
+                cache_ttl = (optarg)? atoi(optarg) : AFCCACHE_DEFAULT_TTL;
+                if (cache_ttl < 0) {
+                    fprintf(stderr, "Error: invalid cache ttl: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case OPT_REFRESH:
+                cache_refresh = true;
+                if (cache_ttl < 0)
+                    cache_ttl = AFCCACHE_DEFAULT_TTL;
+                break;
+
+            case OPT_NO_CACHE:
+                no_cache = true;
+                break;
+
+            case OPT_STATS:
+                if (optarg && strcmp(optarg, "json")) {
+                    fprintf(stderr, "Error: unknown stats format: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                stats = true;
+                stats_json = (optarg != NULL);
+                break;
+
+            case OPT_PROGRESS:
+                if (strcmp(optarg, "json")) {
+                    fprintf(stderr, "Error: unknown progress format: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                progress = true;
+                break;
+
+            case OPT_PROGRESS_FD:
+                progress_fd = atoi(optarg);
+                if (progress_fd < 0 || fcntl(progress_fd, F_GETFD) < 0) {
+                    fprintf(stderr, "Error: invalid progress file descriptor: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
             case 'v':
                 idevice_set_debug_level(1);
                 idev_verbose=true;
@@ -603,19 +6440,137 @@ int main(int argc, char **argv)
     argc -= optind;
     argv += optind;
 
-    if (argc < 1) {
+    if (no_cache)
+        cache_ttl = -1;
+
+    if (batch && argc > 0) {
+        fprintf(stderr, "Error: unexpected command arguments with --batch\n");
+        usage(stderr);
+        return EXIT_FAILURE;
+    } else if (!batch && argc < 1) {
         fprintf(stderr, "Missing command argument\n");
         usage(stderr);
         return EXIT_FAILURE;
     }
 
-    if (appid) {
-        return idev_afc_app_client(progname, udid, appid, appdir, ^int(afc_client_t afc) {
-            return cmd_main(afc, argc, argv);
+    // diff only reads local snapshots
+    if (!batch && !strcmp(argv[0], "diff"))
+        return do_diff(argc, argv);
+
+    if (all_devices && add_all_devices(&udids, &nudids) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    bool multi = (all_devices || nudids > 1);
+    if (multi && (address || socket_path)) {
+        fprintf(stderr, "Error: several devices can't be used with -%c\n", (address)? 'C' : 'S');
+        return EXIT_FAILURE;
+    }
+    if (multi && batch && !strcmp(batch, "-")) {
+        fprintf(stderr, "Error: a batch for several devices has to come from a file\n");
+        return EXIT_FAILURE;
+    }
+    if (multi && !batch && !strcmp(argv[0], "untar") && (argc < 3 || strcmp(argv[1], "-f") || !strcmp(argv[2], "-"))) {
+        fprintf(stderr, "Error: untar for several devices has to read from a file (-f <archive>)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (multi && !batch && !strcmp(argv[0], "mount")) {
+        fprintf(stderr, "Error: mount works on one device at a time\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((stats || progress) && (socket_path || (!batch && !strcmp(argv[0], "serve")))) {
+        fprintf(stderr, "Error: --%s only covers work done by this process, not by a server\n", (stats)? "stats" : "progress");
+        return EXIT_FAILURE;
+    }
+
+    if (progress) {
+        // a line buffered stream of our own, so each event goes out whole
+        int fd = dup(progress_fd);
+        if (fd < 0 || (progress_out = fdopen(fd, "w")) == NULL) {
+            fprintf(stderr, "Error: cannot write progress to fd %d: %s\n", progress_fd, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        setvbuf(progress_out, NULL, _IOLBF, 0);
+    }
+
+    if (stats) {
+        if (!idev_stats_enable()) {
+            fprintf(stderr, "Error: out of memory\n");
+            return EXIT_FAILURE;
+        }
+        atexit(print_stats);
+    }
+
+    if (!batch && !strcmp(argv[0], "serve")) {
+        if (argc == 3 && (!strcmp(argv[1], "--socket") || !strcmp(argv[1], "-S"))) {
+            socket_path = argv[2];
+        } else if (argc != 1) {
+            fprintf(stderr, "Error: invalid arguments for serve command.\n");
+            return EXIT_FAILURE;
+        }
+
+        if (!socket_path) {
+            fprintf(stderr, "Error: serve needs a socket path (--socket <path>)\n");
+            return EXIT_FAILURE;
+        } else if (multi) {
+            fprintf(stderr, "Error: serve takes the device from each request, not -u\n");
+            return EXIT_FAILURE;
+        }
+
+        serve_address = address;
+        return serve_main(socket_path);
+    }
+
+    if (socket_path) {
+        if (batch) {
+            fprintf(stderr, "Error: --batch can't be sent to a server\n");
+            return EXIT_FAILURE;
+        }
+        return serve_client(socket_path, udid, svcname, appid, appdir, argc, argv);
+    }
+
+    int(^run)(idev_afc_pool_t p, char *dev) = ^int(idev_afc_pool_t p, char *dev) {
+        int ret = EXIT_FAILURE;
+
+        pool = p;
+        char *found = (dev)? NULL : idev_afc_pool_udid(p);
+        cmd_device = (dev)? dev : found;
+        if (cache_ttl >= 0)
+            cmd_cache = open_cache(p, address, dev, svcname, appid, appdir);
+
+        afcproto_client_t afc = NULL;
+        if (!batch && !strcmp(argv[0], "mount")) {
+            ret = do_mount(argc, argv);
+        } else if ((afc = idev_afc_pool_checkout(pool)) != NULL) {
+            ret = (batch)? run_batch(afc, batch) : cmd_main(afc, argc, argv);
+            idev_afc_pool_checkin(pool, afc);
+        }
+
+        afccache_close(cmd_cache);
+        cmd_cache = NULL;
+        cmd_device = NULL;
+        free(found);
+        return ret;
+    };
+
+    if (address) {
+        int ret = EXIT_FAILURE;
+        idev_afc_pool_t p = idev_afc_pool_new_address(address, jobs);
+        if (p) {
+            ret = run(p, NULL);
+            idev_afc_pool_free(p);
+        }
+        return ret;
+    } else if (multi) {
+        return run_on_devices(udids, nudids, ^int(char *dev) {
+            return idev_afc_pool_client(progname, dev, svcname, appid, appdir, jobs, ^int(idev_afc_pool_t p) {
+                return run(p, dev);
+            });
         });
     } else {
-        return idev_afc_client_ex(progname, udid, svcname, ^int(idevice_t idev, lockdownd_client_t client, lockdownd_service_descriptor_t ldsvc, afc_client_t afc) {
-            return cmd_main(afc, argc, argv);
+        return idev_afc_pool_client(progname, udid, svcname, appid, appdir, jobs, ^int(idev_afc_pool_t p) {
+            return run(p, udid);
         });
     }
 }
@@ -0,0 +1,1907 @@
+/*
+ * afcfs
+ * Date: Oct 2026
+ *
+ * A caching filesystem view of a device over an AFC connection pool. See
+ * afcfs.h
+ *
+ * Everything cached hangs off a node per path: its attributes, its listing
+ * if it's a directory and its data blocks if it's a file. One lock covers
+ * all of it and is never held across a request to the device. Blocks being
+ * fetched are in the cache as LOADING, so a second reader of the same block
+ * waits for the first fetch instead of starting another.
+ */
+
+#ifdef __linux
+  #ifndef _GNU_SOURCE
+    #define _GNU_SOURCE // asprintf
+  #endif
+#endif
+
+#ifdef __APPLE__
+  #define st_mtim st_mtimespec
+  #define st_atim st_atimespec
+  #define st_ctim st_ctimespec
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "afcfs.h"
+
+#define BLOCK_SIZE AFCFS_BLOCK_SIZE
+
+// requests in flight while fetching the info of a directory's entries
+#define INFO_PIPELINE 16
+
+// unused nodes are dropped once there are more than this many
+#define NODES_MAX 65536
+
+enum { BLOCK_LOADING, BLOCK_READY };
+
+typedef struct afcfs_node afcfs_node_t;
+
+typedef struct afcfs_block {
+    afcfs_node_t *node;
+    uint64_t index;
+    char *data;
+    int state;
+    bool dirty;
+    // being written back. A stale block has been dropped from the cache
+    // while loading or pinned, and is freed by whoever finishes with it
+    int pins;
+    bool stale;
+    struct afcfs_block *hnext;
+    struct afcfs_block *node_prev, *node_next;
+    struct afcfs_block *lru_prev, *lru_next;
+} afcfs_block_t;
+
+struct afcfs_node {
+    char *path;
+    afcfs_node_t *hnext;
+    // open files and work in progress. A node removed from the table while
+    // still referenced is freed with its last reference
+    int refs;
+    bool gone;
+
+    time_t attr_time;
+    int attr_err;
+    struct stat st;
+    char *target;
+
+    time_t list_time;
+    char **list;
+
+    // size includes writes that haven't reached the device yet
+    uint64_t size;
+    uint64_t remote_size;
+    afcfs_block_t *blocks;
+    size_t ndirty;
+    bool flushing;
+
+    // where a sequential reader would continue, and how long it has been
+    uint64_t next_offset;
+    int streak;
+};
+
+typedef struct prefetch {
+    afcfs_node_t *node;
+    uint64_t first;
+    int count;
+    afcfs_block_t *blocks[AFCFS_READAHEAD];
+    struct prefetch *next;
+} prefetch_t;
+
+struct afcfs {
+    idev_afc_pool_t pool;
+    char *root;
+    int ttl;
+    size_t max_blocks;
+
+    pthread_mutex_t lock;
+    // block state changes and finished write-backs
+    pthread_cond_t cond;
+
+    size_t nnodes;
+    size_t node_buckets;
+    afcfs_node_t **nodes;
+
+    size_t nblocks;
+    size_t ndirty;
+    size_t block_buckets;
+    afcfs_block_t **blocks;
+    afcfs_block_t *lru_head, *lru_tail;
+
+    pthread_t prefetchers[AFCFS_PREFETCHERS];
+    int nprefetchers;
+    pthread_cond_t queue_cond;
+    prefetch_t *queue_head, *queue_tail;
+    bool stopping;
+};
+
+struct afcfs_file {
+    afcfs_node_t *node;
+    int flags;
+};
+
+
+#pragma mark - paths and errors
+
+static uint64_t hash_path(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *path; path++) {
+        h ^= (unsigned char)*path;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static char *remote_path(afcfs_t fs, const char *path)
+{
+    char *rpath = NULL;
+    if (!strcmp(fs->root, "/"))
+        return strdup(path);
+    if (asprintf(&rpath, "%s%s", fs->root, (strcmp(path, "/"))? path : "") < 0)
+        return NULL;
+    return rpath;
+}
+
+static char *parent_path(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return (slash && slash != path)? strndup(path, slash - path) : strdup("/");
+}
+
+// "path" itself or anything below it
+static bool path_within(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    return (!strncmp(path, dir, len) && (path[len] == '\0' || path[len] == '/' || !strcmp(dir, "/")));
+}
+
+static int afc_errno(afc_error_t err)
+{
+    switch (err) {
+        case AFC_E_SUCCESS:             return 0;
+        case AFC_E_OBJECT_NOT_FOUND:    return ENOENT;
+        case AFC_E_OBJECT_IS_DIR:       return EISDIR;
+        case AFC_E_PERM_DENIED:         return EACCES;
+        case AFC_E_OBJECT_EXISTS:       return EEXIST;
+        case AFC_E_DIR_NOT_EMPTY:       return ENOTEMPTY;
+        case AFC_E_NO_SPACE_LEFT:       return ENOSPC;
+        case AFC_E_INVALID_ARG:         return EINVAL;
+        case AFC_E_OP_NOT_SUPPORTED:    return ENOTSUP;
+        case AFC_E_OBJECT_BUSY:         return EBUSY;
+        case AFC_E_NO_MEM:              return ENOMEM;
+        case AFC_E_OP_TIMEOUT:          return ETIMEDOUT;
+        default:                        return EIO;
+    }
+}
+
+static uint64_t info_number(char **info, const char *key)
+{
+    const char *val = afcproto_info_value(info, key);
+    return (val)? strtoull(val, NULL, 10) : 0;
+}
+
+static void info_to_stat(char **info, struct stat *st)
+{
+    const char *type = afcproto_info_value(info, "st_ifmt");
+
+    memset(st, 0, sizeof(*st));
+    if (!type || !strcmp(type, "S_IFREG"))
+        st->st_mode = S_IFREG | 0644;
+    else if (!strcmp(type, "S_IFDIR"))
+        st->st_mode = S_IFDIR | 0755;
+    else if (!strcmp(type, "S_IFLNK"))
+        st->st_mode = S_IFLNK | 0777;
+    else if (!strcmp(type, "S_IFCHR"))
+        st->st_mode = S_IFCHR | 0644;
+    else if (!strcmp(type, "S_IFBLK"))
+        st->st_mode = S_IFBLK | 0644;
+    else if (!strcmp(type, "S_IFIFO"))
+        st->st_mode = S_IFIFO | 0644;
+    else if (!strcmp(type, "S_IFSOCK"))
+        st->st_mode = S_IFSOCK | 0644;
+    else
+        st->st_mode = S_IFREG | 0644;
+
+    uint64_t mtime = info_number(info, "st_mtime");
+    st->st_mtim.tv_sec = (time_t)(mtime / 1000000000ULL);
+    st->st_mtim.tv_nsec = (long)(mtime % 1000000000ULL);
+    st->st_atim = st->st_ctim = st->st_mtim;
+
+    st->st_size = (off_t)info_number(info, "st_size");
+    st->st_blocks = (blkcnt_t)info_number(info, "st_blocks");
+    st->st_nlink = (nlink_t)info_number(info, "st_nlink");
+    if (!st->st_nlink)
+        st->st_nlink = 1;
+    st->st_blksize = BLOCK_SIZE;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+}
+
+static void stat_touch(struct stat *st)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    st->st_mtim = st->st_ctim = now;
+}
+
+
+#pragma mark - nodes
+
+static bool is_fresh(afcfs_t fs, time_t when)
+{
+    return (when && time(NULL) - when < fs->ttl);
+}
+
+static void node_link(afcfs_t fs, afcfs_node_t *node)
+{
+    size_t b = hash_path(node->path) % fs->node_buckets;
+    node->hnext = fs->nodes[b];
+    fs->nodes[b] = node;
+}
+
+static void node_unlink(afcfs_t fs, afcfs_node_t *node)
+{
+    afcfs_node_t **np = &fs->nodes[hash_path(node->path) % fs->node_buckets];
+    for (; *np; np = &(*np)->hnext) {
+        if (*np == node) {
+            *np = node->hnext;
+            break;
+        }
+    }
+}
+
+static void block_drop(afcfs_t fs, afcfs_block_t *blk);
+
+// drops the node's blocks from index 'from' on, unflushed writes included
+static void node_drop_blocks(afcfs_t fs, afcfs_node_t *node, uint64_t from)
+{
+    afcfs_block_t *blk, *next;
+    for (blk = node->blocks; blk; blk = next) {
+        next = blk->node_next;
+        if (blk->index >= from)
+            block_drop(fs, blk);
+    }
+}
+
+static void node_free(afcfs_t fs, afcfs_node_t *node)
+{
+    node_drop_blocks(fs, node, 0);
+    afcproto_list_free(node->list);
+    free(node->target);
+    free(node->path);
+    free(node);
+}
+
+// takes the node out of the table, so the next lookup of its path starts
+// over
+static void node_remove(afcfs_t fs, afcfs_node_t *node)
+{
+    node_unlink(fs, node);
+    fs->nnodes--;
+    if (node->refs) {
+        node->gone = true;
+        node_drop_blocks(fs, node, 0);
+    } else {
+        node_free(fs, node);
+    }
+}
+
+static void node_unref(afcfs_t fs, afcfs_node_t *node)
+{
+    if (--node->refs == 0 && node->gone)
+        node_free(fs, node);
+}
+
+// drops nodes that hold nothing worth keeping
+static void nodes_trim(afcfs_t fs)
+{
+    size_t i;
+    for (i=0; i<fs->node_buckets; i++) {
+        afcfs_node_t *node, *next;
+        for (node = fs->nodes[i]; node; node = next) {
+            next = node->hnext;
+            if (!node->refs && !node->blocks && !is_fresh(fs, node->attr_time) && !is_fresh(fs, node->list_time))
+                node_remove(fs, node);
+        }
+    }
+}
+
+static bool nodes_grow(afcfs_t fs)
+{
+    size_t i, nbuckets = (fs->node_buckets)? fs->node_buckets*2 : 256;
+    afcfs_node_t **buckets = calloc(nbuckets, sizeof(afcfs_node_t*));
+    if (!buckets)
+        return false;
+
+    for (i=0; i<fs->node_buckets; i++) {
+        afcfs_node_t *node, *next;
+        for (node = fs->nodes[i]; node; node = next) {
+            next = node->hnext;
+            size_t b = hash_path(node->path) % nbuckets;
+            node->hnext = buckets[b];
+            buckets[b] = node;
+        }
+    }
+    free(fs->nodes);
+    fs->nodes = buckets;
+    fs->node_buckets = nbuckets;
+    return true;
+}
+
+// note: called with the lock held
+static afcfs_node_t *node_find(afcfs_t fs, const char *path, bool create)
+{
+    afcfs_node_t *node;
+
+    if (fs->node_buckets) {
+        for (node = fs->nodes[hash_path(path) % fs->node_buckets]; node; node = node->hnext) {
+            if (!strcmp(node->path, path))
+                return node;
+        }
+    }
+
+    if (!create)
+        return NULL;
+
+    if (fs->nnodes >= NODES_MAX)
+        nodes_trim(fs);
+
+    if (fs->nnodes >= fs->node_buckets && !nodes_grow(fs))
+        return NULL;
+
+    if ((node = calloc(1, sizeof(afcfs_node_t))) == NULL || (node->path = strdup(path)) == NULL) {
+        free(node);
+        return NULL;
+    }
+    node->next_offset = UINT64_MAX;
+
+    node_link(fs, node);
+    fs->nnodes++;
+    return node;
+}
+
+// Records the result of a file info request. Cached data is dropped when
+// the file has changed on the device, unless there are writes of our own
+// still waiting to go out.
+static void node_set_info(afcfs_t fs, afcfs_node_t *node, afc_error_t err, char **info)
+{
+    node->attr_time = time(NULL);
+    node->attr_err = -afc_errno(err);
+    if (err) {
+        if (!node->ndirty)
+            node_drop_blocks(fs, node, 0);
+        return;
+    }
+
+    struct stat st;
+    info_to_stat(info, &st);
+
+    bool changed = ((uint64_t)st.st_size != node->remote_size ||
+                    st.st_mtim.tv_sec != node->st.st_mtim.tv_sec ||
+                    st.st_mtim.tv_nsec != node->st.st_mtim.tv_nsec);
+
+    if (!node->ndirty && !node->flushing) {
+        if (changed)
+            node_drop_blocks(fs, node, 0);
+        node->size = (uint64_t)st.st_size;
+    }
+    node->remote_size = (uint64_t)st.st_size;
+    node->st = st;
+
+    free(node->target);
+    const char *target = afcproto_info_value(info, "LinkTarget");
+    node->target = (target)? strdup(target) : NULL;
+}
+
+static void node_stat(afcfs_node_t *node, struct stat *st)
+{
+    *st = node->st;
+    if (S_ISREG(st->st_mode)) {
+        st->st_size = (off_t)node->size;
+        if ((uint64_t)st->st_blocks * 512 < node->size)
+            st->st_blocks = (blkcnt_t)((node->size + 511) / 512);
+    }
+}
+
+// the parent's listing and attributes change when an entry comes or goes
+static void invalidate_parent(afcfs_t fs, const char *path)
+{
+    char *parent = parent_path(path);
+    afcfs_node_t *node = (parent)? node_find(fs, parent, false) : NULL;
+    if (node)
+        node->attr_time = node->list_time = 0;
+    free(parent);
+}
+
+static void invalidate(afcfs_t fs, const char *path)
+{
+    afcfs_node_t *node = node_find(fs, path, false);
+    if (node)
+        node->attr_time = node->list_time = 0;
+    invalidate_parent(fs, path);
+}
+
+
+#pragma mark - blocks
+
+static void lru_unlink(afcfs_t fs, afcfs_block_t *blk)
+{
+    if (blk->lru_prev)
+        blk->lru_prev->lru_next = blk->lru_next;
+    else
+        fs->lru_head = blk->lru_next;
+    if (blk->lru_next)
+        blk->lru_next->lru_prev = blk->lru_prev;
+    else
+        fs->lru_tail = blk->lru_prev;
+    blk->lru_prev = blk->lru_next = NULL;
+}
+
+static void lru_push(afcfs_t fs, afcfs_block_t *blk)
+{
+    blk->lru_prev = NULL;
+    blk->lru_next = fs->lru_head;
+    if (fs->lru_head)
+        fs->lru_head->lru_prev = blk;
+    else
+        fs->lru_tail = blk;
+    fs->lru_head = blk;
+}
+
+static void lru_touch(afcfs_t fs, afcfs_block_t *blk)
+{
+    if (fs->lru_head != blk) {
+        lru_unlink(fs, blk);
+        lru_push(fs, blk);
+    }
+}
+
+static size_t block_bucket(afcfs_t fs, afcfs_node_t *node, uint64_t index)
+{
+    return (size_t)((((uintptr_t)node >> 4) * 0x9e3779b97f4a7c15ULL + index) % fs->block_buckets);
+}
+
+static afcfs_block_t *block_find(afcfs_t fs, afcfs_node_t *node, uint64_t index)
+{
+    afcfs_block_t *blk;
+    for (blk = fs->blocks[block_bucket(fs, node, index)]; blk; blk = blk->hnext) {
+        if (blk->node == node && blk->index == index)
+            return blk;
+    }
+    return NULL;
+}
+
+static void block_destroy(afcfs_block_t *blk)
+{
+    free(blk->data);
+    free(blk);
+}
+
+// Takes a block out of the cache. One that's still being loaded or written
+// back is only marked stale and left for that work to free.
+static void block_drop(afcfs_t fs, afcfs_block_t *blk)
+{
+    afcfs_node_t *node = blk->node;
+
+    afcfs_block_t **bp = &fs->blocks[block_bucket(fs, node, blk->index)];
+    for (; *bp; bp = &(*bp)->hnext) {
+        if (*bp == blk) {
+            *bp = blk->hnext;
+            break;
+        }
+    }
+
+    if (blk->node_prev)
+        blk->node_prev->node_next = blk->node_next;
+    else
+        node->blocks = blk->node_next;
+    if (blk->node_next)
+        blk->node_next->node_prev = blk->node_prev;
+
+    lru_unlink(fs, blk);
+
+    if (blk->dirty) {
+        node->ndirty--;
+        fs->ndirty--;
+    }
+    fs->nblocks--;
+
+    if (blk->state == BLOCK_LOADING || blk->pins)
+        blk->stale = true;
+    else
+        block_destroy(blk);
+}
+
+// evicts clean blocks, least recently used first, until the cache fits
+static void cache_trim(afcfs_t fs)
+{
+    afcfs_block_t *blk = fs->lru_tail;
+    while (fs->nblocks > fs->max_blocks && blk) {
+        afcfs_block_t *prev = blk->lru_prev;
+        if (blk->state == BLOCK_READY && !blk->dirty && !blk->pins)
+            block_drop(fs, blk);
+        blk = prev;
+    }
+}
+
+static afcfs_block_t *block_new(afcfs_t fs, afcfs_node_t *node, uint64_t index, int state)
+{
+    cache_trim(fs);
+
+    afcfs_block_t *blk = calloc(1, sizeof(afcfs_block_t));
+    if (!blk || (blk->data = malloc(BLOCK_SIZE)) == NULL) {
+        free(blk);
+        return NULL;
+    }
+    blk->node = node;
+    blk->index = index;
+    blk->state = state;
+    if (state == BLOCK_READY)
+        memset(blk->data, 0, BLOCK_SIZE);
+
+    size_t b = block_bucket(fs, node, index);
+    blk->hnext = fs->blocks[b];
+    fs->blocks[b] = blk;
+
+    blk->node_next = node->blocks;
+    if (node->blocks)
+        node->blocks->node_prev = blk;
+    node->blocks = blk;
+
+    lru_push(fs, blk);
+    fs->nblocks++;
+    return blk;
+}
+
+// Fills blocks first..first+count-1 of the file, which the caller has put in
+// the cache as LOADING, with their READs all in flight together on one
+// connection. Each block is handed over as soon as it arrives. Called
+// without the lock; returns 0 or -errno.
+static int fetch_blocks(afcfs_t fs, const char *rpath, afcfs_block_t **blks, uint64_t first, int count)
+{
+    afcproto_client_t afc = idev_afc_pool_checkout(fs->pool);
+    afc_error_t err = AFC_E_MUX_ERROR;
+    uint64_t handle = 0;
+    int i = 0;
+
+    if (afc && (err = afcproto_file_open(afc, rpath, AFC_FOPEN_RDONLY, &handle)) == AFC_E_SUCCESS) {
+        afcproto_reader_t rd;
+        afcproto_reader_init(&rd, afc, handle, BLOCK_SIZE, count);
+        afcproto_reader_seek(&rd, first * BLOCK_SIZE);
+        afcproto_reader_limit(&rd, (uint64_t)count * BLOCK_SIZE);
+
+        bool eof = false;
+        for (; i<count; i++) {
+            uint32_t got = 0;
+            if (!eof && (err = afcproto_reader_next(&rd, blks[i]->data, BLOCK_SIZE, &got)) != AFC_E_SUCCESS)
+                break;
+
+            // past the end of the file on the device reads as zeros
+            memset(blks[i]->data + got, 0, BLOCK_SIZE - got);
+            eof = (eof || got < BLOCK_SIZE);
+
+            pthread_mutex_lock(&fs->lock);
+            if (blks[i]->stale)
+                block_destroy(blks[i]);
+            else
+                blks[i]->state = BLOCK_READY;
+            pthread_cond_broadcast(&fs->cond);
+            pthread_mutex_unlock(&fs->lock);
+        }
+
+        afcproto_reader_finish(&rd);
+        afcproto_file_close(afc, handle);
+    }
+    idev_afc_pool_checkin(fs->pool, afc);
+
+    if (i < count) {
+        if (idev_verbose)
+            fprintf(stderr, "[debug] mount: read error for %s - %s\n", rpath, idev_afc_strerror(err));
+
+        pthread_mutex_lock(&fs->lock);
+        for (; i<count; i++) {
+            afcfs_block_t *blk = blks[i];
+            if (!blk->stale)
+                block_drop(fs, blk);
+            block_destroy(blk);
+        }
+        pthread_cond_broadcast(&fs->cond);
+        pthread_mutex_unlock(&fs->lock);
+        return -afc_errno(err);
+    }
+    return 0;
+}
+
+// Fetches the missing blocks from 'first' up to 'last', stopping at the
+// first one already cached. Called with the lock held, which is let go
+// while waiting on the device.
+static int fetch_missing(afcfs_t fs, afcfs_node_t *node, uint64_t first, uint64_t last)
+{
+    afcfs_block_t *blks[AFCFS_READAHEAD];
+    int count = 0;
+
+    if (last - first >= AFCFS_READAHEAD)
+        last = first + AFCFS_READAHEAD - 1;
+
+    for (; first + count <= last && !block_find(fs, node, first + count); count++) {
+        if ((blks[count] = block_new(fs, node, first + count, BLOCK_LOADING)) == NULL)
+            break;
+    }
+
+    char *rpath = remote_path(fs, node->path);
+    if (!count || !rpath) {
+        for (; count > 0; count--) {
+            block_drop(fs, blks[count-1]);
+            block_destroy(blks[count-1]);
+        }
+        free(rpath);
+        return -ENOMEM;
+    }
+
+    node->refs++;
+    pthread_mutex_unlock(&fs->lock);
+
+    int ret = fetch_blocks(fs, rpath, blks, first, count);
+
+    pthread_mutex_lock(&fs->lock);
+    node_unref(fs, node);
+    free(rpath);
+    return ret;
+}
+
+
+#pragma mark - read-ahead
+
+static void *prefetch_main(void *arg)
+{
+    afcfs_t fs = arg;
+
+    pthread_mutex_lock(&fs->lock);
+    for (;;) {
+        while (!fs->queue_head && !fs->stopping)
+            pthread_cond_wait(&fs->queue_cond, &fs->lock);
+
+        prefetch_t *job = fs->queue_head;
+        if (!job)
+            break;
+        if ((fs->queue_head = job->next) == NULL)
+            fs->queue_tail = NULL;
+
+        char *rpath = (fs->stopping)? NULL : remote_path(fs, job->node->path);
+        if (rpath) {
+            pthread_mutex_unlock(&fs->lock);
+            fetch_blocks(fs, rpath, job->blocks, job->first, job->count);
+            pthread_mutex_lock(&fs->lock);
+            free(rpath);
+        } else {
+            int i;
+            for (i=0; i<job->count; i++) {
+                if (!job->blocks[i]->stale)
+                    block_drop(fs, job->blocks[i]);
+                block_destroy(job->blocks[i]);
+            }
+            pthread_cond_broadcast(&fs->cond);
+        }
+
+        node_unref(fs, job->node);
+        free(job);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return NULL;
+}
+
+// Called with the lock held after a read of offset..offset+size. Once a
+// reader has continued where its last read ended, the blocks ahead of it
+// are queued for the prefetch threads - half a window at a time, so there
+// is always something in flight while it reads on.
+static void read_ahead(afcfs_t fs, afcfs_node_t *node, uint64_t offset, size_t size)
+{
+    node->streak = (offset == node->next_offset)? node->streak+1 : 0;
+    node->next_offset = offset + size;
+
+    if (!node->streak || !fs->nprefetchers || !node->size)
+        return;
+
+    uint64_t cur = (offset + size - 1) / BLOCK_SIZE;
+    uint64_t last = (node->size - 1) / BLOCK_SIZE;
+    uint64_t end = (cur + AFCFS_READAHEAD < last)? cur + AFCFS_READAHEAD : last;
+
+    uint64_t first = cur + 1;
+    while (first <= end && block_find(fs, node, first))
+        first++;
+    if (first > end || first - cur > AFCFS_READAHEAD/2)
+        return;
+
+    prefetch_t *job = calloc(1, sizeof(prefetch_t));
+    if (!job)
+        return;
+    job->node = node;
+    job->first = first;
+    for (; first + job->count <= end && !block_find(fs, node, first + job->count); job->count++) {
+        if ((job->blocks[job->count] = block_new(fs, node, first + job->count, BLOCK_LOADING)) == NULL)
+            break;
+    }
+    if (!job->count) {
+        free(job);
+        return;
+    }
+
+    node->refs++;
+    if (fs->queue_tail)
+        fs->queue_tail->next = job;
+    else
+        fs->queue_head = job;
+    fs->queue_tail = job;
+    pthread_cond_signal(&fs->queue_cond);
+}
+
+
+#pragma mark - write-back
+
+static int index_order(const void *a, const void *b)
+{
+    uint64_t ia = (*(afcfs_block_t* const*)a)->index, ib = (*(afcfs_block_t* const*)b)->index;
+    return (ia < ib)? -1 : (ia > ib);
+}
+
+// Writes a node's dirty blocks to the device in file order, seeking only
+// between runs of consecutive blocks. Blocks written to again meanwhile stay dirty
+// for the next flush; on failure everything not written is dirty again.
+static int node_flush(afcfs_t fs, afcfs_node_t *node)
+{
+    pthread_mutex_lock(&fs->lock);
+    while (node->flushing)
+        pthread_cond_wait(&fs->cond, &fs->lock);
+
+    if (!node->ndirty || node->gone) {
+        if (node->gone)
+            node_drop_blocks(fs, node, 0);
+        pthread_mutex_unlock(&fs->lock);
+        return 0;
+    }
+
+    size_t i, count=0;
+    afcfs_block_t **blks = malloc(node->ndirty * sizeof(afcfs_block_t*));
+    char *buf = malloc(BLOCK_SIZE);
+    char *rpath = remote_path(fs, node->path);
+    if (!blks || !buf || !rpath) {
+        pthread_mutex_unlock(&fs->lock);
+        free(blks);
+        free(buf);
+        free(rpath);
+        return -ENOMEM;
+    }
+
+    afcfs_block_t *blk;
+    for (blk = node->blocks; blk; blk = blk->node_next) {
+        if (blk->dirty) {
+            blk->dirty = false;
+            blk->pins++;
+            blks[count++] = blk;
+        }
+    }
+    qsort(blks, count, sizeof(afcfs_block_t*), index_order);
+    node->ndirty = 0;
+    fs->ndirty -= count;
+    node->flushing = true;
+    node->refs++;
+    pthread_mutex_unlock(&fs->lock);
+
+    afcproto_client_t afc = idev_afc_pool_checkout(fs->pool);
+    afc_error_t err = AFC_E_MUX_ERROR;
+    uint64_t handle = 0, end = 0, at = UINT64_MAX;
+    char **info = NULL;
+
+    if (afc && (err = afcproto_file_open(afc, rpath, AFC_FOPEN_RW, &handle)) == AFC_E_SUCCESS) {
+        for (i=0; i<count && !err; i++) {
+            uint64_t start = blks[i]->index * BLOCK_SIZE;
+            uint32_t len = 0, written = 0;
+
+            pthread_mutex_lock(&fs->lock);
+            if (!blks[i]->stale && start < node->size) {
+                len = (node->size - start < BLOCK_SIZE)? (uint32_t)(node->size - start) : BLOCK_SIZE;
+                memcpy(buf, blks[i]->data, len);
+            }
+            pthread_mutex_unlock(&fs->lock);
+            if (!len)
+                continue;
+
+            if (start != at)
+                err = afcproto_file_seek(afc, handle, (int64_t)start, SEEK_SET);
+            if (!err && (err = afcproto_file_write(afc, handle, buf, len, &written)) == AFC_E_SUCCESS && written != len)
+                err = AFC_E_WRITE_ERROR;
+            at = start + len;
+            if (!err && at > end)
+                end = at;
+        }
+        afc_error_t cerr = afcproto_file_close(afc, handle);
+        if (!err)
+            err = cerr;
+
+        // our own write changed the mtime; pick it up so the cached
+        // blocks aren't taken for out of date
+        if (!err && afcproto_get_file_info(afc, rpath, &info) != AFC_E_SUCCESS)
+            info = NULL;
+    }
+    idev_afc_pool_checkin(fs->pool, afc);
+
+    pthread_mutex_lock(&fs->lock);
+    for (i=0; i<count; i++) {
+        blk = blks[i];
+        blk->pins--;
+        if (blk->stale) {
+            if (!blk->pins)
+                block_destroy(blk);
+        } else if (err && !blk->dirty) {
+            blk->dirty = true;
+            node->ndirty++;
+            fs->ndirty++;
+        }
+    }
+    if (!err) {
+        if (end > node->remote_size)
+            node->remote_size = end;
+        if (info) {
+            struct stat st;
+            info_to_stat(info, &st);
+            node->st = st;
+            node->remote_size = (uint64_t)st.st_size;
+            node->attr_time = time(NULL);
+        }
+    }
+    node->flushing = false;
+    node_unref(fs, node);
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->lock);
+
+    if (err)
+        fprintf(stderr, "Error: mount: write error for %s - %s\n", rpath, idev_afc_strerror(err));
+
+    afcproto_list_free(info);
+    free(blks);
+    free(buf);
+    free(rpath);
+    return -afc_errno(err);
+}
+
+
+#pragma mark - setup
+
+afcfs_t afcfs_new(idev_afc_pool_t pool, const char *root, size_t cache_size, int ttl)
+{
+    afcfs_t fs = calloc(1, sizeof(struct afcfs));
+    if (!fs)
+        return NULL;
+
+    size_t len = strlen(root);
+    while (len > 1 && root[len-1] == '/')
+        len--;
+
+    fs->pool = pool;
+    fs->ttl = ttl;
+    fs->root = strndup(root, len);
+
+    // never less than the read-ahead needs
+    fs->max_blocks = cache_size / BLOCK_SIZE;
+    if (fs->max_blocks < 4 * AFCFS_READAHEAD * AFCFS_PREFETCHERS)
+        fs->max_blocks = 4 * AFCFS_READAHEAD * AFCFS_PREFETCHERS;
+    fs->block_buckets = fs->max_blocks * 2;
+    fs->blocks = calloc(fs->block_buckets, sizeof(afcfs_block_t*));
+
+    pthread_mutex_init(&fs->lock, NULL);
+    pthread_cond_init(&fs->cond, NULL);
+    pthread_cond_init(&fs->queue_cond, NULL);
+
+    if (!fs->root || !fs->blocks || !nodes_grow(fs)) {
+        afcfs_free(fs);
+        return NULL;
+    }
+
+    for (; fs->nprefetchers < AFCFS_PREFETCHERS; fs->nprefetchers++) {
+        if (pthread_create(&fs->prefetchers[fs->nprefetchers], NULL, prefetch_main, fs) != 0)
+            break;
+    }
+
+    return fs;
+}
+
+void afcfs_free(afcfs_t fs)
+{
+    if (!fs)
+        return;
+
+    afcfs_sync(fs);
+
+    pthread_mutex_lock(&fs->lock);
+    fs->stopping = true;
+    pthread_cond_broadcast(&fs->queue_cond);
+    pthread_mutex_unlock(&fs->lock);
+
+    int i;
+    for (i=0; i<fs->nprefetchers; i++)
+        pthread_join(fs->prefetchers[i], NULL);
+
+    size_t b;
+    for (b=0; b<fs->node_buckets; b++) {
+        afcfs_node_t *node, *next;
+        for (node = fs->nodes[b]; node; node = next) {
+            next = node->hnext;
+            node_free(fs, node);
+        }
+    }
+
+    pthread_cond_destroy(&fs->queue_cond);
+    pthread_cond_destroy(&fs->cond);
+    pthread_mutex_destroy(&fs->lock);
+    free(fs->nodes);
+    free(fs->blocks);
+    free(fs->root);
+    free(fs);
+}
+
+int afcfs_sync(afcfs_t fs)
+{
+    int ret = 0;
+    size_t i, count = 0;
+
+    pthread_mutex_lock(&fs->lock);
+    afcfs_node_t **dirty = calloc(fs->nnodes + 1, sizeof(afcfs_node_t*));
+    for (i=0; dirty && i<fs->node_buckets; i++) {
+        afcfs_node_t *node;
+        for (node = fs->nodes[i]; node; node = node->hnext) {
+            if (node->ndirty) {
+                node->refs++;
+                dirty[count++] = node;
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    if (!dirty)
+        return -ENOMEM;
+
+    for (i=0; i<count; i++) {
+        int r = node_flush(fs, dirty[i]);
+        if (r && !ret)
+            ret = r;
+        pthread_mutex_lock(&fs->lock);
+        node_unref(fs, dirty[i]);
+        pthread_mutex_unlock(&fs->lock);
+    }
+    free(dirty);
+    return ret;
+}
+
+
+#pragma mark - metadata
+
+// Gets path's info into *st (and its link target into *target, if asked),
+// from the cache while it's fresh. Failures are cached too, so a program
+// probing for files that don't exist doesn't go to the device each time.
+static int lookup(afcfs_t fs, const char *path, struct stat *st, char **target)
+{
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    afcfs_node_t *node = node_find(fs, path, false);
+    if (!node || (!is_fresh(fs, node->attr_time) && !node->ndirty && !node->flushing)) {
+        pthread_mutex_unlock(&fs->lock);
+
+        char *rpath = remote_path(fs, path);
+        char **info = NULL;
+        afc_error_t err = AFC_E_NO_MEM;
+        afcproto_client_t afc = idev_afc_pool_checkout(fs->pool);
+        if (!afc)
+            err = AFC_E_MUX_ERROR;
+        else if (rpath)
+            err = afcproto_get_file_info(afc, rpath, &info);
+        idev_afc_pool_checkin(fs->pool, afc);
+        free(rpath);
+
+        pthread_mutex_lock(&fs->lock);
+        if ((node = node_find(fs, path, true)) != NULL && (err == AFC_E_SUCCESS || err == AFC_E_OBJECT_NOT_FOUND))
+            node_set_info(fs, node, err, info);
+        afcproto_list_free(info);
+
+        if (!node || (err && err != AFC_E_OBJECT_NOT_FOUND)) {
+            pthread_mutex_unlock(&fs->lock);
+            return (node)? -afc_errno(err) : -ENOMEM;
+        }
+    }
+
+    if ((ret = node->attr_err) == 0) {
+        node_stat(node, st);
+        if (target)
+            *target = (node->target)? strdup(node->target) : NULL;
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+int afcfs_getattr(afcfs_t fs, const char *path, struct stat *st)
+{
+    return lookup(fs, path, st, NULL);
+}
+
+// Fetches a directory's listing and then the info of every entry, with the
+// info requests pipelined, and caches the lot.
+static int list_directory(afcfs_t fs, const char *path)
+{
+    char *rpath = remote_path(fs, path);
+    if (!rpath)
+        return -ENOMEM;
+
+    afcproto_client_t afc = idev_afc_pool_checkout(fs->pool);
+    char **list = NULL, **names = NULL, **paths = NULL, ***infos = NULL;
+    afc_error_t err = (afc)? afcproto_read_directory(afc, rpath, &list) : AFC_E_MUX_ERROR;
+    size_t i, count = 0;
+
+    if (!err) {
+        for (i=0; list[i]; i++);
+        names = calloc(i+1, sizeof(char*));
+        paths = calloc(i+1, sizeof(char*));
+        infos = calloc(i+1, sizeof(char**));
+        if (!names || !paths || !infos)
+            err = AFC_E_NO_MEM;
+
+        for (i=0; !err && list[i]; i++) {
+            if (!strcmp(list[i], ".") || !strcmp(list[i], ".."))
+                continue;
+            names[count] = list[i];
+            if (asprintf(&paths[count], "%s%s%s", rpath, (strcmp(rpath, "/"))? "/" : "", list[i]) < 0) {
+                paths[count] = NULL;
+                err = AFC_E_NO_MEM;
+                break;
+            }
+            count++;
+        }
+    }
+
+    size_t sent = 0, done = 0;
+    while (!err && done < count) {
+        while (sent < count && sent - done < INFO_PIPELINE) {
+            if (afcproto_send_request(afc, AFC_OP_GET_FILE_INFO, paths[sent], strlen(paths[sent])+1, NULL, 0) != AFC_E_SUCCESS)
+                break;
+            sent++;
+        }
+        if (done == sent) {
+            err = AFC_E_MUX_ERROR;
+            break;
+        }
+
+        // an entry gone since the listing is skipped
+        if (afcproto_receive_list(afc, &infos[done]) != AFC_E_SUCCESS) {
+            infos[done] = NULL;
+            if (afcproto_client_is_broken(afc))
+                err = AFC_E_MUX_ERROR;
+        }
+        done++;
+    }
+    idev_afc_pool_checkin(fs->pool, afc);
+
+    if (!err) {
+        pthread_mutex_lock(&fs->lock);
+        afcfs_node_t *node = node_find(fs, path, true);
+        if (node) {
+            afcproto_list_free(node->list);
+            node->list = calloc(count+1, sizeof(char*));
+            node->list_time = (node->list)? time(NULL) : 0;
+        }
+
+        size_t n = 0;
+        for (i=0; node && node->list && i<count; i++) {
+            if (!infos[i])
+                continue;
+            char *child = NULL;
+            if (asprintf(&child, "%s%s%s", path, (strcmp(path, "/"))? "/" : "", names[i]) < 0)
+                continue;
+            afcfs_node_t *cnode = node_find(fs, child, true);
+            if (cnode && !cnode->ndirty && !cnode->flushing)
+                node_set_info(fs, cnode, AFC_E_SUCCESS, infos[i]);
+            free(child);
+            node->list[n++] = strdup(names[i]);
+        }
+        pthread_mutex_unlock(&fs->lock);
+
+        if (!node || !node->list)
+            err = AFC_E_NO_MEM;
+    }
+
+    for (i=0; i<count; i++) {
+        free(paths[i]);
+        afcproto_list_free(infos[i]);
+    }
+    free(paths);
+    free(infos);
+    free(names);
+    afcproto_list_free(list);
+    free(rpath);
+    return -afc_errno(err);
+}
+
+int afcfs_readdir(afcfs_t fs, const char *path, int(^filler)(const char *name, const struct stat *st))
+{
+    char **names = NULL;
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->lock);
+    afcfs_node_t *node = node_find(fs, path, false);
+    if (node && node->list && is_fresh(fs, node->list_time))
+        names = afcproto_list_dup(node->list);
+    pthread_mutex_unlock(&fs->lock);
+
+    if (!names) {
+        if ((ret = list_directory(fs, path)) != 0)
+            return ret;
+
+        pthread_mutex_lock(&fs->lock);
+        node = node_find(fs, path, false);
+        names = (node && node->list)? afcproto_list_dup(node->list) : NULL;
+        pthread_mutex_unlock(&fs->lock);
+        if (!names)
+            return -ENOMEM;
+    }
+
+    size_t i;
+    for (i=0; names[i]; i++) {
+        char *child = NULL;
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+
+        if (asprintf(&child, "%s%s%s", path, (strcmp(path, "/"))? "/" : "", names[i]) > 0) {
+            pthread_mutex_lock(&fs->lock);
+            afcfs_node_t *cnode = node_find(fs, child, false);
+            if (cnode && !cnode->attr_err && cnode->attr_time)
+                node_stat(cnode, &st);
+            pthread_mutex_unlock(&fs->lock);
+            free(child);
+        }
+
+        if (filler(names[i], &st) != 0)
+            break;
+    }
+
+    afcproto_list_free(names);
+    return ret;
+}
+
+int afcfs_readlink(afcfs_t fs, const char *path, char *buf, size_t size)
+{
+    struct stat st;
+    char *target = NULL;
+
+    int ret = lookup(fs, path, &st, &target);
+    if (!ret && (!S_ISLNK(st.st_mode) || !target))
+        ret = -EINVAL;
+
+    if (!ret && size > 0) {
+        strncpy(buf, target, size-1);
+        buf[size-1] = '\0';
+    }
+    free(target);
+    return ret;
+}
+
+int afcfs_statfs(afcfs_t fs, struct statvfs *st)
+{
+    char **info = NULL;
+    afcproto_client_t afc = idev_afc_pool_checkout(fs->pool);
+    afc_error_t err = (afc)? afcproto_get_device_info(afc, &info) : AFC_E_MUX_ERROR;
+    idev_afc_pool_checkin(fs->pool, afc);
+
+    if (!err) {
+        uint64_t bsize = info_number(info, "FSBlockSize");
+        if (!bsize)
+            bsize = 4096;
+
+        memset(st, 0, sizeof(*st));
+        st->f_bsize = st->f_frsize = (unsigned long)bsize;
+        st->f_blocks = (fsblkcnt_t)(info_number(info, "FSTotalBytes") / bsize);
+        st->f_bfree = st->f_bavail = (fsblkcnt_t)(info_number(info, "FSFreeBytes") / bsize);
+        st->f_namemax = 255;
+    }
+    afcproto_list_free(info);
+    return -afc_errno(err);
+}
+
+
+#pragma mark - file data
+
+static afcfs_file_t file_new(afcfs_t fs, const char *path, int flags)
+{
+    afcfs_file_t file = calloc(1, sizeof(struct afcfs_file));
+    if (!file)
+        return NULL;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((file->node = node_find(fs, path, true)) != NULL)
+        file->node->refs++;
+    pthread_mutex_unlock(&fs->lock);
+
+    if (!file->node) {
+        free(file);
+        return NULL;
+    }
+    file->flags = flags;
+    return file;
+}
+
+int afcfs_open(afcfs_t fs, const char *path, int flags, afcfs_file_t *file)
+{
+    struct stat st;
+
+    int ret = lookup(fs, path, &st, NULL);
+    if (!ret && S_ISDIR(st.st_mode))
+        ret = -EISDIR;
+    if (!ret && (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+        ret = afcfs_truncate(fs, path, 0);
+    if (!ret && (*file = file_new(fs, path, flags)) == NULL)
+        ret = -ENOMEM;
+    return ret;
+}
+
+int afcfs_create(afcfs_t fs, const char *path, afcfs_file_t *file)
+{
+    char *rpath = remote_path(fs, path);
+    uint64_t handle = 0;
+    afcproto_client_t afc = idev_afc_pool_checkout(fs->pool);
+    afc_error_t err = (!afc)? AFC_E_MUX_ERROR : (!rpath)? AFC_E_NO_MEM : afcproto_file_open(afc, rpath, AFC_FOPEN_WR, &handle);
+    if (!err)
+        err = afcproto_file_close(afc, handle);
+    idev_afc_pool_checkin(fs->pool, afc);
+    free(rpath);
+
+    if (err)
+        return -afc_errno(err);
+
+    pthread_mutex_lock(&fs->lock);
+    invalidate_parent(fs, path);
+    afcfs_node_t *node = node_find(fs, path, true);
+    if (node) {
+        node_drop_blocks(fs, node, 0);
+        memset(&node->st, 0, sizeof(node->st));
+        node->st.st_mode = S_IFREG | 0644;
+        node->st.st_nlink = 1;
+        node->st.st_blksize = BLOCK_SIZE;
+        node->st.st_uid = getuid();
+        node->st.st_gid = getgid();
+        stat_touch(&node->st);
+        node->st.st_atim = node->st.st_mtim;
+        node->size = node->remote_size = 0;
+        node->attr_err = 0;
+        node->attr_time = time(NULL);
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    return ((*file = file_new(fs, path, O_RDWR)) == NULL)? -ENOMEM : 0;
+}
+
+int afcfs_read(afcfs_t fs, afcfs_file_t file, char *buf, size_t size, off_t offset)
+{
+    afcfs_node_t *node = file->node;
+    size_t done = 0;
+    int ret = 0, retries = 0;
+
+    if (offset < 0)
+        return -EINVAL;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((uint64_t)offset >= node->size) {
+        pthread_mutex_unlock(&fs->lock);
+        return 0;
+    }
+    if (size > node->size - (uint64_t)offset)
+        size = (size_t)(node->size - (uint64_t)offset);
+
+    read_ahead(fs, node, (uint64_t)offset, size);
+
+    while (done < size) {
+        uint64_t pos = (uint64_t)offset + done;
+        uint64_t index = pos / BLOCK_SIZE;
+        afcfs_block_t *blk = block_find(fs, node, index);
+
+        if (!blk) {
+            // the blocks this read needs and nobody is fetching yet. A
+            // failed fetch by someone else is retried once
+            if (retries++ > 1 || (ret = fetch_missing(fs, node, index, (offset + size - 1) / BLOCK_SIZE)) < 0)
+                break;
+            continue;
+        }
+        if (blk->state == BLOCK_LOADING) {
+            pthread_cond_wait(&fs->cond, &fs->lock);
+            continue;
+        }
+
+        size_t off = (size_t)(pos % BLOCK_SIZE);
+        size_t n = BLOCK_SIZE - off;
+        if (n > size - done)
+            n = size - done;
+        memcpy(buf + done, blk->data + off, n);
+        lru_touch(fs, blk);
+        done += n;
+        retries = 0;
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    if (!done && !ret && size)
+        ret = -EIO;
+    return (done)? (int)done : ret;
+}
+
+int afcfs_write(afcfs_t fs, afcfs_file_t file, const char *buf, size_t size, off_t offset)
+{
+    afcfs_node_t *node = file->node;
+    size_t done = 0;
+    int ret = 0;
+
+    if (offset < 0)
+        return -EINVAL;
+
+    pthread_mutex_lock(&fs->lock);
+    if (file->flags & O_APPEND)
+        offset = (off_t)node->size;
+
+    while (done < size) {
+        uint64_t pos = (uint64_t)offset + done;
+        uint64_t index = pos / BLOCK_SIZE;
+        uint64_t start = index * BLOCK_SIZE;
+        size_t off = (size_t)(pos - start);
+        size_t n = BLOCK_SIZE - off;
+        if (n > size - done)
+            n = size - done;
+
+        afcfs_block_t *blk = block_find(fs, node, index);
+        if (blk && blk->state == BLOCK_LOADING) {
+            pthread_cond_wait(&fs->cond, &fs->lock);
+            continue;
+        }
+
+        if (!blk) {
+            // a block only partly overwritten needs the rest of its data
+            // from the device first
+            uint64_t have = (node->remote_size > start)? node->remote_size - start : 0;
+            if (have > BLOCK_SIZE)
+                have = BLOCK_SIZE;
+            if (off > 0 || off + n < have) {
+                if (have && (ret = fetch_missing(fs, node, index, index)) < 0)
+                    break;
+                if (have)
+                    continue;
+            }
+            if ((blk = block_new(fs, node, index, BLOCK_READY)) == NULL) {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+
+        memcpy(blk->data + off, buf + done, n);
+        if (!blk->dirty) {
+            blk->dirty = true;
+            node->ndirty++;
+            fs->ndirty++;
+        }
+        lru_touch(fs, blk);
+        done += n;
+
+        if (pos + n > node->size)
+            node->size = pos + n;
+    }
+
+    if (done)
+        stat_touch(&node->st);
+
+    bool flush = (node->ndirty * BLOCK_SIZE >= AFCFS_DIRTY_MAX || fs->ndirty >= fs->max_blocks / 2);
+    pthread_mutex_unlock(&fs->lock);
+
+    if (flush && !ret)
+        ret = node_flush(fs, node);
+
+    return (ret < 0)? ret : (int)done;
+}
+
+int afcfs_flush(afcfs_t fs, afcfs_file_t file)
+{
+    return node_flush(fs, file->node);
+}
+
+int afcfs_release(afcfs_t fs, afcfs_file_t file)
+{
+    int ret = node_flush(fs, file->node);
+
+    pthread_mutex_lock(&fs->lock);
+    node_unref(fs, file->node);
+    pthread_mutex_unlock(&fs->lock);
+    free(file);
+    return ret;
+}
+
+int afcfs_truncate(afcfs_t fs, const char *path, off_t size)
+{
+    if (size < 0)
+        return -EINVAL;
+
+    // data past the new end is thrown away rather than written back, the
+    // rest goes out first so the device ends up with both
+    pthread_mutex_lock(&fs->lock);
+    afcfs_node_t *node = node_find(fs, path, false);
+    if (node) {
+        node->refs++;
+        node_drop_blocks(fs, node, ((uint64_t)size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        afcfs_block_t *blk = block_find(fs, node, (uint64_t)size / BLOCK_SIZE);
+        if (blk && blk->state == BLOCK_READY)
+            memset(blk->data + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+        if (node->size > (uint64_t)size)
+            node->size = (uint64_t)size;
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    int ret = (node)? node_flush(fs, node) : 0;
+
+    if (!ret) {
+        char *rpath = remote_path(fs, path);
+        uint64_t handle = 0;
+        afcproto_client_t afc = idev_afc_pool_checkout(fs->pool);
+        afc_error_t err = (!afc)? AFC_E_MUX_ERROR : (!rpath)? AFC_E_NO_MEM : afcproto_file_open(afc, rpath, AFC_FOPEN_RW, &handle);
+        if (!err) {
+            err = afcproto_file_truncate(afc, handle, (uint64_t)size);
+            afc_error_t cerr = afcproto_file_close(afc, handle);
+            if (!err)
+                err = cerr;
+        }
+        idev_afc_pool_checkin(fs->pool, afc);
+        free(rpath);
+        ret = -afc_errno(err);
+    }
+
+    pthread_mutex_lock(&fs->lock);
+    if (node) {
+        if (!ret) {
+            node->size = node->remote_size = (uint64_t)size;
+            stat_touch(&node->st);
+        } else {
+            node->attr_time = 0;
+        }
+        node_unref(fs, node);
+    } else {
+        invalidate(fs, path);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+#pragma mark - namespace changes
+
+// runs one request on a pooled connection and invalidates what it changes
+static int change(afcfs_t fs, const char *path, afc_error_t(^request)(afcproto_client_t afc, const char *rpath))
+{
+    char *rpath = remote_path(fs, path);
+    afcproto_client_t afc = idev_afc_pool_checkout(fs->pool);
+    afc_error_t err = (!afc)? AFC_E_MUX_ERROR : (!rpath)? AFC_E_NO_MEM : request(afc, rpath);
+    idev_afc_pool_checkin(fs->pool, afc);
+    free(rpath);
+
+    pthread_mutex_lock(&fs->lock);
+    invalidate(fs, path);
+    pthread_mutex_unlock(&fs->lock);
+    return -afc_errno(err);
+}
+
+int afcfs_mkdir(afcfs_t fs, const char *path)
+{
+    return change(fs, path, ^afc_error_t(afcproto_client_t afc, const char *rpath) {
+        return afcproto_make_directory(afc, rpath);
+    });
+}
+
+static int remove_path(afcfs_t fs, const char *path)
+{
+    int ret = change(fs, path, ^afc_error_t(afcproto_client_t afc, const char *rpath) {
+        return afcproto_remove_path(afc, rpath);
+    });
+
+    if (!ret) {
+        pthread_mutex_lock(&fs->lock);
+        afcfs_node_t *node = node_find(fs, path, false);
+        if (node)
+            node_remove(fs, node);
+        pthread_mutex_unlock(&fs->lock);
+    }
+    return ret;
+}
+
+int afcfs_unlink(afcfs_t fs, const char *path)
+{
+    return remove_path(fs, path);
+}
+
+int afcfs_rmdir(afcfs_t fs, const char *path)
+{
+    return remove_path(fs, path);
+}
+
+int afcfs_rename(afcfs_t fs, const char *from, const char *to)
+{
+    char *rto = remote_path(fs, to);
+    if (!rto)
+        return -ENOMEM;
+
+    int ret = change(fs, from, ^afc_error_t(afcproto_client_t afc, const char *rpath) {
+        return afcproto_rename_path(afc, rpath, rto);
+    });
+    free(rto);
+
+    if (ret)
+        return ret;
+
+    // whatever was at the destination is gone, and everything cached under
+    // the old path moves along - open files included, so their buffered
+    // writes go to the new name
+    pthread_mutex_lock(&fs->lock);
+    invalidate_parent(fs, to);
+
+    size_t i, count = 0;
+    afcfs_node_t **moved = calloc(fs->nnodes + 1, sizeof(afcfs_node_t*));
+    for (i=0; i<fs->node_buckets; i++) {
+        afcfs_node_t *node, *next;
+        for (node = fs->nodes[i]; node; node = next) {
+            next = node->hnext;
+            if (path_within(node->path, to))
+                node_remove(fs, node);
+            else if (moved && path_within(node->path, from))
+                moved[count++] = node;
+        }
+    }
+
+    size_t flen = strlen(from);
+    for (i=0; i<count; i++) {
+        afcfs_node_t *node = moved[i];
+        char *path = NULL;
+        node_unlink(fs, node);
+        if (asprintf(&path, "%s%s", to, node->path + flen) < 0) {
+            node_link(fs, node);
+            node_remove(fs, node);
+            continue;
+        }
+        free(node->path);
+        node->path = path;
+        node_link(fs, node);
+    }
+    if (!moved) {
+        // no room to move them; forget them instead
+        for (i=0; i<fs->node_buckets; i++) {
+            afcfs_node_t *node, *next;
+            for (node = fs->nodes[i]; node; node = next) {
+                next = node->hnext;
+                if (path_within(node->path, from))
+                    node_remove(fs, node);
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->lock);
+    free(moved);
+    return 0;
+}
+
+int afcfs_symlink(afcfs_t fs, const char *target, const char *path)
+{
+    return change(fs, path, ^afc_error_t(afcproto_client_t afc, const char *rpath) {
+        return afcproto_make_link(afc, AFC_SYMLINK, target, rpath);
+    });
+}
+
+int afcfs_link(afcfs_t fs, const char *from, const char *to)
+{
+    char *rfrom = remote_path(fs, from);
+    if (!rfrom)
+        return -ENOMEM;
+
+    int ret = change(fs, to, ^afc_error_t(afcproto_client_t afc, const char *rpath) {
+        return afcproto_make_link(afc, AFC_HARDLINK, rfrom, rpath);
+    });
+    free(rfrom);
+
+    pthread_mutex_lock(&fs->lock);
+    invalidate(fs, from);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+int afcfs_set_mtime(afcfs_t fs, const char *path, uint64_t mtime_ns)
+{
+    // buffered writes would move the mtime again when they go out
+    pthread_mutex_lock(&fs->lock);
+    afcfs_node_t *node = node_find(fs, path, false);
+    if (node)
+        node->refs++;
+    pthread_mutex_unlock(&fs->lock);
+
+    int ret = (node)? node_flush(fs, node) : 0;
+    if (!ret) {
+        ret = change(fs, path, ^afc_error_t(afcproto_client_t afc, const char *rpath) {
+            return afcproto_set_file_time(afc, rpath, mtime_ns);
+        });
+    }
+
+    if (node) {
+        pthread_mutex_lock(&fs->lock);
+        node_unref(fs, node);
+        pthread_mutex_unlock(&fs->lock);
+    }
+    return ret;
+}
+
+
+#pragma mark - FUSE
+
+#ifdef HAVE_FUSE
+
+#include <fuse.h>
+
+// FUSE 3 added a file info argument to several calls and flags to others.
+// MacOS has FUSE 2 through macFUSE.
+#if FUSE_USE_VERSION >= 30
+  #define FI_ARG , struct fuse_file_info *fi
+  #define FILL(filler, buf, name, st) filler(buf, name, st, 0, 0)
+#else
+  #define FI_ARG
+  #define FILL(filler, buf, name, st) filler(buf, name, st, 0)
+#endif
+
+static afcfs_t fuse_fs(void)
+{
+    return fuse_get_context()->private_data;
+}
+
+static afcfs_file_t fuse_file(struct fuse_file_info *fi)
+{
+    return (afcfs_file_t)(uintptr_t)fi->fh;
+}
+
+static int fs_getattr(const char *path, struct stat *st FI_ARG)
+{
+    return afcfs_getattr(fuse_fs(), path, st);
+}
+
+#if FUSE_USE_VERSION >= 30
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+#else
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+#endif
+{
+    FILL(filler, buf, ".", NULL);
+    FILL(filler, buf, "..", NULL);
+    return afcfs_readdir(fuse_fs(), path, ^int(const char *name, const struct stat *st) {
+        return FILL(filler, buf, name, st);
+    });
+}
+
+static int fs_readlink(const char *path, char *buf, size_t size)
+{
+    return afcfs_readlink(fuse_fs(), path, buf, size);
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+    afcfs_file_t file = NULL;
+    int ret = afcfs_open(fuse_fs(), path, fi->flags, &file);
+    fi->fh = (uint64_t)(uintptr_t)file;
+    return ret;
+}
+
+static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    afcfs_file_t file = NULL;
+    int ret = afcfs_create(fuse_fs(), path, &file);
+    fi->fh = (uint64_t)(uintptr_t)file;
+    return ret;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    return afcfs_read(fuse_fs(), fuse_file(fi), buf, size, offset);
+}
+
+static int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    return afcfs_write(fuse_fs(), fuse_file(fi), buf, size, offset);
+}
+
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+    return afcfs_flush(fuse_fs(), fuse_file(fi));
+}
+
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return afcfs_flush(fuse_fs(), fuse_file(fi));
+}
+
+static int fs_release(const char *path, struct fuse_file_info *fi)
+{
+    return afcfs_release(fuse_fs(), fuse_file(fi));
+}
+
+static int fs_truncate(const char *path, off_t size FI_ARG)
+{
+    return afcfs_truncate(fuse_fs(), path, size);
+}
+
+#if FUSE_USE_VERSION < 30
+static int fs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    return afcfs_truncate(fuse_fs(), path, size);
+}
+#endif
+
+static int fs_mkdir(const char *path, mode_t mode)
+{
+    return afcfs_mkdir(fuse_fs(), path);
+}
+
+static int fs_unlink(const char *path)
+{
+    return afcfs_unlink(fuse_fs(), path);
+}
+
+static int fs_rmdir(const char *path)
+{
+    return afcfs_rmdir(fuse_fs(), path);
+}
+
+#if FUSE_USE_VERSION >= 30
+static int fs_rename(const char *from, const char *to, unsigned int flags)
+{
+    // AFC can't exchange paths or refuse to replace one
+    if (flags)
+        return -EINVAL;
+    return afcfs_rename(fuse_fs(), from, to);
+}
+#else
+static int fs_rename(const char *from, const char *to)
+{
+    return afcfs_rename(fuse_fs(), from, to);
+}
+#endif
+
+static int fs_symlink(const char *target, const char *path)
+{
+    return afcfs_symlink(fuse_fs(), target, path);
+}
+
+static int fs_link(const char *from, const char *to)
+{
+    return afcfs_link(fuse_fs(), from, to);
+}
+
+static int fs_utimens(const char *path, const struct timespec tv[2] FI_ARG)
+{
+    struct timespec mtime = tv[1];
+    if (mtime.tv_nsec == UTIME_OMIT)
+        return 0;
+    if (mtime.tv_nsec == UTIME_NOW)
+        clock_gettime(CLOCK_REALTIME, &mtime);
+    return afcfs_set_mtime(fuse_fs(), path, (uint64_t)mtime.tv_sec * 1000000000ULL + (uint64_t)mtime.tv_nsec);
+}
+
+// AFC has no owners or permissions to change. Accepting the calls keeps
+// "cp -p" and friends working
+static int fs_chmod(const char *path, mode_t mode FI_ARG)
+{
+    return 0;
+}
+
+static int fs_chown(const char *path, uid_t uid, gid_t gid FI_ARG)
+{
+    return 0;
+}
+
+static int fs_statfs(const char *path, struct statvfs *st)
+{
+    return afcfs_statfs(fuse_fs(), st);
+}
+
+#if FUSE_USE_VERSION >= 30
+static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    afcfs_t fs = fuse_fs();
+
+    // let the kernel keep attributes as long as we do
+    cfg->attr_timeout = cfg->entry_timeout = cfg->negative_timeout = fs->ttl;
+    return fs;
+}
+#else
+static void *fs_init(struct fuse_conn_info *conn)
+{
+    return fuse_fs();
+}
+#endif
+
+static void fs_destroy(void *private_data)
+{
+    afcfs_sync(private_data);
+}
+
+static struct fuse_operations fs_ops = {
+    .init       = fs_init,
+    .destroy    = fs_destroy,
+    .getattr    = fs_getattr,
+    .readdir    = fs_readdir,
+    .readlink   = fs_readlink,
+    .open       = fs_open,
+    .create     = fs_create,
+    .read       = fs_read,
+    .write      = fs_write,
+    .flush      = fs_flush,
+    .fsync      = fs_fsync,
+    .release    = fs_release,
+    .truncate   = fs_truncate,
+#if FUSE_USE_VERSION < 30
+    .ftruncate  = fs_ftruncate,
+#endif
+    .mkdir      = fs_mkdir,
+    .unlink     = fs_unlink,
+    .rmdir      = fs_rmdir,
+    .rename     = fs_rename,
+    .symlink    = fs_symlink,
+    .link       = fs_link,
+    .utimens    = fs_utimens,
+    .chmod      = fs_chmod,
+    .chown      = fs_chown,
+    .statfs     = fs_statfs,
+};
+
+int afcfs_mount(afcfs_t fs, const char *mountpoint, const char *fsname, int argc, char **args)
+{
+    char *opts = NULL;
+#if FUSE_USE_VERSION >= 30
+    int n = asprintf(&opts, "fsname=%s", fsname);
+#else
+    int n = asprintf(&opts, "fsname=%s,attr_timeout=%d,entry_timeout=%d,negative_timeout=%d", fsname, fs->ttl, fs->ttl, fs->ttl);
+#endif
+    char **fargv = calloc(argc + 6, sizeof(char*));
+    if (n < 0 || !fargv) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(fargv);
+        return EXIT_FAILURE;
+    }
+
+    // always in the foreground: the connections and threads we already
+    // have wouldn't survive FUSE daemonizing
+    int i, fargc = 0;
+    fargv[fargc++] = "afcclient";
+    fargv[fargc++] = "-f";
+    fargv[fargc++] = "-o";
+    fargv[fargc++] = opts;
+    for (i=0; i<argc; i++)
+        fargv[fargc++] = args[i];
+    fargv[fargc++] = (char*)mountpoint;
+
+    int ret = fuse_main(fargc, fargv, &fs_ops, fs);
+
+    free(fargv);
+    free(opts);
+    return (ret == 0)? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#else
+
+int afcfs_mount(afcfs_t fs, const char *mountpoint, const char *fsname, int argc, char **args)
+{
+    fprintf(stderr, "Error: afcclient was built without FUSE support (rebuild with 'make FUSE=1')\n");
+    return EXIT_FAILURE;
+}
+
+#endif // HAVE_FUSE
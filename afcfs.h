@@ -0,0 +1,109 @@
+/*
+ * afcfs
+ * Date: Oct 2026
+ *
+ * A caching filesystem view of a device over an AFC connection pool, as
+ * used by "afcclient mount". The calls follow FUSE's conventions - absolute
+ * paths below the mounted directory, 0 or a byte count on success and a
+ * negative errno on failure - so the FUSE glue stays thin, but nothing here
+ * needs FUSE and the cache can be driven directly.
+ *
+ *  - file info and directory listings are kept for a TTL, and a listing
+ *    fetches the info of every entry with requests pipelined, so the stat
+ *    calls that follow a readdir don't go to the device at all.
+ *  - file data is kept in a block cache shared by all files, evicted least
+ *    recently used first. Blocks are dropped when a file's size or mtime is
+ *    seen to change on the device.
+ *  - a file being read sequentially has the blocks ahead of the reader
+ *    fetched in the background, several READs in flight at a time.
+ *  - writes go into the cache and reach the device on flush, fsync or
+ *    close, or earlier once too much is waiting.
+ */
+
+#ifndef _afcfs_h
+#define _afcfs_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "libidev.h"
+
+#define AFCFS_BLOCK_SIZE (256*1024)
+#define AFCFS_DEFAULT_CACHE_SIZE (256*1024*1024)
+#define AFCFS_DEFAULT_TTL 10
+
+// blocks kept requested ahead of a sequential reader
+#define AFCFS_READAHEAD 16
+
+// background threads doing the read-ahead
+#define AFCFS_PREFETCHERS 2
+
+// a file with this much unflushed data is written back right away
+#define AFCFS_DIRTY_MAX (32*1024*1024)
+
+typedef struct afcfs *afcfs_t;
+
+typedef struct afcfs_file *afcfs_file_t;
+
+// Paths are looked up below root on the device. The pool should have room
+// for the read-ahead threads plus however many calls run at once.
+afcfs_t afcfs_new(idev_afc_pool_t pool, const char *root, size_t cache_size, int ttl);
+
+// writes back anything still buffered and frees the cache
+void afcfs_free(afcfs_t fs);
+
+// writes back all buffered data
+int afcfs_sync(afcfs_t fs);
+
+int afcfs_getattr(afcfs_t fs, const char *path, struct stat *st);
+
+// calls filler for every entry of the directory, "." and ".." excluded. A
+// non-zero return from filler stops the listing
+int afcfs_readdir(afcfs_t fs, const char *path, int(^filler)(const char *name, const struct stat *st));
+
+int afcfs_readlink(afcfs_t fs, const char *path, char *buf, size_t size);
+
+int afcfs_open(afcfs_t fs, const char *path, int flags, afcfs_file_t *file);
+
+// creates or truncates a regular file and opens it
+int afcfs_create(afcfs_t fs, const char *path, afcfs_file_t *file);
+
+int afcfs_read(afcfs_t fs, afcfs_file_t file, char *buf, size_t size, off_t offset);
+
+int afcfs_write(afcfs_t fs, afcfs_file_t file, const char *buf, size_t size, off_t offset);
+
+// writes back the file's buffered data, and reports a failed background
+// write-back
+int afcfs_flush(afcfs_t fs, afcfs_file_t file);
+
+// flushes and closes the file
+int afcfs_release(afcfs_t fs, afcfs_file_t file);
+
+int afcfs_truncate(afcfs_t fs, const char *path, off_t size);
+
+int afcfs_mkdir(afcfs_t fs, const char *path);
+
+int afcfs_unlink(afcfs_t fs, const char *path);
+
+int afcfs_rmdir(afcfs_t fs, const char *path);
+
+int afcfs_rename(afcfs_t fs, const char *from, const char *to);
+
+int afcfs_symlink(afcfs_t fs, const char *target, const char *path);
+
+int afcfs_link(afcfs_t fs, const char *from, const char *to);
+
+// mtime is in nanoseconds since the epoch
+int afcfs_set_mtime(afcfs_t fs, const char *path, uint64_t mtime_ns);
+
+int afcfs_statfs(afcfs_t fs, struct statvfs *st);
+
+// Mounts fs on mountpoint and serves it until unmounted. args are extra
+// FUSE options ("-o", "ro", ...). Returns an exit status; fails when built
+// without FUSE support.
+int afcfs_mount(afcfs_t fs, const char *mountpoint, const char *fsname, int argc, char **args);
+
+#endif // _afcfs_h
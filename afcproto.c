@@ -0,0 +1,852 @@
+/*
+ * afcproto
+ * Date: Oct 2026
+ *
+ * A small client for the AFC wire protocol. See afcproto.h
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef __APPLE__
+  #include <libkern/OSByteOrder.h>
+  #define htole64(x) OSSwapHostToLittleInt64(x)
+  #define le64toh(x) OSSwapLittleToHostInt64(x)
+#else
+  #include <endian.h>
+#endif
+
+#include "afcproto.h"
+
+// Requests that are waiting for their reply, kept for the observer. Replies
+// come back in request order, so reply n always answers packet n.
+#define SENT_SLOTS (AFCPROTO_READER_MAX_WINDOW * 2)
+
+typedef struct sent_request {
+    uint64_t packet_num_1; // packet_num + 1, 0 if the slot is free
+    uint64_t operation;
+    uint64_t bytes_out;
+    uint64_t sent_ns;
+} sent_request_t;
+
+struct afcproto_client {
+    afcproto_transport_t transport;
+    uint64_t packet_num;
+    bool broken;
+
+    // only used with an observer
+    uint64_t replies;
+    uint32_t reply_len;
+    sent_request_t *sent;
+};
+
+static afcproto_observer_t observer = NULL;
+
+
+#pragma mark - transports
+
+// a peer that went away should break the connection, not kill the process
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+static int fd_send(void *ctx, const char *buf, uint32_t len)
+{
+    int fd = (int)(intptr_t)ctx;
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fd_recv(void *ctx, char *buf, uint32_t len)
+{
+    int fd = (int)(intptr_t)ctx;
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void fd_close(void *ctx)
+{
+    close((int)(intptr_t)ctx);
+}
+
+afcproto_client_t afcproto_client_new(afcproto_transport_t *transport)
+{
+    afcproto_client_t afc = calloc(1, sizeof(struct afcproto_client));
+    if (afc)
+        afc->transport = *transport;
+
+    return afc;
+}
+
+afcproto_client_t afcproto_client_new_fd(int fd)
+{
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    afcproto_transport_t t = {
+        .ctx = (void*)(intptr_t)fd,
+        .send = fd_send,
+        .recv = fd_recv,
+        .close = fd_close,
+    };
+    return afcproto_client_new(&t);
+}
+
+// address is either "unix:/path/to/socket" or "host:port"
+afcproto_client_t afcproto_client_new_address(const char *address)
+{
+    int fd = -1;
+
+    if (!strncmp(address, "unix:", 5)) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, address+5, sizeof(sun.sun_path)-1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) {
+            fprintf(stderr, "Error: cannot connect to %s - %s\n", address, strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        char host[256];
+        const char *port = strrchr(address, ':');
+        if (!port || (size_t)(port - address) >= sizeof(host)) {
+            fprintf(stderr, "Error: invalid address (expected host:port or unix:path): %s\n", address);
+            return NULL;
+        }
+        memcpy(host, address, port - address);
+        host[port - address] = '\0';
+        port++;
+
+        struct addrinfo hints, *res=NULL, *ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        int gerr = getaddrinfo(host, port, &hints, &res);
+        if (gerr) {
+            fprintf(stderr, "Error: cannot resolve %s - %s\n", address, gai_strerror(gerr));
+            return NULL;
+        }
+
+        for (ai=res; ai; ai=ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+
+        if (fd < 0) {
+            fprintf(stderr, "Error: cannot connect to %s - %s\n", address, strerror(errno));
+        } else {
+            // requests are small and latency bound - don't let nagle batch them
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+
+    return (fd >= 0)? afcproto_client_new_fd(fd) : NULL;
+}
+
+void afcproto_client_free(afcproto_client_t afc)
+{
+    if (afc) {
+        if (afc->transport.close)
+            afc->transport.close(afc->transport.ctx);
+        free(afc->sent);
+        free(afc);
+    }
+}
+
+bool afcproto_client_is_broken(afcproto_client_t afc)
+{
+    return afc->broken;
+}
+
+void afcproto_list_free(char **list)
+{
+    if (list) {
+        int i;
+        for (i=0; list[i]; i++)
+            free(list[i]);
+        free(list);
+    }
+}
+
+char **afcproto_list_dup(char **list)
+{
+    int i, count=0;
+    while (list && list[count])
+        count++;
+
+    char **ret = calloc(count+1, sizeof(char*));
+    for (i=0; ret && i<count; i++) {
+        if ((ret[i] = strdup(list[i])) == NULL) {
+            afcproto_list_free(ret);
+            return NULL;
+        }
+    }
+    return ret;
+}
+
+const char *afcproto_info_value(char **info, const char *key)
+{
+    int i;
+    for (i=0; info && info[i] && info[i+1]; i+=2) {
+        if (!strcmp(info[i], key))
+            return info[i+1];
+    }
+    return NULL;
+}
+
+// splits a buffer of NUL terminated strings into a NULL terminated list
+static char **make_strings_list(const char *data, uint32_t len)
+{
+    uint32_t i, count=0;
+    for (i=0; i<len; i++) {
+        if (data[i] == '\0')
+            count++;
+    }
+
+    char **list = calloc(count+1, sizeof(char*));
+    if (list) {
+        const char *p = data;
+        for (i=0; i<count; i++) {
+            list[i] = strdup(p);
+            p += strlen(p)+1;
+        }
+    }
+    return list;
+}
+
+
+#pragma mark - instrumentation
+
+void afcproto_set_observer(afcproto_observer_t obs)
+{
+    __atomic_store_n(&observer, obs, __ATOMIC_RELEASE);
+}
+
+afcproto_observer_t afcproto_get_observer(void)
+{
+    return __atomic_load_n(&observer, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void observe_request(afcproto_client_t afc, uint64_t packet_num, uint64_t operation, uint32_t data_len)
+{
+    if (!afc->sent && (afc->sent = calloc(SENT_SLOTS, sizeof(sent_request_t))) == NULL)
+        return;
+
+    // if more than SENT_SLOTS are in flight the oldest just goes unrecorded
+    sent_request_t *s = &afc->sent[packet_num % SENT_SLOTS];
+    s->packet_num_1 = packet_num + 1;
+    s->operation = operation;
+    s->bytes_out = data_len;
+    s->sent_ns = now_ns();
+}
+
+// 'replies' is the reply count from before reading - if it didn't move, no
+// reply was read and there is nothing to report
+static void observe_reply(afcproto_client_t afc, uint64_t replies, afc_error_t err)
+{
+    afcproto_observer_t obs = afcproto_get_observer();
+    if (!obs || !afc->sent || afc->replies == replies)
+        return;
+
+    sent_request_t *s = &afc->sent[replies % SENT_SLOTS];
+    if (s->packet_num_1 != replies + 1)
+        return;
+
+    s->packet_num_1 = 0;
+    obs(s->operation, s->bytes_out, afc->reply_len, now_ns() - s->sent_ns, err);
+}
+
+
+#pragma mark - request/response primitives
+
+afc_error_t afcproto_send_request(
+        afcproto_client_t afc,
+        uint64_t operation,
+        const char *hdr, uint32_t hdr_len,
+        const char *data, uint32_t data_len )
+{
+    if (afc->broken)
+        return AFC_E_MUX_ERROR;
+
+    char pkt[AFCPROTO_HEADER_LEN + 64];
+    char *buf = pkt;
+    uint32_t pkt_len = AFCPROTO_HEADER_LEN + hdr_len;
+
+    if (pkt_len > sizeof(pkt)) {
+        buf = malloc(pkt_len);
+        if (!buf)
+            return AFC_E_NO_MEM;
+    }
+
+    afcproto_header_t *h = (afcproto_header_t*)buf;
+    memcpy(h->magic, AFCPROTO_MAGIC, AFCPROTO_MAGIC_LEN);
+    h->entire_length = htole64((uint64_t)pkt_len + data_len);
+    h->this_length = htole64(pkt_len);
+    h->packet_num = htole64(afc->packet_num);
+    h->operation = htole64(operation);
+    if (hdr_len)
+        memcpy(buf + AFCPROTO_HEADER_LEN, hdr, hdr_len);
+
+    afc_error_t err = AFC_E_SUCCESS;
+    if (afc->transport.send(afc->transport.ctx, buf, pkt_len) != 0 ||
+        (data_len && afc->transport.send(afc->transport.ctx, data, data_len) != 0))
+    {
+        afc->broken = true;
+        err = AFC_E_MUX_ERROR;
+    } else if (afcproto_get_observer()) {
+        observe_request(afc, afc->packet_num, operation, data_len);
+    }
+    afc->packet_num++;
+
+    if (buf != pkt)
+        free(buf);
+
+    return err;
+}
+
+static afc_error_t receive_header(afcproto_client_t afc, uint64_t *operation, uint32_t *payload_len)
+{
+    if (afc->broken)
+        return AFC_E_MUX_ERROR;
+
+    afcproto_header_t h;
+    if (afc->transport.recv(afc->transport.ctx, (char*)&h, sizeof(h)) != 0) {
+        afc->broken = true;
+        return AFC_E_MUX_ERROR;
+    }
+
+    uint64_t entire_length = le64toh(h.entire_length);
+    if (memcmp(h.magic, AFCPROTO_MAGIC, AFCPROTO_MAGIC_LEN) != 0 ||
+        entire_length < AFCPROTO_HEADER_LEN || entire_length - AFCPROTO_HEADER_LEN > UINT32_MAX)
+    {
+        afc->broken = true;
+        return AFC_E_OP_HEADER_INVALID;
+    }
+
+    *operation = le64toh(h.operation);
+    *payload_len = (uint32_t)(entire_length - AFCPROTO_HEADER_LEN);
+
+    afc->replies++;
+    afc->reply_len = (*operation == AFC_OP_STATUS)? 0 : *payload_len;
+    return AFC_E_SUCCESS;
+}
+
+static afc_error_t receive_payload(afcproto_client_t afc, char *buf, uint32_t len)
+{
+    if (len && afc->transport.recv(afc->transport.ctx, buf, len) != 0) {
+        afc->broken = true;
+        return AFC_E_MUX_ERROR;
+    }
+    return AFC_E_SUCCESS;
+}
+
+static afc_error_t status_error(const char *payload, uint32_t len)
+{
+    uint64_t code;
+    if (len < sizeof(code))
+        return AFC_E_OP_HEADER_INVALID;
+
+    memcpy(&code, payload, sizeof(code));
+    return (afc_error_t)le64toh(code);
+}
+
+static afc_error_t receive_response(afcproto_client_t afc, uint64_t *operation, char **data, uint32_t *data_len)
+{
+    uint64_t op=0;
+    uint32_t len=0;
+
+    *data = NULL;
+    *data_len = 0;
+
+    afc_error_t err = receive_header(afc, &op, &len);
+    if (err)
+        return err;
+
+    char *buf = malloc((size_t)len + 1);
+    if (!buf) {
+        afc->broken = true;
+        return AFC_E_NO_MEM;
+    }
+
+    err = receive_payload(afc, buf, len);
+    if (err) {
+        free(buf);
+        return err;
+    }
+    buf[len] = '\0';
+
+    if (operation)
+        *operation = op;
+
+    if (op == AFC_OP_STATUS) {
+        err = status_error(buf, len);
+        free(buf);
+        return err;
+    }
+
+    *data = buf;
+    *data_len = len;
+    return AFC_E_SUCCESS;
+}
+
+static afc_error_t receive_response_into(afcproto_client_t afc, char *buf, uint32_t buf_len, uint32_t *data_len)
+{
+    uint64_t op=0;
+    uint32_t len=0;
+
+    *data_len = 0;
+
+    afc_error_t err = receive_header(afc, &op, &len);
+    if (err)
+        return err;
+
+    if (op == AFC_OP_STATUS) {
+        char status[16];
+        if (len > sizeof(status)) {
+            afc->broken = true;
+            return AFC_E_OP_HEADER_INVALID;
+        }
+        err = receive_payload(afc, status, len);
+        return (err)? err : status_error(status, len);
+    }
+
+    if (len > buf_len) {
+        // we can't resync the stream without the payload - give up on this connection
+        afc->broken = true;
+        return AFC_E_TOO_MUCH_DATA;
+    }
+
+    err = receive_payload(afc, buf, len);
+    if (!err)
+        *data_len = len;
+
+    return err;
+}
+
+afc_error_t afcproto_receive_response(afcproto_client_t afc, uint64_t *operation, char **data, uint32_t *data_len)
+{
+    uint64_t replies = afc->replies;
+    afc_error_t err = receive_response(afc, operation, data, data_len);
+    observe_reply(afc, replies, err);
+    return err;
+}
+
+afc_error_t afcproto_receive_response_into(afcproto_client_t afc, char *buf, uint32_t buf_len, uint32_t *data_len)
+{
+    uint64_t replies = afc->replies;
+    afc_error_t err = receive_response_into(afc, buf, buf_len, data_len);
+    observe_reply(afc, replies, err);
+    return err;
+}
+
+afc_error_t afcproto_receive_list(afcproto_client_t afc, char ***list)
+{
+    char *buf=NULL;
+    uint32_t len=0;
+
+    *list = NULL;
+
+    afc_error_t err = afcproto_receive_response(afc, NULL, &buf, &len);
+    if (!err) {
+        *list = make_strings_list(buf, len);
+        if (!*list)
+            err = AFC_E_NO_MEM;
+    }
+    free(buf);
+    return err;
+}
+
+// sends one request and waits for its reply
+static afc_error_t transact(
+        afcproto_client_t afc,
+        uint64_t operation,
+        const char *hdr, uint32_t hdr_len,
+        const char *data, uint32_t data_len,
+        char **resp, uint32_t *resp_len )
+{
+    afc_error_t err = afcproto_send_request(afc, operation, hdr, hdr_len, data, data_len);
+    if (err)
+        return err;
+
+    char *buf=NULL;
+    uint32_t len=0;
+    err = afcproto_receive_response(afc, NULL, &buf, &len);
+
+    if (resp && !err) {
+        *resp = buf;
+        *resp_len = len;
+    } else if (buf) {
+        free(buf);
+    }
+    return err;
+}
+
+static afc_error_t transact_path(afcproto_client_t afc, uint64_t operation, const char *path)
+{
+    if (!path)
+        return AFC_E_INVALID_ARG;
+
+    return transact(afc, operation, path, strlen(path)+1, NULL, 0, NULL, NULL);
+}
+
+static afc_error_t transact_list(afcproto_client_t afc, uint64_t operation, const char *path, char ***list)
+{
+    *list = NULL;
+
+    afc_error_t err = afcproto_send_request(afc, operation, path, (path)? strlen(path)+1 : 0, NULL, 0);
+    return (err)? err : afcproto_receive_list(afc, list);
+}
+
+
+#pragma mark - AFC operations
+
+afc_error_t afcproto_get_device_info(afcproto_client_t afc, char ***infos)
+{
+    return transact_list(afc, AFC_OP_GET_DEVINFO, NULL, infos);
+}
+
+afc_error_t afcproto_read_directory(afcproto_client_t afc, const char *path, char ***list)
+{
+    return (path)? transact_list(afc, AFC_OP_READ_DIR, path, list) : AFC_E_INVALID_ARG;
+}
+
+afc_error_t afcproto_get_file_info(afcproto_client_t afc, const char *path, char ***infos)
+{
+    return (path)? transact_list(afc, AFC_OP_GET_FILE_INFO, path, infos) : AFC_E_INVALID_ARG;
+}
+
+afc_error_t afcproto_file_open(afcproto_client_t afc, const char *path, afc_file_mode_t mode, uint64_t *handle)
+{
+    if (!path || !handle)
+        return AFC_E_INVALID_ARG;
+
+    size_t plen = strlen(path)+1;
+    char *hdr = malloc(sizeof(uint64_t) + plen);
+    if (!hdr)
+        return AFC_E_NO_MEM;
+
+    uint64_t m = htole64(mode);
+    memcpy(hdr, &m, sizeof(m));
+    memcpy(hdr+sizeof(m), path, plen);
+
+    char *buf=NULL;
+    uint32_t len=0;
+    afc_error_t err = transact(afc, AFC_OP_FILE_OPEN, hdr, sizeof(m)+plen, NULL, 0, &buf, &len);
+    free(hdr);
+
+    if (!err) {
+        if (len >= sizeof(*handle)) {
+            memcpy(handle, buf, sizeof(*handle));
+            *handle = le64toh(*handle);
+        } else {
+            err = AFC_E_OP_HEADER_INVALID;
+        }
+    }
+    free(buf);
+    return err;
+}
+
+afc_error_t afcproto_file_close(afcproto_client_t afc, uint64_t handle)
+{
+    uint64_t h = htole64(handle);
+    return transact(afc, AFC_OP_FILE_CLOSE, (char*)&h, sizeof(h), NULL, 0, NULL, NULL);
+}
+
+static afc_error_t send_read(afcproto_client_t afc, uint64_t handle, uint32_t length)
+{
+    uint64_t hdr[2] = { htole64(handle), htole64(length) };
+    return afcproto_send_request(afc, AFC_OP_READ, (char*)hdr, sizeof(hdr), NULL, 0);
+}
+
+afc_error_t afcproto_file_read(afcproto_client_t afc, uint64_t handle, char *buf, uint32_t length, uint32_t *bytes_read)
+{
+    *bytes_read = 0;
+
+    afc_error_t err = send_read(afc, handle, length);
+    if (!err)
+        err = afcproto_receive_response_into(afc, buf, length, bytes_read);
+
+    return err;
+}
+
+afc_error_t afcproto_file_write(afcproto_client_t afc, uint64_t handle, const char *buf, uint32_t length, uint32_t *bytes_written)
+{
+    uint64_t h = htole64(handle);
+
+    *bytes_written = 0;
+
+    afc_error_t err = transact(afc, AFC_OP_WRITE, (char*)&h, sizeof(h), buf, length, NULL, NULL);
+    if (!err)
+        *bytes_written = length;
+
+    return err;
+}
+
+static afc_error_t send_seek(afcproto_client_t afc, uint64_t handle, int64_t offset, int whence)
+{
+    uint64_t hdr[3] = { htole64(handle), htole64(whence), htole64((uint64_t)offset) };
+    return afcproto_send_request(afc, AFC_OP_FILE_SEEK, (char*)hdr, sizeof(hdr), NULL, 0);
+}
+
+afc_error_t afcproto_file_seek(afcproto_client_t afc, uint64_t handle, int64_t offset, int whence)
+{
+    uint64_t hdr[3] = { htole64(handle), htole64(whence), htole64((uint64_t)offset) };
+    return transact(afc, AFC_OP_FILE_SEEK, (char*)hdr, sizeof(hdr), NULL, 0, NULL, NULL);
+}
+
+afc_error_t afcproto_file_tell(afcproto_client_t afc, uint64_t handle, uint64_t *position)
+{
+    uint64_t h = htole64(handle);
+    char *buf=NULL;
+    uint32_t len=0;
+
+    afc_error_t err = transact(afc, AFC_OP_FILE_TELL, (char*)&h, sizeof(h), NULL, 0, &buf, &len);
+    if (!err) {
+        if (len >= sizeof(*position)) {
+            memcpy(position, buf, sizeof(*position));
+            *position = le64toh(*position);
+        } else {
+            err = AFC_E_OP_HEADER_INVALID;
+        }
+    }
+    free(buf);
+    return err;
+}
+
+afc_error_t afcproto_file_truncate(afcproto_client_t afc, uint64_t handle, uint64_t newsize)
+{
+    uint64_t hdr[2] = { htole64(handle), htole64(newsize) };
+    return transact(afc, AFC_OP_FILE_SET_SIZE, (char*)hdr, sizeof(hdr), NULL, 0, NULL, NULL);
+}
+
+afc_error_t afcproto_remove_path(afcproto_client_t afc, const char *path)
+{
+    return transact_path(afc, AFC_OP_REMOVE_PATH, path);
+}
+
+afc_error_t afcproto_remove_path_and_contents(afcproto_client_t afc, const char *path)
+{
+    return transact_path(afc, AFC_OP_REMOVE_PATH_AND_CONTENTS, path);
+}
+
+afc_error_t afcproto_make_directory(afcproto_client_t afc, const char *path)
+{
+    return transact_path(afc, AFC_OP_MAKE_DIR, path);
+}
+
+afc_error_t afcproto_rename_path(afcproto_client_t afc, const char *from, const char *to)
+{
+    if (!from || !to)
+        return AFC_E_INVALID_ARG;
+
+    size_t flen = strlen(from)+1, tlen = strlen(to)+1;
+    char *hdr = malloc(flen + tlen);
+    if (!hdr)
+        return AFC_E_NO_MEM;
+
+    memcpy(hdr, from, flen);
+    memcpy(hdr+flen, to, tlen);
+
+    afc_error_t err = transact(afc, AFC_OP_RENAME_PATH, hdr, flen+tlen, NULL, 0, NULL, NULL);
+    free(hdr);
+    return err;
+}
+
+afc_error_t afcproto_make_link(afcproto_client_t afc, afc_link_type_t linktype, const char *target, const char *linkname)
+{
+    if (!target || !linkname)
+        return AFC_E_INVALID_ARG;
+
+    size_t tlen = strlen(target)+1, llen = strlen(linkname)+1;
+    char *hdr = malloc(sizeof(uint64_t) + tlen + llen);
+    if (!hdr)
+        return AFC_E_NO_MEM;
+
+    uint64_t type = htole64(linktype);
+    memcpy(hdr, &type, sizeof(type));
+    memcpy(hdr+sizeof(type), target, tlen);
+    memcpy(hdr+sizeof(type)+tlen, linkname, llen);
+
+    afc_error_t err = transact(afc, AFC_OP_MAKE_LINK, hdr, sizeof(type)+tlen+llen, NULL, 0, NULL, NULL);
+    free(hdr);
+    return err;
+}
+
+afc_error_t afcproto_set_file_time(afcproto_client_t afc, const char *path, uint64_t mtime_ns)
+{
+    if (!path)
+        return AFC_E_INVALID_ARG;
+
+    size_t plen = strlen(path)+1;
+    char *hdr = malloc(sizeof(uint64_t) + plen);
+    if (!hdr)
+        return AFC_E_NO_MEM;
+
+    uint64_t mtime = htole64(mtime_ns);
+    memcpy(hdr, &mtime, sizeof(mtime));
+    memcpy(hdr+sizeof(mtime), path, plen);
+
+    afc_error_t err = transact(afc, AFC_OP_SET_FILE_MOD_TIME, hdr, sizeof(mtime)+plen, NULL, 0, NULL, NULL);
+    free(hdr);
+    return err;
+}
+
+
+#pragma mark - pipelined reads
+
+enum { SEEK_NONE, SEEK_PENDING, SEEK_SENT };
+
+void afcproto_reader_init(afcproto_reader_t *rd, afcproto_client_t afc, uint64_t handle, uint32_t chunk, int window)
+{
+    memset(rd, 0, sizeof(*rd));
+    rd->afc = afc;
+    rd->handle = handle;
+    rd->chunk = chunk;
+    rd->window = (window < 1)? 1 : (window > AFCPROTO_READER_MAX_WINDOW)? AFCPROTO_READER_MAX_WINDOW : window;
+}
+
+void afcproto_reader_limit(afcproto_reader_t *rd, uint64_t length)
+{
+    rd->limited = true;
+    rd->limit = length;
+}
+
+void afcproto_reader_seek(afcproto_reader_t *rd, uint64_t offset)
+{
+    rd->seek_state = SEEK_PENDING;
+    rd->seek = offset;
+}
+
+// the SEEK's status comes back ahead of the first READ reply
+static afc_error_t reader_seek_status(afcproto_reader_t *rd)
+{
+    char *buf=NULL;
+    uint32_t len=0;
+
+    rd->seek_state = SEEK_NONE;
+    afc_error_t err = afcproto_receive_response(rd->afc, NULL, &buf, &len);
+    free(buf);
+    return err;
+}
+
+afc_error_t afcproto_reader_next(afcproto_reader_t *rd, char *buf, uint32_t buf_len, uint32_t *bytes_read)
+{
+    afc_error_t err;
+
+    *bytes_read = 0;
+
+    if (rd->seek_state == SEEK_PENDING) {
+        if ((err = send_seek(rd->afc, rd->handle, (int64_t)rd->seek, SEEK_SET)) != AFC_E_SUCCESS)
+            return err;
+        rd->seek_state = SEEK_SENT;
+    }
+
+    // top up the window. replies come back in request order, so the file
+    // position on the device advances exactly as it would for serial reads
+    while (!rd->eof && rd->inflight < rd->window) {
+        uint32_t len = rd->chunk;
+        if (rd->limited) {
+            if (rd->limit == 0)
+                break;
+            if (len > rd->limit)
+                len = (uint32_t)rd->limit;
+            rd->limit -= len;
+        }
+        if ((err = send_read(rd->afc, rd->handle, len)) != AFC_E_SUCCESS)
+            return err;
+        rd->requested[(rd->head + rd->inflight) % AFCPROTO_READER_MAX_WINDOW] = len;
+        rd->inflight++;
+    }
+
+    if (rd->seek_state == SEEK_SENT && (err = reader_seek_status(rd)) != AFC_E_SUCCESS) {
+        rd->eof = true;
+        return err;
+    }
+
+    if (rd->inflight == 0)
+        return AFC_E_SUCCESS;
+
+    uint32_t requested = rd->requested[rd->head];
+    rd->head = (rd->head + 1) % AFCPROTO_READER_MAX_WINDOW;
+    rd->inflight--;
+
+    err = afcproto_receive_response_into(rd->afc, buf, (requested < buf_len)? requested : buf_len, bytes_read);
+
+    // a short read means we hit the end - anything still in flight comes back empty
+    if (err || *bytes_read < requested)
+        rd->eof = true;
+
+    return err;
+}
+
+afc_error_t afcproto_reader_finish(afcproto_reader_t *rd)
+{
+    afc_error_t ret = AFC_E_SUCCESS;
+
+    rd->eof = true;
+    if (rd->seek_state == SEEK_SENT)
+        ret = reader_seek_status(rd);
+    rd->seek_state = SEEK_NONE;
+
+    while (rd->inflight > 0) {
+        char *buf=NULL;
+        uint32_t len=0;
+        afc_error_t err = afcproto_receive_response(rd->afc, NULL, &buf, &len);
+        free(buf);
+        rd->inflight--;
+
+        if (err && !ret)
+            ret = err;
+        if (afcproto_client_is_broken(rd->afc))
+            break;
+    }
+    rd->inflight = 0;
+    return ret;
+}
@@ -0,0 +1,200 @@
+/*
+ * afcproto
+ * Date: Oct 2026
+ *
+ * A small client for the AFC wire protocol. Unlike libimobiledevice's
+ * afc_client_t, the request/response halves are exposed separately so that
+ * callers can keep several requests in flight on a single connection.
+ *
+ * The connection runs over a pluggable transport, so the same client can
+ * talk to a device (see libidev) or to a plain local socket.
+ */
+
+#ifndef _afcproto_h
+#define _afcproto_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libimobiledevice/afc.h>
+
+#define AFCPROTO_MAGIC "CFA6LPAA"
+#define AFCPROTO_MAGIC_LEN 8
+#define AFCPROTO_HEADER_LEN 40
+
+// AFC packet operations
+enum {
+    AFC_OP_STATUS                   = 0x01,
+    AFC_OP_DATA                     = 0x02,
+    AFC_OP_READ_DIR                 = 0x03,
+    AFC_OP_REMOVE_PATH              = 0x08,
+    AFC_OP_MAKE_DIR                 = 0x09,
+    AFC_OP_GET_FILE_INFO            = 0x0a,
+    AFC_OP_GET_DEVINFO              = 0x0b,
+    AFC_OP_FILE_OPEN                = 0x0d,
+    AFC_OP_FILE_OPEN_RES            = 0x0e,
+    AFC_OP_READ                     = 0x0f,
+    AFC_OP_WRITE                    = 0x10,
+    AFC_OP_FILE_SEEK                = 0x11,
+    AFC_OP_FILE_TELL                = 0x12,
+    AFC_OP_FILE_TELL_RES            = 0x13,
+    AFC_OP_FILE_CLOSE               = 0x14,
+    AFC_OP_FILE_SET_SIZE            = 0x15,
+    AFC_OP_RENAME_PATH              = 0x18,
+    AFC_OP_MAKE_LINK                = 0x1c,
+    AFC_OP_SET_FILE_MOD_TIME        = 0x1e,
+    AFC_OP_REMOVE_PATH_AND_CONTENTS = 0x22,
+};
+
+// Every packet starts with this, all fields little endian. this_length
+// covers the header and the operation's own header fields, entire_length
+// adds the data that follows.
+typedef struct afcproto_header {
+    char magic[AFCPROTO_MAGIC_LEN];
+    uint64_t entire_length;
+    uint64_t this_length;
+    uint64_t packet_num;
+    uint64_t operation;
+} __attribute__((packed)) afcproto_header_t;
+
+typedef struct afcproto_transport {
+    void *ctx;
+    // both return 0 on success and must transfer exactly len bytes
+    int (*send)(void *ctx, const char *buf, uint32_t len);
+    int (*recv)(void *ctx, char *buf, uint32_t len);
+    void (*close)(void *ctx);
+} afcproto_transport_t;
+
+typedef struct afcproto_client *afcproto_client_t;
+
+afcproto_client_t afcproto_client_new(afcproto_transport_t *transport);
+
+afcproto_client_t afcproto_client_new_fd(int fd);
+
+afcproto_client_t afcproto_client_new_address(const char *address);
+
+void afcproto_client_free(afcproto_client_t afc);
+
+bool afcproto_client_is_broken(afcproto_client_t afc);
+
+void afcproto_list_free(char **list);
+
+char **afcproto_list_dup(char **list);
+
+// looks up a key in a key/value list as returned by afcproto_get_file_info
+const char *afcproto_info_value(char **info, const char *key);
+
+#pragma mark - request/response primitives
+
+afc_error_t afcproto_send_request(
+        afcproto_client_t afc,
+        uint64_t operation,
+        const char *hdr, uint32_t hdr_len,
+        const char *data, uint32_t data_len );
+
+// Reads the next response. Payload is malloc'd (and NUL terminated) into *data.
+// A STATUS response is translated into its error code.
+afc_error_t afcproto_receive_response(afcproto_client_t afc, uint64_t *operation, char **data, uint32_t *data_len);
+
+// Same as above, but reads the payload into a caller supplied buffer
+afc_error_t afcproto_receive_response_into(afcproto_client_t afc, char *buf, uint32_t buf_len, uint32_t *data_len);
+
+// Same as above, but splits the payload into a NULL terminated list of strings
+// as returned for READ_DIR, GET_FILE_INFO and GET_DEVINFO requests.
+// Free it with afcproto_list_free()
+afc_error_t afcproto_receive_list(afcproto_client_t afc, char ***list);
+
+#pragma mark - AFC operations
+
+afc_error_t afcproto_get_device_info(afcproto_client_t afc, char ***infos);
+
+afc_error_t afcproto_read_directory(afcproto_client_t afc, const char *path, char ***list);
+
+afc_error_t afcproto_get_file_info(afcproto_client_t afc, const char *path, char ***infos);
+
+afc_error_t afcproto_file_open(afcproto_client_t afc, const char *path, afc_file_mode_t mode, uint64_t *handle);
+
+afc_error_t afcproto_file_close(afcproto_client_t afc, uint64_t handle);
+
+afc_error_t afcproto_file_read(afcproto_client_t afc, uint64_t handle, char *buf, uint32_t length, uint32_t *bytes_read);
+
+afc_error_t afcproto_file_write(afcproto_client_t afc, uint64_t handle, const char *buf, uint32_t length, uint32_t *bytes_written);
+
+afc_error_t afcproto_file_seek(afcproto_client_t afc, uint64_t handle, int64_t offset, int whence);
+
+afc_error_t afcproto_file_tell(afcproto_client_t afc, uint64_t handle, uint64_t *position);
+
+afc_error_t afcproto_file_truncate(afcproto_client_t afc, uint64_t handle, uint64_t newsize);
+
+afc_error_t afcproto_remove_path(afcproto_client_t afc, const char *path);
+
+// removes a directory with everything in it in one request
+afc_error_t afcproto_remove_path_and_contents(afcproto_client_t afc, const char *path);
+
+afc_error_t afcproto_rename_path(afcproto_client_t afc, const char *from, const char *to);
+
+afc_error_t afcproto_make_directory(afcproto_client_t afc, const char *path);
+
+afc_error_t afcproto_make_link(afcproto_client_t afc, afc_link_type_t linktype, const char *target, const char *linkname);
+
+// mtime is in nanoseconds since the epoch, as reported in st_mtime
+afc_error_t afcproto_set_file_time(afcproto_client_t afc, const char *path, uint64_t mtime_ns);
+
+#pragma mark - instrumentation
+
+// Called once per reply with the operation of the request it answers, the
+// data bytes sent with the request and received in the reply (headers and
+// status replies not counted), the time from sending the request to having
+// read the reply, and the result. It runs on whichever thread read the reply.
+typedef void (*afcproto_observer_t)(uint64_t operation, uint64_t bytes_out, uint64_t bytes_in, uint64_t elapsed_ns, afc_error_t err);
+
+// Sets the observer for all clients. Requests sent before it was set go
+// unreported.
+void afcproto_set_observer(afcproto_observer_t observer);
+
+// the current observer, so that a new one can pass calls on to it
+afcproto_observer_t afcproto_get_observer(void);
+
+#pragma mark - pipelined reads
+
+#define AFCPROTO_READER_MAX_WINDOW 64
+
+// Keeps up to 'window' READ requests outstanding on one file handle and
+// hands back the replies in order. No other request may be issued on the
+// client until afcproto_reader_finish() has been called.
+//
+// 'chunk' may be changed between calls; it applies to requests sent after.
+typedef struct afcproto_reader {
+    afcproto_client_t afc;
+    uint64_t handle;
+    uint32_t chunk;
+    int window;
+    int inflight;
+    int head;
+    uint32_t requested[AFCPROTO_READER_MAX_WINDOW];
+    bool eof;
+    bool limited;
+    uint64_t limit;
+    int seek_state;
+    uint64_t seek;
+} afcproto_reader_t;
+
+void afcproto_reader_init(afcproto_reader_t *rd, afcproto_client_t afc, uint64_t handle, uint32_t chunk, int window);
+
+// stops after 'length' more bytes have been requested, as if the file ended
+// there. Call it before the first afcproto_reader_next
+void afcproto_reader_limit(afcproto_reader_t *rd, uint64_t length);
+
+// starts reading at 'offset'. The SEEK goes out ahead of the first READs
+// instead of costing a round trip of its own. Call it before the first
+// afcproto_reader_next
+void afcproto_reader_seek(afcproto_reader_t *rd, uint64_t offset);
+
+// returns with *bytes_read == 0 at end of file. buf_len must cover the
+// largest chunk that was requested
+afc_error_t afcproto_reader_next(afcproto_reader_t *rd, char *buf, uint32_t buf_len, uint32_t *bytes_read);
+
+// drains any replies still in flight
+afc_error_t afcproto_reader_finish(afcproto_reader_t *rd);
+
+#endif // _afcproto_h
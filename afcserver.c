@@ -0,0 +1,1008 @@
+/*
+ * afcserver
+ * Date: Oct 2026
+ *
+ * A stand-in for a device's AFC service that serves a local directory over
+ * a TCP or UNIX socket, so afcclient can be run and measured with -C on any
+ * machine. Latency and bandwidth can be added to make it behave more like a
+ * real link:
+ *
+ *   afcserver [-l <ms>] [-b <bytes/s>] [-v] <root> <host:port | unix:path>
+ *
+ * Latency delays every reply by the given time from when its request came
+ * in, without holding up the requests behind it, so pipelining still pays
+ * off the way it does with a device. Bandwidth limits each connection's
+ * incoming and outgoing data separately.
+ */
+
+#ifdef __linux
+  #ifndef _GNU_SOURCE
+    #define _GNU_SOURCE // asprintf
+  #endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef __APPLE__
+  #include <libkern/OSByteOrder.h>
+  #define htole64(x) OSSwapHostToLittleInt64(x)
+  #define le64toh(x) OSSwapLittleToHostInt64(x)
+  #define st_mtim st_mtimespec
+#else
+  #include <endian.h>
+#endif
+
+#include "afcproto.h"
+
+// requests bigger than this are treated as garbage
+#define MAX_REQUEST (64*1024*1024)
+
+char *progname;
+char *root;
+bool verbose = false;
+uint64_t latency_ns = 0;
+uint64_t bandwidth = 0; // bytes per second, 0 for unlimited
+
+
+#pragma mark - Utility functions
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t when)
+{
+    uint64_t now = now_ns();
+    if (when > now) {
+        struct timespec ts = { (when - now) / 1000000000ULL, (when - now) % 1000000000ULL };
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+}
+
+// how long len bytes take at the configured bandwidth
+uint64_t transfer_ns(uint64_t len)
+{
+    return (bandwidth)? len * 1000000000ULL / bandwidth : 0;
+}
+
+// parses sizes like "65536", "64k" or "1M"
+uint64_t parse_size(const char *str)
+{
+    char *end=NULL;
+    uint64_t val = strtoull(str, &end, 10);
+
+    switch ((end)? *end : '\0') {
+        case 'k': case 'K': val *= 1024; break;
+        case 'm': case 'M': val *= 1024*1024; break;
+        case 'g': case 'G': val *= 1024*1024*1024; break;
+        case '\0': break;
+        default: return 0;
+    }
+    return val;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+afc_error_t errno_to_afc(int err)
+{
+    switch (err) {
+        case 0:         return AFC_E_SUCCESS;
+        case ENOENT:
+        case ENOTDIR:   return AFC_E_OBJECT_NOT_FOUND;
+        case EISDIR:    return AFC_E_OBJECT_IS_DIR;
+        case EPERM:
+        case EACCES:    return AFC_E_PERM_DENIED;
+        case EEXIST:    return AFC_E_OBJECT_EXISTS;
+        case ENOTEMPTY: return AFC_E_DIR_NOT_EMPTY;
+        case ENOSPC:    return AFC_E_NO_SPACE_LEFT;
+        case EBADF:
+        case EINVAL:    return AFC_E_INVALID_ARG;
+        case EIO:       return AFC_E_IO_ERROR;
+        default:        return AFC_E_UNKNOWN_ERROR;
+    }
+}
+
+// Maps a path from a request onto the served directory. Paths that would
+// step outside of it are refused. The result must be freed.
+char *local_path(const char *path)
+{
+    const char *p = path;
+    char *ret=NULL;
+    int depth=0;
+
+    while (*p) {
+        p += strspn(p, "/");
+        size_t n = strcspn(p, "/");
+        if (n == 2 && !strncmp(p, "..", 2))
+            depth--;
+        else if (n && !(n == 1 && *p == '.'))
+            depth++;
+        if (depth < 0)
+            return NULL;
+        p += n;
+    }
+
+    while (*path == '/')
+        path++;
+
+    asprintf(&ret, "%s/%s", root, path);
+    return ret;
+}
+
+int remove_tree(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) != 0)
+        return -1;
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        struct dirent *de;
+        while (d && (de = readdir(d)) != NULL) {
+            char *child=NULL;
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                continue;
+            if (asprintf(&child, "%s/%s", path, de->d_name) > 0) {
+                remove_tree(child);
+                free(child);
+            }
+        }
+        if (d)
+            closedir(d);
+        return rmdir(path);
+    }
+
+    return unlink(path);
+}
+
+// like mkdir -p, which is how MAKE_DIR behaves on devices
+int make_dirs(char *path)
+{
+    char *p;
+
+    for (p = path + strlen(root) + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        int r = mkdir(path, 0755);
+        *p = '/';
+        if (r != 0 && errno != EEXIST)
+            return -1;
+    }
+
+    return (mkdir(path, 0755) == 0 || errno == EEXIST)? 0 : -1;
+}
+
+
+#pragma mark - Replies
+
+// With latency or bandwidth set, replies are queued with the time they're
+// due and sent by a separate thread, so that the connection keeps reading
+// (and answering) the requests behind them in the meantime.
+typedef struct reply {
+    char *buf;
+    uint32_t len;
+    uint64_t due;
+    struct reply *next;
+} reply_t;
+
+typedef struct conn {
+    int fd;
+    int *handles;
+    int nhandles;
+    uint64_t rx_free;   // when the incoming side of the link is idle again
+    uint64_t tx_free;
+    bool queued;
+    bool closing;
+    bool broken;        // set by the sender, read without the lock: use __atomic
+    reply_t *head;
+    reply_t *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t sender;
+} conn_t;
+
+static void *sender_main(void *arg)
+{
+    conn_t *c = arg;
+
+    pthread_mutex_lock(&c->lock);
+    while (true) {
+        while (!c->head && !c->closing)
+            pthread_cond_wait(&c->cond, &c->lock);
+        if (!c->head)
+            break;
+
+        reply_t *r = c->head;
+        c->head = r->next;
+        if (!c->head)
+            c->tail = NULL;
+        pthread_mutex_unlock(&c->lock);
+
+        // the reply is due after the latency, and takes its length to get through
+        c->tx_free = ((c->tx_free > r->due)? c->tx_free : r->due) + transfer_ns(r->len);
+        sleep_until(c->tx_free);
+
+        if (!__atomic_load_n(&c->broken, __ATOMIC_RELAXED) && write_all(c->fd, r->buf, r->len) != 0) {
+            __atomic_store_n(&c->broken, true, __ATOMIC_RELAXED);
+            shutdown(c->fd, SHUT_RD);
+        }
+        free(r->buf);
+        free(r);
+
+        pthread_mutex_lock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return NULL;
+}
+
+// Builds a reply packet with room for data_len bytes of data after hdr. The
+// caller fills in the data and passes the packet to send_reply()
+char *new_reply(uint64_t packet_num, uint64_t operation, const void *hdr, uint32_t hdr_len, uint32_t data_len)
+{
+    char *buf = malloc(AFCPROTO_HEADER_LEN + hdr_len + data_len);
+    if (!buf)
+        return NULL;
+
+    afcproto_header_t *h = (afcproto_header_t*)buf;
+    memcpy(h->magic, AFCPROTO_MAGIC, AFCPROTO_MAGIC_LEN);
+    h->entire_length = htole64((uint64_t)AFCPROTO_HEADER_LEN + hdr_len + data_len);
+    h->this_length = htole64((uint64_t)AFCPROTO_HEADER_LEN + hdr_len);
+    h->packet_num = htole64(packet_num);
+    h->operation = htole64(operation);
+    if (hdr_len)
+        memcpy(buf + AFCPROTO_HEADER_LEN, hdr, hdr_len);
+
+    return buf;
+}
+
+// Sends (or queues) a reply made by new_reply(), which is freed. len is the
+// length actually used, which may be less than what was allocated.
+int send_reply(conn_t *c, char *buf, uint32_t len, uint64_t due)
+{
+    afcproto_header_t *h = (afcproto_header_t*)buf;
+    uint64_t this_length = le64toh(h->this_length);
+    h->entire_length = htole64(len);
+    if (this_length > len)
+        h->this_length = h->entire_length;
+
+    if (!c->queued) {
+        int ret = write_all(c->fd, buf, len);
+        free(buf);
+        return ret;
+    }
+
+    reply_t *r = calloc(1, sizeof(reply_t));
+    if (!r) {
+        free(buf);
+        return -1;
+    }
+    r->buf = buf;
+    r->len = len;
+    r->due = due;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->tail)
+        c->tail->next = r;
+    else
+        c->head = r;
+    c->tail = r;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+
+    return (__atomic_load_n(&c->broken, __ATOMIC_RELAXED))? -1 : 0;
+}
+
+int send_status(conn_t *c, uint64_t packet_num, afc_error_t err, uint64_t due)
+{
+    uint64_t code = htole64((uint64_t)err);
+    char *buf = new_reply(packet_num, AFC_OP_STATUS, &code, sizeof(code), 0);
+    return (buf)? send_reply(c, buf, AFCPROTO_HEADER_LEN + sizeof(code), due) : -1;
+}
+
+// replies with a list of NUL terminated strings
+int send_strings(conn_t *c, uint64_t packet_num, char **strs, size_t count, uint64_t due)
+{
+    size_t i, len=0;
+    for (i=0; i<count; i++)
+        len += strlen(strs[i]) + 1;
+
+    char *buf = new_reply(packet_num, AFC_OP_DATA, NULL, 0, len);
+    if (!buf)
+        return send_status(c, packet_num, AFC_E_NO_MEM, due);
+
+    char *p = buf + AFCPROTO_HEADER_LEN;
+    for (i=0; i<count; i++) {
+        size_t n = strlen(strs[i]) + 1;
+        memcpy(p, strs[i], n);
+        p += n;
+    }
+    return send_reply(c, buf, AFCPROTO_HEADER_LEN + len, due);
+}
+
+
+#pragma mark - Operations
+
+int do_read_dir(conn_t *c, uint64_t num, const char *path, uint64_t due)
+{
+    DIR *d = opendir(path);
+    if (!d)
+        return send_status(c, num, errno_to_afc(errno), due);
+
+    char **names=NULL;
+    size_t count=0, cap=0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (count == cap) {
+            cap = (cap)? cap*2 : 64;
+            char **n = realloc(names, cap * sizeof(char*));
+            if (!n)
+                break;
+            names = n;
+        }
+        names[count++] = strdup(de->d_name);
+    }
+    closedir(d);
+
+    int ret = send_strings(c, num, names, count, due);
+
+    while (count > 0)
+        free(names[--count]);
+    free(names);
+    return ret;
+}
+
+int do_file_info(conn_t *c, uint64_t num, const char *path, uint64_t due)
+{
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return send_status(c, num, errno_to_afc(errno), due);
+
+    const char *fmt = S_ISDIR(st.st_mode)? "S_IFDIR" : S_ISLNK(st.st_mode)? "S_IFLNK" :
+                      S_ISCHR(st.st_mode)? "S_IFCHR" : S_ISBLK(st.st_mode)? "S_IFBLK" :
+                      S_ISFIFO(st.st_mode)? "S_IFIFO" : S_ISSOCK(st.st_mode)? "S_IFSOCK" : "S_IFREG";
+
+    char size[24], blocks[24], nlink[24], mtime[24], target[PATH_MAX];
+    snprintf(size, sizeof(size), "%llu", (unsigned long long)st.st_size);
+    snprintf(blocks, sizeof(blocks), "%llu", (unsigned long long)st.st_blocks);
+    snprintf(nlink, sizeof(nlink), "%llu", (unsigned long long)st.st_nlink);
+    snprintf(mtime, sizeof(mtime), "%llu", (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+
+    char *info[14] = {
+        "st_size", size, "st_blocks", blocks, "st_nlink", nlink, "st_ifmt", (char*)fmt,
+        "st_mtime", mtime, "st_birthtime", mtime,
+    };
+    size_t count = 12;
+
+    ssize_t n;
+    if (S_ISLNK(st.st_mode) && (n = readlink(path, target, sizeof(target)-1)) >= 0) {
+        target[n] = '\0';
+        info[count++] = "LinkTarget";
+        info[count++] = target;
+    }
+
+    return send_strings(c, num, info, count, due);
+}
+
+int do_device_info(conn_t *c, uint64_t num, uint64_t due)
+{
+    struct statvfs vfs;
+    char total[24]="0", avail[24]="0", bsize[24]="4096";
+
+    if (statvfs(root, &vfs) == 0) {
+        snprintf(total, sizeof(total), "%llu", (unsigned long long)vfs.f_blocks * vfs.f_frsize);
+        snprintf(avail, sizeof(avail), "%llu", (unsigned long long)vfs.f_bavail * vfs.f_frsize);
+        snprintf(bsize, sizeof(bsize), "%lu", (unsigned long)vfs.f_bsize);
+    }
+
+    char *info[] = {
+        "Model", "afcserver", "FSTotalBytes", total, "FSFreeBytes", avail, "FSBlockSize", bsize,
+    };
+    return send_strings(c, num, info, sizeof(info)/sizeof(info[0]), due);
+}
+
+int do_file_open(conn_t *c, uint64_t num, uint64_t mode, const char *path, uint64_t due)
+{
+    int flags;
+    switch (mode) {
+        case AFC_FOPEN_RDONLY:   flags = O_RDONLY; break;
+        case AFC_FOPEN_RW:       flags = O_RDWR; break;
+        case AFC_FOPEN_WRONLY:   flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+        case AFC_FOPEN_WR:       flags = O_RDWR | O_CREAT | O_TRUNC; break;
+        case AFC_FOPEN_APPEND:   flags = O_WRONLY | O_CREAT | O_APPEND; break;
+        case AFC_FOPEN_RDAPPEND: flags = O_RDWR | O_CREAT | O_APPEND; break;
+        default:
+            return send_status(c, num, AFC_E_INVALID_ARG, due);
+    }
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        return send_status(c, num, AFC_E_OBJECT_IS_DIR, due);
+
+    int fd = open(path, flags, 0644);
+    if (fd < 0)
+        return send_status(c, num, errno_to_afc(errno), due);
+
+    // handles are slot numbers + 1
+    int i;
+    for (i=0; i<c->nhandles && c->handles[i] >= 0; i++)
+        ;
+    if (i == c->nhandles) {
+        int *h = realloc(c->handles, (c->nhandles + 16) * sizeof(int));
+        if (!h) {
+            close(fd);
+            return send_status(c, num, AFC_E_NO_RESOURCES, due);
+        }
+        c->handles = h;
+        for (; c->nhandles < i + 16; c->nhandles++)
+            c->handles[c->nhandles] = -1;
+    }
+    c->handles[i] = fd;
+
+    uint64_t handle = htole64((uint64_t)i + 1);
+    char *buf = new_reply(num, AFC_OP_FILE_OPEN_RES, &handle, sizeof(handle), 0);
+    return (buf)? send_reply(c, buf, AFCPROTO_HEADER_LEN + sizeof(handle), due) : -1;
+}
+
+int handle_fd(conn_t *c, uint64_t handle)
+{
+    return (handle >= 1 && handle <= (uint64_t)c->nhandles)? c->handles[handle-1] : -1;
+}
+
+int do_read(conn_t *c, uint64_t num, int fd, uint64_t len, uint64_t due)
+{
+    if (fd < 0)
+        return send_status(c, num, AFC_E_INVALID_ARG, due);
+    if (len > MAX_REQUEST)
+        len = MAX_REQUEST;
+
+    char *buf = new_reply(num, AFC_OP_DATA, NULL, 0, len);
+    if (!buf)
+        return send_status(c, num, AFC_E_NO_MEM, due);
+
+    uint64_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + AFCPROTO_HEADER_LEN + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            free(buf);
+            return send_status(c, num, errno_to_afc(errno), due);
+        }
+        if (n == 0)
+            break;
+        got += n;
+    }
+
+    return send_reply(c, buf, AFCPROTO_HEADER_LEN + got, due);
+}
+
+int do_write(conn_t *c, uint64_t num, int fd, const char *data, uint64_t len, uint64_t due)
+{
+    if (fd < 0)
+        return send_status(c, num, AFC_E_INVALID_ARG, due);
+
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return send_status(c, num, errno_to_afc(errno), due);
+        data += n;
+        len -= n;
+    }
+    return send_status(c, num, AFC_E_SUCCESS, due);
+}
+
+// runs one request. hdr is followed by data and both are NUL terminated
+int handle_request(conn_t *c, uint64_t num, uint64_t op, char *hdr, uint32_t hdr_len, char *data, uint32_t data_len, uint64_t due)
+{
+    uint64_t f[3] = {0, 0, 0};
+    memcpy(f, hdr, (hdr_len < sizeof(f))? hdr_len : sizeof(f));
+    f[0] = le64toh(f[0]);
+    f[1] = le64toh(f[1]);
+    f[2] = le64toh(f[2]);
+
+    // the operations that take a path at the start of their header
+    char *path = NULL;
+    bool needs_path = true;
+    switch (op) {
+        case AFC_OP_READ_DIR:
+        case AFC_OP_REMOVE_PATH:
+        case AFC_OP_MAKE_DIR:
+        case AFC_OP_GET_FILE_INFO:
+        case AFC_OP_REMOVE_PATH_AND_CONTENTS:
+        case AFC_OP_RENAME_PATH:
+            path = local_path(hdr);
+            break;
+        case AFC_OP_FILE_OPEN:
+        case AFC_OP_SET_FILE_MOD_TIME:
+            path = (hdr_len > 8)? local_path(hdr + 8) : NULL;
+            break;
+        default:
+            needs_path = false;
+    }
+
+    if (needs_path && !path)
+        return send_status(c, num, AFC_E_PERM_DENIED, due);
+
+    int ret, r=0;
+    struct stat st;
+
+    switch (op) {
+        case AFC_OP_READ_DIR:
+            ret = do_read_dir(c, num, path, due);
+            break;
+
+        case AFC_OP_GET_FILE_INFO:
+            ret = do_file_info(c, num, path, due);
+            break;
+
+        case AFC_OP_GET_DEVINFO:
+            ret = do_device_info(c, num, due);
+            break;
+
+        case AFC_OP_REMOVE_PATH:
+            if (lstat(path, &st) == 0)
+                r = (S_ISDIR(st.st_mode))? rmdir(path) : unlink(path);
+            else
+                r = -1;
+            ret = send_status(c, num, (r == 0)? AFC_E_SUCCESS : errno_to_afc(errno), due);
+            break;
+
+        case AFC_OP_REMOVE_PATH_AND_CONTENTS:
+            r = remove_tree(path);
+            ret = send_status(c, num, (r == 0)? AFC_E_SUCCESS : errno_to_afc(errno), due);
+            break;
+
+        case AFC_OP_MAKE_DIR:
+            r = make_dirs(path);
+            ret = send_status(c, num, (r == 0)? AFC_E_SUCCESS : errno_to_afc(errno), due);
+            break;
+
+        case AFC_OP_RENAME_PATH:
+            {
+                size_t n = strlen(hdr) + 1;
+                char *to = (n < hdr_len)? local_path(hdr + n) : NULL;
+                r = (to)? rename(path, to) : (errno = EINVAL, -1);
+                ret = send_status(c, num, (r == 0)? AFC_E_SUCCESS : errno_to_afc(errno), due);
+                free(to);
+            }
+            break;
+
+        case AFC_OP_MAKE_LINK:
+            {
+                const char *target = (hdr_len > 8)? hdr + 8 : "";
+                size_t n = strlen(target) + 1;
+                char *linkname = (8 + n < hdr_len)? local_path(hdr + 8 + n) : NULL;
+                char *ltarget = (f[0] == AFC_HARDLINK)? local_path(target) : NULL;
+
+                if (!linkname || (f[0] == AFC_HARDLINK && !ltarget))
+                    r = (errno = EINVAL, -1);
+                else if (f[0] == AFC_SYMLINK)
+                    r = symlink(target, linkname);
+                else if (f[0] == AFC_HARDLINK)
+                    r = link(ltarget, linkname);
+                else
+                    r = (errno = EINVAL, -1);
+
+                ret = send_status(c, num, (r == 0)? AFC_E_SUCCESS : errno_to_afc(errno), due);
+                free(linkname);
+                free(ltarget);
+            }
+            break;
+
+        case AFC_OP_SET_FILE_MOD_TIME:
+            {
+                struct timespec times[2] = {
+                    { 0, UTIME_OMIT },
+                    { f[0] / 1000000000ULL, f[0] % 1000000000ULL },
+                };
+                r = utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+                ret = send_status(c, num, (r == 0)? AFC_E_SUCCESS : errno_to_afc(errno), due);
+            }
+            break;
+
+        case AFC_OP_FILE_OPEN:
+            ret = do_file_open(c, num, f[0], path, due);
+            break;
+
+        case AFC_OP_READ:
+            ret = do_read(c, num, handle_fd(c, f[0]), f[1], due);
+            break;
+
+        case AFC_OP_WRITE:
+            ret = do_write(c, num, handle_fd(c, f[0]), data, data_len, due);
+            break;
+
+        case AFC_OP_FILE_SEEK:
+            {
+                int fd = handle_fd(c, f[0]);
+                r = (fd >= 0)? (lseek(fd, (off_t)(int64_t)f[2], (int)f[1]) < 0) : (errno = EBADF, -1);
+                ret = send_status(c, num, (r == 0)? AFC_E_SUCCESS : errno_to_afc(errno), due);
+            }
+            break;
+
+        case AFC_OP_FILE_TELL:
+            {
+                int fd = handle_fd(c, f[0]);
+                off_t pos = (fd >= 0)? lseek(fd, 0, SEEK_CUR) : (errno = EBADF, -1);
+                if (pos < 0) {
+                    ret = send_status(c, num, errno_to_afc(errno), due);
+                } else {
+                    uint64_t p = htole64((uint64_t)pos);
+                    char *buf = new_reply(num, AFC_OP_FILE_TELL_RES, &p, sizeof(p), 0);
+                    ret = (buf)? send_reply(c, buf, AFCPROTO_HEADER_LEN + sizeof(p), due) : -1;
+                }
+            }
+            break;
+
+        case AFC_OP_FILE_SET_SIZE:
+            {
+                int fd = handle_fd(c, f[0]);
+                r = (fd >= 0)? ftruncate(fd, (off_t)f[1]) : (errno = EBADF, -1);
+                ret = send_status(c, num, (r == 0)? AFC_E_SUCCESS : errno_to_afc(errno), due);
+            }
+            break;
+
+        case AFC_OP_FILE_CLOSE:
+            {
+                int fd = handle_fd(c, f[0]);
+                r = (fd >= 0)? close(fd) : (errno = EBADF, -1);
+                if (fd >= 0)
+                    c->handles[f[0]-1] = -1;
+                ret = send_status(c, num, (r == 0)? AFC_E_SUCCESS : errno_to_afc(errno), due);
+            }
+            break;
+
+        default:
+            ret = send_status(c, num, AFC_E_OP_NOT_SUPPORTED, due);
+            break;
+    }
+
+    free(path);
+    return ret;
+}
+
+
+#pragma mark - Connections
+
+static void *connection_main(void *arg)
+{
+    conn_t *c = arg;
+    char *hdr=NULL, *data=NULL;
+    size_t hdr_cap=0, data_cap=0;
+
+    c->queued = (latency_ns || bandwidth);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    if (c->queued && pthread_create(&c->sender, NULL, sender_main, c) != 0)
+        c->queued = false;
+
+    while (!__atomic_load_n(&c->broken, __ATOMIC_RELAXED)) {
+        afcproto_header_t h;
+        if (read_all(c->fd, (char*)&h, sizeof(h)) != 0)
+            break;
+
+        uint64_t entire = le64toh(h.entire_length), this = le64toh(h.this_length);
+        uint64_t num = le64toh(h.packet_num), op = le64toh(h.operation);
+        if (memcmp(h.magic, AFCPROTO_MAGIC, AFCPROTO_MAGIC_LEN) != 0 ||
+            this < AFCPROTO_HEADER_LEN || entire < this || entire > MAX_REQUEST)
+        {
+            fprintf(stderr, "%s: bad packet header - dropping connection\n", progname);
+            break;
+        }
+
+        // both parts get a NUL after them, so paths can be used as they are
+        uint32_t hdr_len = this - AFCPROTO_HEADER_LEN, data_len = entire - this;
+        if (hdr_len + 1 > hdr_cap) {
+            char *b = realloc(hdr, hdr_len + 1);
+            if (!b)
+                break;
+            hdr = b;
+            hdr_cap = hdr_len + 1;
+        }
+        if (data_len + 1 > data_cap) {
+            char *b = realloc(data, data_len + 1);
+            if (!b)
+                break;
+            data = b;
+            data_cap = data_len + 1;
+        }
+        if (read_all(c->fd, hdr, hdr_len) != 0 || read_all(c->fd, data, data_len) != 0)
+            break;
+        hdr[hdr_len] = '\0';
+        data[data_len] = '\0';
+
+        // the request only counts as arrived once its data got through the link
+        uint64_t arrived = now_ns();
+        if (bandwidth) {
+            c->rx_free = ((c->rx_free > arrived)? c->rx_free : arrived) + transfer_ns(entire);
+            sleep_until(c->rx_free);
+            arrived = c->rx_free;
+        }
+
+        if (verbose)
+            fprintf(stderr, "%s: fd %d op 0x%02llx #%llu %u+%u bytes\n", progname, c->fd,
+                    (unsigned long long)op, (unsigned long long)num, hdr_len, data_len);
+
+        if (handle_request(c, num, op, hdr, hdr_len, data, data_len, arrived + latency_ns) != 0)
+            break;
+    }
+
+    if (c->queued) {
+        pthread_mutex_lock(&c->lock);
+        c->closing = true;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->sender, NULL);
+    }
+
+    int i;
+    for (i=0; i<c->nhandles; i++) {
+        if (c->handles[i] >= 0)
+            close(c->handles[i]);
+    }
+
+    if (verbose)
+        fprintf(stderr, "%s: connection %d closed\n", progname, c->fd);
+
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    free(c->handles);
+    free(hdr);
+    free(data);
+    free(c);
+    return NULL;
+}
+
+// address is either "unix:/path/to/socket" or "[host:]port"
+int listen_address(const char *address)
+{
+    int fd = -1;
+
+    if (!strncmp(address, "unix:", 5)) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(address+5) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "Error: socket path too long: %s\n", address+5);
+            return -1;
+        }
+        strcpy(sun.sun_path, address+5);
+        unlink(sun.sun_path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) {
+            fprintf(stderr, "Error: cannot listen on %s - %s\n", address, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+    } else {
+        char host[256] = "127.0.0.1";
+        const char *port = strrchr(address, ':');
+        if (port) {
+            if ((size_t)(port - address) >= sizeof(host)) {
+                fprintf(stderr, "Error: invalid address: %s\n", address);
+                return -1;
+            }
+            memcpy(host, address, port - address);
+            host[port - address] = '\0';
+            port++;
+        } else {
+            port = address;
+        }
+
+        struct addrinfo hints, *res=NULL, *ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        int gerr = getaddrinfo(host, port, &hints, &res);
+        if (gerr) {
+            fprintf(stderr, "Error: cannot resolve %s - %s\n", address, gai_strerror(gerr));
+            return -1;
+        }
+
+        for (ai = res; ai; ai = ai->ai_next) {
+            int one = 1;
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+
+        if (fd < 0) {
+            fprintf(stderr, "Error: cannot listen on %s - %s\n", address, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (listen(fd, 64) != 0) {
+        fprintf(stderr, "Error: listen on %s failed - %s\n", address, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+#pragma mark - Main
+
+void usage(FILE *outf)
+{
+    fprintf(outf,
+        "Usage: %s [lbvh] <root> <address>\n\n"
+        "  Serves the directory <root> over the AFC protocol on <address>, which is\n"
+        "  either [host:]port or unix:<path>, for use with afcclient -C.\n\n"
+        "  Options:\n"
+        "    -l, --latency=<MS>         Delay every reply by MS milliseconds (fractions allowed)\n"
+        "    -b, --bandwidth=<SIZE>     Limit each connection to SIZE bytes/s each way, e.g. 30M\n"
+        "    -v, --verbose              Log every request\n"
+        "    -h, --help                 Display this help message\n"
+        , progname);
+}
+
+static struct option longopts[] = {
+    { "latency",    required_argument,  NULL,   'l' },
+    { "bandwidth",  required_argument,  NULL,   'b' },
+    { "verbose",    no_argument,        NULL,   'v' },
+    { "help",       no_argument,        NULL,   'h' },
+    { NULL,         0,                  NULL,   0 }
+};
+
+int main(int argc, char **argv)
+{
+    progname = basename(argv[0]);
+
+    int flag;
+    while ((flag = getopt_long(argc, argv, "l:b:vh", longopts, NULL)) != -1) {
+        switch (flag) {
+            case 'l':
+                {
+                    double ms = atof(optarg);
+                    if (ms < 0) {
+                        fprintf(stderr, "Error: invalid latency: %s\n", optarg);
+                        return EXIT_FAILURE;
+                    }
+                    latency_ns = (uint64_t)(ms * 1000000.0);
+                }
+                break;
+
+            case 'b':
+                if ((bandwidth = parse_size(optarg)) == 0) {
+                    fprintf(stderr, "Error: invalid bandwidth: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'v':
+                verbose = true;
+                break;
+
+            case 'h':
+                usage(stdout);
+                return EXIT_SUCCESS;
+
+            default:
+                usage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 2) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    if (stat(argv[0], &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: not a directory: %s\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    root = realpath(argv[0], NULL);
+
+    int lfd = listen_address(argv[1]);
+    if (!root || lfd < 0)
+        return EXIT_FAILURE;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "%s: serving %s on %s", progname, root, argv[1]);
+    if (latency_ns)
+        fprintf(stderr, ", latency %.3fms", latency_ns / 1e6);
+    if (bandwidth)
+        fprintf(stderr, ", bandwidth %llu bytes/s", (unsigned long long)bandwidth);
+    fprintf(stderr, "\n");
+
+    while (true) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error: accept failed - %s\n", strerror(errno));
+            break;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_t thread;
+        conn_t *c = calloc(1, sizeof(conn_t));
+        if (c) {
+            c->fd = fd;
+            if (pthread_create(&thread, NULL, connection_main, c) == 0) {
+                pthread_detach(thread);
+                continue;
+            }
+            free(c);
+        }
+        close(fd);
+    }
+
+    close(lfd);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,393 @@
+/*
+ * afcsnap
+ * Date: Oct 2026
+ *
+ * Snapshot indexes of remote trees. See afcsnap.h
+ */
+
+#ifdef __linux
+  #ifndef _GNU_SOURCE
+    #define _GNU_SOURCE // asprintf
+  #endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "afcsnap.h"
+
+// strings are collected in chunks of this size, so they never move
+#define SNAP_CHUNK_SIZE (1024*1024)
+
+struct afcsnap {
+    const char *map;
+    size_t map_size;
+    const afcsnap_header_t *header;
+    const afcsnap_entry_t *entries;
+    const char *strings;
+};
+
+typedef struct snap_item {
+    const char *path;
+    const char *target;
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t path_len;
+    uint32_t target_len;
+    char type;
+} snap_item_t;
+
+typedef struct snap_chunk {
+    struct snap_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} snap_chunk_t;
+
+struct afcsnap_builder {
+    char *root;
+    snap_item_t *items;
+    size_t count;
+    size_t alloc;
+    snap_chunk_t *chunks;
+};
+
+
+#pragma mark - reading
+
+// checks that an entry's strings lie within the table and are terminated
+static bool entry_ok(const afcsnap_entry_t *e, const char *strings, uint64_t size)
+{
+    uint64_t end = (uint64_t)e->path_len + ((e->target_len)? (uint64_t)e->target_len + 1 : 0);
+
+    if (e->path >= size || end >= size - e->path)
+        return false;
+
+    return (strings[e->path + e->path_len] == '\0' && strings[e->path + end] == '\0');
+}
+
+afcsnap_t afcsnap_open(const char *file, const char **error)
+{
+    *error = NULL;
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        *error = strerror(errno);
+        return NULL;
+    }
+
+    struct stat st;
+    const char *map = MAP_FAILED;
+    if (fstat(fd, &st) != 0) {
+        *error = strerror(errno);
+    } else if ((size_t)st.st_size < sizeof(afcsnap_header_t)) {
+        *error = "not a snapshot index";
+    } else if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        *error = strerror(errno);
+    }
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const afcsnap_header_t *h = (const afcsnap_header_t *)map;
+    size_t avail = st.st_size - sizeof(afcsnap_header_t);
+
+    if (memcmp(h->magic, AFCSNAP_MAGIC, sizeof(h->magic)) != 0) {
+        *error = "not a snapshot index";
+    } else if (h->version != AFCSNAP_VERSION) {
+        *error = "unsupported snapshot version";
+    } else if (h->byte_order != AFCSNAP_BYTE_ORDER) {
+        *error = "snapshot written on a host with a different byte order";
+    } else if (h->count > avail / sizeof(afcsnap_entry_t) ||
+               h->strings_size != avail - h->count * sizeof(afcsnap_entry_t) ||
+               h->strings_size == 0 || map[st.st_size-1] != '\0') {
+        *error = "truncated or corrupt snapshot";
+    }
+
+    afcsnap_t snap = NULL;
+    if (!*error && (snap = calloc(1, sizeof(struct afcsnap))) == NULL)
+        *error = strerror(ENOMEM);
+
+    if (snap) {
+        snap->map = map;
+        snap->map_size = st.st_size;
+        snap->header = h;
+        snap->entries = (const afcsnap_entry_t *)(map + sizeof(afcsnap_header_t));
+        snap->strings = (const char *)(snap->entries + h->count);
+
+        size_t i;
+        for (i=0; i<h->count; i++) {
+            if (!entry_ok(&snap->entries[i], snap->strings, h->strings_size)) {
+                *error = "truncated or corrupt snapshot";
+                free(snap);
+                snap = NULL;
+                break;
+            }
+        }
+    }
+
+    if (!snap)
+        munmap((void *)map, st.st_size);
+
+    return snap;
+}
+
+void afcsnap_close(afcsnap_t snap)
+{
+    if (snap) {
+        munmap((void *)snap->map, snap->map_size);
+        free(snap);
+    }
+}
+
+const char *afcsnap_root(afcsnap_t snap)
+{
+    return snap->strings;
+}
+
+uint64_t afcsnap_created(afcsnap_t snap)
+{
+    return snap->header->created;
+}
+
+size_t afcsnap_count(afcsnap_t snap)
+{
+    return snap->header->count;
+}
+
+const afcsnap_entry_t *afcsnap_entry(afcsnap_t snap, size_t i)
+{
+    return (i < snap->header->count)? &snap->entries[i] : NULL;
+}
+
+const char *afcsnap_path(afcsnap_t snap, const afcsnap_entry_t *e)
+{
+    return snap->strings + e->path;
+}
+
+const char *afcsnap_target(afcsnap_t snap, const afcsnap_entry_t *e)
+{
+    return (e->target_len)? snap->strings + e->path + e->path_len + 1 : NULL;
+}
+
+
+#pragma mark - comparing
+
+// the same order as strcmp, which the builder sorts with
+static int cmp_paths(afcsnap_t a, const afcsnap_entry_t *ea, afcsnap_t b, const afcsnap_entry_t *eb)
+{
+    uint32_t len = (ea->path_len < eb->path_len)? ea->path_len : eb->path_len;
+    int c = memcmp(a->strings + ea->path, b->strings + eb->path, len);
+    if (c)
+        return c;
+    return (ea->path_len > eb->path_len) - (ea->path_len < eb->path_len);
+}
+
+static bool same_target(afcsnap_t a, const afcsnap_entry_t *ea, afcsnap_t b, const afcsnap_entry_t *eb)
+{
+    return (ea->target_len == eb->target_len &&
+            memcmp(afcsnap_target(a, ea), afcsnap_target(b, eb), ea->target_len) == 0);
+}
+
+// moves on to the next entry, checking that it sorts after the last one,
+// as the merge relies on both sides being in order
+static int next_entry(afcsnap_t s, const afcsnap_entry_t **e)
+{
+    const afcsnap_entry_t *prev = (*e)++;
+    if (*e < s->entries + s->header->count && cmp_paths(s, prev, s, *e) >= 0)
+        return -1;
+    return 0;
+}
+
+int afcsnap_diff(afcsnap_t a, afcsnap_t b, int(^change)(char what, const afcsnap_entry_t *ea, const afcsnap_entry_t *eb))
+{
+    const afcsnap_entry_t *ea = a->entries, *enda = a->entries + a->header->count;
+    const afcsnap_entry_t *eb = b->entries, *endb = b->entries + b->header->count;
+
+    while (ea < enda || eb < endb) {
+        int c = (ea == enda)? 1 : (eb == endb)? -1 : cmp_paths(a, ea, b, eb);
+        int ret = 0;
+
+        if (c < 0) {
+            if ((ret = change('D', ea, NULL)) == 0)
+                ret = next_entry(a, &ea);
+        } else if (c > 0) {
+            if ((ret = change('A', NULL, eb)) == 0)
+                ret = next_entry(b, &eb);
+        } else {
+            if (ea->type != eb->type || (ea->type == 'l' && !same_target(a, ea, b, eb)))
+                ret = change('T', ea, eb);
+            else if (ea->type != 'd' && (ea->size != eb->size || ea->mtime != eb->mtime))
+                ret = change('M', ea, eb);
+
+            if (!ret)
+                ret = next_entry(a, &ea);
+            if (!ret)
+                ret = next_entry(b, &eb);
+        }
+
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+
+#pragma mark - writing
+
+afcsnap_builder_t afcsnap_builder_new(const char *root)
+{
+    afcsnap_builder_t b = calloc(1, sizeof(struct afcsnap_builder));
+    if (b && (b->root = strdup(root)) == NULL) {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+void afcsnap_builder_free(afcsnap_builder_t b)
+{
+    if (!b)
+        return;
+
+    while (b->chunks) {
+        snap_chunk_t *c = b->chunks;
+        b->chunks = c->next;
+        free(c);
+    }
+    free(b->items);
+    free(b->root);
+    free(b);
+}
+
+static const char *builder_strdup(afcsnap_builder_t b, const char *str, size_t len)
+{
+    snap_chunk_t *c = b->chunks;
+
+    if (!c || c->size - c->used < len+1) {
+        size_t size = (len+1 > SNAP_CHUNK_SIZE)? len+1 : SNAP_CHUNK_SIZE;
+        if ((c = malloc(sizeof(snap_chunk_t) + size)) == NULL)
+            return NULL;
+        c->used = 0;
+        c->size = size;
+        c->next = b->chunks;
+        b->chunks = c;
+    }
+
+    char *s = c->data + c->used;
+    memcpy(s, str, len);
+    s[len] = '\0';
+    c->used += len+1;
+    return s;
+}
+
+bool afcsnap_builder_add(afcsnap_builder_t b, const char *path, char type, uint64_t size, uint64_t mtime, const char *target)
+{
+    size_t path_len = strlen(path), target_len = (target)? strlen(target) : 0;
+    if (path_len > UINT32_MAX || target_len > UINT32_MAX)
+        return false;
+
+    if (b->count == b->alloc) {
+        size_t alloc = (b->alloc)? b->alloc*2 : 1024;
+        snap_item_t *items = realloc(b->items, alloc * sizeof(snap_item_t));
+        if (!items)
+            return false;
+        b->items = items;
+        b->alloc = alloc;
+    }
+
+    snap_item_t *item = &b->items[b->count];
+    item->path = builder_strdup(b, path, path_len);
+    item->target = (target_len)? builder_strdup(b, target, target_len) : NULL;
+    if (!item->path || (target_len && !item->target))
+        return false;
+
+    item->path_len = path_len;
+    item->target_len = target_len;
+    item->size = size;
+    item->mtime = mtime;
+    item->type = type;
+    b->count++;
+    return true;
+}
+
+static int cmp_item(const void *a, const void *b)
+{
+    return strcmp(((const snap_item_t *)a)->path, ((const snap_item_t *)b)->path);
+}
+
+int afcsnap_builder_write(afcsnap_builder_t b, const char *file)
+{
+    qsort(b->items, b->count, sizeof(snap_item_t), cmp_item);
+
+    char *tmp = NULL;
+    if (asprintf(&tmp, "%s.%d.tmp", file, (int)getpid()) < 0)
+        return ENOMEM;
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        int err = errno;
+        free(tmp);
+        return err;
+    }
+
+    // strings go in the same order as the entries, so a diff reads both
+    // front to back
+    size_t root_len = strlen(b->root), i;
+    uint64_t off = root_len + 1;
+
+    afcsnap_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, AFCSNAP_MAGIC, sizeof(AFCSNAP_MAGIC));
+    h.version = AFCSNAP_VERSION;
+    h.byte_order = AFCSNAP_BYTE_ORDER;
+    h.count = b->count;
+    h.created = time(NULL);
+    for (i=0; i<b->count; i++)
+        off += b->items[i].path_len + 1 + ((b->items[i].target_len)? b->items[i].target_len + 1 : 0);
+    h.strings_size = off;
+    fwrite(&h, sizeof(h), 1, f);
+
+    off = root_len + 1;
+    for (i=0; i<b->count; i++) {
+        snap_item_t *item = &b->items[i];
+        afcsnap_entry_t e;
+        memset(&e, 0, sizeof(e));
+        e.size = item->size;
+        e.mtime = item->mtime;
+        e.path = off;
+        e.path_len = item->path_len;
+        e.target_len = item->target_len;
+        e.type = item->type;
+        fwrite(&e, sizeof(e), 1, f);
+        off += item->path_len + 1 + ((item->target_len)? item->target_len + 1 : 0);
+    }
+
+    fwrite(b->root, root_len+1, 1, f);
+    for (i=0; i<b->count; i++) {
+        fwrite(b->items[i].path, b->items[i].path_len+1, 1, f);
+        if (b->items[i].target_len)
+            fwrite(b->items[i].target, b->items[i].target_len+1, 1, f);
+    }
+
+    // write and rename so that a reader never maps half a file
+    int err = (ferror(f))? EIO : 0;
+    if (fclose(f) != 0 && !err)
+        err = errno;
+    if (!err && rename(tmp, file) != 0)
+        err = errno;
+    if (err)
+        unlink(tmp);
+
+    free(tmp);
+    return err;
+}
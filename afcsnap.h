@@ -0,0 +1,101 @@
+/*
+ * afcsnap
+ * Date: Oct 2026
+ *
+ * Snapshot indexes of remote trees, as written by "afcclient snapshot" and
+ * compared by "afcclient diff". An index holds the path, type, size, mtime
+ * and link target of everything below a directory, sorted by path, in a
+ * layout that is used straight from an mmap of the file: opening one
+ * doesn't parse or copy anything, and two of them are compared with a
+ * single merge pass and no allocations.
+ *
+ * The file is a header, a fixed size record per entry and a table of NUL
+ * terminated strings, all in host byte order (a marker in the header
+ * catches files from a host with the other one):
+ *
+ *   afcsnap_header_t, afcsnap_entry_t[count], strings
+ *
+ * Entry paths are relative to the snapshot's root, which is the first
+ * string in the table. A link's target follows its path in the table.
+ */
+
+#ifndef _afcsnap_h
+#define _afcsnap_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define AFCSNAP_MAGIC "AFCSNAP"
+#define AFCSNAP_VERSION 1
+#define AFCSNAP_BYTE_ORDER 0x01020304
+
+typedef struct afcsnap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t count;
+    // seconds since the epoch
+    uint64_t created;
+    uint64_t strings_size;
+    uint64_t reserved[3];
+} afcsnap_header_t;
+
+typedef struct afcsnap_entry {
+    uint64_t size;
+    // nanoseconds since the epoch
+    uint64_t mtime;
+    // offset of the path in the string table
+    uint64_t path;
+    uint32_t path_len;
+    // 0 unless it's a link; the target starts at path + path_len + 1
+    uint32_t target_len;
+    // 'f', 'd', 'l', 'c', 'b', 'p', 's' or '?'
+    char type;
+    char reserved[7];
+} afcsnap_entry_t;
+
+typedef struct afcsnap *afcsnap_t;
+
+typedef struct afcsnap_builder *afcsnap_builder_t;
+
+// maps an index file and checks that it's whole. On failure returns NULL
+// and sets error to a message
+afcsnap_t afcsnap_open(const char *file, const char **error);
+
+void afcsnap_close(afcsnap_t snap);
+
+const char *afcsnap_root(afcsnap_t snap);
+
+uint64_t afcsnap_created(afcsnap_t snap);
+
+size_t afcsnap_count(afcsnap_t snap);
+
+const afcsnap_entry_t *afcsnap_entry(afcsnap_t snap, size_t i);
+
+const char *afcsnap_path(afcsnap_t snap, const afcsnap_entry_t *e);
+
+// returns NULL if the entry isn't a link
+const char *afcsnap_target(afcsnap_t snap, const afcsnap_entry_t *e);
+
+// Calls change with 'A' for each path only in b, 'D' for each path only in
+// a, 'T' for a path whose type or link target differ and 'M' for anything
+// but a directory whose size or mtime differ, in path order. The entry of
+// the missing side is NULL. A non-zero return from change stops the
+// comparison and is returned; a snapshot that's out of order gives -1.
+int afcsnap_diff(afcsnap_t a, afcsnap_t b, int(^change)(char what, const afcsnap_entry_t *ea, const afcsnap_entry_t *eb));
+
+// collects entries for a new index of the tree at root
+afcsnap_builder_t afcsnap_builder_new(const char *root);
+
+void afcsnap_builder_free(afcsnap_builder_t b);
+
+// path is relative to the root, target NULL unless it's a link. Returns
+// false when out of memory
+bool afcsnap_builder_add(afcsnap_builder_t b, const char *path, char type, uint64_t size, uint64_t mtime, const char *target);
+
+// sorts the entries and writes the index to file, replacing it whole.
+// Returns 0 or an errno
+int afcsnap_builder_write(afcsnap_builder_t b, const char *file);
+
+#endif // _afcsnap_h
@@ -13,6 +13,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 
 bool idev_verbose=false;
 
@@ -247,11 +250,14 @@ const char *idev_house_arrest_strerror(house_arrest_error_t errnum)
     }
 }
 
+// Opens a device and a lockdown session that stay open until
+// idev_lockdownd_close(). Prints an error and returns EXIT_FAILURE if either
+// can't be opened.
 // note: clientname may be null in which case a default value of "idevtool" is used
-int idev_lockdownd_client(char *clientname, char *udid, int(^callback)(idevice_t idev, lockdownd_client_t client))
+int idev_lockdownd_open(char *clientname, char *udid, idevice_t *idev_out, lockdownd_client_t *client_out)
 {
-    int ret=EXIT_FAILURE;
     idevice_t idev = NULL;
+    lockdownd_client_t client = NULL;
 
     if (!clientname)
         clientname = "idevtool";
@@ -259,26 +265,47 @@ int idev_lockdownd_client(char *clientname, char *udid, int(^callback)(idevice_t
     idevice_error_t ierr=idevice_new(&idev, udid);
 
     if (ierr == IDEVICE_E_SUCCESS && idev) {
-        lockdownd_client_t client = NULL;
         lockdownd_error_t ldret = lockdownd_client_new_with_handshake(idev, &client, clientname);
 
         if (ldret == LOCKDOWN_E_SUCCESS && client) {
-            ret = callback(idev, client);
+            *idev_out = idev;
+            *client_out = client;
+            return EXIT_SUCCESS;
         } else {
             fprintf(stderr, "Error: Can't connect to lockdownd: %s.\n", idev_lockdownd_strerror(ldret));
         }
 
-        if (client)
-            lockdownd_client_free(client);
-
     } else if (ierr == IDEVICE_E_NO_DEVICE) {
         fprintf(stderr, "Error: No device found -- Is it plugged in?\n");
     } else {
         fprintf(stderr, "Error: Cannot connect to device: %s\n", idev_idevice_strerror(ierr));
     }
 
+    idev_lockdownd_close(idev, client);
+
+    return EXIT_FAILURE;
+}
+
+void idev_lockdownd_close(idevice_t idev, lockdownd_client_t client)
+{
+    if (client)
+        lockdownd_client_free(client);
+
     if (idev)
         idevice_free(idev);
+}
+
+// note: clientname may be null in which case a default value of "idevtool" is used
+int idev_lockdownd_client(char *clientname, char *udid, int(^callback)(idevice_t idev, lockdownd_client_t client))
+{
+    int ret=EXIT_FAILURE;
+    idevice_t idev = NULL;
+    lockdownd_client_t client = NULL;
+
+    if (idev_lockdownd_open(clientname, udid, &idev, &client) == EXIT_SUCCESS) {
+        ret = callback(idev, client);
+        idev_lockdownd_close(idev, client);
+    }
 
     return ret;
 }
@@ -585,3 +612,663 @@ int idev_afc_app_client(char *clientname, char *udid, char *appid, const char *h
     });
 }
 
+
+
+#pragma mark - raw AFC connections (see afcproto.h)
+
+static int idev_con_send(void *ctx, const char *buf, uint32_t len)
+{
+    while (len > 0) {
+        uint32_t sent=0;
+        if (idevice_connection_send((idevice_connection_t)ctx, buf, len, &sent) != IDEVICE_E_SUCCESS || sent == 0)
+            return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static int idev_con_recv(void *ctx, char *buf, uint32_t len)
+{
+    while (len > 0) {
+        uint32_t recvd=0;
+        if (idevice_connection_receive((idevice_connection_t)ctx, buf, len, &recvd) != IDEVICE_E_SUCCESS || recvd == 0)
+            return -1;
+        buf += recvd;
+        len -= recvd;
+    }
+    return 0;
+}
+
+static void idev_con_close(void *ctx)
+{
+    idevice_disconnect((idevice_connection_t)ctx);
+}
+
+afcproto_client_t idev_afcproto_client_new(idevice_connection_t con)
+{
+    afcproto_transport_t t = {
+        .ctx = con,
+        .send = idev_con_send,
+        .recv = idev_con_recv,
+        .close = idev_con_close,
+    };
+    return afcproto_client_new(&t);
+}
+
+// the reply is a small plist, so a longer length means a garbled stream
+#define HOUSE_ARREST_MAX_REPLY (1024*1024)
+
+// speaks just enough of the house_arrest plist protocol to vend an app dir on a raw connection
+static int idev_house_arrest_vend(idevice_connection_t con, const char *ha_command, const char *appid)
+{
+    int ret=EXIT_FAILURE;
+
+    plist_t dict = plist_new_dict();
+    plist_dict_set_item(dict, "Command", plist_new_string(ha_command));
+    plist_dict_set_item(dict, "Identifier", plist_new_string(appid));
+
+    char *xml=NULL;
+    uint32_t xml_len=0;
+    plist_to_xml(dict, &xml, &xml_len);
+    plist_free(dict);
+
+    uint32_t nlen = htonl(xml_len);
+    int serr = (xml)? idev_con_send(con, (char*)&nlen, sizeof(nlen)) || idev_con_send(con, xml, xml_len) : -1;
+    if (xml)
+        free(xml);
+
+    if (serr) {
+        fprintf(stderr, "Error: Could not send %s command with argument:%s\n", ha_command, appid);
+        return ret;
+    }
+
+    if (idev_con_recv(con, (char*)&nlen, sizeof(nlen)) != 0) {
+        fprintf(stderr, "Error: Could not get result form house_arrest service\n");
+        return ret;
+    }
+
+    uint32_t len = ntohl(nlen);
+    if (len == 0 || len > HOUSE_ARREST_MAX_REPLY) {
+        fprintf(stderr, "Error: house_arrest service sent a reply of bad length (%u bytes)\n", len);
+        return ret;
+    }
+
+    char *buf=NULL;
+    if ((buf = malloc(len)) != NULL && idev_con_recv(con, buf, len) == 0) {
+        plist_t result = NULL;
+
+        if (len > 8 && !memcmp(buf, "bplist00", 8))
+            plist_from_bin(buf, len, &result);
+        else
+            plist_from_xml(buf, len, &result);
+
+        if (result) {
+            plist_t errnode = plist_dict_get_item(result, "Error");
+            if (!errnode) {
+                ret = EXIT_SUCCESS;
+            } else {
+                char *str = NULL;
+                plist_get_string_val(errnode, &str);
+                fprintf(stderr, "Error: house_arrest service responded: %s\n", str);
+                if (str)
+                    free(str);
+            }
+            plist_free(result);
+        } else {
+            fprintf(stderr, "Error: Could not parse result from house_arrest service\n");
+        }
+    } else {
+        fprintf(stderr, "Error: Could not get result form house_arrest service\n");
+    }
+
+    if (buf)
+        free(buf);
+
+    return ret;
+}
+
+// note: when appid is set the app's directory is vended through house_arrest and afc_servicename is ignored
+afcproto_client_t idev_afcproto_connect(idevice_t idev, lockdownd_client_t client, char *afc_servicename, char *appid, const char *appdir)
+{
+    afcproto_client_t afc=NULL;
+    char *servicename = (appid)? HOUSE_ARREST_SERVICE_NAME : afc_servicename;
+
+    if (!appdir) {
+        appdir = APPDIR_CONTAINER;
+    }
+
+    if (idev_verbose) fprintf(stderr, "[debug] starting '%s' lockdownd service\n", servicename);
+
+    lockdownd_service_descriptor_t ldsvc = NULL;
+    lockdownd_error_t ldret = lockdownd_start_service(client, servicename, &ldsvc);
+
+    if (ldret == LOCKDOWN_E_SUCCESS && ldsvc) {
+        idevice_connection_t con=NULL;
+        idevice_error_t ierr = idevice_connect(idev, ldsvc->port, &con);
+
+        if (ierr == IDEVICE_E_SUCCESS && con) {
+            if (ldsvc->ssl_enabled)
+                ierr = idevice_connection_enable_ssl(con);
+
+            if (ierr != IDEVICE_E_SUCCESS) {
+                fprintf(stderr, "Error: could not enable ssl for %s: %s\n", servicename, idev_idevice_strerror(ierr));
+            } else if (appid && idev_house_arrest_vend(con, appdir, appid) != EXIT_SUCCESS) {
+                // error already reported
+            } else if ((afc = idev_afcproto_client_new(con)) != NULL) {
+                con = NULL; // now owned by afc
+            } else {
+                fprintf(stderr, "Error: unable to create afc client: %s\n", idev_afc_strerror(AFC_E_NO_MEM));
+            }
+
+            if (con)
+                idevice_disconnect(con);
+
+        } else {
+            fprintf(stderr, "Error: could not connect to service %s: %s\n", servicename, idev_idevice_strerror(ierr));
+        }
+
+    } else {
+        fprintf(stderr, "Error: unable to start service: %s - %s\n", servicename, idev_lockdownd_strerror(ldret));
+    }
+
+    if (ldsvc)
+        lockdownd_service_descriptor_free(ldsvc);
+
+    return afc;
+}
+
+int idev_afcproto_client(
+        char *clientname,
+        char *udid,
+        char *afc_servicename,
+        char *appid,
+        const char *appdir,
+        int(^block)(idevice_t idev, lockdownd_client_t client, afcproto_client_t afc) )
+{
+    return idev_lockdownd_client(clientname, udid, ^int(idevice_t idev, lockdownd_client_t client) {
+        int ret = EXIT_FAILURE;
+
+        afcproto_client_t afc = idev_afcproto_connect(idev, client, afc_servicename, appid, appdir);
+        if (afc) {
+            ret = block(idev, client, afc);
+            afcproto_client_free(afc);
+        }
+
+        return ret;
+    });
+}
+
+
+#pragma mark - AFC connection pool
+
+// A pool of up to 'size' AFC connections sharing one lockdown session.
+//
+// Every connection still needs its own lockdownd_start_service: a started
+// service port only ever accepts a single connection. What the pool saves
+// is the device lookup and the lockdown handshake, which are done once.
+struct idev_afc_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    idevice_t idev;
+    lockdownd_client_t client;
+    char *servicename;
+    char *appid;
+    char *appdir;
+    char *address;
+    int size;
+    int nopen;
+    int nidle;
+    afcproto_client_t *idle;
+    time_t *idle_since;
+};
+
+static idev_afc_pool_t idev_afc_pool_alloc(int size)
+{
+    idev_afc_pool_t pool = calloc(1, sizeof(struct idev_afc_pool));
+    if (pool) {
+        pool->size = (size > 0)? size : 1;
+        pool->idle = calloc(pool->size, sizeof(afcproto_client_t));
+        pool->idle_since = calloc(pool->size, sizeof(time_t));
+        if (!pool->idle || !pool->idle_since) {
+            free(pool->idle);
+            free(pool->idle_since);
+            free(pool);
+            return NULL;
+        }
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->cond, NULL);
+    }
+    return pool;
+}
+
+idev_afc_pool_t idev_afc_pool_new(idevice_t idev, lockdownd_client_t client, char *afc_servicename, char *appid, const char *appdir, int size)
+{
+    idev_afc_pool_t pool = idev_afc_pool_alloc(size);
+    if (pool) {
+        pool->idev = idev;
+        pool->client = client;
+        pool->servicename = (afc_servicename)? strdup(afc_servicename) : NULL;
+        pool->appid = (appid)? strdup(appid) : NULL;
+        pool->appdir = (appdir)? strdup(appdir) : NULL;
+    }
+    return pool;
+}
+
+idev_afc_pool_t idev_afc_pool_new_address(char *address, int size)
+{
+    idev_afc_pool_t pool = idev_afc_pool_alloc(size);
+    if (pool)
+        pool->address = strdup(address);
+
+    return pool;
+}
+
+// note: all checked out connections must have been checked back in
+void idev_afc_pool_free(idev_afc_pool_t pool)
+{
+    if (pool) {
+        int i;
+        for (i=0; i<pool->nidle; i++)
+            afcproto_client_free(pool->idle[i]);
+
+        free(pool->idle);
+        free(pool->idle_since);
+        free(pool->servicename);
+        free(pool->appid);
+        free(pool->appdir);
+        free(pool->address);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->cond);
+        free(pool);
+    }
+}
+
+int idev_afc_pool_size(idev_afc_pool_t pool)
+{
+    return pool->size;
+}
+
+// the udid of the pool's device (to be freed), or NULL if it isn't one
+char *idev_afc_pool_udid(idev_afc_pool_t pool)
+{
+    char *udid=NULL;
+    if (pool->idev)
+        idevice_get_udid(pool->idev, &udid);
+
+    return udid;
+}
+
+// lockdownd_client_t isn't thread safe, and several pools may share one.
+// Connections are serialized per client (hashed onto a few locks) so that
+// pools on different devices can connect at the same time.
+#define CONNECT_LOCKS 16
+static pthread_mutex_t connect_locks[CONNECT_LOCKS] = {
+    [0 ... CONNECT_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t *connect_lock(lockdownd_client_t client)
+{
+    return &connect_locks[((uintptr_t)client >> 4) % CONNECT_LOCKS];
+}
+
+static afcproto_client_t idev_afc_pool_connect(idev_afc_pool_t pool)
+{
+    afcproto_client_t afc;
+
+    pthread_mutex_t *lock = connect_lock(pool->client);
+
+    pthread_mutex_lock(lock);
+    if (pool->address)
+        afc = afcproto_client_new_address(pool->address);
+    else
+        afc = idev_afcproto_connect(pool->idev, pool->client, pool->servicename, pool->appid, pool->appdir);
+    pthread_mutex_unlock(lock);
+
+    if (idev_verbose && afc)
+        fprintf(stderr, "[debug] opened pooled afc connection\n");
+
+    return afc;
+}
+
+// a cheap round trip to find out whether an idle connection is still usable
+static bool idev_afc_pool_healthy(afcproto_client_t afc)
+{
+    char **infos=NULL;
+    afc_error_t err = afcproto_get_device_info(afc, &infos);
+    afcproto_list_free(infos);
+
+    return (err == AFC_E_SUCCESS && !afcproto_client_is_broken(afc));
+}
+
+static afcproto_client_t idev_afc_pool_take(idev_afc_pool_t pool, bool wait)
+{
+    afcproto_client_t afc = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!afc) {
+        if (pool->nidle > 0) {
+            pool->nidle--;
+            afc = pool->idle[pool->nidle];
+            time_t since = pool->idle_since[pool->nidle];
+            pthread_mutex_unlock(&pool->lock);
+
+            if (time(NULL) - since > IDEV_AFC_POOL_IDLE_CHECK && !idev_afc_pool_healthy(afc)) {
+                if (idev_verbose)
+                    fprintf(stderr, "[debug] replacing stale pooled afc connection\n");
+                afcproto_client_free(afc);
+                afc = idev_afc_pool_connect(pool);
+
+                pthread_mutex_lock(&pool->lock);
+                if (!afc) {
+                    pool->nopen--;
+                    pthread_cond_signal(&pool->cond);
+                    break;
+                }
+            } else {
+                pthread_mutex_lock(&pool->lock);
+            }
+
+        } else if (pool->nopen < pool->size) {
+            pool->nopen++;
+            pthread_mutex_unlock(&pool->lock);
+
+            afc = idev_afc_pool_connect(pool);
+
+            pthread_mutex_lock(&pool->lock);
+            if (!afc) {
+                pool->nopen--;
+                pthread_cond_signal(&pool->cond);
+                break;
+            }
+
+        } else if (wait) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return afc;
+}
+
+// Hands out an idle connection, or opens a new one if the pool isn't full,
+// or waits for one to be checked in. Returns NULL if a new connection was
+// needed and couldn't be opened.
+afcproto_client_t idev_afc_pool_checkout(idev_afc_pool_t pool)
+{
+    return idev_afc_pool_take(pool, true);
+}
+
+// Like idev_afc_pool_checkout, but returns NULL instead of waiting when every
+// connection is already checked out.
+afcproto_client_t idev_afc_pool_try_checkout(idev_afc_pool_t pool)
+{
+    return idev_afc_pool_take(pool, false);
+}
+
+// Returns a connection to the pool. Broken connections are closed, and a
+// replacement is opened by whichever checkout next needs one.
+void idev_afc_pool_checkin(idev_afc_pool_t pool, afcproto_client_t afc)
+{
+    if (!afc)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    if (afcproto_client_is_broken(afc)) {
+        if (idev_verbose)
+            fprintf(stderr, "[debug] dropping broken pooled afc connection\n");
+        afcproto_client_free(afc);
+        pool->nopen--;
+    } else {
+        pool->idle[pool->nidle] = afc;
+        pool->idle_since[pool->nidle] = time(NULL);
+        pool->nidle++;
+    }
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int idev_afc_pool_client(
+        char *clientname,
+        char *udid,
+        char *afc_servicename,
+        char *appid,
+        const char *appdir,
+        int size,
+        int(^block)(idev_afc_pool_t pool) )
+{
+    return idev_lockdownd_client(clientname, udid, ^int(idevice_t idev, lockdownd_client_t client) {
+        int ret = EXIT_FAILURE;
+
+        idev_afc_pool_t pool = idev_afc_pool_new(idev, client, afc_servicename, appid, appdir, size);
+        if (pool) {
+            ret = block(pool);
+            idev_afc_pool_free(pool);
+        }
+
+        return ret;
+    });
+}
+
+
+#pragma mark - AFC request statistics
+
+// Latencies go into log-linear buckets of microseconds, in the manner of an
+// HDR histogram: below STATS_SUB_BUCKETS every value has its own bucket, and
+// above that each power of two is split into STATS_SUB_BUCKETS, so a bucket
+// is never wider than ~6% of the values in it. Everything is updated with
+// relaxed atomics so that recording costs a few adds and no locks.
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40 // ~12 days
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+#define STATS_OPS 0x40
+
+typedef struct idev_op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t total_ns;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint64_t buckets[STATS_BUCKETS];
+} idev_op_stats_t;
+
+static idev_op_stats_t *op_stats = NULL;
+static struct timespec stats_start;
+
+static const char *stats_op_name(uint64_t op)
+{
+    switch (op) {
+        case AFC_OP_READ_DIR:                   return "read_directory";
+        case AFC_OP_REMOVE_PATH:                return "remove_path";
+        case AFC_OP_MAKE_DIR:                   return "make_directory";
+        case AFC_OP_GET_FILE_INFO:              return "get_file_info";
+        case AFC_OP_GET_DEVINFO:                return "get_device_info";
+        case AFC_OP_FILE_OPEN:                  return "file_open";
+        case AFC_OP_READ:                       return "file_read";
+        case AFC_OP_WRITE:                      return "file_write";
+        case AFC_OP_FILE_SEEK:                  return "file_seek";
+        case AFC_OP_FILE_TELL:                  return "file_tell";
+        case AFC_OP_FILE_CLOSE:                 return "file_close";
+        case AFC_OP_FILE_SET_SIZE:              return "file_truncate";
+        case AFC_OP_RENAME_PATH:                return "rename_path";
+        case AFC_OP_MAKE_LINK:                  return "make_link";
+        case AFC_OP_SET_FILE_MOD_TIME:          return "set_file_time";
+        case AFC_OP_REMOVE_PATH_AND_CONTENTS:   return "remove_path_and_contents";
+        default:                                return NULL;
+    }
+}
+
+static int stats_bucket(uint64_t us)
+{
+    if (us < STATS_SUB_BUCKETS)
+        return (int)us;
+
+    int shift = (63 - __builtin_clzll(us)) - STATS_SUB_BITS;
+    int idx = (shift + 1) * STATS_SUB_BUCKETS + (int)((us >> shift) - STATS_SUB_BUCKETS);
+    return (idx < STATS_BUCKETS)? idx : STATS_BUCKETS-1;
+}
+
+// the largest value that lands in bucket idx
+static uint64_t stats_bucket_max(int idx)
+{
+    if (idx < STATS_SUB_BUCKETS)
+        return idx;
+
+    int shift = idx / STATS_SUB_BUCKETS - 1;
+    return ((uint64_t)(STATS_SUB_BUCKETS + idx % STATS_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void stats_record(uint64_t operation, uint64_t bytes_out, uint64_t bytes_in, uint64_t elapsed_ns, afc_error_t err)
+{
+    if (operation >= STATS_OPS)
+        return;
+
+    idev_op_stats_t *s = &op_stats[operation];
+    uint64_t us = elapsed_ns / 1000;
+
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+    if (err)
+        __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->bytes_out, bytes_out, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->bytes_in, bytes_in, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->total_ns, elapsed_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->buckets[stats_bucket(us)], 1, __ATOMIC_RELAXED);
+
+    uint64_t cur = __atomic_load_n(&s->min_us, __ATOMIC_RELAXED);
+    while (us < cur && !__atomic_compare_exchange_n(&s->min_us, &cur, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    cur = __atomic_load_n(&s->max_us, __ATOMIC_RELAXED);
+    while (us > cur && !__atomic_compare_exchange_n(&s->max_us, &cur, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+bool idev_stats_enable(void)
+{
+    if (op_stats)
+        return true;
+
+    if ((op_stats = calloc(STATS_OPS, sizeof(idev_op_stats_t))) == NULL)
+        return false;
+
+    int i;
+    for (i=0; i<STATS_OPS; i++)
+        op_stats[i].min_us = UINT64_MAX;
+
+    clock_gettime(CLOCK_MONOTONIC, &stats_start);
+    afcproto_set_observer(stats_record);
+    return true;
+}
+
+// nearest rank, reported as the top of its bucket but never above the max seen
+static uint64_t stats_percentile(idev_op_stats_t *s, double pct)
+{
+    uint64_t rank = (uint64_t)(pct / 100.0 * s->count + 0.999999), seen=0;
+    if (rank < 1)
+        rank = 1;
+
+    int i;
+    for (i=0; i<STATS_BUCKETS; i++) {
+        seen += s->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+    uint64_t v = stats_bucket_max(i);
+    return (v < s->max_us)? v : s->max_us;
+}
+
+static idev_op_stats_t *sorting;
+
+static int cmp_total_ns(const void *a, const void *b)
+{
+    uint64_t ta = sorting[*(const int*)a].total_ns, tb = sorting[*(const int*)b].total_ns;
+    return (ta < tb) - (ta > tb);
+}
+
+void idev_stats_print(FILE *outf, bool json)
+{
+    if (!op_stats)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (now.tv_sec - stats_start.tv_sec) + (now.tv_nsec - stats_start.tv_nsec) / 1e9;
+
+    // snapshot so that the numbers add up even if requests are still running
+    idev_op_stats_t *snap = malloc(STATS_OPS * sizeof(idev_op_stats_t));
+    if (!snap)
+        return;
+
+    int order[STATS_OPS], nops=0, i, j;
+    for (i=0; i<STATS_OPS; i++) {
+        uint64_t *src = (uint64_t*)&op_stats[i], *dst = (uint64_t*)&snap[i];
+        for (j=0; j<(int)(sizeof(idev_op_stats_t)/sizeof(uint64_t)); j++)
+            dst[j] = __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+        if (snap[i].count)
+            order[nops++] = i;
+    }
+    sorting = snap;
+    qsort(order, nops, sizeof(int), cmp_total_ns);
+
+    if (json) {
+        fprintf(outf, "{\"seconds\": %.6f, \"operations\": {", secs);
+    } else {
+        fprintf(outf, "AFC requests over %.3fs, by total time:\n", secs);
+        fprintf(outf, "  %-24s %8s %6s %12s %12s %10s %9s %9s %9s %9s %9s\n",
+                "operation", "count", "errors", "bytes out", "bytes in", "total ms",
+                "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    }
+
+    for (i=0; i<nops; i++) {
+        idev_op_stats_t *s = &snap[order[i]];
+        const char *name = stats_op_name(order[i]);
+        char unknown[16];
+        if (!name) {
+            snprintf(unknown, sizeof(unknown), "op_0x%02x", order[i]);
+            name = unknown;
+        }
+
+        if (json) {
+            fprintf(outf, "%s\n  \"%s\": {\"count\": %llu, \"errors\": %llu, \"bytes_out\": %llu, \"bytes_in\": %llu, \"total_ms\": %.3f, ",
+                    (i)? "," : "", name,
+                    (unsigned long long)s->count, (unsigned long long)s->errors,
+                    (unsigned long long)s->bytes_out, (unsigned long long)s->bytes_in, s->total_ns / 1e6);
+            fprintf(outf, "\"latency_us\": {\"min\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}, ",
+                    (unsigned long long)s->min_us,
+                    (unsigned long long)stats_percentile(s, 50), (unsigned long long)stats_percentile(s, 90),
+                    (unsigned long long)stats_percentile(s, 99), (unsigned long long)stats_percentile(s, 99.9),
+                    (unsigned long long)s->max_us);
+
+            // non-empty buckets as [highest value in bucket, count]
+            fprintf(outf, "\"histogram_us\": [");
+            bool first = true;
+            for (j=0; j<STATS_BUCKETS; j++) {
+                if (s->buckets[j]) {
+                    fprintf(outf, "%s[%llu, %llu]", (first)? "" : ", ",
+                            (unsigned long long)stats_bucket_max(j), (unsigned long long)s->buckets[j]);
+                    first = false;
+                }
+            }
+            fprintf(outf, "]}");
+        } else {
+            fprintf(outf, "  %-24s %8llu %6llu %12llu %12llu %10.1f %9llu %9llu %9llu %9llu %9llu\n",
+                    name, (unsigned long long)s->count, (unsigned long long)s->errors,
+                    (unsigned long long)s->bytes_out, (unsigned long long)s->bytes_in, s->total_ns / 1e6,
+                    (unsigned long long)stats_percentile(s, 50), (unsigned long long)stats_percentile(s, 90),
+                    (unsigned long long)stats_percentile(s, 99), (unsigned long long)stats_percentile(s, 99.9),
+                    (unsigned long long)s->max_us);
+        }
+    }
+
+    if (json)
+        fprintf(outf, "%s}}\n", (nops)? "\n" : "");
+    else if (nops == 0)
+        fprintf(outf, "  (none)\n");
+
+    free(snap);
+    fflush(outf);
+}
@@ -12,6 +12,7 @@
 #ifndef _libidev_h
 #define _libidev_h
 
+#include <stdio.h>
 #include <stdbool.h>
 
 #include <libimobiledevice/libimobiledevice.h>
@@ -21,6 +22,8 @@
 #include <libimobiledevice/afc.h>
 #include <libimobiledevice/house_arrest.h>
 
+#include "afcproto.h"
+
 #define AFC_SERVICE_NAME "com.apple.afc"
 #define AFC2_SERVICE_NAME "com.apple.afc2"
 #define HOUSE_ARREST_SERVICE_NAME "com.apple.mobile.house_arrest"
@@ -42,6 +45,10 @@ const char *idev_afc_strerror(afc_error_t errnum);
 
 char * idev_get_app_path(idevice_t idevice, lockdownd_client_t lockd, const char *app);
 
+int idev_lockdownd_open(char *clientname, char *udid, idevice_t *idev, lockdownd_client_t *client);
+
+void idev_lockdownd_close(idevice_t idev, lockdownd_client_t client);
+
 int idev_lockdownd_client (
         char *clientname,
         char *udid,
@@ -78,4 +85,69 @@ int idev_afc_app_client(
 	const char *appdir,
         int(^block)(afc_client_t afc) );
 
+afcproto_client_t idev_afcproto_client_new(idevice_connection_t con);
+
+afcproto_client_t idev_afcproto_connect(
+        idevice_t idev,
+        lockdownd_client_t client,
+        char *afc_servicename,
+        char *appid,
+        const char *appdir );
+
+int idev_afcproto_client(
+        char *clientname,
+        char *udid,
+        char *afc_servicename,
+        char *appid,
+        const char *appdir,
+        int(^block)(idevice_t idev, lockdownd_client_t client, afcproto_client_t afc) );
+
+#pragma mark - AFC connection pool
+
+// Idle connections unused for longer than this are checked before reuse
+#define IDEV_AFC_POOL_IDLE_CHECK 10
+
+typedef struct idev_afc_pool *idev_afc_pool_t;
+
+idev_afc_pool_t idev_afc_pool_new(
+        idevice_t idev,
+        lockdownd_client_t client,
+        char *afc_servicename,
+        char *appid,
+        const char *appdir,
+        int size );
+
+idev_afc_pool_t idev_afc_pool_new_address(char *address, int size);
+
+void idev_afc_pool_free(idev_afc_pool_t pool);
+
+int idev_afc_pool_size(idev_afc_pool_t pool);
+
+char *idev_afc_pool_udid(idev_afc_pool_t pool);
+
+afcproto_client_t idev_afc_pool_checkout(idev_afc_pool_t pool);
+
+afcproto_client_t idev_afc_pool_try_checkout(idev_afc_pool_t pool);
+
+void idev_afc_pool_checkin(idev_afc_pool_t pool, afcproto_client_t afc);
+
+int idev_afc_pool_client(
+        char *clientname,
+        char *udid,
+        char *afc_servicename,
+        char *appid,
+        const char *appdir,
+        int size,
+        int(^block)(idev_afc_pool_t pool) );
+
+#pragma mark - AFC request statistics
+
+// Starts counting every AFC request made through afcproto from here on, in
+// all threads: count, errors, bytes each way and a latency histogram per
+// operation. Cheap enough to leave on.
+bool idev_stats_enable(void);
+
+// Prints a summary table, or a JSON object with the histograms, to outf
+void idev_stats_print(FILE *outf, bool json);
+
 #endif // _libidev_h